@@ -0,0 +1,72 @@
+#include "utils.hh"
+
+#include "../src/diag.hh"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace
+{
+
+template <typename Func>
+double time_lines(unsigned num_lines, Func func)
+// Returns nanoseconds per line
+{
+	Stopwatch stopwatch;
+	for (unsigned i = 0; i < num_lines; ++i)
+	{
+		func(i);
+	}
+	return stopwatch.elapsed_sec() * 1e9 / num_lines;
+}
+
+}
+
+
+BENCH_CASE(diag, "Cost of a diagnostics line on the calling thread: disabled, async, and the former std::endl")
+{
+	// --lines <per run>
+	const unsigned num_lines = args.get_unsigned("lines", 200000);
+	const std::string req = "new_log client0 info the quick brown fox jumps over the lazy dog";
+
+	FILE * dev_null = std::fopen("/dev/null", "w");
+	Diag::set_output(dev_null);
+
+	Diag::set_level(Diag::Level::Info);
+	const double ns_disabled = time_lines(num_lines, [&req](unsigned i)
+		{
+			DIAG(Comm, Debug, "Read Req: " << req << " #" << i);
+		});
+
+	Diag::set_level(Diag::Level::Debug);
+	const double ns_async = time_lines(num_lines, [&req](unsigned i)
+		{
+			DIAG(Comm, Debug, "Read Req: " << req << " #" << i);
+		});
+	Diag::flush();
+	const uint64_t num_dropped = Diag::get_num_dropped();
+
+	// What every request used to pay, minus the terminal
+	std::ofstream sync_out("/dev/null");
+	const double ns_sync = time_lines(num_lines, [&req, &sync_out](unsigned i)
+		{
+			sync_out << "Read Req: " << req << " #" << i << std::endl;
+		});
+
+	Diag::set_level(Diag::default_level);
+	Diag::set_output(stderr);
+	std::fclose(dev_null);
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(12) << "line" << std::setw(14) << "ns/line" << "\n";
+	std::cout << std::setw(12) << "disabled" << std::setw(14) << ns_disabled << "\n";
+	std::cout << std::setw(12) << "async" << std::setw(14) << ns_async << "\n";
+	std::cout << std::setw(12) << "std::endl" << std::setw(14) << ns_sync << "\n";
+	if (num_dropped != 0)
+	{
+		std::cout << "  " << num_dropped << " async lines dropped, the sink couldn't keep up\n";
+	}
+}
@@ -0,0 +1,283 @@
+#include "utils.hh"
+
+#include "../src/msgs.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+BENCH_CASE(dump_filter, "Filtered dump_all cost against the share of matching messages")
+{
+	// --msgs <store size> --rounds <dumps per priority>
+	const unsigned num_msgs = args.get_unsigned("msgs", 2000000);
+	const unsigned rounds = args.get_unsigned("rounds", 5);
+
+	// 0.1% errors, 1% of each of the middle priorities, debug for the rest
+	MsgQueueWrapper q_wrapper;
+	std::mt19937 rng(0);
+	for (unsigned i = 0; i < num_msgs; ++i)
+	{
+		const unsigned roll = rng() % 1000;
+		const Msg::Priority pri =
+			(roll == 0) ? Msg::Priority::Error :
+			(roll < 11) ? Msg::Priority::Critical :
+			(roll < 21) ? Msg::Priority::Warning :
+			(roll < 31) ? Msg::Priority::Info :
+			Msg::Priority::Debug;
+		q_wrapper.push("the quick brown fox jumps over the lazy dog", "user" + std::to_string(rng() % 64), pri);
+	}
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << std::setw(10) << "dump_all" << std::setw(12) << "matching" << std::setw(12) << "ms" <<
+		std::setw(14) << "ns/match" << "\n";
+
+	for (unsigned cap = unsigned(Msg::Priority::Min); cap < unsigned(Msg::Priority::Max); ++cap)
+	{
+		size_t num_matching = 0;
+		size_t checksum = 0;
+
+		Stopwatch stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			num_matching = 0;
+			q_wrapper.for_each([&num_matching, &checksum](const MsgView & msg)
+				{
+					++num_matching;
+					checksum += msg.get_msg().size();
+				},
+				Msg::Priority(cap));
+		}
+		const double ms = stopwatch.elapsed_sec() * 1e3 / rounds;
+
+		std::cout << std::setw(10) << Msg::get_priority_str(Msg::Priority(cap)) << std::setw(12) << num_matching <<
+			std::setw(12) << ms << std::setw(14) << (num_matching ? ms * 1e6 / num_matching : 0.0) << "\n";
+
+		// Keeps the visits from being optimized away
+		if (checksum == 1)
+		{
+			std::cout << "\n";
+		}
+	}
+}
+
+BENCH_CASE(dump_user, "dump_user through the username index against a filtering scan")
+{
+	// --msgs <store size> --rounds <dumps per user>
+	const unsigned num_msgs = args.get_unsigned("msgs", 2000000);
+	const unsigned rounds = args.get_unsigned("rounds", 5);
+
+	// One user with 10% of the store, one with 1%, one with 0.01%, and
+	// 256 others sharing the rest
+	static const char * const users[] = {"heavy", "medium", "light"};
+	MsgQueueWrapper q_wrapper;
+	std::mt19937 rng(0);
+	for (unsigned i = 0; i < num_msgs; ++i)
+	{
+		const unsigned roll = rng() % 10000;
+		const std::string username =
+			(roll < 1000) ? users[0] :
+			(roll < 1100) ? users[1] :
+			(roll < 1101) ? users[2] :
+			"user" + std::to_string(rng() % 256);
+		q_wrapper.push("the quick brown fox jumps over the lazy dog", username, Msg::Priority::Info);
+	}
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << std::setw(10) << "user" << std::setw(12) << "matching" << std::setw(12) << "index ms" <<
+		std::setw(12) << "scan ms" << std::setw(14) << "ns/match" << "\n";
+
+	for (const char * username : users)
+	{
+		size_t num_matching = 0;
+		size_t checksum = 0;
+
+		Stopwatch index_stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			num_matching = 0;
+			q_wrapper.get_user_snapshot(username).visit([&num_matching, &checksum](const MsgView & msg)
+				{
+					++num_matching;
+					checksum += msg.get_msg().size();
+					return true;
+				});
+		}
+		const double index_ms = index_stopwatch.elapsed_sec() * 1e3 / rounds;
+
+		// What a client had to do before: dump it all, keep the user's
+		Stopwatch scan_stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			q_wrapper.for_each([&checksum, username](const MsgView & msg)
+				{
+					if (msg.get_username() == username)
+					{
+						checksum += msg.get_msg().size();
+					}
+				});
+		}
+		const double scan_ms = scan_stopwatch.elapsed_sec() * 1e3 / rounds;
+
+		std::cout << std::setw(10) << username << std::setw(12) << num_matching << std::setw(12) << index_ms <<
+			std::setw(12) << scan_ms << std::setw(14) << (num_matching ? index_ms * 1e6 / num_matching : 0.0) << "\n";
+
+		// Keeps the visits from being optimized away
+		if (checksum == 1)
+		{
+			std::cout << "\n";
+		}
+	}
+}
+
+BENCH_CASE(dump_range, "dump_range through the time index against a filtering scan")
+{
+	// --msgs <store size> --rounds <dumps per range>
+	const unsigned num_msgs = args.get_unsigned("msgs", 2000000);
+	const unsigned rounds = args.get_unsigned("rounds", 5);
+
+	// Ingest spread over a couple hundred milliseconds, so ranges cut
+	// through the store
+	MsgQueueWrapper q_wrapper;
+	for (unsigned i = 0; i < num_msgs; ++i)
+	{
+		q_wrapper.push("the quick brown fox jumps over the lazy dog", "user", Msg::Priority::Info);
+		if (i % 10000 == 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	std::vector<Msg::Time> times;
+	times.reserve(num_msgs);
+	q_wrapper.for_each([&times](const MsgView & msg) { times.push_back(msg.get_time_ms()); });
+	std::sort(times.begin(), times.end());
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << std::setw(10) << "share %" << std::setw(12) << "matching" << std::setw(12) << "index ms" <<
+		std::setw(12) << "scan ms" << std::setw(14) << "ns/match" << "\n";
+
+	// Ranges ending at the newest message, as in "the last few minutes"
+	for (const double share : {0.001, 0.01, 0.1, 0.5})
+	{
+		TimeRange range;
+		range.from_ms = times[size_t((1.0 - share) * (times.size() - 1))];
+
+		size_t num_matching = 0;
+		size_t checksum = 0;
+
+		Stopwatch index_stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			num_matching = 0;
+			q_wrapper.for_each([&num_matching, &checksum](const MsgView & msg)
+				{
+					++num_matching;
+					checksum += msg.get_msg().size();
+				},
+				Msg::Priority::Debug, range);
+		}
+		const double index_ms = index_stopwatch.elapsed_sec() * 1e3 / rounds;
+
+		// What a client had to do before: dump it all, keep the range
+		Stopwatch scan_stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			q_wrapper.for_each([&checksum, &range](const MsgView & msg)
+				{
+					if (range.contains(msg.get_time_ms()))
+					{
+						checksum += msg.get_msg().size();
+					}
+				});
+		}
+		const double scan_ms = scan_stopwatch.elapsed_sec() * 1e3 / rounds;
+
+		std::cout << std::setw(10) << share * 100 << std::setw(12) << num_matching << std::setw(12) << index_ms <<
+			std::setw(12) << scan_ms << std::setw(14) << (num_matching ? index_ms * 1e6 / num_matching : 0.0) << "\n";
+
+		// Keeps the visits from being optimized away
+		if (checksum == 1)
+		{
+			std::cout << "\n";
+		}
+	}
+}
+
+BENCH_CASE(search, "search through the token indexes against a filtering scan, and what the indexes cost")
+{
+	// --msgs <store size> --rounds <searches per term>
+	const unsigned num_msgs = args.get_unsigned("msgs", 2000000);
+	const unsigned rounds = args.get_unsigned("rounds", 5);
+
+	// A word in 10% of the bodies, one in 1%, one in 0.01%, and the rest
+	// from a vocabulary of 4096
+	static const char * const terms[] = {"timeout", "refused", "segfault"};
+	MsgQueueWrapper q_wrapper;
+	std::mt19937 rng(0);
+	for (unsigned i = 0; i < num_msgs; ++i)
+	{
+		const unsigned roll = rng() % 10000;
+		std::string body = "request w" + std::to_string(rng() % 4096) + " from w" + std::to_string(rng() % 4096) + " ";
+		body += (roll < 1000) ? terms[0] : (roll < 1100) ? terms[1] : (roll < 1101) ? terms[2] : "ok";
+		q_wrapper.push(body, "user", Msg::Priority::Info);
+	}
+
+	Stopwatch index_stopwatch;
+	const size_t num_blocks = q_wrapper.index_blocks();
+	const double index_sec = index_stopwatch.elapsed_sec();
+	const auto stats = q_wrapper.get_mem_stats();
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "indexed " << num_blocks << " blocks in " << index_sec * 1e3 << " ms, " <<
+		index_sec * 1e9 / num_msgs << " ns/msg, " << double(stats.search_bytes) / num_msgs << " bytes/msg\n";
+	std::cout << std::setw(10) << "term" << std::setw(12) << "matching" << std::setw(12) << "index ms" <<
+		std::setw(12) << "scan ms" << std::setw(14) << "ns/match" << "\n";
+
+	for (const char * term_str : terms)
+	{
+		const Search::Term term(term_str);
+		size_t num_matching = 0;
+		size_t checksum = 0;
+
+		Stopwatch search_stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			num_matching = 0;
+			q_wrapper.get_search_snapshot(term).visit([&num_matching, &checksum](const MsgView & msg)
+				{
+					++num_matching;
+					checksum += msg.get_msg().size();
+					return true;
+				});
+		}
+		const double search_ms = search_stopwatch.elapsed_sec() * 1e3 / rounds;
+
+		// What a client had to do before: dump it all, keep the matches
+		Stopwatch scan_stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			q_wrapper.for_each([&checksum, &term](const MsgView & msg)
+				{
+					if (term.matches(msg.get_msg()))
+					{
+						checksum += msg.get_msg().size();
+					}
+				});
+		}
+		const double scan_ms = scan_stopwatch.elapsed_sec() * 1e3 / rounds;
+
+		std::cout << std::setw(10) << term_str << std::setw(12) << num_matching << std::setw(12) << search_ms <<
+			std::setw(12) << scan_ms << std::setw(14) << (num_matching ? search_ms * 1e6 / num_matching : 0.0) << "\n";
+
+		// Keeps the visits from being optimized away
+		if (checksum == 1)
+		{
+			std::cout << "\n";
+		}
+	}
+}
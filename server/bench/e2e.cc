@@ -0,0 +1,269 @@
+#include "utils.hh"
+
+#include "../src/networking.hh"
+#include "../src/msgs.hh"
+#include "../src/ingest.hh"
+#include "../src/reqs.hh"
+#include "../src/wire.hh"
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+struct MixConfig
+{
+	unsigned num_reqs; // Per client
+	unsigned window; // Requests in flight per client
+	unsigned dump_permille; // Share of dump_all among the requests
+	Msg::Priority dump_pri;
+	unsigned body_bytes;
+};
+
+struct ClientResult
+{
+	std::vector<double> new_log_us;
+	std::vector<double> dump_all_us;
+	size_t num_failed = 0;
+	size_t dump_bytes = 0;
+};
+
+class MixClient
+// Talks the binary protocol, whose replies say where they end, dumps
+// included. Each latency runs from the write of the request's window to
+// the last byte of its reply.
+{
+public:
+	MixClient(boost::asio::io_service & io_service, PortType port)
+	:	_socket(io_service),
+		_in_buf(256 * 1024)
+	{
+		_socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+		_socket.set_option(tcp::no_delay(true));
+
+		boost::asio::write(_socket, boost::asio::buffer(WireFormat::hello, sizeof(WireFormat::hello)));
+		char hello[sizeof(WireFormat::hello)];
+		boost::asio::read(_socket, boost::asio::buffer(hello));
+	}
+
+	void run(unsigned client_id, const MixConfig & config, ClientResult & result)
+	{
+		typedef std::chrono::steady_clock Clock;
+
+		static const Msg::Priority priorities[] = {
+			Msg::Priority::Debug, Msg::Priority::Info, Msg::Priority::Warning,
+			Msg::Priority::Critical, Msg::Priority::Error};
+
+		std::mt19937 rng(client_id);
+		const std::string username = "client" + std::to_string(client_id);
+		const std::string body(config.body_bytes, 'x');
+
+		std::string out;
+		std::vector<bool> is_dump;
+		for (unsigned sent = 0; sent < config.num_reqs; )
+		{
+			const unsigned batch = std::min(config.window, config.num_reqs - sent);
+
+			out.clear();
+			is_dump.clear();
+			for (unsigned i = 0; i < batch; ++i)
+			{
+				is_dump.push_back(rng() % 1000 < config.dump_permille);
+				if (is_dump.back())
+				{
+					WireFormat::append_frame(out, WireFormat::FrameType::DumpAll, config.dump_pri);
+				}
+				else
+				{
+					WireFormat::append_frame(out, WireFormat::FrameType::NewLog, priorities[rng() % 5], username, body);
+				}
+			}
+
+			const auto start = Clock::now();
+			boost::asio::write(_socket, boost::asio::buffer(out));
+			for (unsigned i = 0; i < batch; ++i)
+			{
+				read_reply(result);
+				const double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+				(is_dump[i] ? result.dump_all_us : result.new_log_us).push_back(us);
+			}
+
+			sent += batch;
+		}
+	}
+
+private:
+	// All the frames of one reply
+	void read_reply(ClientResult & result)
+	{
+		for (;;)
+		{
+			WireFormat::Reply reply;
+			size_t reply_size = 0;
+			if (WireFormat::parse_reply(_in_buf.data() + _begin, _end - _begin, reply, reply_size) !=
+				WireFormat::ParseStatus::Done)
+			{
+				fill(reply_size);
+				continue;
+			}
+
+			_begin += reply_size;
+			result.dump_bytes += reply.body.size();
+			if (!(reply.flags & WireFormat::More))
+			{
+				result.num_failed += (reply.result != uint8_t(ReqUtils::ResultCode::Ok));
+				return;
+			}
+		}
+	}
+
+	// reply_size, if known, is what has to fit
+	void fill(size_t reply_size)
+	{
+		std::memmove(_in_buf.data(), _in_buf.data() + _begin, _end - _begin);
+		_end -= _begin;
+		_begin = 0;
+
+		if (reply_size > _in_buf.size())
+		{
+			_in_buf.resize(reply_size);
+		}
+		_end += _socket.read_some(boost::asio::buffer(_in_buf.data() + _end, _in_buf.size() - _end));
+	}
+
+	tcp::socket _socket;
+	std::vector<char> _in_buf;
+	size_t _begin = 0;
+	size_t _end = 0;
+};
+
+}
+
+
+BENCH_CASE(e2e, "In-process server driven over loopback by a new_log/dump_all mix, with latency percentiles")
+{
+	// --threads <io threads> --clients <n> --reqs <per client> --window <in flight per client>
+	// --dump-permille <dump_all share> --dump-pri <priority> --prefill <msgs stored up front>
+	// --body <bytes> --ring <ingest ring capacity, 0 for none>
+	MixConfig config;
+	const unsigned num_threads = args.get_unsigned("threads", std::max(1u, std::thread::hardware_concurrency()));
+	const unsigned num_clients = args.get_unsigned("clients", 8);
+	config.num_reqs = args.get_unsigned("reqs", 20000);
+	config.window = std::max(1u, args.get_unsigned("window", 1));
+	config.dump_permille = args.get_unsigned("dump-permille", 1);
+	config.dump_pri = Msg::get_priority_from_str(args.get_str("dump-pri", "error"));
+	config.body_bytes = std::max(1u, args.get_unsigned("body", 64));
+	const unsigned prefill = args.get_unsigned("prefill", 10000);
+	const unsigned ring_capacity = args.get_unsigned("ring", Cfg::ingest_ring_capacity);
+
+	if (config.dump_pri == Msg::Priority::Illegal)
+	{
+		std::cout << "Unknown --dump-pri\n";
+		return;
+	}
+
+	GlobalMsgQueue::init();
+	auto & q_wrapper = GlobalMsgQueue::get_inst();
+	for (unsigned i = 0; i < prefill; ++i)
+	{
+		q_wrapper.push(Msg("prefilled message " + std::to_string(i), "prefill", Msg::Priority(i % 5)));
+	}
+	if (ring_capacity != 0)
+	{
+		q_wrapper.set_ingest_ring(std::unique_ptr<IngestRing>(new IngestRing(q_wrapper, ring_capacity)));
+	}
+
+	Server server(0, num_threads);
+	server.start();
+
+	std::vector<ClientResult> results(num_clients);
+	std::vector<std::thread> clients;
+
+	Stopwatch stopwatch;
+	for (unsigned i = 0; i < num_clients; ++i)
+	{
+		clients.emplace_back([&, i]()
+			{
+				boost::asio::io_service io_service;
+				MixClient client(io_service, server.get_port());
+				client.run(i, config, results[i]);
+			});
+	}
+	for (std::thread & thd : clients)
+	{
+		thd.join();
+	}
+	const double secs = stopwatch.elapsed_sec();
+
+	server.stop();
+	server.join();
+
+	std::vector<double> new_log_us;
+	std::vector<double> dump_all_us;
+	size_t num_failed = 0;
+	size_t dump_bytes = 0;
+	for (ClientResult & result : results)
+	{
+		new_log_us.insert(new_log_us.end(), result.new_log_us.begin(), result.new_log_us.end());
+		dump_all_us.insert(dump_all_us.end(), result.dump_all_us.begin(), result.dump_all_us.end());
+		num_failed += result.num_failed;
+		dump_bytes += result.dump_bytes;
+	}
+
+	const Percentiles new_log = Percentiles::of(new_log_us);
+	const Percentiles dump_all = Percentiles::of(dump_all_us);
+	const double msgs_per_sec = double(new_log.count) / secs;
+	const double reqs_per_sec = double(new_log.count + dump_all.count) / secs;
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(10) << "request" << std::setw(10) << "count"
+		<< std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "p999 us" << std::setw(12) << "max us" << "\n";
+	for (const auto & row : {std::make_pair("new_log", new_log), std::make_pair("dump_all", dump_all)})
+	{
+		std::cout << std::setw(10) << row.first << std::setw(10) << row.second.count
+			<< std::setw(12) << row.second.p50 << std::setw(12) << row.second.p99
+			<< std::setw(12) << row.second.p999 << std::setw(12) << row.second.max << "\n";
+	}
+	std::cout << std::setprecision(0) << msgs_per_sec << " msgs/sec, " << reqs_per_sec << " reqs/sec, "
+		<< std::setprecision(3) << secs << " s\n";
+	if (num_failed != 0)
+	{
+		std::cout << "  WARNING: " << num_failed << " requests failed\n";
+	}
+
+	JsonWriter * json = args.get_json();
+	if (!json)
+	{
+		return;
+	}
+
+	json->begin_object("config");
+	json->add("io_threads", num_threads);
+	json->add("clients", num_clients);
+	json->add("reqs_per_client", config.num_reqs);
+	json->add("window", config.window);
+	json->add("dump_permille", config.dump_permille);
+	json->add("dump_pri", std::string(Msg::get_priority_str(config.dump_pri)));
+	json->add("body_bytes", config.body_bytes);
+	json->add("prefill", prefill);
+	json->add("ring", ring_capacity);
+	json->end_object();
+	json->add("seconds", secs);
+	json->add("msgs_per_sec", msgs_per_sec);
+	json->add("reqs_per_sec", reqs_per_sec);
+	json->add("failed", num_failed);
+	json->add("dump_bytes", dump_bytes);
+	json->add("new_log", new_log, "us");
+	json->add("dump_all", dump_all, "us");
+}
@@ -0,0 +1,148 @@
+#include "utils.hh"
+
+#include "../src/networking.hh"
+#include "../src/msgs.hh"
+#include "../src/ingest.hh"
+#include "../src/reqs.hh"
+
+#include <boost/asio.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+size_t drive_new_logs(PortType port, unsigned client_id, unsigned num_msgs, unsigned window, unsigned batch_size)
+// One pipelining client: sends new_logs in windows and waits for every Ok.
+// With batch_size, each line is a new_log_batch frame of that many.
+// Returns the number of messages acknowledged.
+{
+	boost::asio::io_service io_service;
+	tcp::socket socket(io_service);
+	socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+
+	const std::string body = "the quick brown fox jumps over the lazy dog";
+	const std::string username = "client" + std::to_string(client_id);
+	const unsigned msgs_per_line = batch_size ? batch_size : 1;
+	const std::string line = batch_size ?
+		ReqsUnitTestsUtils::make_new_log_batch_str(
+			std::vector<Msg>(batch_size, Msg(body, username, Msg::Priority::Info))) + "\r\n" :
+		"new_log " + username + " info " + body + "\r\n";
+	const std::string ok_reply = "Ok\n";
+
+	size_t num_ok = 0;
+	std::vector<char> in_buf(4096);
+
+	const unsigned num_lines = (num_msgs + msgs_per_line - 1) / msgs_per_line;
+	for (unsigned sent = 0; sent < num_lines; )
+	{
+		const unsigned batch = std::min(window, num_lines - sent);
+
+		std::string out;
+		out.reserve(line.size() * batch);
+		for (unsigned i = 0; i < batch; ++i)
+		{
+			out += line;
+		}
+		boost::asio::write(socket, boost::asio::buffer(out));
+		sent += batch;
+
+		size_t expected_bytes = ok_reply.size() * batch;
+		while (expected_bytes > 0)
+		{
+			size_t n = socket.read_some(boost::asio::buffer(in_buf));
+			num_ok += size_t(std::count(in_buf.begin(), in_buf.begin() + n, '\n'));
+			expected_bytes -= std::min(expected_bytes, n);
+		}
+	}
+
+	return num_ok * msgs_per_line;
+}
+
+}
+
+
+BENCH_CASE(load, "new_log throughput over TCP as the IO thread pool grows")
+{
+	// --threads <max io threads> --clients <n> --msgs <per client> --window <pipelined lines>
+	// --ring <ingest ring capacity, 0 to push straight into the queue>
+	// --batch <messages per new_log_batch line, 0 for plain new_logs>
+	const unsigned max_threads = args.get_unsigned("threads", std::max(1u, std::thread::hardware_concurrency()));
+	const unsigned num_clients = args.get_unsigned("clients", 8);
+	const unsigned num_msgs = args.get_unsigned("msgs", 20000);
+	const unsigned window = args.get_unsigned("window", 64);
+	const unsigned ring_capacity = args.get_unsigned("ring", Cfg::ingest_ring_capacity);
+	const unsigned batch_size = args.get_unsigned("batch", 0);
+
+	std::vector<unsigned> thread_counts;
+	for (unsigned n = 1; n < max_threads; n *= 2)
+	{
+		thread_counts.push_back(n);
+	}
+	thread_counts.push_back(max_threads);
+
+	std::cout << std::setw(10) << "threads" << std::setw(16) << "msgs/sec" << std::setw(12) << "seconds"
+		<< std::setw(14) << "allocs/msg" << "\n";
+
+	for (unsigned num_threads : thread_counts)
+	{
+		GlobalMsgQueue::init();
+		if (ring_capacity != 0)
+		{
+			auto & q_wrapper = GlobalMsgQueue::get_inst();
+			q_wrapper.set_ingest_ring(std::unique_ptr<IngestRing>(new IngestRing(q_wrapper, ring_capacity)));
+		}
+
+		Server server(0, num_threads);
+		server.start();
+
+		std::vector<size_t> num_ok(num_clients, 0);
+		std::vector<std::thread> clients(num_clients);
+
+		const size_t allocs_before = get_num_allocs();
+		Stopwatch stopwatch;
+		for (unsigned i = 0; i < num_clients; ++i)
+		{
+			clients[i] = std::thread([&, i]()
+				{
+					num_ok[i] = drive_new_logs(server.get_port(), i, num_msgs, window, batch_size);
+				});
+		}
+		for (std::thread & thd : clients)
+		{
+			thd.join();
+		}
+		const double secs = stopwatch.elapsed_sec();
+		// Clients included, but they only allocate once per window
+		const size_t num_allocs = get_num_allocs() - allocs_before;
+
+		server.stop();
+		server.join();
+
+		size_t total = 0;
+		for (size_t n : num_ok)
+		{
+			total += n;
+		}
+
+		std::cout << std::setw(10) << num_threads
+			<< std::setw(16) << std::fixed << std::setprecision(0) << double(total) / secs
+			<< std::setw(12) << std::setprecision(3) << secs
+			<< std::setw(14) << std::setprecision(2) << double(num_allocs) / double(std::max<size_t>(total, 1)) << "\n";
+
+		// Whole frames only, so that may round num_msgs up
+		const unsigned msgs_per_line = std::max(batch_size, 1u);
+		const size_t expected = size_t(num_clients) * ((num_msgs + msgs_per_line - 1) / msgs_per_line) * msgs_per_line;
+		if (total != expected)
+		{
+			std::cout << "  WARNING: expected " << expected << " acknowledged, got " << total << "\n";
+		}
+	}
+}
@@ -0,0 +1,6 @@
+#include "utils.hh"
+
+int main(int argc, char * argv[])
+{
+	return BenchRegistry::get_inst().run(argc, argv);
+}
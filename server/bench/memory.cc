@@ -0,0 +1,124 @@
+#include "utils.hh"
+
+#include "../src/msgs.hh"
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+
+namespace
+{
+
+size_t get_rss_bytes()
+{
+	size_t total_pages = 0;
+	size_t resident_pages = 0;
+	std::ifstream statm("/proc/self/statm");
+	statm >> total_pages >> resident_pages;
+	return resident_pages * size_t(sysconf(_SC_PAGESIZE));
+}
+
+class MsgGen
+// The same synthetic load every time for a given seed: 64 usernames,
+// bodies of 8 to 200 chars.
+{
+public:
+	explicit MsgGen(unsigned seed)
+	:	_rng(seed)
+	{
+
+	}
+
+	Msg next()
+	{
+		static const char * words[] = {"request", "served", "in", "ms", "connection", "reset",
+			"by", "peer", "cache", "miss", "for", "key", "user", "logged", "out", "retrying"};
+
+		const size_t body_len = 8 + _rng() % 193;
+		std::string body;
+		while (body.size() < body_len)
+		{
+			body += words[_rng() % 16];
+			body += ' ';
+		}
+		body.resize(body_len);
+
+		return Msg(std::move(body), "user" + std::to_string(_rng() % 64),
+			Msg::Priority(_rng() % unsigned(Msg::Priority::Max)));
+	}
+
+private:
+	std::mt19937 _rng;
+};
+
+void print_row(const char * name, size_t rss_bytes, size_t num_msgs)
+{
+	std::cout << std::setw(16) << name <<
+		std::setw(14) << double(rss_bytes) / (1024 * 1024) <<
+		std::setw(14) << double(rss_bytes) / num_msgs << "\n";
+}
+
+}
+
+
+BENCH_CASE(memory, "Bytes per message of the arena store against a std::deque<Msg>")
+{
+	// --msgs <number of messages>
+	const unsigned num_msgs = args.get_unsigned("msgs", 10000000);
+
+	size_t body_bytes = 0;
+	size_t deque_rss = 0;
+	size_t store_rss = 0;
+	MsgQueueWrapper::MemStats stats {};
+
+	// What the queue used to be
+	{
+		malloc_trim(0);
+		const size_t rss_before = get_rss_bytes();
+
+		MsgGen gen(0);
+		std::deque<Msg> q;
+		for (unsigned i = 0; i < num_msgs; ++i)
+		{
+			q.push_back(gen.next());
+			body_bytes += q.back().get_msg().size();
+		}
+
+		deque_rss = get_rss_bytes() - rss_before;
+	}
+
+	{
+		malloc_trim(0);
+		const size_t rss_before = get_rss_bytes();
+
+		MsgGen gen(0);
+		MsgQueueWrapper q_wrapper;
+		for (unsigned i = 0; i < num_msgs; ++i)
+		{
+			q_wrapper.push(gen.next());
+		}
+
+		store_rss = get_rss_bytes() - rss_before;
+
+		// On top of that, once the indexer has been through
+		q_wrapper.index_blocks();
+		stats = q_wrapper.get_mem_stats();
+	}
+
+	std::cout << num_msgs << " msgs, average body " << double(body_bytes) / num_msgs << " bytes\n";
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(16) << "store" << std::setw(14) << "rss MiB" << std::setw(14) << "bytes/msg" << "\n";
+	print_row("deque<Msg>", deque_rss, num_msgs);
+	print_row("arena", store_rss, num_msgs);
+	std::cout << "arena accounting, bytes/msg: records " << double(stats.record_bytes) / num_msgs <<
+		", bodies " << double(stats.body_bytes) / num_msgs <<
+		", usernames " << double(stats.symbol_bytes) / num_msgs <<
+		", search index " << double(stats.search_bytes) / num_msgs << "\n";
+	std::cout << "saved: " << 100.0 * (1.0 - double(store_rss) / deque_rss) << "%\n";
+}
@@ -0,0 +1,142 @@
+#include "utils.hh"
+
+#include "../src/reqs.hh"
+#include "../src/msgs.hh"
+#include "../tests/reference.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+std::vector<std::string> make_req_lines(size_t num_lines, unsigned seed)
+// Roughly what a busy server sees: mostly new_logs of varying length,
+// some dumps, the odd typo.
+{
+	static const char * priorities[] = {"debug", "info", "warning", "critical", "error"};
+	static const char * words[] = {"request", "served", "in", "ms", "connection", "reset",
+		"by", "peer", "cache", "miss", "for", "key", "user", "logged", "out", "retrying"};
+
+	std::mt19937 rng(seed);
+	std::vector<std::string> lines;
+	lines.reserve(num_lines);
+
+	for (size_t i = 0; i < num_lines; ++i)
+	{
+		const unsigned kind = rng() % 100;
+		std::string line;
+
+		if (kind < 75)
+		{
+			line = "new_log user" + std::to_string(rng() % 64) + " " + priorities[rng() % 5] + " ";
+			const unsigned num_words = 3 + rng() % 30;
+			for (unsigned w = 0; w < num_words; ++w)
+			{
+				line += words[rng() % 16];
+				line += ' ';
+			}
+			line += std::to_string(rng());
+		}
+		else if (kind < 93)
+		{
+			line = std::string("dump_all ") + priorities[rng() % 5];
+		}
+		else if (kind < 95)
+		{
+			line = "delete_all";
+		}
+		else if (kind < 98)
+		{
+			line = "new_log user1 verbose something happened";
+		}
+		else
+		{
+			line = "dumpall debug";
+		}
+
+		lines.push_back(line);
+	}
+
+	return lines;
+}
+
+template <typename ParseFunc>
+double time_parser(const std::vector<std::string> & lines, unsigned rounds, ParseFunc parse, size_t & num_ok, double & allocs_per_req)
+// Returns nanoseconds per request
+{
+	num_ok = 0;
+	const size_t allocs_before = get_num_allocs();
+	Stopwatch stopwatch;
+	for (unsigned r = 0; r < rounds; ++r)
+	{
+		for (const std::string & line : lines)
+		{
+			ReqUtils::ResultCode result_code;
+			auto req_ptr = parse(line, result_code);
+			num_ok += (result_code == ReqUtils::ResultCode::Ok);
+		}
+	}
+	const double secs = stopwatch.elapsed_sec();
+	allocs_per_req = double(get_num_allocs() - allocs_before) / (double(lines.size()) * rounds);
+	return secs * 1e9 / (double(lines.size()) * rounds);
+}
+
+}
+
+
+BENCH_CASE(parse, "Reqs::parse_req_str() against the former std::regex parser")
+{
+	// --lines <distinct request lines> --rounds <passes over them>
+	const unsigned num_lines = args.get_unsigned("lines", 20000);
+	const unsigned rounds = args.get_unsigned("rounds", 5);
+
+	const auto lines = make_req_lines(num_lines, 0);
+
+	size_t num_ok_regex = 0;
+	size_t num_ok = 0;
+	double allocs_regex = 0;
+	double allocs = 0;
+
+	const double ns_regex = time_parser(lines, rounds,
+		[](const std::string & line, ReqUtils::ResultCode & result_code)
+		{
+			return Reference::parse_req_str_regex(line, result_code);
+		},
+		num_ok_regex,
+		allocs_regex);
+
+	const double ns = time_parser(lines, rounds,
+		[](const std::string & line, ReqUtils::ResultCode & result_code)
+		{
+			return Reqs::parse_req_str(line, result_code);
+		},
+		num_ok,
+		allocs);
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(12) << "parser" << std::setw(14) << "ns/req" << std::setw(16) << "reqs/sec" << std::setw(14) << "allocs/req" << "\n";
+	std::cout << std::setw(12) << "regex" << std::setw(14) << ns_regex << std::setw(16) << 1e9 / ns_regex << std::setw(14) << allocs_regex << "\n";
+	std::cout << std::setw(12) << "tokenizer" << std::setw(14) << ns << std::setw(16) << 1e9 / ns << std::setw(14) << allocs << "\n";
+	std::cout << "speedup: " << ns_regex / ns << "x\n";
+
+	if (num_ok != num_ok_regex)
+	{
+		std::cout << "WARNING: parsers disagree, " << num_ok << " vs " << num_ok_regex << " Ok requests\n";
+	}
+
+	if (JsonWriter * json = args.get_json())
+	{
+		json->begin_object("regex");
+		json->add("ns_per_req", ns_regex);
+		json->add("allocs_per_req", allocs_regex);
+		json->end_object();
+		json->begin_object("tokenizer");
+		json->add("ns_per_req", ns);
+		json->add("allocs_per_req", allocs);
+		json->end_object();
+	}
+}
@@ -0,0 +1,133 @@
+#include "utils.hh"
+
+#include "../src/sanitize.hh"
+#include "../tests/reference.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+std::vector<std::string> make_lines(size_t num_lines, size_t line_len, bool dirty, unsigned seed)
+// Printable request lines ending in "\r\n", or with a tab or a '\0' in
+// every 64 bytes or so, as some clients send
+{
+	std::mt19937 rng(seed);
+	std::vector<std::string> lines;
+	lines.reserve(num_lines);
+	for (size_t i = 0; i < num_lines; ++i)
+	{
+		std::string line;
+		line.reserve(line_len);
+		while (line.size() + 2 < line_len)
+		{
+			line += (dirty && rng() % 64 == 0) ? ((rng() % 2) ? '\t' : '\0') : char(0x20 + rng() % 0x5f);
+		}
+		line += "\r\n";
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+template <typename Func>
+double time_lines(const std::vector<std::string> & lines, unsigned rounds, Func func)
+// Returns nanoseconds per line
+{
+	Stopwatch stopwatch;
+	for (unsigned r = 0; r < rounds; ++r)
+	{
+		for (const std::string & line : lines)
+		{
+			func(line);
+		}
+	}
+	return stopwatch.elapsed_sec() * 1e9 / (double(rounds) * lines.size());
+}
+
+}
+
+
+BENCH_CASE(sanitize, "Request line delimiter scan and sanitize() per kernel, against the byte at a time ones")
+{
+	// --bytes <per line length and kind, roughly>
+	const unsigned total_bytes = args.get_unsigned("bytes", 64 * 1024 * 1024);
+	const size_t line_lens[] = {100, 4096};
+	const Sanitize::Isa best = Sanitize::get_best_isa();
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(6) << "line" << std::setw(7) << "kind" << std::setw(10) << "kernels"
+		<< std::setw(12) << "delim ns" << std::setw(14) << "sanitize ns" << std::setw(10) << "GB/s" << "\n";
+
+	size_t checksum = 0;
+	for (size_t line_len : line_lens)
+	{
+		for (bool dirty : {false, true})
+		{
+			// Few enough lines to stay in cache, read over and over
+			const size_t num_lines = std::max<size_t>(1, 256 * 1024 / line_len);
+			const std::vector<std::string> lines = make_lines(num_lines, line_len, dirty, 42);
+			const unsigned rounds = std::max(1u, unsigned(total_bytes / (num_lines * line_len)));
+			const char * kind = dirty ? "dirty" : "clean";
+
+			// Kernel by kernel, and "byte" for the way it was done before:
+			// asio's search for the delimiter and the isprint() sanitize()
+			for (int k = -1; k <= int(best); ++k)
+			{
+				double delim_ns = 0;
+				double sanitize_ns = 0;
+				std::forward_list<std::string> filtered_lines;
+				if (k < 0)
+				{
+					static const char delim[] = "\r\n";
+					delim_ns = time_lines(lines, rounds, [&checksum](const std::string & line)
+						{
+							checksum += size_t(std::search(line.begin(), line.end(), delim, delim + 2) - line.begin());
+						});
+					sanitize_ns = time_lines(lines, rounds, [&checksum, &filtered_lines](const std::string & line)
+						{
+							checksum += Reference::sanitize(line, filtered_lines).size();
+							filtered_lines.clear();
+						});
+				}
+				else
+				{
+					Sanitize::set_isa(Sanitize::Isa(k));
+					delim_ns = time_lines(lines, rounds, [&checksum](const std::string & line)
+						{
+							checksum += Sanitize::find_crlf(line.data(), line.size());
+						});
+					sanitize_ns = time_lines(lines, rounds, [&checksum, &filtered_lines](const std::string & line)
+						{
+							checksum += Sanitize::sanitize(line, filtered_lines).size();
+							filtered_lines.clear();
+						});
+				}
+				const char * kernels = (k < 0) ? "byte" : Sanitize::to_str(Sanitize::Isa(k));
+				const double gb_per_sec = line_len / (delim_ns + sanitize_ns);
+
+				std::cout << std::setw(6) << line_len << std::setw(7) << kind << std::setw(10) << kernels
+					<< std::setw(12) << delim_ns << std::setw(14) << sanitize_ns << std::setw(10) << gb_per_sec << "\n";
+
+				if (JsonWriter * json = args.get_json())
+				{
+					json->begin_object((std::to_string(line_len) + "_" + kind + "_" + kernels).c_str());
+					json->add("delim_ns_per_line", delim_ns);
+					json->add("sanitize_ns_per_line", sanitize_ns);
+					json->add("gb_per_sec", gb_per_sec);
+					json->end_object();
+				}
+			}
+		}
+	}
+	Sanitize::set_isa(best);
+
+	if (checksum == 1)
+	{
+		std::cout << "\n";
+	}
+}
@@ -0,0 +1,338 @@
+#include "utils.hh"
+
+#include "../src/reqs.hh"
+#include "../src/msgs.hh"
+
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Each stage a request goes through, on its own, so a regression in the
+// end-to-end numbers can be pinned on one of them
+
+namespace
+{
+
+class CountingBuf : public std::streambuf
+// Swallows what's written, only counting the bytes
+{
+public:
+	size_t get_count() const
+	{
+		return _count;
+	}
+
+protected:
+	virtual std::streamsize xsputn(const char *, std::streamsize n) override
+	{
+		_count += size_t(n);
+		return n;
+	}
+
+	virtual int_type overflow(int_type c) override
+	{
+		++_count;
+		return c;
+	}
+
+private:
+	size_t _count = 0;
+};
+
+std::vector<unsigned> get_thread_counts(unsigned max_threads)
+{
+	std::vector<unsigned> thread_counts;
+	for (unsigned n = 1; n < max_threads; n *= 2)
+	{
+		thread_counts.push_back(n);
+	}
+	thread_counts.push_back(max_threads);
+	return thread_counts;
+}
+
+template <typename Func>
+double time_on_threads(unsigned num_threads, Func func)
+// Runs func(thread_index) on each thread at once, returns seconds
+{
+	std::vector<std::thread> threads;
+	Stopwatch stopwatch;
+	for (unsigned t = 0; t < num_threads; ++t)
+	{
+		threads.emplace_back([&func, t]() { func(t); });
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+	return stopwatch.elapsed_sec();
+}
+
+}
+
+
+BENCH_CASE(push, "new_log serve() into the store from 1..N threads, one request at a time and batched")
+{
+	// --threads <max threads> --msgs <per thread> --body <bytes>
+	const unsigned max_threads = args.get_unsigned("threads", std::max(1u, std::thread::hardware_concurrency()));
+	const unsigned num_msgs = args.get_unsigned("msgs", 200000);
+	const std::string body(args.get_unsigned("body", 64), 'x');
+	const size_t batch_size = 64;
+
+	std::cout << std::setw(10) << "threads" << std::setw(16) << "serve/sec" << std::setw(16) << "batched/sec" << "\n";
+	if (args.get_json())
+	{
+		args.get_json()->begin_object("msgs_per_sec");
+	}
+
+	for (unsigned num_threads : get_thread_counts(max_threads))
+	{
+		// Requests are built up front, only serving is timed
+		std::vector<std::vector<Reqs::ReqBaseUnqPtr>> reqs(num_threads);
+		for (unsigned t = 0; t < num_threads; ++t)
+		{
+			for (unsigned i = 0; i < num_msgs; ++i)
+			{
+				reqs[t].push_back(ReqsUnitTestsUtils::make_new_log_req(body, "user" + std::to_string(t), Msg::Priority::Info));
+			}
+		}
+
+		MsgQueueWrapper q_wrapper;
+		const double serve_secs = time_on_threads(num_threads, [&reqs, &q_wrapper](unsigned t)
+			{
+				std::ostringstream unused;
+				for (auto & req : reqs[t])
+				{
+					req->serve(q_wrapper, unused);
+				}
+			});
+
+		MsgQueueWrapper batch_q_wrapper;
+		const double batch_secs = time_on_threads(num_threads, [&](unsigned t)
+			{
+				const std::string username = "user" + std::to_string(t);
+				std::vector<MsgView> views;
+				std::vector<ReqUtils::ResultCode> result_codes;
+				for (unsigned i = 0; i < num_msgs; i += unsigned(batch_size))
+				{
+					views.assign(std::min(batch_size, size_t(num_msgs - i)), MsgView(body, username, Msg::Priority::Info, 0));
+					Reqs::serve_new_logs(batch_q_wrapper, views, result_codes);
+				}
+			});
+
+		const double total = double(num_msgs) * num_threads;
+		std::cout << std::setw(10) << num_threads << std::fixed << std::setprecision(0)
+			<< std::setw(16) << total / serve_secs << std::setw(16) << total / batch_secs << "\n";
+
+		if (JsonWriter * json = args.get_json())
+		{
+			json->begin_object(std::to_string(num_threads).c_str());
+			json->add("serve", total / serve_secs);
+			json->add("batched", total / batch_secs);
+			json->end_object();
+		}
+	}
+
+	if (args.get_json())
+	{
+		args.get_json()->end_object();
+	}
+}
+
+BENCH_CASE(format, "Dump formatting with MsgFormat against the former operator<< path, and a bare visit of the same messages")
+{
+	// --msgs <store size> --rounds <dumps> --body <bytes>
+	const unsigned num_msgs = args.get_unsigned("msgs", 1000000);
+	const unsigned rounds = args.get_unsigned("rounds", 5);
+	const std::string body(args.get_unsigned("body", 64), 'x');
+	const size_t chunk_bytes = 64 * 1024;
+
+	MsgQueueWrapper q_wrapper;
+	for (unsigned i = 0; i < num_msgs; ++i)
+	{
+		q_wrapper.push(body, "user" + std::to_string(i % 64), Msg::Priority(i % 5));
+	}
+	const auto snapshot = q_wrapper.get_snapshot();
+
+	// Each way of dumping the store: seconds for all rounds, and bytes out
+	struct Path
+	{
+		const char * name;
+		std::function<size_t()> dump;
+	};
+	size_t checksum = 0;
+	const std::vector<Path> paths = {
+		{"visit", [&q_wrapper, &checksum]()
+			{
+				q_wrapper.for_each([&checksum](const MsgView & msg)
+					{
+						checksum += msg.get_msg().size();
+					});
+				return size_t(0);
+			}},
+		// dump_to_stream() as it was
+		{"ostream endl", [&q_wrapper]()
+			{
+				CountingBuf buf;
+				std::ostream os(&buf);
+				q_wrapper.for_each([&os](const MsgView & msg)
+					{
+						os << msg << std::endl;
+					});
+				return buf.get_count();
+			}},
+		{"dump_to_stream", [&q_wrapper]()
+			{
+				CountingBuf buf;
+				std::ostream os(&buf);
+				q_wrapper.dump_to_stream(os);
+				return buf.get_count();
+			}},
+		// A streamed reply's chunks, the way next_chunk() used to build them
+		{"chunks ostringstream", [&snapshot, chunk_bytes]()
+			{
+				size_t num_bytes = 0;
+				Msg::Seq from_seq = 0;
+				while (from_seq < snapshot.get_end_seq())
+				{
+					std::string chunk;
+					std::ostringstream oss;
+					from_seq = snapshot.visit(
+						[&oss, chunk_bytes](const MsgView & msg)
+						{
+							oss << msg << '\n';
+							return size_t(oss.tellp()) < chunk_bytes;
+						},
+						Msg::Priority::Debug, from_seq);
+					chunk += oss.str();
+					num_bytes += chunk.size();
+				}
+				return num_bytes;
+			}},
+		{"chunks append_line", [&snapshot, chunk_bytes]()
+			{
+				size_t num_bytes = 0;
+				Msg::Seq from_seq = 0;
+				while (from_seq < snapshot.get_end_seq())
+				{
+					std::string chunk;
+					chunk.reserve(chunk_bytes + 4096);
+					from_seq = snapshot.visit(
+						[&chunk, chunk_bytes](const MsgView & msg)
+						{
+							MsgFormat::append_line(chunk, msg);
+							return chunk.size() < chunk_bytes;
+						},
+						Msg::Priority::Debug, from_seq);
+					num_bytes += chunk.size();
+				}
+				return num_bytes;
+			}}
+	};
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(22) << "path" << std::setw(10) << "ns/msg" << std::setw(14) << "msgs/sec" << std::setw(10) << "MB/s" << "\n";
+
+	for (const Path & path : paths)
+	{
+		size_t num_bytes = 0;
+		Stopwatch stopwatch;
+		for (unsigned r = 0; r < rounds; ++r)
+		{
+			num_bytes += path.dump();
+		}
+		const double secs = stopwatch.elapsed_sec();
+		const double ns_per_msg = secs * 1e9 / (double(num_msgs) * rounds);
+		const double mb_per_sec = double(num_bytes) / secs / 1e6;
+
+		std::cout << std::setw(22) << path.name << std::setw(10) << std::setprecision(1) << ns_per_msg
+			<< std::setw(14) << std::setprecision(0) << 1e9 / ns_per_msg << std::setw(10) << mb_per_sec << "\n";
+
+		if (JsonWriter * json = args.get_json())
+		{
+			json->begin_object(path.name);
+			json->add("ns_per_msg", ns_per_msg);
+			json->add("mb_per_sec", mb_per_sec);
+			json->end_object();
+		}
+	}
+
+	// Keeps the visits from being optimized away
+	if (checksum == 1)
+	{
+		std::cout << "\n";
+	}
+
+	if (JsonWriter * json = args.get_json())
+	{
+		json->add("msgs", num_msgs);
+	}
+}
+
+BENCH_CASE(msg, "Msg construction, copy and move cost by body length")
+{
+	// --msgs <per body length>
+	const unsigned num_msgs = args.get_unsigned("msgs", 1000000);
+	const size_t body_lens[] = {8, 64, 512};
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(10) << "body" << std::setw(16) << "construct ns" << std::setw(12) << "copy ns"
+		<< std::setw(12) << "move ns" << "\n";
+
+	size_t checksum = 0;
+	for (size_t body_len : body_lens)
+	{
+		const std::string body(body_len, 'x');
+		const std::string username = "username";
+
+		std::vector<Msg> msgs;
+		msgs.reserve(num_msgs);
+		Stopwatch stopwatch;
+		for (unsigned i = 0; i < num_msgs; ++i)
+		{
+			msgs.emplace_back(body, username, Msg::Priority::Info);
+		}
+		const double construct_ns = stopwatch.elapsed_sec() * 1e9 / num_msgs;
+
+		std::vector<Msg> copies;
+		copies.reserve(num_msgs);
+		stopwatch.reset();
+		for (const Msg & msg : msgs)
+		{
+			copies.push_back(msg);
+		}
+		const double copy_ns = stopwatch.elapsed_sec() * 1e9 / num_msgs;
+
+		std::vector<Msg> moved;
+		moved.reserve(num_msgs);
+		stopwatch.reset();
+		for (Msg & msg : msgs)
+		{
+			moved.push_back(std::move(msg));
+		}
+		const double move_ns = stopwatch.elapsed_sec() * 1e9 / num_msgs;
+
+		checksum += copies.back().get_msg().size() + moved.back().get_msg().size();
+
+		std::cout << std::setw(10) << body_len << std::setw(16) << construct_ns << std::setw(12) << copy_ns
+			<< std::setw(12) << move_ns << "\n";
+
+		if (JsonWriter * json = args.get_json())
+		{
+			json->begin_object(std::to_string(body_len).c_str());
+			json->add("construct_ns", construct_ns);
+			json->add("copy_ns", copy_ns);
+			json->add("move_ns", move_ns);
+			json->end_object();
+		}
+	}
+
+	if (checksum == 1)
+	{
+		std::cout << "\n";
+	}
+}
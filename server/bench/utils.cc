@@ -0,0 +1,272 @@
+#include "utils.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdlib>
+#include <new>
+
+
+namespace
+{
+	std::atomic<size_t> num_allocs(0);
+}
+
+void * operator new(size_t size)
+{
+	num_allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void * ptr = std::malloc(size ? size : 1))
+	{
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+size_t get_num_allocs()
+{
+	return num_allocs.load(std::memory_order_relaxed);
+}
+
+
+unsigned BenchArgs::get_unsigned(const std::string & key, unsigned default_value) const
+{
+	auto it = _args.find(key);
+	if (it == _args.end())
+	{
+		return default_value;
+	}
+	return unsigned(std::strtoul(it->second.c_str(), nullptr, 10));
+}
+
+std::string BenchArgs::get_str(const std::string & key, const std::string & default_value) const
+{
+	auto it = _args.find(key);
+	if (it == _args.end())
+	{
+		return default_value;
+	}
+	return it->second;
+}
+
+
+Percentiles Percentiles::of(std::vector<double> & samples)
+{
+	Percentiles percentiles;
+	if (samples.empty())
+	{
+		return percentiles;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	auto at = [&samples](double p)
+		{
+			return samples[std::min(samples.size() - 1, size_t(p * double(samples.size())))];
+		};
+
+	percentiles.count = samples.size();
+	percentiles.p50 = at(0.5);
+	percentiles.p99 = at(0.99);
+	percentiles.p999 = at(0.999);
+	percentiles.max = samples.back();
+	return percentiles;
+}
+
+
+void JsonWriter::begin_object(const char * key)
+{
+	if (key)
+	{
+		write_key(key);
+	}
+	_os << "{";
+	_first.push_back(true);
+}
+
+void JsonWriter::end_object()
+{
+	_first.pop_back();
+	_os << "}";
+	if (_first.empty())
+	{
+		_os << "\n";
+	}
+}
+
+void JsonWriter::add(const char * key, double value)
+{
+	write_key(key);
+	const std::ios::fmtflags flags = _os.flags();
+	const std::streamsize precision = _os.precision();
+	_os << std::fixed << std::setprecision(3) << value;
+	_os.flags(flags);
+	_os.precision(precision);
+}
+
+void JsonWriter::add(const char * key, unsigned value)
+{
+	write_key(key);
+	_os << value;
+}
+
+void JsonWriter::add(const char * key, size_t value)
+{
+	write_key(key);
+	_os << value;
+}
+
+void JsonWriter::add(const char * key, const std::string & value)
+{
+	write_key(key);
+	_os << '"';
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\')
+		{
+			_os << '\\';
+		}
+		_os << c;
+	}
+	_os << '"';
+}
+
+void JsonWriter::add(const char * key, const Percentiles & percentiles, const char * unit)
+{
+	const std::string suffix = std::string("_") + unit;
+	begin_object(key);
+	add("count", percentiles.count);
+	add(("p50" + suffix).c_str(), percentiles.p50);
+	add(("p99" + suffix).c_str(), percentiles.p99);
+	add(("p999" + suffix).c_str(), percentiles.p999);
+	add(("max" + suffix).c_str(), percentiles.max);
+	end_object();
+}
+
+void JsonWriter::write_key(const char * key)
+{
+	if (!_first.back())
+	{
+		_os << ",";
+	}
+	_first.back() = false;
+	_os << '"' << key << "\":";
+}
+
+
+BenchRegistry & BenchRegistry::get_inst()
+{
+	static BenchRegistry inst;
+	return inst;
+}
+
+void BenchRegistry::add(const char * name, const char * description, BenchFunc func)
+{
+	_entries.push_back(Entry{name, description, func});
+}
+
+int BenchRegistry::run(int argc, char * argv[]) const
+{
+	BenchArgs args;
+	std::vector<std::string> names;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg(argv[i]);
+		if (arg == "--list")
+		{
+			for (const Entry & entry : _entries)
+			{
+				std::cout << entry.name << "\t" << entry.description << "\n";
+			}
+			return 0;
+		}
+		else if (arg.compare(0, 2, "--") == 0 && i + 1 < argc)
+		{
+			args.set(arg.substr(2), argv[++i]);
+		}
+		else if (arg.compare(0, 2, "--") == 0)
+		{
+			std::cerr << "Missing value for " << arg << std::endl;
+			return 1;
+		}
+		else
+		{
+			names.push_back(arg);
+		}
+	}
+
+	for (const std::string & name : names)
+	{
+		bool found = false;
+		for (const Entry & entry : _entries)
+		{
+			found = found || (name == entry.name);
+		}
+		if (!found)
+		{
+			std::cerr << "Unknown benchmark: " << name << " (try --list)" << std::endl;
+			return 1;
+		}
+	}
+
+	// Not stdout, that's where the tables go
+	const std::string json_path = args.get_str("json", "");
+	std::ofstream json_file;
+	if (!json_path.empty())
+	{
+		json_file.open(json_path);
+		if (!json_file)
+		{
+			std::cerr << "Can't write " << json_path << std::endl;
+			return 1;
+		}
+	}
+	JsonWriter json(json_file);
+	if (!json_path.empty())
+	{
+		args.set_json(&json);
+		json.begin_object();
+	}
+
+	for (const Entry & entry : _entries)
+	{
+		bool selected = names.empty();
+		for (const std::string & name : names)
+		{
+			selected = selected || (name == entry.name);
+		}
+
+		if (selected)
+		{
+			std::cout << "=== " << entry.name << ": " << entry.description << "\n";
+			if (args.get_json())
+			{
+				json.begin_object(entry.name);
+				entry.func(args);
+				json.end_object();
+			}
+			else
+			{
+				entry.func(args);
+			}
+		}
+	}
+
+	if (args.get_json())
+	{
+		json.end_object();
+	}
+
+	return 0;
+}
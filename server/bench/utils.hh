@@ -0,0 +1,163 @@
+#ifndef BENCH_UTILS_HH
+#define BENCH_UTILS_HH
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+struct Percentiles
+// Of a set of samples, e.g. latencies
+{
+	size_t count = 0;
+	double p50 = 0;
+	double p99 = 0;
+	double p999 = 0;
+	double max = 0;
+
+	// Sorts samples
+	static Percentiles of(std::vector<double> & samples);
+};
+
+
+class JsonWriter
+// Just enough JSON for bench results: nested objects of numbers and
+// strings, written out as they're added
+{
+public:
+	explicit JsonWriter(std::ostream & os)
+	:	_os(os)
+	{
+
+	}
+
+	// A nested object under key, or the outermost one without
+	void begin_object(const char * key = nullptr);
+	void end_object();
+
+	void add(const char * key, double value); // With 3 decimals
+	void add(const char * key, unsigned value);
+	void add(const char * key, size_t value);
+	void add(const char * key, const std::string & value);
+
+	// count, p50, p99, p999 and max, the latter suffixed with unit
+	void add(const char * key, const Percentiles & percentiles, const char * unit);
+
+private:
+	void write_key(const char * key);
+
+	std::ostream & _os;
+	std::vector<bool> _first; // Per open object: nothing in it yet
+};
+
+
+class BenchArgs
+// Command line options of the form "--key value"
+{
+public:
+	void set(const std::string & key, const std::string & value)
+	{
+		_args[key] = value;
+	}
+
+	unsigned get_unsigned(const std::string & key, unsigned default_value) const;
+
+	std::string get_str(const std::string & key, const std::string & default_value) const;
+
+	// Where a benchmark adds its results, inside an object of its own.
+	// Null unless the run was given --json <file>.
+	JsonWriter * get_json() const
+	{
+		return _json;
+	}
+
+	void set_json(JsonWriter * json)
+	{
+		_json = json;
+	}
+
+private:
+	std::map<std::string, std::string> _args;
+	JsonWriter * _json = nullptr;
+};
+
+
+typedef std::function<void(const BenchArgs &)> BenchFunc;
+
+
+class BenchRegistry
+{
+public:
+	static BenchRegistry & get_inst();
+
+	void add(const char * name, const char * description, BenchFunc func);
+
+	// Usage: bench [--list] [<bench_name>...] [--json <file>] [--<key> <value>...]
+	// Runs every registered benchmark when no name is given. With --json,
+	// also writes their results to file, one object per benchmark name.
+	int run(int argc, char * argv[]) const;
+
+private:
+	struct Entry
+	{
+		const char * name;
+		const char * description;
+		BenchFunc func;
+	};
+
+	std::vector<Entry> _entries;
+};
+
+
+struct BenchRegistrar
+{
+	BenchRegistrar(const char * name, const char * description, BenchFunc func)
+	{
+		BenchRegistry::get_inst().add(name, description, func);
+	}
+};
+
+
+// Defines and registers a benchmark, in the spirit of BOOST_AUTO_TEST_CASE
+#define BENCH_CASE(name, description) \
+	static void bench_##name(const BenchArgs &); \
+	static const BenchRegistrar bench_registrar_##name(#name, description, bench_##name); \
+	static void bench_##name(const BenchArgs & args)
+
+
+class Stopwatch
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	Stopwatch()
+	:	_start(Clock::now())
+	{
+
+	}
+
+	void reset()
+	{
+		_start = Clock::now();
+	}
+
+	double elapsed_sec() const
+	{
+		return std::chrono::duration<double>(Clock::now() - _start).count();
+	}
+
+private:
+	Clock::time_point _start;
+};
+
+
+// Heap allocations made so far by the whole process, counted by the
+// bench's replacement operator new. Take the difference around a run.
+size_t get_num_allocs();
+
+
+#endif
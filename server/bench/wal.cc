@@ -0,0 +1,103 @@
+#include "utils.hh"
+
+#include "../src/msgs.hh"
+#include "../src/reqs.hh"
+#include "../src/wal.hh"
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+void remove_dir(const std::string & path)
+{
+	if (DIR * dir = opendir(path.c_str()))
+	{
+		while (dirent * entry = readdir(dir))
+		{
+			if (entry->d_name[0] != '.')
+			{
+				unlink((path + "/" + entry->d_name).c_str());
+			}
+		}
+		closedir(dir);
+	}
+	rmdir(path.c_str());
+}
+
+}
+
+
+BENCH_CASE(wal, "new_log throughput with the write-ahead log at each fsync policy")
+{
+	// --threads <writers> --msgs <per writer> --dir <where to put the log>
+	// --policies <comma separated fsync policies>
+	const unsigned num_threads = args.get_unsigned("threads", 8);
+	const unsigned msgs_per_thd = args.get_unsigned("msgs", 5000);
+	const std::string base_dir = args.get_str("dir", "/tmp/logger_bench_wal_" + std::to_string(getpid()));
+	const std::string policies = args.get_str("policies", "none,10ms,1000,always");
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << std::setw(10) << "fsync" << std::setw(14) << "msgs/sec" << std::setw(12) << "syncs" <<
+		std::setw(14) << "msgs/sync" << std::setw(12) << "MiB" << "\n";
+
+	std::istringstream policies_stream(policies);
+	std::string policy_str;
+	while (std::getline(policies_stream, policy_str, ','))
+	{
+		WriteAheadLog::SyncPolicy policy;
+		if (!WriteAheadLog::SyncPolicy::from_str(policy_str, policy))
+		{
+			std::cout << "skipping bad policy " << policy_str << "\n";
+			continue;
+		}
+
+		const std::string dir = base_dir + "_" + policy_str;
+		remove_dir(dir);
+
+		MsgQueueWrapper q_wrapper;
+		q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir, policy)));
+
+		// Through ReqNewLog::serve(), so "always" waits for the disk the
+		// way a client's request does
+		Stopwatch stopwatch;
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < num_threads; ++t)
+		{
+			threads.emplace_back([&q_wrapper, t, msgs_per_thd]()
+				{
+					std::ostringstream oss;
+					for (unsigned i = 0; i < msgs_per_thd; ++i)
+					{
+						ReqsUnitTestsUtils::make_new_log_req(
+							"the quick brown fox jumps over the lazy dog " + std::to_string(i),
+							"writer" + std::to_string(t),
+							Msg::Priority::Info)->serve(q_wrapper, oss);
+					}
+				});
+		}
+		for (std::thread & thd : threads)
+		{
+			thd.join();
+		}
+		q_wrapper.get_wal()->sync();
+		const double sec = stopwatch.elapsed_sec();
+
+		const auto stats = q_wrapper.get_wal()->get_stats();
+		const double total = double(num_threads) * msgs_per_thd;
+		std::cout << std::setw(10) << policy_str << std::setw(14) << total / sec << std::setw(12) << stats.syncs <<
+			std::setw(14) << (stats.syncs ? total / stats.syncs : 0.0) <<
+			std::setw(12) << double(stats.bytes) / (1024 * 1024) << "\n";
+
+		q_wrapper.set_wal(nullptr);
+		remove_dir(dir);
+	}
+}
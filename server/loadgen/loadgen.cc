@@ -0,0 +1,279 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <boost/asio.hpp>
+
+#include "../src/wire.hh"
+
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+struct Options
+{
+	std::string host = "127.0.0.1";
+	unsigned short port = 9876;
+	unsigned clients = 8;
+	unsigned msgs = 100000; // Per client
+	unsigned window = 64; // Requests in flight per client
+	unsigned body_bytes = 64;
+	bool binary = true;
+};
+
+struct ClientResult
+{
+	size_t num_ok = 0;
+	size_t num_failed = 0;
+	std::vector<double> window_us; // Round trip of each window
+};
+
+class Client
+// Sends new_logs a window at a time and waits for all of the window's
+// replies before the next one
+{
+public:
+	Client(boost::asio::io_service & io_service, const Options & options)
+	:	_socket(io_service),
+		_options(options),
+		_in_buf(64 * 1024)
+	{
+		_socket.connect(tcp::endpoint(boost::asio::ip::address::from_string(options.host), options.port));
+		_socket.set_option(tcp::no_delay(true));
+
+		if (_options.binary)
+		{
+			boost::asio::write(_socket, boost::asio::buffer(WireFormat::hello, sizeof(WireFormat::hello)));
+			char hello[sizeof(WireFormat::hello)];
+			boost::asio::read(_socket, boost::asio::buffer(hello));
+			if (std::memcmp(hello, WireFormat::hello, sizeof(hello)) != 0)
+			{
+				throw std::runtime_error("server doesn't speak binary");
+			}
+		}
+	}
+
+	void run(unsigned client_id, ClientResult & result)
+	{
+		typedef std::chrono::steady_clock Clock;
+
+		const std::string username = "loadgen" + std::to_string(client_id);
+		const std::string body(_options.body_bytes, 'x');
+
+		std::string request;
+		if (_options.binary)
+		{
+			WireFormat::append_frame(request, WireFormat::FrameType::NewLog, Msg::Priority::Info, username, body);
+		}
+		else
+		{
+			request = "new_log " + username + " info " + body + "\r\n";
+		}
+
+		std::string out;
+		for (unsigned sent = 0; sent < _options.msgs; )
+		{
+			const unsigned batch = std::min(_options.window, _options.msgs - sent);
+
+			out.clear();
+			for (unsigned i = 0; i < batch; ++i)
+			{
+				out += request;
+			}
+
+			const auto start = Clock::now();
+			boost::asio::write(_socket, boost::asio::buffer(out));
+			read_replies(batch, result);
+			result.window_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+
+			sent += batch;
+		}
+	}
+
+private:
+	void read_replies(unsigned num_replies, ClientResult & result)
+	{
+		while (num_replies > 0)
+		{
+			const char * data = _in_buf.data() + _begin;
+			const size_t size = _end - _begin;
+
+			size_t reply_size = 0;
+			bool ok = false;
+			if (_options.binary)
+			{
+				WireFormat::Reply reply;
+				if (WireFormat::parse_reply(data, size, reply, reply_size) == WireFormat::ParseStatus::Done)
+				{
+					ok = (reply.result == 0);
+				}
+				else
+				{
+					reply_size = 0;
+				}
+			}
+			else
+			{
+				const char * eol = static_cast<const char *>(std::memchr(data, '\n', size));
+				if (eol)
+				{
+					reply_size = size_t(eol - data) + 1;
+					ok = (reply_size == 3 && data[0] == 'O' && data[1] == 'k');
+				}
+			}
+
+			if (reply_size == 0)
+			{
+				fill();
+				continue;
+			}
+
+			_begin += reply_size;
+			++(ok ? result.num_ok : result.num_failed);
+			--num_replies;
+		}
+	}
+
+	void fill()
+	{
+		// Keep the partial reply, drop the rest
+		std::memmove(_in_buf.data(), _in_buf.data() + _begin, _end - _begin);
+		_end -= _begin;
+		_begin = 0;
+
+		_end += _socket.read_some(boost::asio::buffer(_in_buf.data() + _end, _in_buf.size() - _end));
+	}
+
+	tcp::socket _socket;
+	const Options & _options;
+	std::vector<char> _in_buf;
+	size_t _begin = 0;
+	size_t _end = 0;
+};
+
+}
+
+
+int main(int argc, char * argv[])
+{
+	// Usage: loadgen [--host <ip>] [--port <n>] [--clients <n>] [--msgs <per client>]
+	//     [--window <in flight>] [--body <bytes>] [--proto binary|text]
+	Options options;
+	bool usage_error = false;
+
+	for (int i = 1; i < argc && !usage_error; ++i)
+	{
+		const std::string arg(argv[i]);
+		if (i + 1 >= argc)
+		{
+			usage_error = true;
+		}
+		else if (arg == "--host")
+		{
+			options.host = argv[++i];
+		}
+		else if (arg == "--port")
+		{
+			options.port = static_cast<unsigned short>(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (arg == "--clients")
+		{
+			options.clients = unsigned(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (arg == "--msgs")
+		{
+			options.msgs = unsigned(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (arg == "--window")
+		{
+			options.window = unsigned(std::strtoul(argv[++i], nullptr, 10));
+			usage_error = (options.window == 0);
+		}
+		else if (arg == "--body")
+		{
+			options.body_bytes = unsigned(std::strtoul(argv[++i], nullptr, 10));
+			usage_error = (options.body_bytes == 0);
+		}
+		else if (arg == "--proto")
+		{
+			const std::string proto(argv[++i]);
+			options.binary = (proto == "binary");
+			usage_error = !options.binary && proto != "text";
+		}
+		else
+		{
+			usage_error = true;
+		}
+	}
+
+	if (usage_error)
+	{
+		std::cerr << "Usage: " << argv[0] << " [--host <ip>] [--port <n>] [--clients <n>] [--msgs <per client>]"
+			" [--window <in flight>] [--body <bytes>] [--proto binary|text]" << std::endl;
+		return 1;
+	}
+
+	std::vector<ClientResult> results(options.clients);
+	std::vector<std::thread> threads;
+
+	const auto start = std::chrono::steady_clock::now();
+	try
+	{
+		for (unsigned i = 0; i < options.clients; ++i)
+		{
+			threads.emplace_back([&options, &results, i]()
+				{
+					try
+					{
+						boost::asio::io_service io_service;
+						Client client(io_service, options);
+						client.run(i, results[i]);
+					}
+					catch (std::exception & e)
+					{
+						std::cerr << "Client " << i << ": " << e.what() << std::endl;
+					}
+				});
+		}
+	}
+	catch (std::exception & e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+	const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t num_ok = 0;
+	size_t num_failed = 0;
+	std::vector<double> window_us;
+	for (const ClientResult & result : results)
+	{
+		num_ok += result.num_ok;
+		num_failed += result.num_failed;
+		window_us.insert(window_us.end(), result.window_us.begin(), result.window_us.end());
+	}
+	std::sort(window_us.begin(), window_us.end());
+
+	auto percentile = [&window_us](double p)
+	{
+		return window_us.empty() ? 0.0 : window_us[std::min(window_us.size() - 1, size_t(p * window_us.size()))];
+	};
+
+	std::cout << std::fixed << std::setprecision(0)
+		<< (options.binary ? "binary" : "text") << ": " << num_ok << " ok, " << num_failed << " failed in "
+		<< std::setprecision(3) << secs << " s, " << std::setprecision(0) << double(num_ok) / secs << " msgs/sec\n"
+		<< "window of " << options.window << " round trip: p50 " << percentile(0.5) << " us, p99 "
+		<< percentile(0.99) << " us" << std::endl;
+
+	return num_failed == 0 ? 0 : 2;
+}
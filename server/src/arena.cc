@@ -0,0 +1,153 @@
+#include "arena.hh"
+
+#include <cstring>
+#include <mutex>
+
+#include <boost/functional/hash.hpp>
+
+
+// Arena
+
+Arena::Arena(size_t chunk_size)
+:	_chunk_size(chunk_size),
+	_cur(nullptr),
+	_left(0),
+	_bytes_used(0),
+	_bytes_reserved(0)
+{
+
+}
+
+char * Arena::new_chunk(size_t size)
+{
+	_chunks.emplace_back(new char[size]);
+	_bytes_reserved += size;
+	return _chunks.back().get();
+}
+
+void Arena::reserve(size_t num_bytes)
+{
+	if (num_bytes > _left)
+	{
+		_cur = new_chunk(num_bytes);
+		_left = num_bytes;
+	}
+}
+
+const char * Arena::append(boost::string_ref bytes)
+{
+	const size_t len = bytes.size();
+	char * dest;
+
+	if (len <= _left)
+	{
+		dest = _cur;
+		_cur += len;
+		_left -= len;
+	}
+	else if (len > _chunk_size / 4)
+	{
+		// Big ones get a chunk of their own rather than wasting the
+		// rest of the current one
+		dest = new_chunk(len);
+	}
+	else
+	{
+		dest = new_chunk(_chunk_size);
+		_cur = dest + len;
+		_left = _chunk_size - len;
+	}
+
+	if (len != 0)
+	{
+		std::memcpy(dest, bytes.data(), len);
+	}
+	_bytes_used += len;
+
+	return dest;
+}
+
+
+// SymbolTable
+
+SymbolTable::SymbolTable()
+:	_arena(Cfg::symbol_arena_chunk_size),
+	_blocks(new std::unique_ptr<boost::string_ref[]>[max_blocks]),
+	_size(0),
+	_max_size(max_blocks * block_size)
+{
+
+}
+
+size_t SymbolTable::StrRefHash::operator()(boost::string_ref str) const
+{
+	return boost::hash_range(str.begin(), str.end());
+}
+
+bool SymbolTable::intern(boost::string_ref str, Id & id)
+{
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+		auto it = _ids.find(str);
+		if (it != _ids.end())
+		{
+			id = it->second;
+			return true;
+		}
+	}
+
+	std::unique_lock<std::shared_timed_mutex> lock(_mutex);
+
+	// Someone may have beaten us to it
+	auto it = _ids.find(str);
+	if (it != _ids.end())
+	{
+		id = it->second;
+		return true;
+	}
+
+	const size_t new_id = _size.load(std::memory_order_relaxed);
+	if (new_id >= _max_size.load(std::memory_order_relaxed))
+	{
+		return false;
+	}
+
+	auto & block = _blocks[new_id >> block_bits];
+	if (!block)
+	{
+		block.reset(new boost::string_ref[block_size]);
+	}
+
+	const boost::string_ref stored(_arena.append(str), str.size());
+	block[new_id & block_mask] = stored;
+	_ids.emplace(stored, Id(new_id));
+	_size.store(new_id + 1, std::memory_order_release);
+
+	id = Id(new_id);
+	return true;
+}
+
+bool SymbolTable::find(boost::string_ref str, Id & id) const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+	auto it = _ids.find(str);
+	if (it == _ids.end())
+	{
+		return false;
+	}
+	id = it->second;
+	return true;
+}
+
+size_t SymbolTable::get_bytes_used() const
+{
+	std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+
+	const size_t num_blocks = (_size.load(std::memory_order_relaxed) + block_size - 1) / block_size;
+
+	return _arena.get_bytes_reserved() +
+		max_blocks * sizeof(_blocks[0]) +
+		num_blocks * block_size * sizeof(boost::string_ref) +
+		_ids.bucket_count() * sizeof(void *) +
+		_ids.size() * (sizeof(boost::string_ref) + sizeof(Id) + 2 * sizeof(void *));
+}
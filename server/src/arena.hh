@@ -0,0 +1,130 @@
+#ifndef ARENA_HH
+#define ARENA_HH
+
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/utility/string_ref.hpp>
+
+
+namespace Cfg
+{
+	static const size_t arena_chunk_size = 64 * 1024;
+	static const size_t symbol_arena_chunk_size = 4 * 1024;
+};
+
+
+class Arena
+// Append-only byte storage carved out of large chunks. Bytes handed out
+// never move and live as long as the arena. Not thread safe.
+{
+public:
+
+	explicit Arena(size_t chunk_size = Cfg::arena_chunk_size);
+
+	// Copies bytes in, returns where they landed
+	const char * append(boost::string_ref bytes);
+
+	// Makes room for num_bytes more in the current chunk, so the appends
+	// that add up to them take a single allocation of just that size
+	void reserve(size_t num_bytes);
+
+	// Bytes handed out
+	size_t get_bytes_used() const
+	{
+		return _bytes_used;
+	}
+
+	// Bytes allocated from the heap
+	size_t get_bytes_reserved() const
+	{
+		return _bytes_reserved;
+	}
+
+private:
+
+	char * new_chunk(size_t size);
+
+	const size_t _chunk_size;
+	std::vector<std::unique_ptr<char[]>> _chunks;
+	char * _cur;
+	size_t _left;
+	size_t _bytes_used;
+	size_t _bytes_reserved;
+};
+
+
+class SymbolTable
+// Interns strings as dense 32-bit ids. Thread safe. Resolving an id is
+// lock-free: entries never move once written, and an id can only be
+// known to a thread after intern() published it. Nothing is ever taken
+// out, so once it holds get_max_size() strings, new ones are refused.
+{
+public:
+
+	typedef uint32_t Id;
+
+	SymbolTable();
+
+	// Takes a shared lock for known strings, an exclusive one for new ones.
+	// False, and id untouched, if str is new and the table is full.
+	bool intern(boost::string_ref str, Id & id);
+
+	// Without interning it: false if str never was
+	bool find(boost::string_ref str, Id & id) const;
+
+	// The view stays valid for the table's lifetime
+	boost::string_ref get_str(Id id) const
+	{
+		return _blocks[id >> block_bits][id & block_mask];
+	}
+
+	size_t size() const
+	{
+		return _size.load(std::memory_order_acquire);
+	}
+
+	size_t get_max_size() const
+	{
+		return _max_size.load(std::memory_order_relaxed);
+	}
+
+	// For tests, to fill it up without 2^28 strings. Never above what ids can address.
+	void set_max_size(size_t max_size)
+	{
+		_max_size.store(std::min(max_size, max_blocks * block_size), std::memory_order_relaxed);
+	}
+
+	// Strings, id table and hash index, roughly
+	size_t get_bytes_used() const;
+
+private:
+
+	static const unsigned block_bits = 12;
+	static const size_t block_size = size_t(1) << block_bits;
+	static const size_t block_mask = block_size - 1;
+	static const size_t max_blocks = size_t(1) << 16;
+
+	struct StrRefHash
+	{
+		size_t operator()(boost::string_ref str) const;
+	};
+
+	mutable std::shared_timed_mutex _mutex;
+	Arena _arena;
+
+	// Fixed directory, so a reader never sees it reallocate
+	std::unique_ptr<std::unique_ptr<boost::string_ref[]>[]> _blocks;
+	std::unordered_map<boost::string_ref, Id, StrRefHash> _ids;
+	std::atomic<size_t> _size;
+	std::atomic<size_t> _max_size;
+};
+
+
+#endif
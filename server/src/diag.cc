@@ -0,0 +1,306 @@
+#include "diag.hh"
+#include "ingest.hh"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+
+
+namespace
+{
+
+constexpr const char * level_names[] = {
+	#define LOGGER_DIAG_LEVEL_STR(name, str) str,
+	LOGGER_DIAG_LEVELS(LOGGER_DIAG_LEVEL_STR)
+	#undef LOGGER_DIAG_LEVEL_STR
+};
+
+constexpr const char * channel_names[] = {
+	#define LOGGER_DIAG_CHANNEL_STR(name, str) str,
+	LOGGER_DIAG_CHANNELS(LOGGER_DIAG_CHANNEL_STR)
+	#undef LOGGER_DIAG_CHANNEL_STR
+};
+
+class Sink
+// Lines go through a BoundedRing to one thread that writes them out in
+// batches. A full ring drops the line rather than stall the caller.
+{
+public:
+	Sink()
+	:	_ring(Cfg::diag_ring_capacity),
+		_out(stderr),
+		_stop(false),
+		_dropped(0),
+		_reported_dropped(0),
+		_written(0)
+	{
+		_thread = std::thread([this]() { drain_loop(); });
+	}
+
+	~Sink()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_wake_cv.notify_one();
+		_thread.join();
+	}
+
+	void submit(std::string && line)
+	{
+		if (!_ring.try_push(std::move(line)))
+		{
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// Don't wait for the timer in a burst
+		if (_ring.size_approx() > _ring.capacity() / 2)
+		{
+			_wake_cv.notify_one();
+		}
+	}
+
+	void set_output(FILE * out)
+	{
+		flush();
+		_out.store(out);
+	}
+
+	void flush()
+	{
+		const size_t target = _ring.get_enqueue_pos();
+		std::unique_lock<std::mutex> lock(_mutex);
+		_wake_cv.notify_one();
+		_written_cv.wait(lock, [this, target]() { return _written >= target; });
+	}
+
+	uint64_t get_num_dropped() const
+	{
+		return _dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	void drain_loop()
+	{
+		std::string batch;
+		for (;;)
+		{
+			batch.clear();
+			size_t num_lines = 0;
+			while (_ring.try_pop([&batch](std::string && line) { batch += line; }))
+			{
+				++num_lines;
+			}
+
+			const uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+			if (dropped != _reported_dropped)
+			{
+				batch += "diag: " + std::to_string(dropped - _reported_dropped) + " lines dropped\n";
+				_reported_dropped = dropped;
+			}
+
+			if (!batch.empty())
+			{
+				FILE * out = _out.load();
+				std::fwrite(batch.data(), 1, batch.size(), out);
+				std::fflush(out);
+			}
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_written += num_lines;
+			_written_cv.notify_all();
+
+			if (num_lines == 0)
+			{
+				if (_stop)
+				{
+					return;
+				}
+				_wake_cv.wait_for(lock, std::chrono::milliseconds(Cfg::diag_flush_interval_ms));
+			}
+		}
+	}
+
+	BoundedRing<std::string> _ring;
+	std::atomic<FILE *> _out;
+
+	std::mutex _mutex;
+	std::condition_variable _wake_cv;
+	std::condition_variable _written_cv;
+	bool _stop;
+
+	std::atomic<uint64_t> _dropped;
+	uint64_t _reported_dropped; // Only touched by the sink thread
+	size_t _written;
+
+	std::thread _thread;
+};
+
+Sink & get_sink()
+{
+	static Sink sink;
+	return sink;
+}
+
+// The lines of a thread are built in the same stream, and the clock is
+// only broken down into hours, minutes and seconds once a second
+std::ostringstream & get_line_stream()
+{
+	static thread_local std::ostringstream os;
+	return os;
+}
+
+void write_time(std::ostream & os)
+{
+	static thread_local std::time_t last_secs = 0;
+	static thread_local char time_str[16];
+
+	const auto now = std::chrono::system_clock::now();
+	const std::time_t secs = std::chrono::system_clock::to_time_t(now);
+	const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count() % 1000000;
+
+	if (secs != last_secs)
+	{
+		std::tm tm;
+		localtime_r(&secs, &tm);
+		std::strftime(time_str, sizeof(time_str), "%H:%M:%S", &tm);
+		last_secs = secs;
+	}
+
+	os << time_str << '.' << std::setw(6) << std::setfill('0') << micros << std::setfill(' ');
+}
+
+}
+
+
+std::atomic<uint8_t> Diag::channel_levels[unsigned(Channel::Max)] = {
+	#define LOGGER_DIAG_CHANNEL_DEFAULT(name, str) {uint8_t(default_level)},
+	LOGGER_DIAG_CHANNELS(LOGGER_DIAG_CHANNEL_DEFAULT)
+	#undef LOGGER_DIAG_CHANNEL_DEFAULT
+};
+
+const char * Diag::get_level_str(Level level)
+{
+	return level_names[unsigned(level)];
+}
+
+const char * Diag::get_channel_str(Channel channel)
+{
+	return channel_names[unsigned(channel)];
+}
+
+bool Diag::get_level_from_str(boost::string_ref str, Level & level)
+{
+	for (unsigned i = 0; i < sizeof(level_names) / sizeof(level_names[0]); ++i)
+	{
+		if (str == level_names[i])
+		{
+			level = Level(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+void Diag::set_level(Level level)
+{
+	for (auto & channel_level : channel_levels)
+	{
+		channel_level.store(uint8_t(level), std::memory_order_relaxed);
+	}
+}
+
+void Diag::set_level(Channel channel, Level level)
+{
+	channel_levels[unsigned(channel)].store(uint8_t(level), std::memory_order_relaxed);
+}
+
+Diag::Level Diag::get_level(Channel channel)
+{
+	return Level(channel_levels[unsigned(channel)].load(std::memory_order_relaxed));
+}
+
+bool Diag::set_levels_from_str(boost::string_ref spec)
+{
+	Level level;
+	if (get_level_from_str(spec, level))
+	{
+		set_level(level);
+		return true;
+	}
+
+	// Parse it all before touching anything
+	Level levels[unsigned(Channel::Max)];
+	for (unsigned i = 0; i < unsigned(Channel::Max); ++i)
+	{
+		levels[i] = get_level(Channel(i));
+	}
+
+	while (!spec.empty())
+	{
+		const size_t comma = spec.find(',');
+		const boost::string_ref item = spec.substr(0, comma);
+		spec = (comma == boost::string_ref::npos) ? boost::string_ref() : spec.substr(comma + 1);
+
+		const size_t eq = item.find('=');
+		if (eq == boost::string_ref::npos || !get_level_from_str(item.substr(eq + 1), level))
+		{
+			return false;
+		}
+
+		const boost::string_ref channel_str = item.substr(0, eq);
+		unsigned channel = 0;
+		while (channel < unsigned(Channel::Max) && channel_str != channel_names[channel])
+		{
+			++channel;
+		}
+		if (channel == unsigned(Channel::Max))
+		{
+			return false;
+		}
+		levels[channel] = level;
+	}
+
+	for (unsigned i = 0; i < unsigned(Channel::Max); ++i)
+	{
+		set_level(Channel(i), levels[i]);
+	}
+	return true;
+}
+
+void Diag::set_output(FILE * out)
+{
+	get_sink().set_output(out);
+}
+
+void Diag::flush()
+{
+	get_sink().flush();
+}
+
+uint64_t Diag::get_num_dropped()
+{
+	return get_sink().get_num_dropped();
+}
+
+
+// Diag::Line
+
+Diag::Line::Line(Channel channel, Level level)
+:	_os(get_line_stream())
+{
+	_os.str(std::string());
+	write_time(_os);
+	_os << ' ' << get_level_str(level) << ' ' << get_channel_str(channel) << ": ";
+}
+
+Diag::Line::~Line()
+{
+	_os << '\n';
+	get_sink().submit(_os.str());
+}
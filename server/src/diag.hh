@@ -0,0 +1,136 @@
+#ifndef DIAG_HH
+#define DIAG_HH
+
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include <boost/utility/string_ref.hpp>
+
+
+namespace Cfg
+{
+	static const size_t diag_ring_capacity = 4096; // Lines waiting for the sink thread
+	static const unsigned diag_flush_interval_ms = 20;
+};
+
+
+namespace Diag
+// The server's own diagnostics, as opposed to the messages it logs.
+// Every line belongs to a channel and has a level, and a channel prints
+// the lines at or below its level, which can change at runtime. Lines
+// are formatted by the caller but written by a background thread, so
+// the IO threads never wait on the terminal. When a line is disabled,
+// DIAG() costs a relaxed load and a compare, and its arguments are never
+// evaluated.
+{
+	// X(<enumerator>, <name>), quietest first
+	#define LOGGER_DIAG_LEVELS(X) \
+		X(Off, "off") \
+		X(Error, "error") \
+		X(Warn, "warn") \
+		X(Info, "info") \
+		X(Debug, "debug") \
+		X(Trace, "trace")
+
+	// X(<enumerator>, <name>)
+	#define LOGGER_DIAG_CHANNELS(X) \
+		X(Server, "server") \
+		X(Session, "session") \
+		X(Comm, "comm") \
+		X(Req, "req") \
+		X(Parse, "parse") \
+		X(Queue, "queue") \
+		X(Wal, "wal")
+
+	enum class Level : uint8_t
+	{
+		#define LOGGER_DIAG_LEVEL_ENUM(name, str) name,
+		LOGGER_DIAG_LEVELS(LOGGER_DIAG_LEVEL_ENUM)
+		#undef LOGGER_DIAG_LEVEL_ENUM
+	};
+
+	enum class Channel : unsigned
+	{
+		#define LOGGER_DIAG_CHANNEL_ENUM(name, str) name,
+		LOGGER_DIAG_CHANNELS(LOGGER_DIAG_CHANNEL_ENUM)
+		#undef LOGGER_DIAG_CHANNEL_ENUM
+		Max
+	};
+
+	// What every channel starts at
+	static const Level default_level = Level::Info;
+
+	// One per channel, read by enabled()
+	extern std::atomic<uint8_t> channel_levels[unsigned(Channel::Max)];
+
+	inline bool enabled(Channel channel, Level level)
+	{
+		return uint8_t(level) <= channel_levels[unsigned(channel)].load(std::memory_order_relaxed);
+	}
+
+	const char * get_level_str(Level level);
+	const char * get_channel_str(Channel channel);
+
+	// False if str names no level
+	bool get_level_from_str(boost::string_ref str, Level & level);
+
+	void set_level(Level level); // Every channel
+	void set_level(Channel channel, Level level);
+	Level get_level(Channel channel);
+
+	// Either a level for every channel, e.g. "debug", or a comma separated
+	// list of <channel>=<level>, e.g. "comm=trace,req=debug". False and
+	// nothing changed if it doesn't parse.
+	bool set_levels_from_str(boost::string_ref spec);
+
+	// Where the sink thread writes, stderr to begin with
+	void set_output(FILE * out);
+
+	// Blocks until every line submitted so far is written out
+	void flush();
+
+	// Lines lost because the sink thread couldn't keep up
+	uint64_t get_num_dropped();
+
+	class Line
+	// One line of diagnostics, submitted to the sink when it goes away.
+	// Only one at a time per thread.
+	{
+	public:
+		Line(Channel channel, Level level);
+
+		~Line();
+
+		Line(const Line &) = delete;
+		Line & operator=(const Line &) = delete;
+
+		template <typename T>
+		Line & operator<<(const T & value)
+		{
+			_os << value;
+			return *this;
+		}
+
+	private:
+		std::ostringstream & _os; // The thread's, reused line after line
+	};
+};
+
+
+// DIAG(Comm, Debug, "Bytes read: " << n): the line only gets built when
+// the channel is at that level
+#define DIAG(channel, level, args) \
+	do \
+	{ \
+		if (Diag::enabled(Diag::Channel::channel, Diag::Level::level)) \
+		{ \
+			Diag::Line(Diag::Channel::channel, Diag::Level::level) << args; \
+		} \
+	} \
+	while (false)
+
+
+#endif
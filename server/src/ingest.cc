@@ -0,0 +1,216 @@
+#include "ingest.hh"
+
+#include <chrono>
+#include <algorithm>
+
+
+// IngestRing
+
+IngestRing::IngestRing(MsgQueueWrapper & q_wrapper, size_t capacity, OverflowPolicy policy)
+:	_q_wrapper(q_wrapper),
+	_ring(capacity),
+	_policy(policy),
+	_drain_waiting(false),
+	_stop(false),
+	_committed_pos(0),
+	_pushed(0),
+	_drained(0),
+	_dropped(0),
+	_rejected(0),
+	_blocked(0),
+	_refused(0),
+	_high_watermark(0)
+{
+	_drain_thread = std::thread([this]() { drain_loop(); });
+}
+
+IngestRing::~IngestRing()
+{
+	_stop.store(true);
+	wake_drain();
+	_drain_thread.join();
+}
+
+bool IngestRing::push(Msg && msg)
+{
+	bool counted_block = false;
+
+	while (!_ring.try_push(std::move(msg)))
+	{
+		switch (_policy)
+		{
+			case OverflowPolicy::Reject:
+				_rejected.fetch_add(1, std::memory_order_relaxed);
+				return false;
+
+			case OverflowPolicy::DropOldest:
+				if (_ring.try_pop([](Msg &&) {}))
+				{
+					_dropped.fetch_add(1, std::memory_order_relaxed);
+				}
+				break;
+
+			case OverflowPolicy::Block:
+			default:
+				if (!counted_block)
+				{
+					_blocked.fetch_add(1, std::memory_order_relaxed);
+					counted_block = true;
+				}
+				wake_drain();
+				std::this_thread::yield();
+				break;
+		}
+	}
+
+	_pushed.fetch_add(1, std::memory_order_relaxed);
+
+	const size_t occupancy = _ring.size_approx();
+	size_t high = _high_watermark.load(std::memory_order_relaxed);
+	while (occupancy > high &&
+		!_high_watermark.compare_exchange_weak(high, occupancy, std::memory_order_relaxed))
+	{
+
+	}
+
+	// Pairs with the fence in drain_loop(): either the drain thread sees
+	// our item when it re-checks the ring, or we see it parked.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_drain_waiting.load(std::memory_order_relaxed))
+	{
+		wake_drain();
+	}
+
+	return true;
+}
+
+void IngestRing::sync()
+{
+	const size_t target = _ring.get_enqueue_pos();
+
+	wake_drain();
+
+	std::unique_lock<std::mutex> lock(_sync_mutex);
+	_sync_cv.wait(lock, [this, target]() { return _committed_pos >= target; });
+}
+
+IngestRing::Stats IngestRing::get_stats() const
+{
+	Stats stats;
+	stats.capacity = _ring.capacity();
+	stats.occupancy = _ring.size_approx();
+	stats.high_watermark = _high_watermark.load(std::memory_order_relaxed);
+	stats.pushed = _pushed.load(std::memory_order_relaxed);
+	stats.drained = _drained.load(std::memory_order_relaxed);
+	stats.dropped = _dropped.load(std::memory_order_relaxed);
+	stats.rejected = _rejected.load(std::memory_order_relaxed);
+	stats.blocked = _blocked.load(std::memory_order_relaxed);
+	stats.refused = _refused.load(std::memory_order_relaxed);
+	return stats;
+}
+
+const char * IngestRing::get_policy_str(OverflowPolicy policy)
+{
+	switch (policy)
+	{
+		case OverflowPolicy::Block:
+			return "block";
+		case OverflowPolicy::DropOldest:
+			return "drop_oldest";
+		case OverflowPolicy::Reject:
+			return "reject";
+	}
+	return "illegal";
+}
+
+bool IngestRing::get_policy_from_str(const std::string & str, OverflowPolicy & policy)
+{
+	for (OverflowPolicy p : {OverflowPolicy::Block, OverflowPolicy::DropOldest, OverflowPolicy::Reject})
+	{
+		if (str == get_policy_str(p))
+		{
+			policy = p;
+			return true;
+		}
+	}
+	return false;
+}
+
+void IngestRing::wake_drain()
+{
+	std::lock_guard<std::mutex> lock(_drain_mutex);
+	_drain_cv.notify_one();
+}
+
+void IngestRing::drain_loop()
+{
+	std::vector<Msg> batch;
+	batch.reserve(Cfg::ingest_drain_batch);
+
+	unsigned idle_spins = 0;
+
+	for (;;)
+	{
+		while (batch.size() < Cfg::ingest_drain_batch &&
+			_ring.try_pop([&batch](Msg && msg) { batch.push_back(std::move(msg)); }))
+		{
+
+		}
+
+		if (!batch.empty())
+		{
+			_drained.fetch_add(batch.size(), std::memory_order_relaxed);
+			if (!_q_wrapper.push_batch(batch))
+			{
+				// Some username found no room: one by one, the others still go in
+				for (Msg & msg : batch)
+				{
+					if (!_q_wrapper.push(std::move(msg)).owns_lock())
+					{
+						_refused.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+			}
+			batch.clear();
+			idle_spins = 0;
+		}
+
+		// Everything below the dequeue position is now either in the queue
+		// or was dropped by a producer.
+		{
+			std::lock_guard<std::mutex> lock(_sync_mutex);
+			_committed_pos = _ring.get_dequeue_pos();
+		}
+		_sync_cv.notify_all();
+
+		if (_ring.front_ready())
+		{
+			continue;
+		}
+
+		if (_stop.load() && _ring.size_approx() == 0)
+		{
+			break;
+		}
+
+		// Empty, or a producer claimed the next slot and has yet to fill
+		// it: nothing to pop either way, so back off instead of spinning.
+		// Yield a little before parking, bursts usually come back quickly
+		if (idle_spins < Cfg::ingest_drain_spins)
+		{
+			++idle_spins;
+			std::this_thread::yield();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_drain_mutex);
+		_drain_waiting.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!_ring.front_ready() && (!_stop.load() || _ring.size_approx() != 0))
+		{
+			// Timed, so a missed wakeup costs at most one period
+			_drain_cv.wait_for(lock, std::chrono::microseconds(Cfg::ingest_drain_idle_wait_us));
+		}
+		_drain_waiting.store(false, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,278 @@
+#ifndef INGEST_HH
+#define INGEST_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <type_traits>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "msgs.hh"
+
+
+namespace Cfg
+{
+	static const size_t ingest_ring_capacity = 65536;
+	static const size_t ingest_drain_batch = 512;
+	static const unsigned ingest_drain_spins = 64;
+	static const unsigned ingest_drain_idle_wait_us = 1000;
+};
+
+
+template <typename T>
+class BoundedRing
+// Bounded lock-free ring after Dmitry Vyukov's array queue. Every slot
+// carries a sequence number telling whether it is free or holds an item
+// for the current lap, so producers only ever CAS the shared enqueue
+// position and never take a lock. Popping is CAS based too, which lets
+// producers evict the oldest item when the ring is full.
+{
+public:
+
+	explicit BoundedRing(size_t min_capacity)
+	:	_mask(round_up_pow2(min_capacity) - 1),
+		_slots(_mask + 1),
+		_enqueue_pos(0),
+		_dequeue_pos(0)
+	{
+		for (size_t i = 0; i < _slots.size(); ++i)
+		{
+			_slots[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	~BoundedRing()
+	{
+		while (try_pop([](T &&) {}))
+		{
+
+		}
+	}
+
+	BoundedRing(const BoundedRing &) = delete;
+	BoundedRing & operator=(const BoundedRing &) = delete;
+
+	// Lock-free. Leaves item untouched and returns false when full.
+	bool try_push(T && item)
+	{
+		size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Slot & slot = _slots[pos & _mask];
+			const size_t seq = slot.seq.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+			if (diff == 0)
+			{
+				if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					new (&slot.storage) T(std::move(item));
+					slot.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = _enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Lock-free. Hands the oldest item to func(T &&), returns false when empty.
+	template <typename Func>
+	bool try_pop(Func && func)
+	{
+		size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			Slot & slot = _slots[pos & _mask];
+			const size_t seq = slot.seq.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+
+			if (diff == 0)
+			{
+				if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					T * stored = reinterpret_cast<T *>(&slot.storage);
+					func(std::move(*stored));
+					stored->~T();
+					slot.seq.store(pos + _mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = _dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Number of slots claimed by producers so far
+	size_t get_enqueue_pos() const
+	{
+		return _enqueue_pos.load(std::memory_order_acquire);
+	}
+
+	// Number of slots claimed by consumers so far
+	size_t get_dequeue_pos() const
+	{
+		return _dequeue_pos.load(std::memory_order_acquire);
+	}
+
+	// Whether the oldest slot holds a published item. False both when
+	// empty and when a producer has claimed the slot but not filled it.
+	bool front_ready() const
+	{
+		const size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+		const Slot & slot = _slots[pos & _mask];
+		return slot.seq.load(std::memory_order_acquire) == pos + 1;
+	}
+
+	// Racy by nature, good enough for stats
+	size_t size_approx() const
+	{
+		const size_t enq = get_enqueue_pos();
+		const size_t deq = get_dequeue_pos();
+		return enq > deq ? enq - deq : 0;
+	}
+
+	size_t capacity() const
+	{
+		return _mask + 1;
+	}
+
+private:
+
+	static size_t round_up_pow2(size_t n)
+	{
+		size_t pow2 = 2;
+		while (pow2 < n)
+		{
+			pow2 <<= 1;
+		}
+		return pow2;
+	}
+
+	struct Slot
+	{
+		std::atomic<size_t> seq;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+
+	const size_t _mask;
+	std::vector<Slot> _slots;
+
+	// Producers and the consumer hammer different ends; keep them apart
+	char _pad0[64];
+	std::atomic<size_t> _enqueue_pos;
+	char _pad1[64];
+	std::atomic<size_t> _dequeue_pos;
+	char _pad2[64];
+};
+
+
+class IngestRing
+// Non-blocking front door of a MsgQueueWrapper. Network threads hand
+// messages to a BoundedRing; one drain thread moves them into the
+// queue in batches, so the queue lock is taken once per batch instead
+// of once per message.
+{
+public:
+
+	enum class OverflowPolicy : unsigned
+	{
+		Block,      // Producer waits for the drain thread to make room
+		DropOldest, // Producer evicts the oldest queued message
+		Reject      // Producer gives up, request fails with NewLogQueueFull
+	};
+
+	struct Stats
+	{
+		size_t capacity;
+		size_t occupancy;
+		size_t high_watermark;
+		uint64_t pushed;
+		uint64_t drained;
+		uint64_t dropped;
+		uint64_t rejected;
+		uint64_t blocked;
+		uint64_t refused; // Drained, but the queue had no room for their usernames
+	};
+
+	IngestRing(
+		MsgQueueWrapper & q_wrapper,
+		size_t capacity = Cfg::ingest_ring_capacity,
+		OverflowPolicy policy = OverflowPolicy::Block);
+
+	~IngestRing();
+
+	IngestRing(const IngestRing &) = delete;
+	IngestRing & operator=(const IngestRing &) = delete;
+
+	// Thread safe, lock-free unless the policy is Block and the ring is full.
+	// Returns false only when the message was rejected; msg is then untouched.
+	bool push(Msg && msg);
+
+	// Blocks until everything pushed before this call has reached the queue
+	// (or been dropped). Gives readers read-your-writes semantics.
+	void sync();
+
+	Stats get_stats() const;
+
+	OverflowPolicy get_policy() const
+	{
+		return _policy;
+	}
+
+	static const char * get_policy_str(OverflowPolicy policy);
+
+	// Returns false on unknown names
+	static bool get_policy_from_str(const std::string & str, OverflowPolicy & policy);
+
+private:
+
+	void drain_loop();
+
+	void wake_drain();
+
+	MsgQueueWrapper & _q_wrapper;
+	BoundedRing<Msg> _ring;
+	const OverflowPolicy _policy;
+
+	// Drain thread parking
+	std::atomic<bool> _drain_waiting;
+	std::atomic<bool> _stop;
+	std::mutex _drain_mutex;
+	std::condition_variable _drain_cv;
+
+	// Ring position up to which everything is in the queue or dropped
+	size_t _committed_pos;
+	std::mutex _sync_mutex;
+	std::condition_variable _sync_cv;
+
+	// Counters
+	std::atomic<uint64_t> _pushed;
+	std::atomic<uint64_t> _drained;
+	std::atomic<uint64_t> _dropped;
+	std::atomic<uint64_t> _rejected;
+	std::atomic<uint64_t> _blocked;
+	std::atomic<uint64_t> _refused;
+	std::atomic<size_t> _high_watermark;
+
+	std::thread _drain_thread;
+};
+
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef LOOKUP_HH
+#define LOOKUP_HH
+
+#include <cstddef>
+#include <cstring>
+
+#include <boost/utility/string_ref.hpp>
+
+
+namespace Lookup
+{
+
+template <size_t N, unsigned TableBits>
+struct PerfectHash
+// Keyword -> index table. The hash only looks at the length and the
+// first and last chars, which is all it takes to tell our keywords apart;
+// the multipliers are searched at compile time until no two keywords
+// share a slot. A lookup is one hash, one table load and one memcmp.
+{
+	static constexpr size_t table_size = size_t(1) << TableBits;
+	static constexpr size_t not_found = N;
+
+	unsigned mul_first;
+	unsigned mul_last;
+
+	const char * keys[N];
+	size_t lens[N];
+
+	// Key index + 1, or 0 for an empty slot
+	unsigned char slots[table_size];
+
+	constexpr size_t slot_of(const char * str, size_t len) const
+	{
+		return (len +
+			unsigned(static_cast<unsigned char>(str[0])) * mul_first +
+			unsigned(static_cast<unsigned char>(str[len - 1])) * mul_last) & (table_size - 1);
+	}
+
+	// Index of str in the keys, or not_found
+	size_t find(boost::string_ref str) const
+	{
+		if (str.empty())
+		{
+			return not_found;
+		}
+
+		const size_t idx = size_t(slots[slot_of(str.data(), str.size())]) - 1;
+
+		// An empty slot wraps idx around to SIZE_MAX, failing the bound check
+		return (idx < N && lens[idx] == str.size() &&
+			std::memcmp(keys[idx], str.data(), str.size()) == 0) ? idx : not_found;
+	}
+
+	constexpr bool is_valid() const
+	{
+		return mul_first != 0;
+	}
+};
+
+
+template <size_t N, unsigned TableBits>
+constexpr size_t PerfectHash<N, TableBits>::table_size;
+
+template <size_t N, unsigned TableBits>
+constexpr size_t PerfectHash<N, TableBits>::not_found;
+
+
+constexpr size_t const_strlen(const char * str)
+{
+	size_t len = 0;
+	while (str[len] != '\0')
+	{
+		++len;
+	}
+	return len;
+}
+
+
+template <size_t N, unsigned TableBits>
+constexpr PerfectHash<N, TableBits> make_perfect_hash(const char * const (&keys)[N])
+// Check the result with is_valid() in a static_assert: it's false when
+// no collision free multipliers exist for this table size.
+{
+	PerfectHash<N, TableBits> ph {};
+
+	for (size_t i = 0; i < N; ++i)
+	{
+		ph.keys[i] = keys[i];
+		ph.lens[i] = const_strlen(keys[i]);
+	}
+
+	for (unsigned mul_first = 1; mul_first < 64; ++mul_first)
+	{
+		for (unsigned mul_last = 0; mul_last < 64; ++mul_last)
+		{
+			ph.mul_first = mul_first;
+			ph.mul_last = mul_last;
+
+			for (size_t slot = 0; slot < ph.table_size; ++slot)
+			{
+				ph.slots[slot] = 0;
+			}
+
+			bool collision = false;
+			for (size_t i = 0; i < N && !collision; ++i)
+			{
+				const size_t slot = ph.slot_of(ph.keys[i], ph.lens[i]);
+				collision = (ph.slots[slot] != 0);
+				ph.slots[slot] = static_cast<unsigned char>(i + 1);
+			}
+
+			if (!collision)
+			{
+				return ph;
+			}
+		}
+	}
+
+	ph.mul_first = 0;
+	return ph;
+}
+
+};
+
+
+#endif
@@ -1,29 +1,101 @@
-
 #include <iostream>
 #include <exception>
+#include <string>
+#include <cstdlib>
 
 #include "networking.hh"
-
-namespace Cfg
-{
-	static const bool cli_arg_debug = false;
-};
+#include "diag.hh"
 
 int main(int argc, char * argv[])
 {
-	std::cout << argc << std::endl;
+	// Usage: server [--threads <n>] [--ingest-ring <capacity>] [--overflow block|drop_oldest|reject]
+	//     [--wal <dir>] [--fsync always|none|<records>|<ms>ms] [--segment-mb <n>]
+	//     [--diag <level>|<channel>=<level>,...] [--metrics-port <port>]
+	//     [--retain [<priority>:]msgs|bytes|age=<n>[k|m|g|s|m|h|d],...] [--search-index on|off]
+	ServerOptions options;
+	bool usage_error = false;
+
+	for (int i = 1; i < argc && !usage_error; ++i)
+	{
+		const std::string arg(argv[i]);
+		if (i + 1 >= argc)
+		{
+			usage_error = true;
+		}
+		else if (arg == "--threads")
+		{
+			options.num_threads = unsigned(std::strtoul(argv[++i], nullptr, 10));
+		}
+		else if (arg == "--ingest-ring")
+		{
+			options.ingest_ring_capacity = size_t(std::strtoull(argv[++i], nullptr, 10));
+		}
+		else if (arg == "--overflow")
+		{
+			usage_error = !IngestRing::get_policy_from_str(argv[++i], options.overflow_policy);
+		}
+		else if (arg == "--wal")
+		{
+			options.wal_dir = argv[++i];
+		}
+		else if (arg == "--fsync")
+		{
+			usage_error = !WriteAheadLog::SyncPolicy::from_str(argv[++i], options.wal_sync_policy);
+		}
+		else if (arg == "--segment-mb")
+		{
+			options.wal_segment_bytes = size_t(std::strtoull(argv[++i], nullptr, 10)) * 1024 * 1024;
+			usage_error = (options.wal_segment_bytes == 0);
+		}
+		else if (arg == "--diag")
+		{
+			usage_error = !Diag::set_levels_from_str(argv[++i]);
+		}
+		else if (arg == "--metrics-port")
+		{
+			const unsigned long port = std::strtoul(argv[++i], nullptr, 10);
+			options.metrics_port = PortType(port);
+			usage_error = (port == 0 || port > 65535);
+		}
+		else if (arg == "--retain")
+		{
+			usage_error = !MsgQueueWrapper::RetentionPolicy::from_str(argv[++i], options.retention);
+		}
+		else if (arg == "--search-index")
+		{
+			const std::string value(argv[++i]);
+			options.search_index = (value == "on");
+			usage_error = (value != "on" && value != "off");
+		}
+		else
+		{
+			usage_error = true;
+		}
+	}
+
+	if (usage_error)
+	{
+		std::cerr << "Usage: " << argv[0] << " [--threads <n>] [--ingest-ring <capacity>]"
+			" [--overflow block|drop_oldest|reject]"
+			" [--wal <dir>] [--fsync always|none|<records>|<ms>ms] [--segment-mb <n>]"
+			" [--diag <level>|<channel>=<level>,...] [--metrics-port <port>]"
+			" [--retain [<priority>:]msgs|bytes|age=<n>[k|m|g|s|m|h|d],...] [--search-index on|off]" << std::endl;
+		return 1;
+	}
 
-	if (Cfg::cli_arg_debug)
+	if (Diag::enabled(Diag::Channel::Server, Diag::Level::Trace))
 	{
+		Diag::Line line(Diag::Channel::Server, Diag::Level::Trace);
+		line << "Command line:";
 		for (int i = 0; i < argc; ++i)
 		{
-			std::cout << argv[i] << std::endl;
+			line << " " << argv[i];
 		}
 	}
 
 	try
 	{
-		start_server();
+		start_server(options);
 	}
 	catch (std::exception & e)
 	{
@@ -0,0 +1,222 @@
+#include "metrics.hh"
+#include "msgs.hh"
+#include "ingest.hh"
+#include "reqs.hh"
+
+#include <deque>
+#include <mutex>
+
+
+namespace
+{
+
+constexpr const char * counter_names[] = {
+	#define LOGGER_METRICS_COUNTER_STR(name, str, help) str,
+	LOGGER_METRICS_COUNTERS(LOGGER_METRICS_COUNTER_STR)
+	#undef LOGGER_METRICS_COUNTER_STR
+};
+
+constexpr const char * counter_helps[] = {
+	#define LOGGER_METRICS_COUNTER_HELP(name, str, help) help,
+	LOGGER_METRICS_COUNTERS(LOGGER_METRICS_COUNTER_HELP)
+	#undef LOGGER_METRICS_COUNTER_HELP
+};
+
+constexpr const char * histogram_names[] = {
+	#define LOGGER_METRICS_HISTOGRAM_STR(name, str, help) str,
+	LOGGER_METRICS_HISTOGRAMS(LOGGER_METRICS_HISTOGRAM_STR)
+	#undef LOGGER_METRICS_HISTOGRAM_STR
+};
+
+constexpr const char * histogram_helps[] = {
+	#define LOGGER_METRICS_HISTOGRAM_HELP(name, str, help) help,
+	LOGGER_METRICS_HISTOGRAMS(LOGGER_METRICS_HISTOGRAM_HELP)
+	#undef LOGGER_METRICS_HISTOGRAM_HELP
+};
+
+constexpr unsigned num_result_codes = 0
+	#define LOGGER_RESULT_CODE_COUNT(name, description) + 1
+	LOGGER_RESULT_CODES(LOGGER_RESULT_CODE_COUNT)
+	#undef LOGGER_RESULT_CODE_COUNT
+	;
+
+static_assert(num_result_codes <= Metrics::max_results, "Grow Metrics::max_results");
+
+class Registry
+// Every slot ever handed out. Slots never move nor go away, so readers
+// and owners can use them without holding the lock.
+{
+public:
+	Metrics::Slot & claim()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (Metrics::Slot & slot : _slots)
+		{
+			if (!slot.in_use)
+			{
+				slot.in_use = true;
+				return slot;
+			}
+		}
+		_slots.emplace_back();
+		_slots.back().in_use = true;
+		return _slots.back();
+	}
+
+	void release(Metrics::Slot & slot)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		slot.in_use = false;
+	}
+
+	template <typename Func>
+	uint64_t sum(Func func)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		uint64_t total = 0;
+		for (const Metrics::Slot & slot : _slots)
+		{
+			total += func(slot);
+		}
+		return total;
+	}
+
+private:
+	std::mutex _mutex;
+	std::deque<Metrics::Slot> _slots;
+};
+
+Registry & get_registry()
+{
+	// Never destroyed: threads may still count while statics go away
+	static Registry * registry = new Registry;
+	return *registry;
+}
+
+class SlotReleaser
+// Hands the thread's slot back when the thread exits
+{
+public:
+	~SlotReleaser()
+	{
+		if (Metrics::thread_slot)
+		{
+			get_registry().release(*Metrics::thread_slot);
+			Metrics::thread_slot = nullptr;
+		}
+	}
+};
+
+uint64_t load(const std::atomic<uint64_t> & value)
+{
+	return value.load(std::memory_order_relaxed);
+}
+
+void write_header(std::ostream & os, const char * name, const char * type, const char * help)
+{
+	os << "# HELP logger_" << name << ' ' << help << "\n";
+	os << "# TYPE logger_" << name << ' ' << type << "\n";
+}
+
+}
+
+
+thread_local Metrics::Slot * Metrics::thread_slot = nullptr;
+
+Metrics::Slot & Metrics::claim_slot()
+{
+	static thread_local SlotReleaser releaser;
+	(void)releaser;
+
+	thread_slot = &get_registry().claim();
+	return *thread_slot;
+}
+
+uint64_t Metrics::get(Counter counter)
+{
+	return get_registry().sum([counter](const Slot & slot) { return load(slot.counters[unsigned(counter)]); });
+}
+
+uint64_t Metrics::get_result(unsigned result_code)
+{
+	return get_registry().sum([result_code](const Slot & slot) { return load(slot.results[result_code]); });
+}
+
+Metrics::HistogramTotals Metrics::get(Histogram histogram)
+{
+	HistogramTotals totals {};
+	const unsigned h = unsigned(histogram);
+	for (unsigned b = 0; b < num_buckets; ++b)
+	{
+		totals.buckets[b] = get_registry().sum([h, b](const Slot & slot) { return load(slot.buckets[h][b]); });
+		totals.count += totals.buckets[b];
+	}
+	totals.sum = get_registry().sum([h](const Slot & slot) { return load(slot.sums[h]); });
+	return totals;
+}
+
+const char * Metrics::get_counter_str(Counter counter)
+{
+	return counter_names[unsigned(counter)];
+}
+
+const char * Metrics::get_histogram_str(Histogram histogram)
+{
+	return histogram_names[unsigned(histogram)];
+}
+
+void Metrics::write_to_stream(std::ostream & os, const MsgQueueWrapper & q_wrapper)
+{
+	for (unsigned c = 0; c < unsigned(Counter::Max); ++c)
+	{
+		write_header(os, counter_names[c], "counter", counter_helps[c]);
+		os << "logger_" << counter_names[c] << ' ' << get(Counter(c)) << "\n";
+	}
+
+	write_header(os, "requests_total", "counter", "Replies sent, by result code");
+	for (unsigned r = 0; r < num_result_codes; ++r)
+	{
+		os << "logger_requests_total{result=\"" << ReqUtils::get_short_result_str(ReqUtils::ResultCode(r)) << "\"} "
+			<< get_result(r) << "\n";
+	}
+
+	// Opened and closed are counted apart, often on different threads.
+	// Closed goes first so it can't overtake opened meanwhile.
+	const uint64_t sessions_closed = get(Counter::SessionsClosed);
+	const uint64_t sessions_opened = get(Counter::SessionsOpened);
+	write_header(os, "sessions_open", "gauge", "Client connections right now");
+	os << "logger_sessions_open " << sessions_opened - sessions_closed << "\n";
+
+	write_header(os, "queue_msgs", "gauge", "Messages in the store");
+	os << "logger_queue_msgs " << q_wrapper.size() << "\n";
+
+	const IngestRing * ingest_ring = q_wrapper.get_ingest_ring();
+	if (ingest_ring)
+	{
+		const IngestRing::Stats stats = ingest_ring->get_stats();
+		write_header(os, "ingest_ring_msgs", "gauge", "Messages waiting in the ingest ring");
+		os << "logger_ingest_ring_msgs " << stats.occupancy << "\n";
+		write_header(os, "ingest_ring_dropped_total", "counter", "Messages the ingest ring evicted when full");
+		os << "logger_ingest_ring_dropped_total " << stats.dropped << "\n";
+		write_header(os, "ingest_ring_rejected_total", "counter", "Messages the ingest ring turned away when full");
+		os << "logger_ingest_ring_rejected_total " << stats.rejected << "\n";
+		write_header(os, "ingest_ring_refused_total", "counter", "Messages the queue refused after the ingest ring, with no room for their usernames");
+		os << "logger_ingest_ring_refused_total " << stats.refused << "\n";
+	}
+
+	for (unsigned h = 0; h < unsigned(Histogram::Max); ++h)
+	{
+		write_header(os, histogram_names[h], "histogram", histogram_helps[h]);
+		const HistogramTotals totals = get(Histogram(h));
+
+		uint64_t cumulative = 0;
+		for (unsigned b = 0; b + 1 < num_buckets; ++b)
+		{
+			cumulative += totals.buckets[b];
+			os << "logger_" << histogram_names[h] << "_bucket{le=\"" << (uint64_t(1) << b) << "\"} " << cumulative << "\n";
+		}
+		os << "logger_" << histogram_names[h] << "_bucket{le=\"+Inf\"} " << totals.count << "\n";
+		os << "logger_" << histogram_names[h] << "_sum " << totals.sum << "\n";
+		os << "logger_" << histogram_names[h] << "_count " << totals.count << "\n";
+	}
+}
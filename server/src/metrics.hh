@@ -0,0 +1,156 @@
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+
+class MsgQueueWrapper;
+
+namespace Cfg
+{
+	static const unsigned metrics_parse_sample_every = 16; // Parses timed, one in every so many
+};
+
+
+namespace Metrics
+// Counters and latency histograms of what the server's been doing. Every
+// thread counts into a slot of its own, with plain relaxed loads and
+// stores, so counting never contends nor waits; reading sums the slots up.
+// Slots are handed back when their thread exits and taken over, totals
+// and all, by the next thread that starts counting.
+{
+	// X(<enumerator>, <exported name>, <help>)
+	#define LOGGER_METRICS_COUNTERS(X) \
+		X(SessionsOpened, "sessions_opened_total", "Client connections accepted") \
+		X(SessionsClosed, "sessions_closed_total", "Client connections gone") \
+		X(BytesIn, "bytes_in_total", "Bytes of requests read from clients") \
+		X(BytesOut, "bytes_out_total", "Bytes written to clients") \
+		X(ShardLockContended, "shard_lock_contended_total", "Shard lock acquisitions that had to wait") \
+		X(RetentionDropped, "retention_dropped_total", "Messages dropped by the retention policy")
+
+	// X(<enumerator>, <exported name>, <help>), all in nanoseconds
+	#define LOGGER_METRICS_HISTOGRAMS(X) \
+		X(ParseNs, "parse_ns", "Parsing a request, sampled") \
+		X(ServeNs, "serve_ns", "Serving a request other than new_log, up to its first reply chunk") \
+		X(NewLogsServeNs, "new_logs_serve_ns", "Serving a run of new_logs together") \
+		X(ShardLockWaitNs, "shard_lock_wait_ns", "Waiting for a contended shard lock")
+
+	enum class Counter : unsigned
+	{
+		#define LOGGER_METRICS_COUNTER_ENUM(name, str, help) name,
+		LOGGER_METRICS_COUNTERS(LOGGER_METRICS_COUNTER_ENUM)
+		#undef LOGGER_METRICS_COUNTER_ENUM
+		Max
+	};
+
+	enum class Histogram : unsigned
+	{
+		#define LOGGER_METRICS_HISTOGRAM_ENUM(name, str, help) name,
+		LOGGER_METRICS_HISTOGRAMS(LOGGER_METRICS_HISTOGRAM_ENUM)
+		#undef LOGGER_METRICS_HISTOGRAM_ENUM
+		Max
+	};
+
+	// Room for every ReqUtils::ResultCode, checked in metrics.cc
+	static const unsigned max_results = 32;
+
+	// Bucket i counts values up to 2^i, the last one everything above
+	static const unsigned num_buckets = 32;
+
+	struct Slot
+	{
+		std::atomic<uint64_t> counters[unsigned(Counter::Max)];
+		std::atomic<uint64_t> results[max_results];
+		std::atomic<uint64_t> buckets[unsigned(Histogram::Max)][num_buckets];
+		std::atomic<uint64_t> sums[unsigned(Histogram::Max)];
+		bool in_use; // Guarded by the registry
+		char pad[64]; // Keep neighbouring slots off the same cache line
+	};
+
+	// The calling thread's slot, null until it first counts something
+	extern thread_local Slot * thread_slot;
+
+	Slot & claim_slot();
+
+	inline Slot & get_slot()
+	{
+		Slot * slot = thread_slot;
+		return slot ? *slot : claim_slot();
+	}
+
+	// Only the slot's thread writes to it: no read-modify-write needed
+	inline void bump(std::atomic<uint64_t> & value, uint64_t n)
+	{
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	inline unsigned get_bucket(uint64_t value)
+	{
+		if (value <= 1)
+		{
+			return 0;
+		}
+		const unsigned bucket = 64 - unsigned(__builtin_clzll(value - 1));
+		return bucket < num_buckets ? bucket : num_buckets - 1;
+	}
+
+	inline void add(Counter counter, uint64_t n = 1)
+	{
+		bump(get_slot().counters[unsigned(counter)], n);
+	}
+
+	// One reply sent with that ReqUtils::ResultCode
+	inline void add_result(unsigned result_code)
+	{
+		bump(get_slot().results[result_code], 1);
+	}
+
+	inline void record(Histogram histogram, uint64_t value)
+	{
+		Slot & slot = get_slot();
+		bump(slot.buckets[unsigned(histogram)][get_bucket(value)], 1);
+		bump(slot.sums[unsigned(histogram)], value);
+	}
+
+	inline uint64_t now_ns()
+	{
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Whether the calling thread should time this parse
+	inline bool sample_parse()
+	{
+		static thread_local unsigned countdown = 0;
+		if (countdown == 0)
+		{
+			countdown = Cfg::metrics_parse_sample_every;
+		}
+		return --countdown == 0;
+	}
+
+	struct HistogramTotals
+	{
+		uint64_t buckets[num_buckets];
+		uint64_t sum;
+		uint64_t count;
+	};
+
+	// Summed over every slot, so only as fresh as the relaxed loads make them
+	uint64_t get(Counter counter);
+	uint64_t get_result(unsigned result_code);
+	HistogramTotals get(Histogram histogram);
+
+	const char * get_counter_str(Counter counter);
+	const char * get_histogram_str(Histogram histogram);
+
+	// Everything, plus the queue's current depth, in the Prometheus text
+	// format: one "<name>[{<labels>}] <value>" line per value
+	void write_to_stream(std::ostream & os, const MsgQueueWrapper & q_wrapper);
+};
+
+
+#endif
@@ -1,16 +1,637 @@
 #include "msgs.hh"
+#include "ingest.hh"
+#include "wal.hh"
+#include "lookup.hh"
+#include "metrics.hh"
 
 #include <vector>
+#include <algorithm>
 
-const std::vector<const char *> Msg::_priority_strings = {
-		"debug",
-		"info",
-		"warning",
-		"critical",
-		"error",
+#include <time.h>
+
+const char * const Msg::_priority_strings[] = {
+		#define LOGGER_MSG_PRIORITY_STR(name, str) str,
+		LOGGER_MSG_PRIORITIES(LOGGER_MSG_PRIORITY_STR)
+		#undef LOGGER_MSG_PRIORITY_STR
 		"illegal"
 	};
 
+const uint8_t Msg::_priority_str_lens[] = {
+		#define LOGGER_MSG_PRIORITY_STR_LEN(name, str) sizeof(str) - 1,
+		LOGGER_MSG_PRIORITIES(LOGGER_MSG_PRIORITY_STR_LEN)
+		#undef LOGGER_MSG_PRIORITY_STR_LEN
+		sizeof("illegal") - 1
+	};
+
+namespace
+{
+	constexpr const char * priority_names[] = {
+		#define LOGGER_MSG_PRIORITY_STR(name, str) str,
+		LOGGER_MSG_PRIORITIES(LOGGER_MSG_PRIORITY_STR)
+		#undef LOGGER_MSG_PRIORITY_STR
+	};
+
+	constexpr auto priority_lookup = Lookup::make_perfect_hash<
+		sizeof(priority_names) / sizeof(priority_names[0]), 4>(priority_names);
+
+	static_assert(priority_lookup.is_valid(), "No perfect hash for the priority names, grow the table");
+	static_assert(sizeof(priority_names) / sizeof(priority_names[0]) == size_t(Msg::Priority::Illegal),
+		"Priority names out of sync with Msg::Priority");
+};
+
+Msg::Priority Msg::get_priority_from_str(boost::string_ref priority_str)
+{
+	// not_found == number of priorities == Illegal
+	return static_cast<Priority>(priority_lookup.find(priority_str));
+}
+
+static_assert(sizeof(MsgRecord) == 32, "MsgRecord grew, check the memory report");
+static_assert(Cfg::msg_block_records <= 65536, "Block positions must fit the priority index");
+
+// MsgQueueWrapper
+
+MsgQueueWrapper::MsgQueueWrapper(size_t num_shards)
+:	_shards(num_shards ? num_shards : 1),
+	_next_seq(0),
+	_now_secs(0)
+{
+
+}
+
+MsgQueueWrapper::~MsgQueueWrapper()
+{
+	// Stop the drain thread first, it still pushes into the shards
+	_ingest_ring.reset();
+	stop_retention();
+	stop_indexer();
+}
+
+MsgQueueWrapper::Shard & MsgQueueWrapper::get_shard()
+{
+	// Each thread gets a fixed slot on first use, handed out round robin
+	// so that N threads spread evenly over N shards.
+	static std::atomic<size_t> next_thd_slot(0);
+	static thread_local const size_t thd_slot = next_thd_slot++;
+
+	return _shards[thd_slot % _shards.size()];
+}
+
+Msg::Time MsgQueueWrapper::read_clock()
+{
+	// Read off the vDSO, no syscall, at the last tick's resolution
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return Msg::Time(ts.tv_sec) * 1000 + Msg::Time(ts.tv_nsec) / 1000000;
+}
+
+void MsgQueueWrapper::MsgBlock::append(
+	boost::string_ref body,
+	SymbolTable::Id username,
+	Msg::Priority priority,
+	Msg::Seq seq,
+	Msg::Time time_ms)
+{
+	if (records.empty())
+	{
+		base_ms = time_ms;
+	}
+	last_ms = time_ms;
+
+	const uint16_t pos = static_cast<uint16_t>(records.size());
+	for (size_t p = size_t(Msg::Priority::Debug) + 1; p <= size_t(priority); ++p)
+	{
+		at_least[p].push_back(pos);
+	}
+
+	records.push_back(MsgRecord {
+		arena.append(body),
+		seq,
+		static_cast<uint32_t>(body.size()),
+		username,
+		priority,
+		static_cast<uint32_t>(time_ms - base_ms) });
+	body_bytes[size_t(priority)] += body.size();
+	by_user[username].push_back(pos);
+}
+
+void MsgQueueWrapper::Shard::append(
+	boost::string_ref body,
+	SymbolTable::Id username,
+	Msg::Priority priority,
+	Msg::Seq seq,
+	uint32_t now_secs,
+	Msg::Time time_ms)
+{
+	if (blocks.empty() || blocks.back()->closed || blocks.back()->records.size() == Cfg::msg_block_records ||
+		!blocks.back()->fits_time(time_ms))
+	{
+		blocks.push_back(std::make_shared<MsgBlock>());
+		blocks.back()->first_secs = now_secs;
+	}
+
+	MsgBlock & block = *blocks.back();
+	block.append(body, username, priority, seq, time_ms);
+	block.last_secs = now_secs;
+	++num_msgs;
+}
+
+void MsgQueueWrapper::Shard::evict_before(Msg::Seq seq)
+{
+	while (!blocks.empty() && blocks.front()->records.back().seq < seq)
+	{
+		num_msgs -= blocks.front()->records.size();
+		blocks.pop_front();
+	}
+}
+
+size_t MsgQueueWrapper::Snapshot::BlockRef::lower_bound(Msg::Seq seq, Msg::Priority priority_cap) const
+{
+	size_t lo = 0;
+	size_t hi = count(priority_cap);
+	while (lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+		if (get(priority_cap, mid).seq < seq)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+size_t MsgQueueWrapper::Snapshot::BlockRef::lower_bound_time(Msg::Time time_ms, Msg::Priority priority_cap) const
+{
+	size_t lo = 0;
+	size_t hi = count(priority_cap);
+	while (lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+		if (block->get_time_ms(get(priority_cap, mid)) < time_ms)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+bool MsgQueueWrapper::Snapshot::ShardView::seek(
+	Cursor & cursor,
+	Msg::Seq seq,
+	Msg::Time from_ms,
+	Msg::Priority priority_cap) const
+{
+	if (!seek_seq(cursor, seq, priority_cap))
+	{
+		return false;
+	}
+	if (from_ms == 0)
+	{
+		return true;
+	}
+
+	// Seqs and times both only grow along a shard: whichever comes later
+	Cursor by_time;
+	if (!seek_time(by_time, from_ms, priority_cap))
+	{
+		return false;
+	}
+	if (by_time.block > cursor.block || (by_time.block == cursor.block && by_time.pos > cursor.pos))
+	{
+		cursor = by_time;
+	}
+	return true;
+}
+
+bool MsgQueueWrapper::Snapshot::ShardView::seek_seq(Cursor & cursor, Msg::Seq seq, Msg::Priority priority_cap) const
+{
+	// Past every block whose last record is before seq
+	auto it = std::partition_point(blocks.begin(), blocks.end(),
+		[seq](const BlockRef & block)
+		{
+			return block.get(Msg::Priority::Debug, block.count(Msg::Priority::Debug) - 1).seq < seq;
+		});
+
+	for (cursor.block = size_t(it - blocks.begin()); cursor.block < blocks.size(); ++cursor.block)
+	{
+		const size_t pos = blocks[cursor.block].lower_bound(seq, priority_cap);
+		if (pos < blocks[cursor.block].count(priority_cap))
+		{
+			cursor.pos = pos;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool MsgQueueWrapper::Snapshot::ShardView::seek_time(Cursor & cursor, Msg::Time from_ms, Msg::Priority priority_cap) const
+{
+	// Past every block whose last record is older than from_ms
+	auto it = std::partition_point(blocks.begin(), blocks.end(),
+		[from_ms](const BlockRef & block) { return block.last_ms < from_ms; });
+
+	for (cursor.block = size_t(it - blocks.begin()); cursor.block < blocks.size(); ++cursor.block)
+	{
+		const size_t pos = blocks[cursor.block].lower_bound_time(from_ms, priority_cap);
+		if (pos < blocks[cursor.block].count(priority_cap))
+		{
+			cursor.pos = pos;
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t MsgQueueWrapper::Snapshot::ShardView::count(Msg::Seq from_seq, Msg::Seq end_seq) const
+{
+	size_t count = 0;
+	for (const BlockRef & block : blocks)
+	{
+		count += block.lower_bound(end_seq, Msg::Priority::Debug) - block.lower_bound(from_seq, Msg::Priority::Debug);
+	}
+	return count;
+}
+
+size_t MsgQueueWrapper::Snapshot::size() const
+{
+	// Segments sealed while the shards were being locked can reach past _end_seq
+	size_t total = 0;
+	for (const auto & segment : _segments)
+	{
+		total += segment->count_before(_end_seq);
+	}
+
+	const Msg::Seq shards_from = std::min(_sealed_end, _end_seq);
+	for (const ShardView & shard : _shards)
+	{
+		total += shard.count(shards_from, _end_seq);
+	}
+	return total;
+}
+
+bool MsgQueueWrapper::Snapshot::visit_sealed(
+	const std::function<bool(const MsgView &)> & func,
+	Msg::Priority priority_cap,
+	Msg::Seq from_seq,
+	Msg::Seq end_seq,
+	boost::string_ref username,
+	const TimeRange & range) const
+{
+	for (const auto & segment : _segments)
+	{
+		if (segment->get_first_seq() >= end_seq)
+		{
+			break;
+		}
+		if (segment->get_end_seq() > from_seq && segment->overlaps(range) &&
+			!segment->for_each(func, priority_cap, from_seq, end_seq, username, range))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+MsgQueueWrapper::Lock MsgQueueWrapper::push(
+	boost::string_ref body,
+	boost::string_ref username,
+	Msg::Priority priority)
+{
+	// The symbol table has its own lock, keep it out of the shard's, and
+	// so is the clock
+	SymbolTable::Id username_id;
+	if (!_symbols.intern(username, username_id))
+	{
+		return Lock();
+	}
+	const Msg::Time now_ms = read_clock();
+
+	Shard & shard = get_shard();
+	Lock lock = lock_for_write(shard);
+
+	// Taken under the shard lock, so every shard stays sorted by seq and
+	// time, and under the log's lock, so the log is sorted by seq too
+	const Msg::Time time_ms = shard.stamp(now_ms);
+	Msg::Seq seq;
+	if (_wal)
+	{
+		auto wal_lock = _wal->get_lock();
+		seq = _next_seq.fetch_add(1, std::memory_order_relaxed);
+		_wal->append(wal_lock, body, username, priority, seq, time_ms);
+	}
+	else
+	{
+		seq = _next_seq.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	shard.append(body, username_id, priority, seq, _now_secs.load(std::memory_order_relaxed), time_ms);
+	evict_sealed(shard);
+
+	return lock;
+}
+
+bool MsgQueueWrapper::push_batch(const std::vector<Msg> & msgs)
+{
+	return push_batch_impl(msgs);
+}
+
+bool MsgQueueWrapper::push_batch(const std::vector<MsgView> & msgs)
+{
+	return push_batch_impl(msgs);
+}
+
+template <typename MsgT>
+bool MsgQueueWrapper::push_batch_impl(const std::vector<MsgT> & msgs)
+{
+	// Usernames interned before a refused one stay interned, unused
+	std::vector<SymbolTable::Id> username_ids(msgs.size());
+	for (size_t i = 0; i < msgs.size(); ++i)
+	{
+		if (!_symbols.intern(msgs[i].get_username(), username_ids[i]))
+		{
+			return false;
+		}
+	}
+
+	// One clock read for the lot
+	const Msg::Time now_ms = read_clock();
+
+	Shard & shard = get_shard();
+	Lock lock = lock_for_write(shard);
+
+	const Msg::Time time_ms = shard.stamp(now_ms);
+	Msg::Seq seq;
+	if (_wal)
+	{
+		auto wal_lock = _wal->get_lock();
+		seq = _next_seq.fetch_add(msgs.size(), std::memory_order_relaxed);
+		for (size_t i = 0; i < msgs.size(); ++i)
+		{
+			_wal->append(wal_lock, msgs[i].get_msg(), msgs[i].get_username(), msgs[i].get_priority(), seq + i, time_ms);
+		}
+	}
+	else
+	{
+		seq = _next_seq.fetch_add(msgs.size(), std::memory_order_relaxed);
+	}
+
+	const uint32_t now_secs = _now_secs.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < msgs.size(); ++i)
+	{
+		shard.append(msgs[i].get_msg(), username_ids[i], msgs[i].get_priority(), seq++, now_secs, time_ms);
+	}
+	evict_sealed(shard);
+	return true;
+}
+
+void MsgQueueWrapper::set_ingest_ring(std::unique_ptr<IngestRing> ingest_ring)
+{
+	_ingest_ring = std::move(ingest_ring);
+}
+
+void MsgQueueWrapper::sync_ingest()
+{
+	if (_ingest_ring)
+	{
+		_ingest_ring->sync();
+	}
+}
+
+void MsgQueueWrapper::set_wal(std::unique_ptr<WriteAheadLog> wal)
+{
+	auto locks = get_all_locks();
+
+	if (wal)
+	{
+		Msg::Seq next_seq = _next_seq.load(std::memory_order_relaxed);
+		_next_seq.store(std::max(next_seq, wal->get_next_seq()), std::memory_order_relaxed);
+	}
+	_wal = std::move(wal);
+	if (_wal)
+	{
+		_wal->set_seal_hook([this](Msg::Seq sealed_end) { evict_idle_shards(sealed_end); });
+	}
+}
+
+MsgQueueWrapper::Snapshot MsgQueueWrapper::get_snapshot() const
+{
+	Snapshot snapshot;
+	snapshot._symbols = &_symbols;
+
+	// Every seq below this was handed out under its shard's lock, and
+	// appended before that lock was let go: taking the locks one by one
+	// afterwards is enough to see all of them.
+	snapshot._end_seq = _next_seq.load(std::memory_order_relaxed);
+
+	snapshot._shards.resize(_shards.size());
+	for (size_t i = 0; i < _shards.size(); ++i)
+	{
+		Lock lock(_shards[i].mutex);
+
+		auto & blocks = snapshot._shards[i].blocks;
+		blocks.reserve(_shards[i].blocks.size());
+		for (const auto & block : _shards[i].blocks)
+		{
+			blocks.push_back(Snapshot::BlockRef { block, {}, block->last_ms });
+			for (size_t p = 0; p < size_t(Msg::Priority::Max); ++p)
+			{
+				blocks.back().counts[p] = static_cast<uint32_t>(block->count(Msg::Priority(p)));
+			}
+		}
+	}
+
+	// Only now: blocks are evicted once the log has sealed them, so the
+	// segments must reach at least as far as whatever the shards dropped
+	if (_wal)
+	{
+		snapshot._segments = _wal->get_sealed_segments();
+		if (!snapshot._segments.empty())
+		{
+			snapshot._sealed_end = std::min(snapshot._segments.back()->get_end_seq(), snapshot._end_seq);
+		}
+	}
+
+	return snapshot;
+}
+
+MsgQueueWrapper::MatchSnapshot MsgQueueWrapper::get_user_snapshot(
+	boost::string_ref username,
+	Msg::Priority priority_cap) const
+{
+	MatchSnapshot user_snapshot;
+	user_snapshot._snapshot = get_snapshot();
+	user_snapshot._username = username.to_string();
+	user_snapshot._priority_cap = priority_cap;
+
+	// Never interned, so not in memory; the segments may still have some
+	SymbolTable::Id username_id;
+	if (!_symbols.find(username, username_id))
+	{
+		return user_snapshot;
+	}
+
+	const Snapshot & snapshot = user_snapshot._snapshot;
+	std::vector<MatchSnapshot::RecordRef> & records = user_snapshot._records;
+	for (size_t i = 0; i < snapshot._shards.size(); ++i)
+	{
+		const auto & blocks = snapshot._shards[i].blocks;
+		for (size_t b = 0; b < blocks.size(); ++b)
+		{
+			// The others were full, or closed, by the time of the snapshot
+			Lock lock;
+			if (b + 1 == blocks.size())
+			{
+				lock = Lock(_shards[i].mutex);
+			}
+
+			const MsgBlock & block = *blocks[b].block;
+			const auto it = block.by_user.find(username_id);
+			if (it == block.by_user.end())
+			{
+				continue;
+			}
+
+			const size_t count = blocks[b].count(Msg::Priority::Debug);
+			for (uint16_t pos : it->second)
+			{
+				if (pos >= count)
+				{
+					break;
+				}
+
+				// Those before _sealed_end are served from the segments
+				const MsgRecord & record = block.records[pos];
+				if (record.priority >= priority_cap && record.seq >= snapshot._sealed_end && record.seq < snapshot._end_seq)
+				{
+					records.push_back(MatchSnapshot::RecordRef { &record, block.base_ms });
+				}
+			}
+		}
+	}
+
+	user_snapshot.sort_records();
+
+	return user_snapshot;
+}
+
+MsgQueueWrapper::Lock MsgQueueWrapper::lock_for_write(Shard & shard)
+{
+	// Uncontended, which is the usual, costs no clock reads
+	Lock lock(shard.mutex, std::try_to_lock);
+	if (!lock.owns_lock())
+	{
+		const uint64_t start = Metrics::now_ns();
+		lock.lock();
+		Metrics::add(Metrics::Counter::ShardLockContended);
+		Metrics::record(Metrics::Histogram::ShardLockWaitNs, Metrics::now_ns() - start);
+	}
+	return lock;
+}
+
+void MsgQueueWrapper::evict_sealed(Shard & shard)
+{
+	if (_wal)
+	{
+		shard.evict_before(_wal->get_sealed_end());
+	}
+}
+
+void MsgQueueWrapper::evict_idle_shards(Msg::Seq sealed_end)
+{
+	// Only try: a locked shard is being pushed to, and evicts itself, or
+	// read, and the next seal gets it. Waiting could deadlock with a
+	// writer holding its shard while it waits on the log.
+	for (Shard & shard : _shards)
+	{
+		Lock lock(shard.mutex, std::try_to_lock);
+		if (lock.owns_lock())
+		{
+			shard.evict_before(sealed_end);
+		}
+	}
+}
+
+MsgQueueWrapper::Locks MsgQueueWrapper::get_all_locks() const
+{
+	Locks locks;
+	locks.reserve(_shards.size());
+	for (const Shard & shard : _shards)
+	{
+		locks.emplace_back(shard.mutex);
+	}
+	return locks;
+}
+
+void MsgQueueWrapper::clear()
+{
+	auto locks = get_all_locks();
+	for (Shard & shard : _shards)
+	{
+		shard.blocks.clear();
+		shard.num_msgs = 0;
+	}
+
+	if (_wal)
+	{
+		_wal->reset();
+	}
+}
+
+size_t MsgQueueWrapper::size() const
+{
+	return get_snapshot().size();
+}
+
+MsgQueueWrapper::MemStats MsgQueueWrapper::get_mem_stats() const
+{
+	auto locks = get_all_locks();
+
+	MemStats stats {};
+	for (const Shard & shard : _shards)
+	{
+		stats.num_msgs += shard.num_msgs;
+		stats.record_bytes += shard.blocks.size() * sizeof(shard.blocks[0]);
+		for (const auto & block : shard.blocks)
+		{
+			stats.record_bytes += sizeof(MsgBlock) + block->records.capacity() * sizeof(MsgRecord);
+			stats.body_bytes += block->arena.get_bytes_reserved();
+			for (const auto & positions : block->at_least)
+			{
+				stats.index_bytes += positions.capacity() * sizeof(positions[0]);
+			}
+			stats.index_bytes += block->by_user.bucket_count() * sizeof(void *);
+			if (const auto token_index = std::atomic_load(&block->token_index))
+			{
+				stats.search_bytes += token_index->get_bytes();
+			}
+			for (const auto & user : block->by_user)
+			{
+				stats.index_bytes += sizeof(user) + 2 * sizeof(void *) + user.second.capacity() * sizeof(user.second[0]);
+			}
+		}
+	}
+	stats.symbol_bytes = _symbols.get_bytes_used();
+
+	if (_wal)
+	{
+		for (const auto & segment : _wal->get_sealed_segments())
+		{
+			stats.mapped_bytes += segment->get_size_bytes();
+			stats.index_bytes += segment->get_index_bytes();
+		}
+	}
+
+	return stats;
+}
+
 // Global msg queue.
 std::unique_ptr<MsgQueueWrapper> GlobalMsgQueue::_inst;
 
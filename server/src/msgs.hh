@@ -3,15 +3,34 @@
 
 #include <vector>
 #include <deque>
+#include <unordered_map>
 #include <string>
 #include <memory>
 #include <exception>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <functional>
+#include <limits>
+#include <algorithm>
 #include <iostream>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "arena.hh"
+#include "diag.hh"
+#include "search.hh"
 
 namespace Cfg
 {
-	static const bool msg_q_debug = true;
+	static const size_t msg_q_num_shards = 16;
+	static const size_t msg_block_records = 4096;
+	static const size_t dump_buf_bytes = 64 * 1024; // Formatted lines gathered before an ostream write
+	static const unsigned retention_interval_ms = 100;
 };
 
 class Msg
@@ -20,18 +39,27 @@ class Msg
 public:
 	typedef std::string MsgBody;
 	typedef std::string Username;
+	typedef uint64_t Seq;
+	typedef uint64_t Time; // Milliseconds since the Unix epoch
+
+	// The one place priorities are defined. Enumerators, their names and
+	// the name lookup table are all generated from this list, which runs
+	// from least to most severe.
+	#define LOGGER_MSG_PRIORITIES(X) \
+		X(Debug, "debug") \
+		X(Info, "info") \
+		X(Warning, "warning") \
+		X(Critical, "critical") \
+		X(Error, "error")
 
 	enum class Priority : unsigned
 	{
-		Min = 0,
-		Debug = Min,
-		Info,
-		Warning,
-		Critical,
-		Error,
+		#define LOGGER_MSG_PRIORITY_ENUM(name, str) name,
+		LOGGER_MSG_PRIORITIES(LOGGER_MSG_PRIORITY_ENUM)
+		#undef LOGGER_MSG_PRIORITY_ENUM
 		Illegal,
+		Min = 0,
 		Max = Illegal
-		// If you update this, don't forget to update the corresponding strings in msgs.cc
 	};
 
 	class InvalidPriorityException : public std::exception
@@ -42,28 +70,20 @@ public:
 		}
 	};
 
-	static Priority get_priority_from_str(const std::string & priority_str)
-	{
-		Priority pri = Priority::Illegal;
-
-		for (unsigned i = 0; i < _priority_strings.size(); ++i)
-		{
-			if (priority_str == _priority_strings[i])
-			{
-				pri = static_cast<Priority> (i);
-				break;
-			}
-		}
-
-		return pri;
-
-	}
+	// Compile time perfect hash, see msgs.cc. Illegal if unknown.
+	static Priority get_priority_from_str(boost::string_ref priority_str);
 
 	static const char * get_priority_str(Priority pri)
 	{
 		return _priority_strings[static_cast<size_t>(pri)];
 	};
 
+	// strlen(get_priority_str(pri)), without the scan
+	static size_t get_priority_str_len(Priority pri)
+	{
+		return _priority_str_lens[static_cast<size_t>(pri)];
+	}
+
 	Priority get_priority() const
 	{
 		return _priority;
@@ -77,9 +97,7 @@ public:
 			(this->_body == b._body);
 	}
 
-	// Returning by value for thread safety for now.
-	// TODO: add ref version when needed.
-	Username get_username() const
+	const Username & get_username() const
 	{
 		return _username;
 	}
@@ -89,15 +107,40 @@ public:
 		return _priority;
 	}
 
-	MsgBody get_msg() const
+	const MsgBody & get_msg() const
 	{
 		return _body;
 	}
 
+	// Arrival order, stamped by the queue. Not part of the message value,
+	// so it doesn't take part in comparisons.
+	Seq get_seq() const
+	{
+		return _seq;
+	}
+
+	void set_seq(Seq seq)
+	{
+		_seq = seq;
+	}
+
+	// When the queue took it in, stamped along with the seq
+	Time get_time_ms() const
+	{
+		return _time_ms;
+	}
+
+	void set_time_ms(Time time_ms)
+	{
+		_time_ms = time_ms;
+	}
+
 	Msg(MsgBody body, Username username, Priority priority)
-	:	_body(body),
-		_username(username),
-		_priority(priority)
+	:	_body(std::move(body)),
+		_username(std::move(username)),
+		_priority(priority),
+		_seq(0),
+		_time_ms(0)
 	{
 		if (_priority == Priority::Illegal)
 		{
@@ -118,45 +161,897 @@ private:
 	MsgBody _body;
 	Username _username;
 	Priority _priority;
+	Seq _seq;
+	Time _time_ms;
+
+	static const char * const _priority_strings[];
+	static const uint8_t _priority_str_lens[];
+};
+
+
+struct TimeRange
+// Ingest times from_ms <= time < to_ms
+{
+	Msg::Time from_ms = 0;
+	Msg::Time to_ms = std::numeric_limits<Msg::Time>::max();
+
+	bool contains(Msg::Time time_ms) const
+	{
+		return from_ms <= time_ms && time_ms < to_ms;
+	}
+
+	// Whether any time from min_ms to max_ms, both included, is in it
+	bool overlaps(Msg::Time min_ms, Msg::Time max_ms) const
+	{
+		return min_ms < to_ms && max_ms >= from_ms;
+	}
+};
 
-	static const std::vector<const char *> _priority_strings;
+
+struct MsgRecord
+// How the store keeps a message. The body lives in its block's arena and
+// the username is an id in the store's symbol table, so a record is a
+// fixed 32 bytes however long the strings are. Its time is an offset from
+// its block's, which fills what would otherwise be padding.
+{
+	const char * body;
+	Msg::Seq seq;
+	uint32_t body_len;
+	SymbolTable::Id username;
+	Msg::Priority priority;
+	uint32_t time_offset; // Milliseconds after its block's base_ms
 };
 
 
+class MsgView
+// A stored message as read back from the store, in memory or in a mapped
+// segment. Cheap to copy, but it points into the store, so it's only
+// good while the shards are locked.
+{
+public:
+
+	MsgView(boost::string_ref body, boost::string_ref username, Msg::Priority priority, Msg::Seq seq, Msg::Time time_ms = 0)
+	:	_body(body),
+		_username(username),
+		_priority(priority),
+		_seq(seq),
+		_time_ms(time_ms)
+	{
+
+	}
+
+	// base_ms: that of the record's block
+	MsgView(const MsgRecord & record, Msg::Time base_ms, const SymbolTable & symbols)
+	:	MsgView(
+			boost::string_ref(record.body, record.body_len),
+			symbols.get_str(record.username),
+			record.priority,
+			record.seq,
+			base_ms + record.time_offset)
+	{
+
+	}
+
+	boost::string_ref get_username() const
+	{
+		return _username;
+	}
+
+	boost::string_ref get_msg() const
+	{
+		return _body;
+	}
+
+	Msg::Priority get_priority() const
+	{
+		return _priority;
+	}
+
+	Msg::Priority get_pri() const
+	{
+		return _priority;
+	}
+
+	Msg::Seq get_seq() const
+	{
+		return _seq;
+	}
+
+	Msg::Time get_time_ms() const
+	{
+		return _time_ms;
+	}
+
+	// An owning copy
+	Msg to_msg() const
+	{
+		Msg msg(_body.to_string(), _username.to_string(), _priority);
+		msg.set_seq(_seq);
+		msg.set_time_ms(_time_ms);
+		return msg;
+	}
+
+	bool operator==(const Msg & b) const
+	{
+		return
+			(_priority == b.get_priority()) &&
+			(_username == b.get_username()) &&
+			(_body == b.get_msg());
+	}
+
+	friend std::ostream & operator<<(std::ostream & os, const MsgView & msg)
+	{
+		os << "u[" << msg._username << "] p[" << Msg::get_priority_str(msg._priority) <<
+			"] m[" << msg._body << "]";
+		return os;
+	}
+
+private:
+	boost::string_ref _body;
+	boost::string_ref _username;
+	Msg::Priority _priority;
+	Msg::Seq _seq;
+	Msg::Time _time_ms;
+};
+
+
+namespace MsgFormat
+// Dump lines: "u[<username>] p[<priority>] m[<body>]" and a '\n', byte for
+// byte what operator<< and a newline write. A line's size is known before
+// any of it is, so it's appended with one size check and a memcpy per
+// field, rather than an ostream insertion per piece.
+{
+	inline size_t get_line_size(const MsgView & msg)
+	{
+		// "u[", "] p[", "] m[" and "]\n"
+		return 12 + msg.get_username().size() + Msg::get_priority_str_len(msg.get_priority()) + msg.get_msg().size();
+	}
+
+	inline char * put(char * out, const char * data, size_t size)
+	{
+		std::memcpy(out, data, size);
+		return out + size;
+	}
+
+	inline void append_line(std::string & out, const MsgView & msg)
+	{
+		const size_t old_size = out.size();
+		out.resize(old_size + get_line_size(msg));
+
+		char * pos = &out[old_size];
+		pos = put(pos, "u[", 2);
+		pos = put(pos, msg.get_username().data(), msg.get_username().size());
+		pos = put(pos, "] p[", 4);
+		pos = put(pos, Msg::get_priority_str(msg.get_priority()), Msg::get_priority_str_len(msg.get_priority()));
+		pos = put(pos, "] m[", 4);
+		pos = put(pos, msg.get_msg().data(), msg.get_msg().size());
+		put(pos, "]\n", 2);
+	}
+
+
+	class StreamWriter
+	// Lines for an ostream, gathered in a buffer and written out in big
+	// pieces: no flush per line, as std::endl did
+	{
+	public:
+
+		explicit StreamWriter(std::ostream & os)
+		:	_os(os)
+		{
+			_buf.reserve(Cfg::dump_buf_bytes);
+		}
+
+		~StreamWriter()
+		{
+			flush();
+		}
+
+		void add(const MsgView & msg)
+		{
+			append_line(_buf, msg);
+			if (_buf.size() >= Cfg::dump_buf_bytes)
+			{
+				flush();
+			}
+		}
+
+		void flush()
+		{
+			_os.write(_buf.data(), std::streamsize(_buf.size()));
+			_buf.clear();
+		}
+
+	private:
+
+		std::ostream & _os;
+		std::string _buf;
+	};
+};
+
+
+class IngestRing;
+class WriteAheadLog;
+class Segment;
+
+
 class MsgQueueWrapper
+// Messages are spread over independently locked shards, keyed by the
+// ingesting thread, so writers on different threads don't contend.
+// A global sequence number stamped on every message restores arrival
+// order when the shards are read back together. So does a time, off a
+// coarse clock read once per push or batch, that never goes back within
+// a shard: a shard's blocks are in time order too, and a time range is
+// found by binary search.
+//
+// A shard is a list of fixed size blocks of MsgRecords, each block with
+// its own arena for the bodies. Usernames are interned once for the
+// whole store, since the same few of them come up over and over.
+//
+// With a write-ahead log, history lives in its sealed segments. A block
+// is dropped once the segments cover it, and reads serve those messages
+// from the mapped segments instead, so memory only holds the hot tail:
+// what's been written since the last segment was sealed.
 {
 public:
 
-	typedef std::deque<Msg> Queue;
 	typedef std::mutex Mutex;
 	typedef std::unique_lock<Mutex> Lock;
+	typedef std::vector<Lock> Locks;
 
-	Queue & get_queue()
+	struct RetentionPolicy
+	// How much the store keeps. limits[p] applies to the messages of
+	// priority p and below: the Error one covers every message, and a
+	// tighter one further down lets the less severe ones go sooner.
 	{
-		return _queue;
-	}
+		struct Limits
+		{
+			// 0 for no limit
+			size_t max_msgs = 0;
+			size_t max_bytes = 0; // Bodies plus a MsgRecord each
+			unsigned max_age_secs = 0;
 
+			bool any() const
+			{
+				return max_msgs != 0 || max_bytes != 0 || max_age_secs != 0;
+			}
+		};
+
+		Limits limits[size_t(Msg::Priority::Max)];
+
+		bool any() const;
+
+		// Comma separated [<priority>:]<limit>=<value>, e.g.
+		// "msgs=1000000,bytes=512m,debug:age=10m". The limits are msgs,
+		// bytes (k, m or g suffix) and age (s, m, h or d suffix, seconds
+		// without). No priority means error, i.e. every message.
+		static bool from_str(const std::string & str, RetentionPolicy & policy);
+
+		std::string to_str() const;
+	};
+
+	struct MemStats
+	{
+		size_t num_msgs; // Held in memory
+		size_t record_bytes; // MsgRecords and block bookkeeping
+		size_t body_bytes; // Arena chunks holding the bodies
+		size_t symbol_bytes; // Interned usernames
+		size_t index_bytes; // Priority indexes of the blocks and segments
+		size_t search_bytes; // Token indexes of the blocks
+		size_t mapped_bytes; // Sealed segments, in page cache rather than the heap
+
+		// Heap bytes
+		size_t get_total_bytes() const
+		{
+			return record_bytes + body_bytes + symbol_bytes + index_bytes + search_bytes;
+		}
+	};
+
+	explicit MsgQueueWrapper(size_t num_shards = Cfg::msg_q_num_shards);
+
+	~MsgQueueWrapper();
+
+	// Lock of the calling thread's shard
 	Lock get_lock()
 	{
-		return Lock(_mutex);
+		return Lock(get_shard().mutex);
+	}
+
+	// Newest message of the calling thread's shard. Hold that shard's
+	// lock, e.g. the one push() returned, and make sure it's not empty.
+	MsgView back()
+	{
+		const Shard & shard = get_shard();
+		return MsgView(shard.back(), shard.blocks.back()->base_ms, _symbols);
+	}
+
+	// Stamps the message with the next sequence number and the time and
+	// copies it into the calling thread's shard. The returned lock guards
+	// that shard. It owns nothing if the message was refused: its username
+	// is new and there's no room left for usernames, see get_max_usernames().
+	Lock push(boost::string_ref body, boost::string_ref username, Msg::Priority priority);
+
+	Lock push(Msg && msg)
+	{
+		return push(msg.get_msg(), msg.get_username(), msg.get_priority());
+	}
+
+	// Same as push() for every element, under a single lock acquisition.
+	// All or nothing: false, and nothing taken, if any one is refused.
+	bool push_batch(const std::vector<Msg> & msgs);
+
+	// Same, straight from views, e.g. into a network buffer; their seqs and times are ignored
+	bool push_batch(const std::vector<MsgView> & msgs);
+
+	// Usernames are interned for good, retention or not, and there's
+	// room for this many
+	size_t get_max_usernames() const
+	{
+		return _symbols.get_max_size();
+	}
+
+	// For tests
+	void set_max_usernames(size_t max_usernames)
+	{
+		_symbols.set_max_size(max_usernames);
+	}
+
+	// Puts a lock-free ingest ring in front of the queue. Once set,
+	// new_log requests go through the ring and its drain thread.
+	void set_ingest_ring(std::unique_ptr<IngestRing> ingest_ring);
+
+	IngestRing * get_ingest_ring()
+	{
+		return _ingest_ring.get();
+	}
+
+	const IngestRing * get_ingest_ring() const
+	{
+		return _ingest_ring.get();
 	}
 
-	void dump_to_stream(std::ostream & os, Msg::Priority priority_cap = Msg::Priority::Debug) const
-	// Thread unsafe! Caller's responsibility ;)
+	// Waits until everything handed to the ingest ring so far is visible
+	// in the queue. No-op without a ring.
+	void sync_ingest();
+
+	// From now on every message is appended to wal, in seq order, and
+	// clear() wipes it too. The messages already in its segments become
+	// part of the store; seqs carry on after them.
+	void set_wal(std::unique_ptr<WriteAheadLog> wal);
+
+	WriteAheadLog * get_wal()
+	{
+		return _wal.get();
+	}
+
+	// Enforces policy from now on, on a thread of its own that wakes up
+	// every Cfg::retention_interval_ms: writers never wait for it. Ages
+	// count from this call. With run_thread false only enforce_retention()
+	// does. Ignored with a write-ahead log: it already bounds memory by
+	// sealing segments, and what's on disk is its own business.
+	void set_retention(const RetentionPolicy & policy, bool run_thread = true);
+
+	// One pass of the retention policy, as of now_secs since
+	// set_retention(). Messages go a block at a time, oldest first, either
+	// whole blocks or, for a limit below Error, the block's messages at or
+	// below that priority; so a count or byte limit may keep up to a block
+	// less than it allows. Returns the number of messages dropped.
+	size_t enforce_retention(uint32_t now_secs);
+
+	// Builds the blocks' token indexes from now on, on a thread of its own
+	// that wakes up every Cfg::search_index_interval_ms, once a block is
+	// done with: writers never do it nor wait for it. Searches scan the
+	// blocks it hasn't got to yet.
+	void start_indexer();
+
+	// One pass of it. Returns the number of blocks indexed.
+	size_t index_blocks();
+
+	// Lock every shard, always in the same order
+	Locks get_all_locks() const;
+
+	// Drops every message, from the write-ahead log too. Interned
+	// usernames are kept.
+	void clear();
+
+	size_t size() const;
+
+	size_t get_num_shards() const
+	{
+		return _shards.size();
+	}
+
+	MemStats get_mem_stats() const;
+
+	// One past the last seq handed out so far
+	Msg::Seq get_next_seq() const
 	{
-		for (const auto & msg : _queue)
+		return _next_seq.load(std::memory_order_relaxed);
+	}
+
+	class Snapshot;
+	class MatchSnapshot;
+
+	// Cheap: a few pointers per block, taken one shard lock at a time
+	Snapshot get_snapshot() const;
+
+	// A snapshot of username's messages that pass priority_cap, looked up
+	// in the blocks' username indexes: it costs a hash lookup per block
+	// plus that user's messages, however many others there are
+	MatchSnapshot get_user_snapshot(boost::string_ref username, Msg::Priority priority_cap = Msg::Priority::Debug) const;
+
+	// A snapshot of the messages holding term that pass priority_cap,
+	// looked up in the blocks' token indexes. The sealed segments have
+	// none and are read through.
+	MatchSnapshot get_search_snapshot(const Search::Term & term, Msg::Priority priority_cap = Msg::Priority::Debug) const;
+
+	template <typename Func>
+	void for_each(
+		Func && func,
+		Msg::Priority priority_cap = Msg::Priority::Debug,
+		const TimeRange & range = TimeRange()) const
+	// Visits every message in arrival order, as MsgViews, off a snapshot:
+	// no lock is held while visiting.
+	{
+		get_snapshot().visit(
+			[&func](const MsgView & msg)
+			{
+				func(msg);
+				return true;
+			},
+			priority_cap, 0, std::numeric_limits<Msg::Seq>::max(), range);
+	}
+
+	void dump_to_stream(
+		std::ostream & os,
+		Msg::Priority priority_cap = Msg::Priority::Debug,
+		const TimeRange & range = TimeRange()) const
+	// Writers carry on while it formats
+	{
+		MsgFormat::StreamWriter writer(os);
+		for_each(
+			[&writer](const MsgView & msg)
+			{
+				writer.add(msg);
+			},
+			priority_cap, range);
+	}
+
+private:
+
+	struct MsgBlock
+	{
+		explicit MsgBlock(size_t capacity = Cfg::msg_block_records)
 		{
-			if (static_cast<unsigned>(msg.get_priority()) >= static_cast<unsigned>(priority_cap))
+			// Reserved in full, so appending never moves what a snapshot
+			// may be reading
+			records.reserve(capacity);
+			for (size_t p = size_t(Msg::Priority::Debug) + 1; p < size_t(Msg::Priority::Max); ++p)
 			{
-				os << msg << std::endl;
+				at_least[p].reserve(capacity);
 			}
 		}
-	}
+
+		// Mind the capacity, and fits_time()
+		void append(boost::string_ref body, SymbolTable::Id username, Msg::Priority priority, Msg::Seq seq, Msg::Time time_ms);
+
+		// Whether a record of that time can go in, as an offset from base_ms
+		bool fits_time(Msg::Time time_ms) const
+		{
+			return records.empty() || time_ms - base_ms <= std::numeric_limits<uint32_t>::max();
+		}
+
+		Msg::Time get_time_ms(const MsgRecord & record) const
+		{
+			return base_ms + record.time_offset;
+		}
+
+		std::vector<MsgRecord> records;
+		Arena arena;
+
+		// Times of the first and the last record. Those in between don't
+		// go back, so these are the block's bounds.
+		Msg::Time base_ms = 0;
+		Msg::Time last_ms = 0;
+
+		// For the retention policy: body bytes by priority, and when the
+		// first and last records came in, in its coarse seconds
+		size_t body_bytes[size_t(Msg::Priority::Max)] = {};
+		uint32_t first_secs = 0;
+		uint32_t last_secs = 0;
+
+		// Set by the retention policy: writers start a new block instead
+		bool closed = false;
+
+		// Priority index: at_least[p] lists, in order, the positions of the
+		// records of priority p or above. Every record qualifies for Debug,
+		// so that one stays empty and records stands in for it.
+		std::vector<uint16_t> at_least[size_t(Msg::Priority::Max)];
+
+		// Username index: the positions of each user's records, in order.
+		// Unlike the rest it may change while a snapshot holds the block,
+		// as long as it's the shard's back block: read that one locked.
+		std::unordered_map<SymbolTable::Id, std::vector<uint16_t>> by_user;
+
+		// Set once by the indexer, when writers are done with the block:
+		// read it with std::atomic_load(). Null until then.
+		std::shared_ptr<const Search::TokenIndex> token_index;
+
+		// Records that pass priority_cap
+		size_t count(Msg::Priority priority_cap) const
+		{
+			return (priority_cap == Msg::Priority::Debug) ?
+				records.size() :
+				at_least[size_t(priority_cap)].size();
+		}
+
+		// The pos-th of them
+		const MsgRecord & get(Msg::Priority priority_cap, size_t pos) const
+		{
+			return records[(priority_cap == Msg::Priority::Debug) ? pos : at_least[size_t(priority_cap)][pos]];
+		}
+	};
+
+public:
+
+	class Snapshot
+	// The store as it was when get_snapshot() returned: every message with
+	// a seq below get_end_seq(), and none after. Blocks are shared with the
+	// store and only ever appended to, so a snapshot just remembers how far
+	// each one was filled. Reading it takes no lock; writers, delete_all
+	// and the log sealing segments carry on meanwhile. Must not outlive the
+	// store it was taken from.
+	{
+	public:
+
+		Msg::Seq get_end_seq() const
+		{
+			return _end_seq;
+		}
+
+		size_t size() const;
+
+		template <typename Func>
+		Msg::Seq visit(
+			Func && func,
+			Msg::Priority priority_cap = Msg::Priority::Debug,
+			Msg::Seq from_seq = 0,
+			Msg::Seq end_seq = std::numeric_limits<Msg::Seq>::max(),
+			const TimeRange & range = TimeRange()) const
+		// Visits the messages with from_seq <= seq < end_seq that pass
+		// priority_cap and were taken in within range, in arrival order,
+		// for as long as func returns true: first what's in the sealed
+		// segments, then the shards merged back together. Returns the seq
+		// to carry on from, which is end_seq (or get_end_seq() if lower)
+		// once everything was visited.
+		{
+			end_seq = std::min(end_seq, _end_seq);
+
+			Msg::Seq resume_seq = end_seq;
+			auto visit_one = [&func, &resume_seq](const MsgView & msg)
+			{
+				if (func(msg))
+				{
+					return true;
+				}
+				resume_seq = msg.get_seq() + 1;
+				return false;
+			};
+
+			if (!visit_sealed(visit_one, priority_cap, from_seq, end_seq, boost::string_ref(), range))
+			{
+				return resume_seq;
+			}
+
+			typedef std::pair<Msg::Seq, size_t> Head; // (seq, shard index)
+			std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+			std::vector<ShardView::Cursor> cursors(_shards.size());
+
+			// A shard's times only grow, so past range.to_ms it's done
+			for (size_t i = 0; i < _shards.size(); ++i)
+			{
+				if (_shards[i].seek(cursors[i], std::max(from_seq, _sealed_end), range.from_ms, priority_cap) &&
+					_shards[i].get_time_ms(cursors[i], priority_cap) < range.to_ms)
+				{
+					heads.emplace(_shards[i].at(cursors[i], priority_cap).seq, i);
+				}
+			}
+
+			// Thanks to the priority index, only matching records are visited
+			while (!heads.empty() && heads.top().first < end_seq)
+			{
+				const size_t i = heads.top().second;
+				heads.pop();
+
+				const ShardView & shard = _shards[i];
+				if (!visit_one(shard.get_view(cursors[i], priority_cap, *_symbols)))
+				{
+					return resume_seq;
+				}
+
+				if (shard.advance(cursors[i], priority_cap) && shard.get_time_ms(cursors[i], priority_cap) < range.to_ms)
+				{
+					heads.emplace(shard.at(cursors[i], priority_cap).seq, i);
+				}
+			}
+
+			return end_seq;
+		}
+
+	private:
+
+		friend class MsgQueueWrapper;
+		friend class MatchSnapshot;
+
+		// A block as far as it was filled when the snapshot was taken
+		struct BlockRef
+		{
+			std::shared_ptr<const MsgBlock> block;
+			uint32_t counts[size_t(Msg::Priority::Max)];
+			Msg::Time last_ms;
+
+			size_t count(Msg::Priority priority_cap) const
+			{
+				return counts[size_t(priority_cap)];
+			}
+
+			const MsgRecord & get(Msg::Priority priority_cap, size_t pos) const
+			{
+				return block->get(priority_cap, pos);
+			}
+
+			// Position of the first record at or after seq that passes priority_cap
+			size_t lower_bound(Msg::Seq seq, Msg::Priority priority_cap) const;
+
+			// Same, for the first one taken in at or after time_ms
+			size_t lower_bound_time(Msg::Time time_ms, Msg::Priority priority_cap) const;
+		};
+
+		struct ShardView
+		{
+			// Walks the records of one priority cap. Blocks are never empty,
+			// but they may have nothing that passes the cap, which advance()
+			// steps over.
+			struct Cursor
+			{
+				size_t block = 0;
+				size_t pos = 0;
+			};
+
+			const MsgRecord & at(const Cursor & cursor, Msg::Priority priority_cap) const
+			{
+				return blocks[cursor.block].get(priority_cap, cursor.pos);
+			}
+
+			Msg::Time get_time_ms(const Cursor & cursor, Msg::Priority priority_cap) const
+			{
+				return blocks[cursor.block].block->get_time_ms(at(cursor, priority_cap));
+			}
+
+			MsgView get_view(const Cursor & cursor, Msg::Priority priority_cap, const SymbolTable & symbols) const
+			{
+				return MsgView(at(cursor, priority_cap), blocks[cursor.block].block->base_ms, symbols);
+			}
+
+			// False once past the end
+			bool advance(Cursor & cursor, Msg::Priority priority_cap) const
+			{
+				++cursor.pos;
+				while (cursor.pos == blocks[cursor.block].count(priority_cap))
+				{
+					cursor.pos = 0;
+					if (++cursor.block == blocks.size())
+					{
+						return false;
+					}
+				}
+				return true;
+			}
+
+			// Points cursor at the first record at or after seq, and taken
+			// in at or after from_ms, that passes priority_cap. False if none.
+			bool seek(Cursor & cursor, Msg::Seq seq, Msg::Time from_ms, Msg::Priority priority_cap) const;
+
+			// Each half of seek(): by seq, and by a binary search of the
+			// blocks' time bounds, then of the block's records
+			bool seek_seq(Cursor & cursor, Msg::Seq seq, Msg::Priority priority_cap) const;
+			bool seek_time(Cursor & cursor, Msg::Time from_ms, Msg::Priority priority_cap) const;
+
+			// Number of records with from_seq <= seq < end_seq
+			size_t count(Msg::Seq from_seq, Msg::Seq end_seq) const;
+
+			std::vector<BlockRef> blocks;
+		};
+
+		// visit() over the sealed segments, of username's messages only
+		// unless it's empty. False if func stopped.
+		bool visit_sealed(
+			const std::function<bool(const MsgView &)> & func,
+			Msg::Priority priority_cap,
+			Msg::Seq from_seq,
+			Msg::Seq end_seq,
+			boost::string_ref username = boost::string_ref(),
+			const TimeRange & range = TimeRange()) const;
+
+		const SymbolTable * _symbols = nullptr;
+		Msg::Seq _end_seq = 0;
+
+		// The shards serve everything from _sealed_end on, the segments
+		// everything before
+		std::vector<std::shared_ptr<const Segment>> _segments;
+		Msg::Seq _sealed_end = 0;
+
+		std::vector<ShardView> _shards;
+	};
+
+	class MatchSnapshot
+	// One user's messages, or those holding a search term, out of a
+	// Snapshot. Those in memory were picked out of the username or token
+	// indexes when it was taken; those in sealed segments are read back,
+	// from the strides that may hold any.
+	{
+	public:
+
+		Msg::Seq get_end_seq() const
+		{
+			return _snapshot.get_end_seq();
+		}
+
+		template <typename Func>
+		Msg::Seq visit(Func && func, Msg::Seq from_seq = 0) const
+		// Same as Snapshot::visit(), with the priority cap it was taken with
+		{
+			const Msg::Seq end_seq = _snapshot.get_end_seq();
+
+			Msg::Seq resume_seq = end_seq;
+			auto visit_one = [&func, &resume_seq](const MsgView & msg)
+			{
+				if (func(msg))
+				{
+					return true;
+				}
+				resume_seq = msg.get_seq() + 1;
+				return false;
+			};
+
+			const Search::Term & term = _term;
+			const bool sealed_done = term.empty() ?
+				_snapshot.visit_sealed(visit_one, _priority_cap, from_seq, end_seq, _username) :
+				_snapshot.visit_sealed(
+					[&term, &visit_one](const MsgView & msg) { return !term.matches(msg.get_msg()) || visit_one(msg); },
+					_priority_cap, from_seq, end_seq, _username);
+			if (!sealed_done)
+			{
+				return resume_seq;
+			}
+
+			auto it = std::lower_bound(_records.begin(), _records.end(), from_seq,
+				[](const RecordRef & ref, Msg::Seq seq) { return ref.record->seq < seq; });
+			for (; it != _records.end(); ++it)
+			{
+				if (!visit_one(MsgView(*it->record, it->base_ms, *_snapshot._symbols)))
+				{
+					return resume_seq;
+				}
+			}
+
+			return end_seq;
+		}
+
+	private:
+
+		friend class MsgQueueWrapper;
+
+		Snapshot _snapshot;
+		std::string _username; // Empty for anyone's
+		Search::Term _term; // Empty for any body
+		Msg::Priority _priority_cap = Msg::Priority::Debug;
+
+		struct RecordRef
+		{
+			const MsgRecord * record;
+			Msg::Time base_ms; // Its block's
+		};
+
+		// The matching records in the snapshot's blocks, by seq. The
+		// snapshot keeps them alive, and blocks never move their records.
+		std::vector<RecordRef> _records;
+
+		// Once gathered shard by shard: each shard's are in order already,
+		// only the shards need merging
+		void sort_records()
+		{
+			std::sort(_records.begin(), _records.end(),
+				[](const RecordRef & a, const RecordRef & b) { return a.record->seq < b.record->seq; });
+		}
+	};
 
 private:
 
-	Queue _queue;
-	Mutex _mutex;
+	struct Shard
+	{
+		const MsgRecord & back() const
+		{
+			return blocks.back()->records.back();
+		}
+
+		// time_ms from stamp()
+		void append(
+			boost::string_ref body,
+			SymbolTable::Id username,
+			Msg::Priority priority,
+			Msg::Seq seq,
+			uint32_t now_secs,
+			Msg::Time time_ms);
+
+		// The time to stamp on the next message: now_ms, unless the clock
+		// went back since the last one
+		Msg::Time stamp(Msg::Time now_ms)
+		{
+			last_ms = std::max(last_ms, now_ms);
+			return last_ms;
+		}
+
+		// Drops the blocks that hold nothing at or after seq
+		void evict_before(Msg::Seq seq);
+
+		// Shared with the snapshots still reading them
+		std::deque<std::shared_ptr<MsgBlock>> blocks;
+		size_t num_msgs = 0;
+		Msg::Time last_ms = 0;
+		mutable Mutex mutex;
+		char pad[64]; // Keep neighbouring shards' locks off the same cache line
+	};
+
+	Shard & get_shard();
+
+	// Wall clock, coarse: a few ms of resolution for next to nothing
+	static Msg::Time read_clock();
+
+	// Locks the shard to write to it, timing the wait if it's contended
+	static Lock lock_for_write(Shard & shard);
+
+	// Both push_batch()es, defined next to them
+	template <typename MsgT>
+	bool push_batch_impl(const std::vector<MsgT> & msgs);
+
+	// Called with shard locked, after appending to it
+	void evict_sealed(Shard & shard);
+
+	// The log's seal hook, so that shards no one pushes to let go too
+	void evict_idle_shards(Msg::Seq sealed_end);
+
+	// See retention.cc
+	void retention_loop();
+	void stop_retention();
+	size_t enforce_limits(Msg::Priority priority, const RetentionPolicy::Limits & limits, uint32_t now_secs);
+
+	// See search.cc
+	void indexer_loop();
+	void stop_indexer();
+
+	std::vector<Shard> _shards;
+	std::atomic<Msg::Seq> _next_seq;
+	SymbolTable _symbols;
+	std::unique_ptr<WriteAheadLog> _wal;
+
+	// The retention policy's clock, stamped on blocks as they fill
+	std::atomic<uint32_t> _now_secs;
+	RetentionPolicy _retention;
+	std::mutex _retention_mutex; // One pass at a time
+	std::thread _retention_thread;
+	std::mutex _retention_stop_mutex;
+	std::condition_variable _retention_stop_cv;
+	bool _retention_stop = false;
+
+	std::mutex _indexer_mutex; // One pass at a time
+	std::thread _indexer_thread;
+	std::mutex _indexer_stop_mutex;
+	std::condition_variable _indexer_stop_cv;
+	bool _indexer_stop = false;
+
+	// Declared last: its drain thread must stop before the shards and
+	// the log go away
+	std::unique_ptr<IngestRing> _ingest_ring;
 
 };
 
@@ -167,10 +1062,7 @@ class GlobalMsgQueue
 public:
 	static void init()
 	{
-		if (Cfg::msg_q_debug)
-		{
-			std::cout << "Initialized GlobalMsgQueue!\n";
-		}
+		DIAG(Queue, Debug, "Initialized GlobalMsgQueue!");
 		_inst = std::unique_ptr<MsgQueueWrapper>(new MsgQueueWrapper);
 	}
 
@@ -179,11 +1071,6 @@ public:
 		return *_inst;
 	}
 
-	static MsgQueueWrapper::Queue & get_queue()
-	{
-		return _inst->get_queue();
-	}
-
 	static MsgQueueWrapper::Lock get_lock()
 	{
 		return _inst->get_lock();
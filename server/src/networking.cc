@@ -1,42 +1,103 @@
-#include <iostream>
+#include <sstream>
 
 #include <string>
 #include <vector>
 #include <deque>
+#include <forward_list>
+#include <memory>
+#include <thread>
+#include <algorithm>
 
-#include <cctype>
+#include <cstring>
 
 #include <boost/asio.hpp>
 
+#include "networking.hh"
 #include "reqs.hh"
 #include "msgs.hh"
+#include "ingest.hh"
+#include "wire.hh"
+#include "diag.hh"
+#include "metrics.hh"
+#include "sanitize.hh"
 
 using boost::asio::ip::tcp;
 
 // Local Scope Definitions //////////////////////////////////////////
-namespace
-{
-	typedef uint16_t PortType;
-};
 
 namespace Cfg
 {
 	static const PortType port = 9876;
-	static const size_t session_buf_size = 4096;
-	static const char * req_delim = "\r\n";
-	static const bool req_trim_trailing_whitespaces = true;
-	static const bool req_filter_out_non_printable_chars = true;
-
-	// Debug flags
-	static const bool req_debug = true;
-	static const bool session_obj_debug = true;
-	static const bool session_obj_debug_verbose = false;
-	static const bool comm_debug = true;
-	static const bool comm_debug_ultra_verbose = false;
-	static const bool comm_write_debug_ultra_verbose = false;
+	static const size_t session_buf_size = 16 * 1024 * 1024; // Longest new_log_batch line or binary frame
+	static const size_t req_line_bytes = 4 * 1024; // Longest request line of any other type
+	static const size_t reply_chunk_bytes = 64 * 1024;
+	static const size_t reply_chunk_slack = 4 * 1024; // For the line that takes a chunk past reply_chunk_bytes
+	static const size_t metrics_req_buf_size = 8 * 1024; // Headers of a metrics scrape, without a body
+	static const char * req_delim = "\r\n"; // ReqDelimMatch looks for it with Sanitize::find_crlf()
+};
+
+typedef boost::asio::buffers_iterator<boost::asio::streambuf::const_buffers_type> StreambufIter;
+
+class ReqDelimMatch
+// For async_read_until(): the end of the first request delimiter, found
+// with a vectorized scan rather than asio's byte at a time one. Reading
+// starts at a line's start, and the streambuf's bytes are all in one
+// buffer, which is how a line can be told to be a new_log_batch. Any
+// other line is given up on past Cfg::req_line_bytes: that's reported as
+// a match without the delimiter, for the handler to hang up on.
+{
+public:
+
+	explicit ReqDelimMatch(const boost::asio::streambuf & buf)
+	:	_buf(&buf)
+	{
+
+	}
+
+	std::pair<StreambufIter, bool> operator()(StreambufIter begin, StreambufIter end) const
+	{
+		const size_t size = size_t(end - begin);
+		if (size == 0)
+		{
+			return std::make_pair(end, false);
+		}
+
+		const char * const data = &*begin;
+		const size_t pos = Sanitize::find_crlf(data, size);
+		if (pos != size)
+		{
+			return std::make_pair(begin + (pos + 2), true);
+		}
+
+		const size_t line_size = _buf->size();
+		if (line_size > Cfg::req_line_bytes &&
+			!Reqs::is_length_prefixed(boost::string_ref(boost::asio::buffer_cast<const char *>(_buf->data()), line_size)))
+		{
+			return std::make_pair(end, true);
+		}
+
+		// A '\r' at the end may be the start of one: look again from there
+		return std::make_pair((data[size - 1] == '\r') ? end - 1 : end, false);
+	}
+
+private:
 
+	const boost::asio::streambuf * _buf;
 };
 
+namespace boost
+{
+	namespace asio
+	{
+		template <>
+		struct is_match_condition<ReqDelimMatch> : public boost::true_type
+		{
+
+		};
+	};
+};
+
+
 class Session
 	: public std::enable_shared_from_this<Session>
 {
@@ -44,24 +105,42 @@ public:
 
 	typedef std::string InMsg;
 	typedef std::deque<InMsg> InQueue;
+	typedef std::string OutMsg;
+	typedef std::deque<OutMsg> OutQueue;
+	typedef std::vector<OutMsg> OutMsgs;
 
 
 	Session(boost::asio::io_service & io_service)
 	:	_socket(io_service),
+		_strand(io_service),
 		_in_buf(Cfg::session_buf_size)
 	{
-		if (Cfg::session_obj_debug_verbose)	std::cout << "Session constructed!\n";
+		DIAG(Session, Trace, "Session constructed!");
 	}
 
 	~Session()
 	{
-		if (Cfg::session_obj_debug)	std::cout << "Session destroyed!\n";
+		DIAG(Session, Debug, "Session destroyed!");
+
+		if (_started)
+		{
+			Metrics::add(Metrics::Counter::SessionsClosed);
+		}
 	}
 
 	void start()
 	{
-		if (Cfg::session_obj_debug_verbose)	std::cout << "Session started!\n";
-		read();
+		DIAG(Session, Trace, "Session started!");
+
+		_started = true;
+		Metrics::add(Metrics::Counter::SessionsOpened);
+
+		// Replies already go out one write per batch of requests; holding
+		// them back for more only stalls pipelining clients on delayed ACKs
+		boost::system::error_code ec;
+		_socket.set_option(tcp::no_delay(true), ec);
+
+		detect_protocol();
 	}
 
 	tcp::socket & get_socket()
@@ -70,6 +149,52 @@ public:
 	}
 
 private:
+	void detect_protocol()
+	// Binary clients open with WireFormat::hello, anything else speaks text
+	{
+		auto self(shared_from_this());
+		boost::asio::async_read(
+			_socket,
+			_in_buf,
+			boost::asio::transfer_at_least(1),
+			_strand.wrap([this, self](boost::system::error_code ec, std::size_t)
+			{
+				if (ec)
+				{
+					DIAG(Comm, Debug, "Read error: " << ec);
+					return;
+				}
+
+				const char * data = boost::asio::buffer_cast<const char *>(_in_buf.data());
+				const size_t size = boost::asio::buffer_size(_in_buf.data());
+
+				if (data[0] != WireFormat::hello[0])
+				{
+					read();
+					return;
+				}
+
+				if (size < sizeof(WireFormat::hello))
+				{
+					detect_protocol();
+					return;
+				}
+
+				if (std::memcmp(data, WireFormat::hello, sizeof(WireFormat::hello)) != 0)
+				{
+					DIAG(Comm, Warn, "Bad hello, hanging up");
+					return;
+				}
+
+				DIAG(Comm, Debug, "Client speaks binary");
+
+				_binary = true;
+				consume(sizeof(WireFormat::hello));
+				write(OutMsg(WireFormat::hello, sizeof(WireFormat::hello)));
+				serve_frames();
+			}));
+	}
+
 	void read()
 	{
 		std::shared_ptr<Session> self(shared_from_this());
@@ -77,200 +202,664 @@ private:
 		boost::asio::async_read_until(
 			_socket,
 			_in_buf,
-			std::string(Cfg::req_delim),
-			[this, self]
+			ReqDelimMatch(_in_buf),
+			_strand.wrap([this, self]
 				// N.B.: Must copying "self" by value to increase ref count
 				// so that the calling object doesn't die before callback.
+				// All handlers of one session go through _strand, so worker
+				// threads never run two of them concurrently.
 				(boost::system::error_code ec, std::size_t bytes_transferred)
 			{
 				// Async read callback function
 
 				if (ec)
 				{
-					if (Cfg::comm_debug)
-						std::cout << "Read error: " << ec << std::endl;
+					DIAG(Comm, Debug, "Read error: " << ec);
 					return;
 				}
 
-				if (Cfg::comm_debug)
-					std::cout << "Bytes read: " << bytes_transferred << " Bytes\n";
+				DIAG(Comm, Debug, "Bytes read: " << bytes_transferred << " Bytes");
 
-				// Read buffer into temporary string
-				//_in_buf.commit(bytes_transferred);
-				std::istream is(&_in_buf);
-				std::string in_msg;
-				std::getline(is, in_msg);
-
-				// Test raw message
-				if (Cfg::comm_debug_ultra_verbose)
+				const char * data = boost::asio::buffer_cast<const char *>(_in_buf.data());
+				if (!boost::string_ref(data, bytes_transferred).ends_with(Cfg::req_delim))
 				{
-					std::cout << "Read Raw: " << in_msg << std::endl;
-					for (int c : in_msg)
-					{
-						std::cout << c << " ";
-					}
-					std::cout << std::endl;
+					DIAG(Comm, Warn, "Request line longer than " << Cfg::req_line_bytes << " bytes, hanging up");
+					return;
 				}
 
-				// Trim trailing whitespace
+				serve_lines();
+			}));
+	}
 
-				if (Cfg::req_trim_trailing_whitespaces)
+	void serve_lines()
+	// Must be called from within _strand. Serves every complete line read
+	// so far, in order, with runs of new_logs going into the queue together,
+	// and sends all the replies with one write. Stops behind a request
+	// whose reply streams: the lines after it wait until it's all out.
+	{
+		const char * data = boost::asio::buffer_cast<const char *>(_in_buf.data());
+		const boost::string_ref buf(data, boost::asio::buffer_size(_in_buf.data()));
+
+		// A partial line at the end waits for the next read
+		const size_t delim_pos = buf.rfind(Cfg::req_delim);
+		const size_t end = (delim_pos == boost::string_ref::npos) ? 0 : delim_pos + std::strlen(Cfg::req_delim);
+
+		// Views in _new_logs may point into these
+		std::forward_list<std::string> filtered_lines;
+
+		size_t pos = 0;
+		while (pos < end && !_reply_stream)
+		{
+			// There's one at least at end - 1
+			const size_t eol = static_cast<const char *>(std::memchr(data + pos, '\n', end - pos)) - data;
+			const boost::string_ref raw_msg(data + pos, eol - pos);
+			pos = eol + 1;
+
+			// Test raw message
+			if (Diag::enabled(Diag::Channel::Comm, Diag::Level::Trace))
+			{
+				Diag::Line line(Diag::Channel::Comm, Diag::Level::Trace);
+				line << "Read Raw: " << raw_msg << " |";
+				for (int c : raw_msg)
 				{
-					while (!in_msg.empty())
-					{
-						char trailing_char = in_msg.back();
-						if (!isprint(trailing_char) || isspace(trailing_char))
-						{
-							in_msg.pop_back();
-						}
-						else
-						{
-							break;
-						}
-					}
+					line << " " << c;
 				}
+			}
 
-				// Delete all non-printables
-
-				if (Cfg::req_filter_out_non_printable_chars)
+			// Sanitizing would throw a new_log_batch's byte counts off
+			boost::string_ref in_msg;
+			if (Reqs::is_length_prefixed(raw_msg))
+			{
+				in_msg = raw_msg;
+				if (!in_msg.empty() && in_msg.back() == '\r')
 				{
-					in_msg.erase(
-						std::remove_if(
-							in_msg.begin(),
-							in_msg.end(),
-							[](char c)
-								{
-									return !isprint(c);
-								}
-							),
-						in_msg.end()
-					);
+					in_msg.remove_suffix(1);
 				}
+			}
+			else
+			{
+				in_msg = Sanitize::sanitize(raw_msg, filtered_lines);
+			}
 
-				// If message still isn't empty, add it to the queue
-				if (!in_msg.empty())
-				{
+			// Nothing left, nothing to reply to
+			if (in_msg.empty())
+			{
+				continue;
+			}
 
-					if (Cfg::comm_debug)
-						std::cout << "Read Req: " << in_msg << std::endl;
+			DIAG(Comm, Debug, "Read Req: " << in_msg);
 
-					if (Cfg::comm_debug_ultra_verbose)
-					{
-						for (int c : in_msg)
-						{
-							std::cout << c << " ";
-						}
-						std::cout << std::endl;
-					}
+			ReqUtils::ResultCode result_code;
+			const size_t num_new_logs = _new_logs.size();
+			const uint64_t parse_start = Metrics::sample_parse() ? Metrics::now_ns() : 0;
+			auto req_uptr = Reqs::parse_req_str(in_msg, _new_logs, result_code);
+			if (parse_start != 0)
+			{
+				Metrics::record(Metrics::Histogram::ParseNs, Metrics::now_ns() - parse_start);
+			}
 
-					ReqUtils::ResultCode result_code;
-					auto req_uptr = Reqs::parse_req_str(in_msg, result_code);
+			if (Diag::enabled(Diag::Channel::Req, Diag::Level::Debug))
+			{
+				Diag::Line line(Diag::Channel::Req, Diag::Level::Debug);
+				line << "New Req (" << ReqUtils::get_short_result_str(result_code) << "): ";
+				if (req_uptr)
+					line << *req_uptr;
+				else if (_new_logs.size() != num_new_logs)
+					line << _new_logs.back();
+				else
+					line << "nullptr";
+			}
+
+			if (_new_logs.size() != num_new_logs)
+			{
+				_new_log_replies.push_back(_replies.size());
+				_replies.emplace_back();
+				continue;
+			}
+
+			// Whatever came before goes first
+			serve_new_logs();
+
+			// Serving may still fail (e.g. full ingest ring), so the
+			// status line is only known afterwards.
+			std::ostringstream served_contents;
+			if (req_uptr != nullptr)
+			{
+				serve(*req_uptr, served_contents, result_code);
+			}
 
-					if (Cfg::req_debug)
-					{
-						std::cout << "New Req (" << ReqUtils::get_short_result_str(result_code) << "): ";
-						if (req_uptr)
-							std::cout << *req_uptr << std::endl;
-						else
-							std::cout << "nullptr" << std::endl;
-					}
-
-					std::ostringstream returned_contents;
-					returned_contents << ReqUtils::get_short_result_str(result_code) << std::endl;
-					if (req_uptr != nullptr)
-					{
-						req_uptr->serve(GlobalMsgQueue::get_inst(), returned_contents);
-					}
+			_replies.push_back(make_reply(result_code, served_contents.str(), _reply_stream != nullptr));
+			Metrics::add_result(unsigned(result_code));
+		}
 
-					// TODO: send returned contents and status message back
-					write(returned_contents.str());
-					read();
+		serve_new_logs();
+
+		consume(pos);
+		write(_replies);
+
+		// The rest of a streamed reply goes out chunk by chunk as the
+		// socket takes it, see write_front(), and reading resumes after
+		if (!_reply_stream)
+		{
+			// Exactly one outstanding read per session
+			read();
+		}
+	}
+
+	void read_frames()
+	{
+		auto self(shared_from_this());
+		boost::asio::async_read(
+			_socket,
+			_in_buf,
+			boost::asio::transfer_at_least(1),
+			_strand.wrap([this, self](boost::system::error_code ec, std::size_t bytes_transferred)
+			{
+				if (ec)
+				{
+					DIAG(Comm, Debug, "Read error: " << ec);
+					return;
 				}
 
-				read();
-			});
+				DIAG(Comm, Debug, "Bytes read: " << bytes_transferred << " Bytes");
+
+				serve_frames();
+			}));
 	}
 
-	void write(const std::string & str)
+	void serve_frames()
+	// serve_lines() for the binary protocol. Frames are served right where
+	// they sit in _in_buf: a new_log's bytes go from there into the queue.
 	{
-		if (Cfg::comm_write_debug_ultra_verbose)
-			std::cout << "Sending: " << str << std::endl;
+		const char * data = boost::asio::buffer_cast<const char *>(_in_buf.data());
+		const size_t size = boost::asio::buffer_size(_in_buf.data());
+
+		size_t pos = 0;
+		bool hang_up = false;
+		while (!_reply_stream)
+		{
+			WireFormat::Frame frame;
+			size_t frame_size = 0;
+			const auto status = WireFormat::parse_frame(data + pos, size - pos, Cfg::session_buf_size, frame, frame_size);
+			if (status == WireFormat::ParseStatus::Incomplete)
+			{
+				break;
+			}
+			if (status == WireFormat::ParseStatus::TooLarge)
+			{
+				DIAG(Comm, Warn, "Frame of " << frame_size << " bytes, hanging up");
+				hang_up = true;
+				break;
+			}
+			pos += frame_size;
+
+			ReqUtils::ResultCode result_code;
+			const size_t num_new_logs = _new_logs.size();
+			const uint64_t parse_start = Metrics::sample_parse() ? Metrics::now_ns() : 0;
+			auto req_uptr = Reqs::parse_req_frame(frame, _new_logs, result_code);
+			if (parse_start != 0)
+			{
+				Metrics::record(Metrics::Histogram::ParseNs, Metrics::now_ns() - parse_start);
+			}
+
+			if (Diag::enabled(Diag::Channel::Req, Diag::Level::Debug))
+			{
+				Diag::Line line(Diag::Channel::Req, Diag::Level::Debug);
+				line << "New Frame (" << ReqUtils::get_short_result_str(result_code) << "): ";
+				if (req_uptr)
+					line << *req_uptr;
+				else
+					line << "type " << unsigned(frame.type);
+			}
+
+			if (_new_logs.size() != num_new_logs)
+			{
+				_new_log_replies.push_back(_replies.size());
+				_replies.emplace_back();
+				continue;
+			}
+
+			// Whatever came before goes first
+			serve_new_logs();
+
+			std::ostringstream served_contents;
+			if (req_uptr != nullptr)
+			{
+				serve(*req_uptr, served_contents, result_code);
+			}
+			_replies.push_back(make_reply(result_code, served_contents.str(), _reply_stream != nullptr));
+			Metrics::add_result(unsigned(result_code));
+		}
+
+		// Before the bytes they point into go away
+		serve_new_logs();
+
+		consume(pos);
+		write(_replies);
+
+		if (!_reply_stream && !hang_up)
+		{
+			read_frames();
+		}
+	}
+
+	// Done with the first num_bytes of _in_buf. Only what's consumed counts
+	// as read: async_read_until() reports where the delimiter is, not what
+	// came in.
+	void consume(size_t num_bytes)
+	{
+		_in_buf.consume(num_bytes);
+		Metrics::add(Metrics::Counter::BytesIn, num_bytes);
+	}
+
+	// Reads on the way the session speaks, serving what's already read first
+	void resume_reading()
+	{
+		if (_binary)
+		{
+			serve_frames();
+		}
+		else
+		{
+			read();
+		}
+	}
+
+	void serve(ReqBase & req, std::ostream & os, ReqUtils::ResultCode & result_code)
+	// Serves a request other than a new_log; a reply that streams is left in _reply_stream
+	{
+		const uint64_t start = Metrics::now_ns();
+		_reply_stream = req.serve_streamed(GlobalMsgQueue::get_inst(), os, result_code);
+		Metrics::record(Metrics::Histogram::ServeNs, Metrics::now_ns() - start);
+	}
+
+	void serve_new_logs()
+	// Serves the run of new_logs in _new_logs and fills in their replies
+	{
+		if (_new_logs.empty())
+		{
+			return;
+		}
+
+		const uint64_t start = Metrics::now_ns();
+		Reqs::serve_new_logs(GlobalMsgQueue::get_inst(), _new_logs, _result_codes);
+		Metrics::record(Metrics::Histogram::NewLogsServeNs, Metrics::now_ns() - start);
+
+		for (size_t i = 0; i < _new_logs.size(); ++i)
+		{
+			_replies[_new_log_replies[i]] = make_reply(_result_codes[i]);
+			Metrics::add_result(unsigned(_result_codes[i]));
+		}
+		_new_logs.clear();
+		_new_log_replies.clear();
+	}
+
+	// Status line and contents, or a reply frame. more if a streamed reply follows.
+	OutMsg make_reply(ReqUtils::ResultCode result_code, const std::string & contents = std::string(), bool more = false) const
+	{
+		OutMsg reply;
+		if (_binary)
+		{
+			WireFormat::append_reply(reply, uint8_t(result_code), more ? WireFormat::More : 0, contents);
+		}
+		else
+		{
+			reply = ReqUtils::get_short_result_str(result_code);
+			reply += '\n';
+			reply += contents;
+		}
+		return reply;
+	}
+
+	void write(OutMsgs & strs)
+	// Must be called from within _strand. Leaves strs empty.
+	{
+		const bool write_in_progress = !_out_queue.empty();
+		for (OutMsg & str : strs)
+		{
+			DIAG(Comm, Trace, "Sending: " << str);
+
+			_out_queue.push_back(std::move(str));
+		}
+		strs.clear();
+		if (!write_in_progress && !_out_queue.empty())
+		{
+			write_front();
+		}
+	}
+
+	void write(OutMsg str)
+	// Must be called from within _strand
+	{
+		DIAG(Comm, Trace, "Sending: " << str);
+
+		// Keep the buffer alive until async_write completes, and never
+		// interleave two async_writes on the same socket.
+		const bool write_in_progress = !_out_queue.empty();
+		_out_queue.push_back(std::move(str));
+		if (!write_in_progress)
+		{
+			write_front();
+		}
+	}
+
+	void write_front()
+	// Sends everything queued so far with one gathering write. What's
+	// queued meanwhile goes out with the next one.
+	{
+		std::vector<boost::asio::const_buffer> buffers;
+		buffers.reserve(_out_queue.size());
+		for (const OutMsg & str : _out_queue)
+		{
+			buffers.push_back(boost::asio::buffer(str));
+		}
+
 		auto self(shared_from_this());
 		boost::asio::async_write(
 			_socket,
-			boost::asio::buffer(str),
-			[this, self](boost::system::error_code ec, std::size_t)
+			buffers,
+			_strand.wrap([this, self, num_sent = buffers.size()](boost::system::error_code ec, std::size_t bytes_transferred)
 			{
-				if (!ec)
+				if (ec)
 				{
+					DIAG(Comm, Debug, "Write error: " << ec);
+					return;
+				}
 
+				Metrics::add(Metrics::Counter::BytesOut, bytes_transferred);
+
+				// push_back() leaves the strings in flight where they are
+				_out_queue.erase(_out_queue.begin(), _out_queue.begin() + num_sent);
+				if (!_out_queue.empty())
+				{
+					write_front();
 				}
-			});
+				else if (_reply_stream)
+				{
+					write_next_chunk();
+				}
+			}));
+	}
+
+	void write_next_chunk()
+	// Must be called from within _strand, with nothing left to write. Only
+	// one chunk is in memory at a time: a slow client slows the stream down
+	// rather than piling the reply up here.
+	{
+		// In binary, the reply header goes in front once the chunk's size is
+		// known, so the lines are formatted right where they're sent from
+		const size_t head_size = _binary ? WireFormat::header_size : 0;
+		OutMsg chunk(head_size, '\0');
+		chunk.reserve(head_size + Cfg::reply_chunk_bytes + Cfg::reply_chunk_slack);
+
+		bool more = true;
+		while (chunk.size() == head_size && more)
+		{
+			more = _reply_stream->next_chunk(chunk, Cfg::reply_chunk_bytes);
+		}
+
+		if (!more)
+		{
+			_reply_stream.reset();
+		}
+
+		// Even an empty last chunk has to say it's the last
+		if (_binary)
+		{
+			WireFormat::write_reply_header(
+				&chunk[0], uint8_t(ReqUtils::ResultCode::Ok), more ? WireFormat::More : 0, uint32_t(chunk.size() - head_size));
+		}
+
+		if (!chunk.empty())
+		{
+			write(std::move(chunk));
+		}
+
+		if (!more)
+		{
+			resume_reading();
+		}
 	}
 
 	tcp::socket _socket;
 
+	boost::asio::io_service::strand _strand;
+
 	boost::asio::streambuf _in_buf;
 
+	OutQueue _out_queue;
+
+	// What's left of the reply being streamed, if any
+	std::unique_ptr<ReplyStream> _reply_stream;
+
+	// Scratch of serve_lines() and serve_frames(), kept for their capacity.
+	// _new_logs is the run of new_logs waiting to be served together, and
+	// _new_log_replies where their replies go in _replies.
+	OutMsgs _replies;
+	std::vector<MsgView> _new_logs;
+	std::vector<size_t> _new_log_replies;
+	std::vector<ReqUtils::ResultCode> _result_codes;
+
+	// Set once the client sent WireFormat::hello
+	bool _binary = false;
+
+	// Counted as opened, so it's counted as closed too
+	bool _started = false;
+
 };
 
 
-class Server
+class MetricsSession
+	: public std::enable_shared_from_this<MetricsSession>
+// One scrape of the metrics port: whatever the request, the reply is the
+// metrics, in as much HTTP as it takes for curl or Prometheus to read it.
 {
 public:
 
-
-
-	Server(
-		boost::asio::io_service& io_service,
-		PortType port)
-	:
-		_acceptor(io_service, tcp::endpoint(tcp::v4(), port)),
-		_io_service(io_service),
-		_port(port)
+	MetricsSession(boost::asio::io_service & io_service)
+	:	_socket(io_service),
+		_in_buf(Cfg::metrics_req_buf_size)
 	{
 
 	}
 
-	void run()
+	void start()
 	{
-		if (Cfg::comm_debug)
-			std::cout << "Listing on port...\n";
-		std::shared_ptr<Session> session( new Session(_io_service) );
-
-		_acceptor.async_accept(
-			session->get_socket(),
-			[this, session](boost::system::error_code ec)
+		auto self(shared_from_this());
+		boost::asio::async_read_until(
+			_socket,
+			_in_buf,
+			std::string("\r\n\r\n"),
+			[this, self](boost::system::error_code ec, std::size_t)
+			{
+				if (ec)
 				{
-					if (Cfg::comm_debug)
-						std::cout << "accept ec: " << ec << std::endl;
-					if (!ec)
+					DIAG(Comm, Debug, "Metrics read error: " << ec);
+					return;
+				}
+
+				std::ostringstream body;
+				Metrics::write_to_stream(body, GlobalMsgQueue::get_inst());
+
+				std::ostringstream reply;
+				reply << "HTTP/1.0 200 OK\r\n"
+					"Content-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: " << body.str().size() << "\r\n"
+					"\r\n" << body.str();
+				_out = reply.str();
+
+				boost::asio::async_write(
+					_socket,
+					boost::asio::buffer(_out),
+					[this, self](boost::system::error_code ec, std::size_t)
 					{
-						session->start();
-					}
+						if (ec)
+						{
+							DIAG(Comm, Debug, "Metrics write error: " << ec);
+							return;
+						}
+
+						_socket.shutdown(tcp::socket::shutdown_both, ec);
+					});
+			});
+	}
 
-					run();
-				});
+	tcp::socket & get_socket()
+	{
+		return _socket;
 	}
 
 private:
 
-	tcp::acceptor _acceptor;
-	boost::asio::io_service & _io_service;
-	const PortType _port;
+	tcp::socket _socket;
+
+	boost::asio::streambuf _in_buf;
+
+	std::string _out;
+
 };
 
 
-void start_server()
+// Exported Classes /////////////////////////////////////////////////
+
+Server::Server(PortType port, unsigned num_threads)
+:
+	_io_service(),
+	_acceptor(_io_service, tcp::endpoint(tcp::v4(), port)),
+	_num_threads(num_threads ? num_threads : std::max(1u, std::thread::hardware_concurrency()))
 {
-	GlobalMsgQueue::init();
 
-	boost::asio::io_service io_service;
+}
 
-	Server s(io_service, Cfg::port);
-	s.run();
+Server::~Server()
+{
+	stop();
+	join();
+}
 
-	io_service.run();
+void Server::start()
+{
+	DIAG(Server, Info, "Starting " << _num_threads << " IO threads");
+
+	accept();
+
+	for (unsigned i = 0; i < _num_threads; ++i)
+	{
+		_threads.emplace_back([this]() { _io_service.run(); });
+	}
+}
+
+void Server::join()
+{
+	for (std::thread & thd : _threads)
+	{
+		if (thd.joinable())
+		{
+			thd.join();
+		}
+	}
+	_threads.clear();
+}
+
+void Server::run()
+{
+	start();
+	join();
+}
+
+void Server::stop()
+{
+	_io_service.stop();
+}
+
+PortType Server::get_port() const
+{
+	return _acceptor.local_endpoint().port();
+}
+
+void Server::serve_metrics(PortType port)
+{
+	_metrics_acceptor.reset(new tcp::acceptor(_io_service, tcp::endpoint(tcp::v4(), port)));
+	accept_metrics();
+}
+
+PortType Server::get_metrics_port() const
+{
+	return _metrics_acceptor ? _metrics_acceptor->local_endpoint().port() : 0;
+}
+
+void Server::accept()
+{
+	DIAG(Server, Debug, "Listening on port " << get_port());
+	std::shared_ptr<Session> session( new Session(_io_service) );
+
+	_acceptor.async_accept(
+		session->get_socket(),
+		[this, session](boost::system::error_code ec)
+			{
+				DIAG(Server, Debug, "accept ec: " << ec);
+				if (!ec)
+				{
+					session->start();
+				}
+
+				accept();
+			});
 }
 
 
+void Server::accept_metrics()
+{
+	DIAG(Server, Debug, "Serving metrics on port " << get_metrics_port());
+	std::shared_ptr<MetricsSession> session(new MetricsSession(_io_service));
+
+	_metrics_acceptor->async_accept(
+		session->get_socket(),
+		[this, session](boost::system::error_code ec)
+			{
+				if (!ec)
+				{
+					session->start();
+				}
+
+				accept_metrics();
+			});
+}
+
+
+void start_server(const ServerOptions & options)
+{
+	GlobalMsgQueue::init();
+
+	if (!options.wal_dir.empty())
+	{
+		auto & q_wrapper = GlobalMsgQueue::get_inst();
+		q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(
+			new WriteAheadLog(options.wal_dir, options.wal_sync_policy, options.wal_segment_bytes)));
+		DIAG(Wal, Info, "Took over " << q_wrapper.size() << " messages from " << options.wal_dir);
+	}
+
+	if (options.retention.any())
+	{
+		GlobalMsgQueue::get_inst().set_retention(options.retention);
+	}
+
+	if (options.search_index)
+	{
+		GlobalMsgQueue::get_inst().start_indexer();
+	}
+
+	if (options.ingest_ring_capacity != 0)
+	{
+		auto & q_wrapper = GlobalMsgQueue::get_inst();
+		q_wrapper.set_ingest_ring(std::unique_ptr<IngestRing>(
+			new IngestRing(q_wrapper, options.ingest_ring_capacity, options.overflow_policy)));
+	}
+
+	Server s(Cfg::port, options.num_threads);
+	if (options.metrics_port != 0)
+	{
+		s.serve_metrics(options.metrics_port);
+	}
+	s.run();
+}
@@ -1,11 +1,107 @@
 #ifndef FRONTEND_HH
 #define FRONTEND_HH
 
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
-void start_server();
+#include <boost/asio.hpp>
+
+#include "ingest.hh"
+#include "wal.hh"
+
+typedef uint16_t PortType;
+
+class Server
+// TCP front end. One shared io_service is run by a pool of worker threads;
+// each Session serializes its own handlers through a strand, so sessions
+// are served in parallel while a single session never races with itself.
+{
+public:
+
+	// num_threads == 0 means one worker per hardware thread.
+	// port == 0 lets the OS pick a free port, see get_port().
+	Server(PortType port, unsigned num_threads = 0);
+
+	~Server();
+
+	// Spawn the worker threads and return immediately.
+	void start();
+
+	// Block until all worker threads have returned.
+	void join();
+
+	// Start, then block until stopped.
+	void run();
+
+	// Thread safe. Abandons outstanding sessions.
+	void stop();
+
+	PortType get_port() const;
+
+	// Also answers every HTTP request on port with the metrics, see
+	// Metrics::write_to_stream(). Call before start(); port == 0 lets the
+	// OS pick, see get_metrics_port().
+	void serve_metrics(PortType port);
+
+	// 0 unless serve_metrics() was called
+	PortType get_metrics_port() const;
+
+	unsigned get_num_threads() const
+	{
+		return _num_threads;
+	}
+
+private:
+
+	void accept();
+
+	void accept_metrics();
+
+	boost::asio::io_service _io_service;
+	boost::asio::ip::tcp::acceptor _acceptor;
+	std::unique_ptr<boost::asio::ip::tcp::acceptor> _metrics_acceptor;
+	const unsigned _num_threads;
+	std::vector<std::thread> _threads;
+
+};
+
+
+struct ServerOptions
+{
+	// 0 means one IO thread per hardware thread
+	unsigned num_threads = 0;
+
+	// 0 sends new_logs straight to the queue, bypassing the ingest ring
+	size_t ingest_ring_capacity = Cfg::ingest_ring_capacity;
+	IngestRing::OverflowPolicy overflow_policy = IngestRing::OverflowPolicy::Block;
+
+	// Empty keeps messages in memory only
+	std::string wal_dir;
+	WriteAheadLog::SyncPolicy wal_sync_policy;
+
+	// Messages in sealed segments are served from disk, so this is
+	// roughly how much history is kept in memory
+	size_t wal_segment_bytes = Cfg::wal_segment_bytes;
+
+	// No limits keeps everything; ignored with a write-ahead log
+	MsgQueueWrapper::RetentionPolicy retention;
+
+	// Without it, searches scan every block
+	bool search_index = true;
+
+	// 0 serves no metrics port; the stats request works regardless
+	PortType metrics_port = 0;
+};
+
+
+void start_server(const ServerOptions & options = ServerOptions());
 
 
 #endif
 
 
 
+
@@ -1,16 +1,18 @@
 #include "reqs.hh"
 #include "msgs.hh"
-
-#include <regex>
+#include "ingest.hh"
+#include "wal.hh"
+#include "lookup.hh"
+#include "diag.hh"
+#include "metrics.hh"
+#include "sanitize.hh"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
 #include <typeinfo>
 
-
-namespace Cfg
-{
-	static bool regex_debug = false;
-	static bool req_obj_debug = false;
-	static bool req_obj_debug_verbose = false;
-};
+#include <boost/utility/string_ref.hpp>
 
 
 // Local Scope Helper Functions /////////////////////////////////////
@@ -18,97 +20,899 @@ namespace Cfg
 namespace
 {
 
+// The one place request types are defined: X(<enumerator>, <request name>)
+#define LOGGER_REQ_TYPES(X) \
+	X(NewLog, "new_log") \
+	X(NewLogBatch, "new_log_batch") \
+	X(DumpAll, "dump_all") \
+	X(DumpUser, "dump_user") \
+	X(DumpRange, "dump_range") \
+	X(Search, "search") \
+	X(DeleteAll, "delete_all") \
+	X(Stats, "stats")
+
 enum class ReqType : unsigned
 {
-	NewLog,
-	DumpAll,
-	DeleteAll,
+	#define LOGGER_REQ_TYPE_ENUM(name, str) name,
+	LOGGER_REQ_TYPES(LOGGER_REQ_TYPE_ENUM)
+	#undef LOGGER_REQ_TYPE_ENUM
 	Illegal
 };
 
-inline ReqType get_req_type(const std::string & req_type_str)
+constexpr const char * req_type_names[] = {
+	#define LOGGER_REQ_TYPE_STR(name, str) str,
+	LOGGER_REQ_TYPES(LOGGER_REQ_TYPE_STR)
+	#undef LOGGER_REQ_TYPE_STR
+};
+
+constexpr auto req_type_lookup = Lookup::make_perfect_hash<
+	sizeof(req_type_names) / sizeof(req_type_names[0]), 4>(req_type_names);
+
+static_assert(req_type_lookup.is_valid(), "No perfect hash for the request names, grow the table");
+
+inline ReqType get_req_type(Reqs::StrRef req_type_str)
 {
-	ReqType type = ReqType::Illegal;
+	// not_found == number of request types == Illegal
+	return static_cast<ReqType>(req_type_lookup.find(req_type_str));
+}
 
-	static const std::vector<const char *> available_strings = {
-		"new_log",
-		"dump_all",
-		"delete_all"
-	};
+// Character classes of the original regex grammar: \s and \S in the
+// classic locale, and the ECMAScript "." which stops at line terminators.
 
-	for (unsigned i = 0; i < available_strings.size(); ++i)
+inline bool is_space(char c)
+{
+	switch (c)
 	{
-		if (req_type_str == available_strings[i])
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\v':
+		case '\f':
+		case '\r':
+			return true;
+		default:
+			return false;
+	}
+}
+
+inline bool is_line_terminator(char c)
+{
+	return c == '\n' || c == '\r';
+}
+
+class Tokenizer
+// Single forward pass over a request string, handing out views into it.
+// Never allocates.
+{
+public:
+	explicit Tokenizer(Reqs::StrRef str)
+	:	_pos(str.begin()),
+		_end(str.end())
+	{
+
+	}
+
+	void skip_whitespace()
+	{
+		while (_pos != _end && is_space(*_pos))
 		{
-			type = static_cast<ReqType>(i);
-			break;
+			++_pos;
+		}
+	}
+
+	// "\s*(\S+)": empty if there's no token left
+	Reqs::StrRef next_token()
+	{
+		skip_whitespace();
+		const char * begin = _pos;
+		while (_pos != _end && !is_space(*_pos))
+		{
+			++_pos;
+		}
+		return Reqs::StrRef(begin, size_t(_pos - begin));
+	}
+
+	// "\s+(.+)" right after a token: empty if it wouldn't match.
+	// Mirrors the regex backtracking: when only whitespace is left, ".+"
+	// still grabs the last whitespace char that isn't a line terminator.
+	Reqs::StrRef next_body()
+	{
+		const char * token_end = _pos;
+		skip_whitespace();
+
+		if (_pos == token_end)
+		{
+			return Reqs::StrRef();
+		}
+
+		if (_pos != _end)
+		{
+			const char * begin = _pos;
+			while (_pos != _end && !is_line_terminator(*_pos))
+			{
+				++_pos;
+			}
+			return Reqs::StrRef(begin, size_t(_pos - begin));
+		}
+
+		for (const char * c = _end - 1; c != token_end; --c)
+		{
+			if (!is_line_terminator(*c))
+			{
+				return Reqs::StrRef(c, 1);
+			}
 		}
+		return Reqs::StrRef();
 	}
-	return type;
+
+	// A single space, then exactly n bytes: empty if they aren't all there
+	Reqs::StrRef next_bytes(size_t n)
+	{
+		if (_pos == _end || *_pos != ' ' || size_t(_end - _pos - 1) < n)
+		{
+			return Reqs::StrRef();
+		}
+
+		const char * begin = _pos + 1;
+		_pos = begin + n;
+		return Reqs::StrRef(begin, n);
+	}
+
+	Reqs::StrRef rest() const
+	{
+		return Reqs::StrRef(_pos, size_t(_end - _pos));
+	}
+
+private:
+	const char * _pos;
+	const char * const _end;
+};
+
+// Plain decimal, nothing else. False if it's not, or doesn't fit.
+bool parse_size(Reqs::StrRef str, size_t & n)
+{
+	if (str.empty() || str.size() > 9)
+	{
+		return false;
+	}
+
+	n = 0;
+	for (char c : str)
+	{
+		if (c < '0' || c > '9')
+		{
+			return false;
+		}
+		n = n * 10 + size_t(c - '0');
+	}
+	return true;
 }
 
-std::string regex_debug(const std::smatch & matches)
-{
-	std::ostringstream oss;
+// Same for a time, which takes more digits
+bool parse_time(Reqs::StrRef str, Msg::Time & time_ms)
+{
+	if (str.empty() || str.size() > 19)
+	{
+		return false;
+	}
+
+	time_ms = 0;
+	for (char c : str)
+	{
+		if (c < '0' || c > '9')
+		{
+			return false;
+		}
+		time_ms = time_ms * 10 + Msg::Time(c - '0');
+	}
+	return true;
+}
+
+IngestRing * get_new_log_ring(MsgQueueWrapper & q_wrapper)
+// The ring new_logs go through, if any. Not when the log only answers Ok
+// once a message is on disk: the ring would answer as soon as it's queued.
+{
+	WriteAheadLog * wal = q_wrapper.get_wal();
+	if (wal && wal->get_policy().acks_after_sync())
+	{
+		return nullptr;
+	}
+	return q_wrapper.get_ingest_ring();
+}
+
+}
+
+
+// Local Scope Class Definitions ////////////////////////////////////
+
+
+class ReqNewLog : public ReqBase
+{
+public:
+
+	static const char * req_type_str_static()
+	{
+		return "ReqNewLog";
+	}
+
+	virtual const char * req_type_str() const override
+	{
+		return ReqNewLog::req_type_str_static();
+	}
+
+	virtual void write_to_stream(std::ostream & os) const override
+	{
+		os << "[" << req_type_str() << "] [" << _msg << "]";
+	}
+
+	virtual ~ReqNewLog() override
+	{
+		DIAG(Req, Trace, "ReqNewLog::dtor()");
+	}
+
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream &,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqNewLog::serve()");
+
+		// With the ring in front, Ok means queued, not yet on disk
+		IngestRing * ingest_ring = get_new_log_ring(q_wrapper);
+		if (ingest_ring)
+		{
+			result_code = ingest_ring->push(std::move(_msg)) ?
+				ReqUtils::ResultCode::Ok :
+				ReqUtils::ResultCode::NewLogQueueFull;
+			return MsgQueueWrapper::Lock();
+		}
+
+		// Whatever this client sent through the ring before goes first
+		q_wrapper.sync_ingest();
+
+		auto lock = q_wrapper.push(std::move(_msg));
+		if (!lock.owns_lock())
+		{
+			result_code = ReqUtils::ResultCode::NewLogTooManyUsers;
+			return lock;
+		}
+		result_code = ReqUtils::ResultCode::Ok;
+
+		// Don't hold the shard while waiting for the disk. Everyone who
+		// appended meanwhile is covered by the same fdatasync.
+		WriteAheadLog * wal = q_wrapper.get_wal();
+		if (wal && wal->get_policy().acks_after_sync())
+		{
+			lock.unlock();
+			if (!wal->sync())
+			{
+				result_code = ReqUtils::ResultCode::NewLogNotPersisted;
+			}
+		}
+
+		return lock;
+	}
+
+	virtual bool operator==(const ReqBase & b_base) const override
+	{
+		// Return false if dynamic types are different
+		if (typeid(*this) != typeid(b_base))
+		{
+			return false;
+		}
+
+		// Same dynamic type. Downcast then do member-wise comparison
+		const ReqNewLog & b = static_cast<const ReqNewLog &>(b_base);
+
+		return (this->_msg == b._msg);
+
+	}
+
+	static std::unique_ptr<ReqNewLog> make_req(Reqs::StrRef args, ReqUtils::ResultCode & result_code)
+	{
+		Reqs::StrRef username;
+		Reqs::StrRef msg_body;
+		Msg::Priority pri;
+		if (!parse_args(args, username, msg_body, pri, result_code))
+		{
+			return nullptr;
+		}
+
+		// First allocations of the whole parse happen right here
+		auto new_uptr = std::unique_ptr<ReqNewLog>(new ReqNewLog(msg_body, username, pri));
+
+		DIAG(Req, Trace, "Parsed " << *new_uptr);
+
+		return new_uptr;
+	}
+
+	// make_req() up to building the request: views into args
+	static bool parse_args(
+		Reqs::StrRef args,
+		Reqs::StrRef & username,
+		Reqs::StrRef & msg_body,
+		Msg::Priority & pri,
+		ReqUtils::ResultCode & result_code)
+	{
+		// Command Format
+		// <username> <priority> <message_body>
+		// username: Anything character that can be matched by (\S+), only printable & non-whitespace
+		// priority: One of the following (low to high): debug, info, warning, critical, error
+		// message body: anything that's printable! No trailing whitespace
+
+		Tokenizer tokenizer(args);
+		username = tokenizer.next_token();
+		const Reqs::StrRef pri_str = tokenizer.next_token();
+		msg_body = tokenizer.next_body();
+
+		DIAG(Parse, Trace, "new_log args: [" << username << "] [" << pri_str << "] [" << msg_body << "]");
+
+		if (username.empty() || pri_str.empty() || msg_body.empty())
+		{
+			result_code = ReqUtils::ResultCode::NewLogTooFewArgs;
+			return false;
+		}
+
+		pri = Msg::get_priority_from_str(pri_str);
+
+		if (pri == Msg::Priority::Illegal)
+		{
+			result_code = ReqUtils::ResultCode::NewLogWrongPriority;
+			return false;
+		}
+
+		result_code = ReqUtils::ResultCode::Ok;
+		return true;
+	}
+
+	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_new_log_req(
+		const std::string & body,
+		const std::string & username,
+		const Msg::Priority priority);
+
+private:
+	ReqNewLog(
+		const std::string & body,
+		const std::string & username,
+		const Msg::Priority priority)
+	:
+		_msg(body, username, priority)
+	{
+		DIAG(Req, Trace, "ReqNewLog::ctor()");
+	}
+
+	ReqNewLog(
+		Reqs::StrRef body,
+		Reqs::StrRef username,
+		const Msg::Priority priority)
+	:
+		_msg(
+			Msg::MsgBody(body.data(), body.size()),
+			Msg::Username(username.data(), username.size()),
+			priority)
+	{
+		DIAG(Req, Trace, "ReqNewLog::ctor()");
+	}
+
+	Msg _msg; // Non const cuz it's designed to be moved away after serve
+
+};
+
+class ReqNewLogBatch : public ReqBase
+// Many new_logs in one request, logged together under one result code:
+//   new_log_batch <count> <username> <priority> <body length> <body> ...
+// Lengths make the frame unambiguous, so bodies may hold spaces, trailing
+// ones included. The frame is parsed before any sanitizing, so lengths
+// count the bytes as sent; usernames and bodies must be printable.
+{
+public:
+
+	static const char * req_type_str_static()
+	{
+		return "ReqNewLogBatch";
+	}
+
+	virtual const char * req_type_str() const override
+	{
+		return ReqNewLogBatch::req_type_str_static();
+	}
+
+	virtual void write_to_stream(std::ostream & os) const override
+	{
+		os << "[" << req_type_str() << "] [" << _msgs.size() << " msgs]";
+	}
+
+	virtual ~ReqNewLogBatch() override
+	{
+		DIAG(Req, Trace, "ReqNewLogBatch::dtor()");
+	}
+
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream &,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqNewLogBatch::serve()");
+
+		// Straight into the queue, one lock for the lot. Whatever this
+		// client sent through the ring before goes first.
+		q_wrapper.sync_ingest();
+		if (!q_wrapper.push_batch(_msgs))
+		{
+			result_code = ReqUtils::ResultCode::NewLogTooManyUsers;
+			return MsgQueueWrapper::Lock();
+		}
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		WriteAheadLog * wal = q_wrapper.get_wal();
+		if (wal && wal->get_policy().acks_after_sync() && !wal->sync())
+		{
+			result_code = ReqUtils::ResultCode::NewLogNotPersisted;
+		}
+
+		return MsgQueueWrapper::Lock();
+	}
+
+	virtual bool operator==(const ReqBase & b_base) const override
+	{
+		// Return false if dynamic types are different
+		if (typeid(*this) != typeid(b_base))
+		{
+			return false;
+		}
+
+		// Same dynamic type. Downcast then do member-wise comparison
+		const ReqNewLogBatch & b = static_cast<const ReqNewLogBatch &>(b_base);
+
+		return (this->_msgs == b._msgs);
+
+	}
+
+	static std::unique_ptr<ReqNewLogBatch> make_req(Reqs::StrRef args, ReqUtils::ResultCode & result_code)
+	{
+		// All or nothing: one bad record fails the whole frame
+		result_code = ReqUtils::ResultCode::NewLogBatchBadFrame;
+
+		Tokenizer tokenizer(args);
+		size_t count = 0;
+		if (!parse_size(tokenizer.next_token(), count) || count == 0)
+		{
+			return nullptr;
+		}
+
+		// Don't let a made up count reserve more than the frame could hold
+		std::vector<Msg> msgs;
+		msgs.reserve(std::min(count, args.size() / 8));
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			const Reqs::StrRef username = tokenizer.next_token();
+			const Reqs::StrRef pri_str = tokenizer.next_token();
+
+			size_t body_len = 0;
+			if (username.empty() || !parse_size(tokenizer.next_token(), body_len) || body_len == 0)
+			{
+				return nullptr;
+			}
+
+			const Reqs::StrRef msg_body = tokenizer.next_bytes(body_len);
+			const Msg::Priority pri = Msg::get_priority_from_str(pri_str);
+			if (msg_body.empty() || pri == Msg::Priority::Illegal ||
+				Sanitize::find_non_printable(username.data(), username.size()) != username.size() ||
+				Sanitize::find_non_printable(msg_body.data(), msg_body.size()) != msg_body.size())
+			{
+				return nullptr;
+			}
+
+			msgs.emplace_back(
+				Msg::MsgBody(msg_body.data(), msg_body.size()),
+				Msg::Username(username.data(), username.size()),
+				pri);
+		}
+
+		tokenizer.skip_whitespace();
+		if (!tokenizer.rest().empty())
+		{
+			return nullptr;
+		}
+
+		DIAG(Parse, Trace, "new_log_batch args: [" << msgs.size() << " records]");
+
+		result_code = ReqUtils::ResultCode::Ok;
+		return std::unique_ptr<ReqNewLogBatch>(new ReqNewLogBatch(std::move(msgs)));
+	}
+
+	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_new_log_batch_req(const std::vector<Msg> & msgs);
+
+private:
+	explicit ReqNewLogBatch(std::vector<Msg> msgs)
+	:
+		_msgs(std::move(msgs))
+	{
+		DIAG(Req, Trace, "ReqNewLogBatch::ctor()");
+	}
+
+	const std::vector<Msg> _msgs;
+
+};
+
+class DumpStream : public ReplyStream
+// The messages a dump_all or dump_range asked for, a chunk at a time, off
+// a snapshot taken when the dump came in: formatting never locks the
+// store, and later messages don't make the dump longer.
+{
+public:
+
+	DumpStream(const MsgQueueWrapper & q_wrapper, Msg::Priority pri, const TimeRange & range = TimeRange()) :
+		_snapshot(q_wrapper.get_snapshot()),
+		_pri(pri),
+		_range(range),
+		_from_seq(0)
+	{}
+
+	virtual bool next_chunk(std::string & out, size_t max_bytes) override
+	{
+		// Straight into out, no stream nor copy in between
+		const size_t start = out.size();
+		_from_seq = _snapshot.visit(
+			[&out, start, max_bytes](const MsgView & msg)
+			{
+				MsgFormat::append_line(out, msg);
+				return out.size() - start < max_bytes;
+			},
+			_pri, _from_seq, std::numeric_limits<Msg::Seq>::max(), _range);
+
+		return _from_seq < _snapshot.get_end_seq();
+	}
+
+private:
+
+	const MsgQueueWrapper::Snapshot _snapshot;
+	const Msg::Priority _pri;
+	const TimeRange _range;
+	Msg::Seq _from_seq;
+};
+
+class ReqDumpAll : public ReqBase
+{
+public:
+
+	static const char * req_type_str_static()
+	{
+		return "ReqDumpAll";
+	}
+
+	virtual const char * req_type_str() const override
+	{
+		return ReqDumpAll::req_type_str_static();
+	}
+
+	virtual void write_to_stream(std::ostream & os) const override
+	{
+		os << "[" << req_type_str() << "] [" << Msg::get_priority_str(_pri) << "]";
+	}
+
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream & os,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqDumpAll::serve()");
+
+		// Include whatever this client sent right before
+		q_wrapper.sync_ingest();
+
+		// Off a snapshot, new_logs carry on meanwhile
+		q_wrapper.dump_to_stream(os, _pri);
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		return MsgQueueWrapper::Lock();
+
+	}
+
+	virtual std::unique_ptr<ReplyStream> serve_streamed(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream &,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqDumpAll::serve_streamed()");
+
+		q_wrapper.sync_ingest();
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		return std::unique_ptr<ReplyStream>(new DumpStream(q_wrapper, _pri));
+	}
+
+	virtual bool operator==(const ReqBase & b_base) const override
+	{
+		// Return false if dynamic types are different
+		if (typeid(*this) != typeid(b_base))
+		{
+			return false;
+		}
+
+		// Same dynamic type. Downcast then do member-wise comparison
+		const ReqDumpAll & b = static_cast<const ReqDumpAll &>(b_base);
+
+		return (this->_pri == b._pri);
+
+	}
+
+	virtual ~ReqDumpAll() override
+	{
+		DIAG(Req, Trace, "ReqDumpAll::dtor()");
+	}
+
+	static std::unique_ptr<ReqDumpAll> make_req(Reqs::StrRef args, ReqUtils::ResultCode & result_code)
+	{
+		// Command Format:
+		// dump_all <priority>
+		//
+		// priority: One of the following (low to high): debug, info, warning, critical, error
+
+		Tokenizer tokenizer(args);
+		const Reqs::StrRef pri_str = tokenizer.next_token();
+
+		DIAG(Parse, Trace, "dump_all args: [" << pri_str << "]");
+
+		if (pri_str.empty())
+		{
+			result_code = ReqUtils::ResultCode::DumpAllTooFewArgs;
+			return nullptr;
+		}
+
+		const Msg::Priority pri = Msg::get_priority_from_str(pri_str);
+
+		if (pri == Msg::Priority::Illegal)
+		{
+			result_code = ReqUtils::ResultCode::DumpAllWrongPriority;
+			return nullptr;
+		}
+
+		auto new_uptr = std::unique_ptr<ReqDumpAll>(new ReqDumpAll(pri));
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		DIAG(Req, Trace, "Parsed " << *new_uptr);
+
+		return new_uptr;
+	}
+
+	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_dump_all_req(const Msg::Priority pri);
+
+	friend Reqs::ReqBaseUnqPtr Reqs::parse_req_frame(
+		const WireFormat::Frame & frame,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
+
+
+private:
+	ReqDumpAll(const Msg::Priority pri)
+	:	_pri(pri)
+	{
+		DIAG(Req, Trace, "ReqDumpAll::ctor()");
+	}
+
+	const Msg::Priority _pri;
+
+};
+
+class MatchDumpStream : public ReplyStream
+// DumpStream for a dump_user or a search: the same chunks, off a MatchSnapshot
+{
+public:
+
+	explicit MatchDumpStream(MsgQueueWrapper::MatchSnapshot snapshot) :
+		_snapshot(std::move(snapshot)),
+		_from_seq(0)
+	{}
+
+	virtual bool next_chunk(std::string & out, size_t max_bytes) override
+	{
+		const size_t start = out.size();
+		_from_seq = _snapshot.visit(
+			[&out, start, max_bytes](const MsgView & msg)
+			{
+				MsgFormat::append_line(out, msg);
+				return out.size() - start < max_bytes;
+			},
+			_from_seq);
+
+		return _from_seq < _snapshot.get_end_seq();
+	}
+
+private:
+
+	const MsgQueueWrapper::MatchSnapshot _snapshot;
+	Msg::Seq _from_seq;
+};
+
+class ReqDumpUser : public ReqBase
+// dump_all narrowed down to one user, served off the username index
+{
+public:
+
+	static const char * req_type_str_static()
+	{
+		return "ReqDumpUser";
+	}
+
+	virtual const char * req_type_str() const override
+	{
+		return ReqDumpUser::req_type_str_static();
+	}
+
+	virtual void write_to_stream(std::ostream & os) const override
+	{
+		os << "[" << req_type_str() << "] [" << _username << "] [" << Msg::get_priority_str(_pri) << "]";
+	}
+
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream & os,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqDumpUser::serve()");
+
+		q_wrapper.sync_ingest();
+
+		MsgFormat::StreamWriter writer(os);
+		q_wrapper.get_user_snapshot(_username, _pri).visit(
+			[&writer](const MsgView & msg)
+			{
+				writer.add(msg);
+				return true;
+			});
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		return MsgQueueWrapper::Lock();
+	}
+
+	virtual std::unique_ptr<ReplyStream> serve_streamed(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream &,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqDumpUser::serve_streamed()");
+
+		q_wrapper.sync_ingest();
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		return std::unique_ptr<ReplyStream>(new MatchDumpStream(q_wrapper.get_user_snapshot(_username, _pri)));
+	}
+
+	virtual bool operator==(const ReqBase & b_base) const override
+	{
+		// Return false if dynamic types are different
+		if (typeid(*this) != typeid(b_base))
+		{
+			return false;
+		}
+
+		// Same dynamic type. Downcast then do member-wise comparison
+		const ReqDumpUser & b = static_cast<const ReqDumpUser &>(b_base);
+
+		return (this->_username == b._username) && (this->_pri == b._pri);
+	}
+
+	virtual ~ReqDumpUser() override
+	{
+		DIAG(Req, Trace, "ReqDumpUser::dtor()");
+	}
+
+	static std::unique_ptr<ReqDumpUser> make_req(Reqs::StrRef args, ReqUtils::ResultCode & result_code)
+	{
+		// Command Format:
+		// dump_user <username> <priority>
+		//
+		// username: Exactly as it was logged
+		// priority: One of the following (low to high): debug, info, warning, critical, error
+
+		Tokenizer tokenizer(args);
+		const Reqs::StrRef username = tokenizer.next_token();
+		const Reqs::StrRef pri_str = tokenizer.next_token();
+
+		DIAG(Parse, Trace, "dump_user args: [" << username << "] [" << pri_str << "]");
+
+		if (pri_str.empty())
+		{
+			result_code = ReqUtils::ResultCode::DumpUserTooFewArgs;
+			return nullptr;
+		}
+
+		const Msg::Priority pri = Msg::get_priority_from_str(pri_str);
+
+		if (pri == Msg::Priority::Illegal)
+		{
+			result_code = ReqUtils::ResultCode::DumpUserWrongPriority;
+			return nullptr;
+		}
+
+		auto new_uptr = std::unique_ptr<ReqDumpUser>(new ReqDumpUser(username.to_string(), pri));
 
-	bool first = true;
-	for (const auto & capture_group : matches)
-	{
-		if (!first)
-			oss << "Captured: [" << capture_group << "]\n";
-		first = false;
+		result_code = ReqUtils::ResultCode::Ok;
+
+		DIAG(Req, Trace, "Parsed " << *new_uptr);
+
+		return new_uptr;
 	}
-	oss << "Suffix: [" << matches.suffix() << "]\n";
 
-	return oss.str();
-}
+	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_dump_user_req(const std::string & username, const Msg::Priority pri);
 
-}
+	friend Reqs::ReqBaseUnqPtr Reqs::parse_req_frame(
+		const WireFormat::Frame & frame,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
 
 
-// Local Scope Class Definitions ////////////////////////////////////
+private:
+	ReqDumpUser(std::string username, const Msg::Priority pri)
+	:	_username(std::move(username)),
+		_pri(pri)
+	{
+		DIAG(Req, Trace, "ReqDumpUser::ctor()");
+	}
 
+	const std::string _username;
+	const Msg::Priority _pri;
 
-class ReqNewLog : public ReqBase
+};
+
+class ReqDumpRange : public ReqBase
+// dump_all narrowed down to a span of ingest times, served off the blocks'
+// and segments' time summaries
 {
 public:
 
 	static const char * req_type_str_static()
 	{
-		return "ReqNewLog";
+		return "ReqDumpRange";
 	}
 
 	virtual const char * req_type_str() const override
 	{
-		return ReqNewLog::req_type_str_static();
+		return ReqDumpRange::req_type_str_static();
 	}
 
 	virtual void write_to_stream(std::ostream & os) const override
 	{
-		os << "[" << req_type_str() << "] [" << _msg << "]";
+		os << "[" << req_type_str() << "] [" << _range.from_ms << "] [" << _range.to_ms << "] ["
+			<< Msg::get_priority_str(_pri) << "]";
 	}
 
-	virtual ~ReqNewLog() override
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream & os,
+		ReqUtils::ResultCode & result_code) override
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqNewLog::dtor()\n";
-		}
+		DIAG(Req, Trace, "ReqDumpRange::serve()");
+
+		q_wrapper.sync_ingest();
+
+		q_wrapper.dump_to_stream(os, _pri, _range);
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		return MsgQueueWrapper::Lock();
 	}
 
-	virtual MsgQueueWrapper::Lock serve(MsgQueueWrapper & q_wrapper, std::ostream &) override
+	virtual std::unique_ptr<ReplyStream> serve_streamed(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream &,
+		ReqUtils::ResultCode & result_code) override
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqNewLog::serve()\n";
-		}
+		DIAG(Req, Trace, "ReqDumpRange::serve_streamed()");
 
-		auto lock = q_wrapper.get_lock();
+		q_wrapper.sync_ingest();
 
-		auto & q = q_wrapper.get_queue();
-		q.push_back(std::move(_msg));
+		result_code = ReqUtils::ResultCode::Ok;
 
-		return lock;
+		return std::unique_ptr<ReplyStream>(new DumpStream(q_wrapper, _pri, _range));
 	}
 
 	virtual bool operator==(const ReqBase & b_base) const override
@@ -120,118 +924,137 @@ public:
 		}
 
 		// Same dynamic type. Downcast then do member-wise comparison
-		const ReqNewLog & b = static_cast<const ReqNewLog &>(b_base);
+		const ReqDumpRange & b = static_cast<const ReqDumpRange &>(b_base);
 
-		return (this->_msg == b._msg);
+		return (this->_range.from_ms == b._range.from_ms) && (this->_range.to_ms == b._range.to_ms) &&
+			(this->_pri == b._pri);
+	}
 
+	virtual ~ReqDumpRange() override
+	{
+		DIAG(Req, Trace, "ReqDumpRange::dtor()");
 	}
 
-	static std::unique_ptr<ReqNewLog> make_req(const std::string & args, ReqUtils::ResultCode & result_code)
+	static std::unique_ptr<ReqDumpRange> make_req(Reqs::StrRef args, ReqUtils::ResultCode & result_code)
 	{
-		// Command Format
-		// <username> <priority> <message_body>
-		// username: Anything character that can be matched by (\S+), only printable & non-whitespace
+		// Command Format:
+		// dump_range <from> <to> <priority>
+		//
+		// from, to: Milliseconds since the Unix epoch, to excluded
 		// priority: One of the following (low to high): debug, info, warning, critical, error
-		// message body: anything that's printable! No trailing whitespace
-
-		const unsigned MinGroups = 3;
 
-		std::smatch matches;
-		std::regex rule("^\\s*(\\S+)\\s+(\\S+)\\s+(.+)");
+		Tokenizer tokenizer(args);
+		const Reqs::StrRef from_str = tokenizer.next_token();
+		const Reqs::StrRef to_str = tokenizer.next_token();
+		const Reqs::StrRef pri_str = tokenizer.next_token();
 
-		std::regex_search(args, matches, rule);
+		DIAG(Parse, Trace, "dump_range args: [" << from_str << "] [" << to_str << "] [" << pri_str << "]");
 
-		if (Cfg::regex_debug)
+		if (pri_str.empty())
 		{
-			std::cout << "Request parse result level 2:\n";
-			std::cout << regex_debug(matches);
+			result_code = ReqUtils::ResultCode::DumpRangeTooFewArgs;
+			return nullptr;
 		}
 
-		if (matches.size() < MinGroups + 1)
+		TimeRange range;
+		if (!parse_time(from_str, range.from_ms) || !parse_time(to_str, range.to_ms) || range.to_ms < range.from_ms)
 		{
-			result_code = ReqUtils::ResultCode::NewLogTooFewArgs;
+			result_code = ReqUtils::ResultCode::DumpRangeBadTime;
 			return nullptr;
 		}
 
-		const std::string & username = matches[1];
-		const std::string & pri_str = matches[2];
-		const std::string & msg_body = matches[3];
-
 		const Msg::Priority pri = Msg::get_priority_from_str(pri_str);
 
 		if (pri == Msg::Priority::Illegal)
 		{
-			result_code = ReqUtils::ResultCode::NewLogWrongPriority;
+			result_code = ReqUtils::ResultCode::DumpRangeWrongPriority;
 			return nullptr;
 		}
 
-		auto new_uptr = std::unique_ptr<ReqNewLog>(new ReqNewLog(msg_body, username, pri));
+		auto new_uptr = std::unique_ptr<ReqDumpRange>(new ReqDumpRange(range, pri));
 
 		result_code = ReqUtils::ResultCode::Ok;
 
-		if (Cfg::req_obj_debug_verbose)
-		{
-			std::cout << *new_uptr << std::endl;
-		}
+		DIAG(Req, Trace, "Parsed " << *new_uptr);
 
 		return new_uptr;
 	}
 
-	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_new_log_req(
-		const std::string & body,
-		const std::string & username,
-		const Msg::Priority priority);
+	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_dump_range_req(const TimeRange & range, const Msg::Priority pri);
+
+	friend Reqs::ReqBaseUnqPtr Reqs::parse_req_frame(
+		const WireFormat::Frame & frame,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
+
 
 private:
-	ReqNewLog(
-		const std::string & body,
-		const std::string & username,
-		const Msg::Priority priority)
-	:
-		_msg(body, username, priority)
+	ReqDumpRange(const TimeRange & range, const Msg::Priority pri)
+	:	_range(range),
+		_pri(pri)
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqNewLog::ctor()\n";
-		}
+		DIAG(Req, Trace, "ReqDumpRange::ctor()");
 	}
 
-	Msg _msg; // Non const cuz it's designed to be moved away after serve
+	const TimeRange _range;
+	const Msg::Priority _pri;
 
 };
 
-class ReqDumpAll : public ReqBase
+class ReqSearch : public ReqBase
+// The messages holding a term, served off the blocks' token indexes
 {
 public:
 
 	static const char * req_type_str_static()
 	{
-		return "ReqDumpAll";
+		return "ReqSearch";
 	}
 
 	virtual const char * req_type_str() const override
 	{
-		return ReqDumpAll::req_type_str_static();
+		return ReqSearch::req_type_str_static();
 	}
 
 	virtual void write_to_stream(std::ostream & os) const override
 	{
-		os << "[" << req_type_str() << "] [" << Msg::get_priority_str(_pri) << "]";
+		os << "[" << req_type_str() << "] [" << _term.get_text() << "] [" << Msg::get_priority_str(_pri) << "]";
 	}
 
-	virtual MsgQueueWrapper::Lock serve(MsgQueueWrapper & q_wrapper, std::ostream & os) override
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream & os,
+		ReqUtils::ResultCode & result_code) override
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqDumpAll::serve()\n";
-		}
+		DIAG(Req, Trace, "ReqSearch::serve()");
 
-		auto lock = q_wrapper.get_lock();
+		q_wrapper.sync_ingest();
 
-		q_wrapper.dump_to_stream(os, _pri);
+		MsgFormat::StreamWriter writer(os);
+		q_wrapper.get_search_snapshot(_term, _pri).visit(
+			[&writer](const MsgView & msg)
+			{
+				writer.add(msg);
+				return true;
+			});
 
-		return lock;
+		result_code = ReqUtils::ResultCode::Ok;
+
+		return MsgQueueWrapper::Lock();
+	}
+
+	virtual std::unique_ptr<ReplyStream> serve_streamed(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream &,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqSearch::serve_streamed()");
+
+		q_wrapper.sync_ingest();
+
+		result_code = ReqUtils::ResultCode::Ok;
 
+		return std::unique_ptr<ReplyStream>(new MatchDumpStream(q_wrapper.get_search_snapshot(_term, _pri)));
 	}
 
 	virtual bool operator==(const ReqBase & b_base) const override
@@ -243,81 +1066,77 @@ public:
 		}
 
 		// Same dynamic type. Downcast then do member-wise comparison
-		const ReqDumpAll & b = static_cast<const ReqDumpAll &>(b_base);
-
-		return (this->_pri == b._pri);
+		const ReqSearch & b = static_cast<const ReqSearch &>(b_base);
 
+		return (this->_term.get_text() == b._term.get_text()) && (this->_pri == b._pri);
 	}
 
-	virtual ~ReqDumpAll() override
+	virtual ~ReqSearch() override
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqDumpAll::dtor()\n";
-		}
+		DIAG(Req, Trace, "ReqSearch::dtor()");
 	}
 
-	static std::unique_ptr<ReqDumpAll> make_req(const std::string & args, ReqUtils::ResultCode & result_code)
+	static std::unique_ptr<ReqSearch> make_req(Reqs::StrRef args, ReqUtils::ResultCode & result_code)
 	{
 		// Command Format:
-		// dump_all <priority>
+		// search <term> [priority]
 		//
-		// priority: One of the following (low to high): debug, info, warning, critical, error
-
-		const unsigned MinGroups = 1;
+		// term: One or more words, joined by anything but whitespace, matched case-insensitively
+		// priority: One of the following (low to high): debug, info, warning, critical, error. Defaults to debug.
 
-		std::smatch matches;
-		std::regex rule("^\\s*(\\S+)\\s*");
+		Tokenizer tokenizer(args);
+		const Reqs::StrRef term_str = tokenizer.next_token();
+		const Reqs::StrRef pri_str = tokenizer.next_token();
 
-		std::regex_search(args, matches, rule);
+		DIAG(Parse, Trace, "search args: [" << term_str << "] [" << pri_str << "]");
 
-		if (Cfg::regex_debug)
+		if (term_str.empty())
 		{
-			std::cout << "Request parse result level 2:\n";
-			std::cout << regex_debug(matches);
+			result_code = ReqUtils::ResultCode::SearchTooFewArgs;
+			return nullptr;
 		}
 
-		if (matches.size() < MinGroups + 1)
+		const Msg::Priority pri = pri_str.empty() ? Msg::Priority::Debug : Msg::get_priority_from_str(pri_str);
+
+		if (pri == Msg::Priority::Illegal)
 		{
-			result_code = ReqUtils::ResultCode::DumpAllTooFewArgs;
+			result_code = ReqUtils::ResultCode::SearchWrongPriority;
 			return nullptr;
 		}
 
-		const std::string & pri_str = matches[1];
-
-		const Msg::Priority pri = Msg::get_priority_from_str(pri_str);
-
-		if (pri == Msg::Priority::Illegal)
+		Search::Term term(term_str);
+		if (term.empty())
 		{
-			result_code = ReqUtils::ResultCode::DumpAllWrongPriority;
+			result_code = ReqUtils::ResultCode::SearchBadTerm;
 			return nullptr;
 		}
 
-		auto new_uptr = std::unique_ptr<ReqDumpAll>(new ReqDumpAll(pri));
+		auto new_uptr = std::unique_ptr<ReqSearch>(new ReqSearch(std::move(term), pri));
 
 		result_code = ReqUtils::ResultCode::Ok;
 
-		if (Cfg::req_obj_debug_verbose)
-		{
-			std::cout << *new_uptr << std::endl;
-		}
+		DIAG(Req, Trace, "Parsed " << *new_uptr);
 
 		return new_uptr;
 	}
 
-	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_dump_all_req(const Msg::Priority pri);
+	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_search_req(const std::string & term, const Msg::Priority pri);
+
+	friend Reqs::ReqBaseUnqPtr Reqs::parse_req_frame(
+		const WireFormat::Frame & frame,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
 
 
 private:
-	ReqDumpAll(const Msg::Priority pri)
-	:	_pri(pri)
+	ReqSearch(Search::Term term, const Msg::Priority pri)
+	:	_term(std::move(term)),
+		_pri(pri)
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqDumpAll::ctor()\n";
-		}
+		DIAG(Req, Trace, "ReqSearch::ctor()");
 	}
 
+	const Search::Term _term;
 	const Msg::Priority _pri;
 
 };
@@ -341,27 +1160,25 @@ public:
 		os << "[" << req_type_str() << "]";
 	}
 
-	virtual MsgQueueWrapper::Lock serve(MsgQueueWrapper & q_wrapper, std::ostream &) override
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream &,
+		ReqUtils::ResultCode & result_code) override
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqDeleteAll::serve()\n";
-		}
+		DIAG(Req, Trace, "ReqDeleteAll::serve()");
 
-		auto lock = q_wrapper.get_lock();
+		// Also wipe what's still in flight in the ingest ring
+		q_wrapper.sync_ingest();
+		q_wrapper.clear();
 
-		auto & q = q_wrapper.get_queue();
-		q.clear();
+		result_code = ReqUtils::ResultCode::Ok;
 
-		return lock;
+		return MsgQueueWrapper::Lock();
 	}
 
 	virtual ~ReqDeleteAll() override
 	{
-		if (Cfg::req_obj_debug)
-		{
-			std::cout << "ReqDeleteAll::dtor()\n";
-		}
+		DIAG(Req, Trace, "ReqDeleteAll::dtor()");
 	}
 
 	virtual bool operator==(const ReqBase & b_base) const override
@@ -387,24 +1204,107 @@ public:
 
 		result_code = ReqUtils::ResultCode::Ok;
 
-		if (Cfg::req_obj_debug_verbose)
-		{
-			std::cout << *new_uptr << std::endl;
-		}
+		DIAG(Req, Trace, "Parsed " << *new_uptr);
 
 		return new_uptr;
 	}
 
 	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_delete_all_req();
 
+	friend Reqs::ReqBaseUnqPtr Reqs::parse_req_frame(
+		const WireFormat::Frame & frame,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
+
 
 private:
 	ReqDeleteAll()
 	{
-		if (Cfg::req_obj_debug)
+		DIAG(Req, Trace, "ReqDeleteAll::ctor()");
+	}
+
+};
+
+
+class ReqStats : public ReqBase
+// The server's metrics, the same text the metrics port serves
+{
+public:
+
+	static const char * req_type_str_static()
+	{
+		return "ReqStats";
+	}
+
+	virtual const char * req_type_str() const override
+	{
+		return ReqStats::req_type_str_static();
+	}
+
+	virtual void write_to_stream(std::ostream & os) const override
+	{
+		os << "[" << req_type_str() << "]";
+	}
+
+	virtual MsgQueueWrapper::Lock serve(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream & os,
+		ReqUtils::ResultCode & result_code) override
+	{
+		DIAG(Req, Trace, "ReqStats::serve()");
+
+		Metrics::write_to_stream(os, q_wrapper);
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		return MsgQueueWrapper::Lock();
+	}
+
+	virtual ~ReqStats() override
+	{
+		DIAG(Req, Trace, "ReqStats::dtor()");
+	}
+
+	virtual bool operator==(const ReqBase & b_base) const override
+	{
+		// Return false if dynamic types are different
+
+		// Keep the syntax this way! For consistency with other subclasses.
+		if (typeid(*this) != typeid(b_base))
 		{
-			std::cout << "ReqDeleteAll::ctor()\n";
+			return false;
 		}
+
+		return true;
+	}
+
+	static std::unique_ptr<ReqStats> make_req(ReqUtils::ResultCode & result_code)
+	{
+		// Command Format:
+		// stats
+		//
+
+		auto new_uptr = std::unique_ptr<ReqStats>(new ReqStats);
+
+		result_code = ReqUtils::ResultCode::Ok;
+
+		DIAG(Req, Trace, "Parsed " << *new_uptr);
+
+		return new_uptr;
+	}
+
+	friend Reqs::ReqBaseUnqPtr ReqsUnitTestsUtils::make_stats_req();
+
+	friend Reqs::ReqBaseUnqPtr Reqs::parse_req_frame(
+		const WireFormat::Frame & frame,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
+
+
+private:
+	ReqStats()
+	{
+		DIAG(Req, Trace, "ReqStats::ctor()");
 	}
 
 };
@@ -413,48 +1313,34 @@ private:
 // Exported Functions ///////////////////////////////////////////////
 
 
-Reqs::ReqBaseUnqPtr Reqs::parse_req_str(const std::string & req_str, ReqUtils::ResultCode & result_code)
+Reqs::ReqBaseUnqPtr Reqs::parse_req_str(StrRef req_str, ReqUtils::ResultCode & result_code)
 {
 	// Step 1: Break down the request string.
 
 	// String format:
 	// <ReqType> <Args...>
-	//		ReqType: One of the following: new_log, dump_all, delete_all
+	//		ReqType: One of the following: new_log, new_log_batch, dump_all, dump_user, dump_range, search, delete_all, stats
 	//		Args: Send to subclass for processing. Must conform to the subtype's argument format
 
 	// Set result string to an initial value...
 	result_code = ReqUtils::ResultCode::UnknownError;
 
-	const unsigned MinCaptures = 1;
-
-	std::smatch matches;
-	std::regex rule("^\\s*(\\S+)\\s*");
+	Tokenizer tokenizer(req_str);
+	const StrRef req_type_str = tokenizer.next_token();
+	tokenizer.skip_whitespace();
+	const StrRef additional_args = tokenizer.rest();
 
-	std::regex_search(req_str, matches, rule);
-
-	if (Cfg::regex_debug)
-	{
-		std::cout << "Request parse result level 1:\n";
-		std::cout << regex_debug(matches);
-	}
+	DIAG(Parse, Trace, "Request type: [" << req_type_str << "] args: [" << additional_args << "]");
 
 	// Step 2: Process first 2 common fields: request type, and username
 
-
-
 	// Early exit due to not enough arguments?
-	if (matches.size() < MinCaptures + 1)
-		// Note: matches[0] is entire match. Capture groups start from i=1.
+	if (req_type_str.empty())
 	{
 		result_code = ReqUtils::ResultCode::TooFewArgs;
 		return nullptr;
 	}
 
-	// First two fields correct. Keep going!
-	const std::string & req_type_str = matches[1];
-	//const std::string & username_str = matches[1];
-	const std::string & additional_args = matches.suffix();
-
 	ReqType req_type = get_req_type(req_type_str);
 
 	ReqBaseUnqPtr req_obj_ptr;
@@ -469,14 +1355,34 @@ Reqs::ReqBaseUnqPtr Reqs::parse_req_str(const std::string & req_str, ReqUtils::R
 			req_obj_ptr = ReqBaseUnqPtr(ReqNewLog::make_req(additional_args, result_code));
 			break;
 
+		case ReqType::NewLogBatch:
+			req_obj_ptr = ReqBaseUnqPtr(ReqNewLogBatch::make_req(additional_args, result_code));
+			break;
+
 		case ReqType::DumpAll:
 			req_obj_ptr = ReqBaseUnqPtr(ReqDumpAll::make_req(additional_args, result_code));
 			break;
 
+		case ReqType::DumpUser:
+			req_obj_ptr = ReqBaseUnqPtr(ReqDumpUser::make_req(additional_args, result_code));
+			break;
+
+		case ReqType::DumpRange:
+			req_obj_ptr = ReqBaseUnqPtr(ReqDumpRange::make_req(additional_args, result_code));
+			break;
+
+		case ReqType::Search:
+			req_obj_ptr = ReqBaseUnqPtr(ReqSearch::make_req(additional_args, result_code));
+			break;
+
 		case ReqType::DeleteAll:
 			req_obj_ptr = ReqBaseUnqPtr(ReqDeleteAll::make_req(result_code));
 			break;
 
+		case ReqType::Stats:
+			req_obj_ptr = ReqBaseUnqPtr(ReqStats::make_req(result_code));
+			break;
+
 		case ReqType::Illegal:
 		default:
 			req_obj_ptr = nullptr;
@@ -487,6 +1393,193 @@ Reqs::ReqBaseUnqPtr Reqs::parse_req_str(const std::string & req_str, ReqUtils::R
 	return req_obj_ptr;
 }
 
+Reqs::ReqBaseUnqPtr Reqs::parse_req_str(
+	StrRef req_str,
+	std::vector<MsgView> & new_logs,
+	ReqUtils::ResultCode & result_code)
+{
+	Tokenizer tokenizer(req_str);
+	if (get_req_type(tokenizer.next_token()) != ReqType::NewLog)
+	{
+		return parse_req_str(req_str, result_code);
+	}
+	tokenizer.skip_whitespace();
+
+	StrRef username;
+	StrRef msg_body;
+	Msg::Priority pri;
+	if (ReqNewLog::parse_args(tokenizer.rest(), username, msg_body, pri, result_code))
+	{
+		new_logs.emplace_back(msg_body, username, pri, 0);
+	}
+	return nullptr;
+}
+
+bool Reqs::is_length_prefixed(StrRef line)
+{
+	return get_req_type(Tokenizer(line).next_token()) == ReqType::NewLogBatch;
+}
+
+void Reqs::serve_new_logs(
+	MsgQueueWrapper & q_wrapper,
+	const std::vector<MsgView> & msgs,
+	std::vector<ReqUtils::ResultCode> & result_codes)
+{
+	result_codes.assign(msgs.size(), ReqUtils::ResultCode::Ok);
+
+	// The ring takes them one by one, each may find it full
+	IngestRing * ingest_ring = get_new_log_ring(q_wrapper);
+	if (ingest_ring)
+	{
+		for (size_t i = 0; i < msgs.size(); ++i)
+		{
+			if (!ingest_ring->push(msgs[i].to_msg()))
+			{
+				result_codes[i] = ReqUtils::ResultCode::NewLogQueueFull;
+			}
+		}
+		return;
+	}
+
+	q_wrapper.sync_ingest();
+	if (!q_wrapper.push_batch(msgs))
+	{
+		// Some username found no room: one by one, the others still go in
+		for (size_t i = 0; i < msgs.size(); ++i)
+		{
+			if (!q_wrapper.push(msgs[i].get_msg(), msgs[i].get_username(), msgs[i].get_priority()).owns_lock())
+			{
+				result_codes[i] = ReqUtils::ResultCode::NewLogTooManyUsers;
+			}
+		}
+	}
+
+	WriteAheadLog * wal = q_wrapper.get_wal();
+	if (wal && wal->get_policy().acks_after_sync() && !wal->sync())
+	{
+		std::replace(result_codes.begin(), result_codes.end(),
+			ReqUtils::ResultCode::Ok, ReqUtils::ResultCode::NewLogNotPersisted);
+	}
+}
+
+Reqs::ReqBaseUnqPtr Reqs::parse_req_frame(
+	const WireFormat::Frame & frame,
+	std::vector<MsgView> & new_logs,
+	ReqUtils::ResultCode & result_code)
+{
+	const Msg::Priority pri = (frame.priority < uint8_t(Msg::Priority::Max)) ?
+		Msg::Priority(frame.priority) :
+		Msg::Priority::Illegal;
+
+	switch (WireFormat::FrameType(frame.type))
+	{
+		case WireFormat::FrameType::NewLog:
+			if (frame.username.empty() || frame.body.empty())
+			{
+				result_code = ReqUtils::ResultCode::NewLogTooFewArgs;
+			}
+			else if (pri == Msg::Priority::Illegal)
+			{
+				result_code = ReqUtils::ResultCode::NewLogWrongPriority;
+			}
+			// What a text new_log can't hold either: a '\n' in a body would
+			// forge lines in text dumps, a ' ' makes a username dump_user can't name
+			else if (Sanitize::find_non_printable(frame.body.data(), frame.body.size()) != frame.body.size() ||
+				Sanitize::find_non_printable(frame.username.data(), frame.username.size()) != frame.username.size() ||
+				frame.username.find(' ') != Reqs::StrRef::npos)
+			{
+				result_code = ReqUtils::ResultCode::NewLogBadBytes;
+			}
+			else
+			{
+				new_logs.emplace_back(frame.body, frame.username, pri, 0);
+				result_code = ReqUtils::ResultCode::Ok;
+			}
+			return nullptr;
+
+		case WireFormat::FrameType::DumpAll:
+			if (pri == Msg::Priority::Illegal)
+			{
+				result_code = ReqUtils::ResultCode::DumpAllWrongPriority;
+				return nullptr;
+			}
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqBaseUnqPtr(new ReqDumpAll(pri));
+
+		case WireFormat::FrameType::DeleteAll:
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqBaseUnqPtr(new ReqDeleteAll);
+
+		case WireFormat::FrameType::Stats:
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqBaseUnqPtr(new ReqStats);
+
+		case WireFormat::FrameType::DumpUser:
+			if (frame.username.empty())
+			{
+				result_code = ReqUtils::ResultCode::DumpUserTooFewArgs;
+				return nullptr;
+			}
+			if (pri == Msg::Priority::Illegal)
+			{
+				result_code = ReqUtils::ResultCode::DumpUserWrongPriority;
+				return nullptr;
+			}
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqBaseUnqPtr(new ReqDumpUser(frame.username.to_string(), pri));
+
+		case WireFormat::FrameType::DumpRange:
+		{
+			if (frame.body.size() != 2 * sizeof(Msg::Time))
+			{
+				result_code = ReqUtils::ResultCode::DumpRangeTooFewArgs;
+				return nullptr;
+			}
+			TimeRange range;
+			range.from_ms = WireFormat::load_le64(frame.body.data());
+			range.to_ms = WireFormat::load_le64(frame.body.data() + sizeof(Msg::Time));
+			if (range.to_ms < range.from_ms)
+			{
+				result_code = ReqUtils::ResultCode::DumpRangeBadTime;
+				return nullptr;
+			}
+			if (pri == Msg::Priority::Illegal)
+			{
+				result_code = ReqUtils::ResultCode::DumpRangeWrongPriority;
+				return nullptr;
+			}
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqBaseUnqPtr(new ReqDumpRange(range, pri));
+		}
+
+		case WireFormat::FrameType::Search:
+		{
+			if (frame.body.empty())
+			{
+				result_code = ReqUtils::ResultCode::SearchTooFewArgs;
+				return nullptr;
+			}
+			if (pri == Msg::Priority::Illegal)
+			{
+				result_code = ReqUtils::ResultCode::SearchWrongPriority;
+				return nullptr;
+			}
+			Search::Term term(frame.body);
+			if (term.empty())
+			{
+				result_code = ReqUtils::ResultCode::SearchBadTerm;
+				return nullptr;
+			}
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqBaseUnqPtr(new ReqSearch(std::move(term), pri));
+		}
+
+		default:
+			result_code = ReqUtils::ResultCode::UnknownReqType;
+			return nullptr;
+	}
+}
+
 
 namespace ReqsUnitTestsUtils
 {
@@ -499,14 +1592,56 @@ Reqs::ReqBaseUnqPtr make_new_log_req(
 	return Reqs::ReqBaseUnqPtr(new ReqNewLog(body, username, priority));
 }
 
+Reqs::ReqBaseUnqPtr make_new_log_batch_req(const std::vector<Msg> & msgs)
+{
+	return Reqs::ReqBaseUnqPtr(new ReqNewLogBatch(msgs));
+}
+
+std::string make_new_log_batch_str(const std::vector<Msg> & msgs)
+{
+	std::string str = "new_log_batch " + std::to_string(msgs.size());
+	for (const Msg & msg : msgs)
+	{
+		str += ' ';
+		str += msg.get_username();
+		str += ' ';
+		str += Msg::get_priority_str(msg.get_priority());
+		str += ' ';
+		str += std::to_string(msg.get_msg().size());
+		str += ' ';
+		str += msg.get_msg();
+	}
+	return str;
+}
+
 Reqs::ReqBaseUnqPtr make_dump_all_req(const Msg::Priority pri)
 {
 	return Reqs::ReqBaseUnqPtr(new ReqDumpAll(pri));
 }
 
+Reqs::ReqBaseUnqPtr make_dump_user_req(const std::string & username, const Msg::Priority pri)
+{
+	return Reqs::ReqBaseUnqPtr(new ReqDumpUser(username, pri));
+}
+
+Reqs::ReqBaseUnqPtr make_dump_range_req(const TimeRange & range, const Msg::Priority pri)
+{
+	return Reqs::ReqBaseUnqPtr(new ReqDumpRange(range, pri));
+}
+
+Reqs::ReqBaseUnqPtr make_search_req(const std::string & term, const Msg::Priority pri)
+{
+	return Reqs::ReqBaseUnqPtr(new ReqSearch(Search::Term(term), pri));
+}
+
 Reqs::ReqBaseUnqPtr make_delete_all_req()
 {
 	return Reqs::ReqBaseUnqPtr(new ReqDeleteAll);
 }
 
+Reqs::ReqBaseUnqPtr make_stats_req()
+{
+	return Reqs::ReqBaseUnqPtr(new ReqStats);
+}
+
 };
@@ -7,7 +7,10 @@
 #include <memory>
 #include <vector>
 
+#include <boost/utility/string_ref.hpp>
+
 #include "msgs.hh"
+#include "wire.hh"
 
 
 class MsgQueueWrapper;
@@ -16,29 +19,109 @@ class GlobalMsgQueue;
 namespace ReqUtils
 {
 
+	// The one place result codes are defined: X(<enumerator>, <long description>).
+	// The short string sent back to clients is the enumerator's name. A
+	// binary reply sends the position instead, so new codes go at the end.
+	#define LOGGER_RESULT_CODES(X) \
+		X(Ok, \
+			"Big success!") \
+		X(TooFewArgs, \
+			"Too few arguments. Please start the request with argument: <request_type>, " \
+			"which can be one of the following: new_log, new_log_batch, dump_all, dump_user, dump_range, search, delete_all, stats") \
+		X(NewLogTooFewArgs, \
+			"Too few arguments for request type \"new_log\". Usage: " \
+			"new_log <username (no whitespace)> <priority (debug/info/warning/critical/error)> " \
+			"<message body, anything but no leading or trailing whitespace>") \
+		X(NewLogWrongPriority, \
+			"Invalid priority string for request type \"new_log\". Choose one of the following: " \
+			"debug/info/warning/critical/error") \
+		X(NewLogQueueFull, \
+			"The server's ingest queue is full and the message was rejected. Please retry later.") \
+		X(NewLogNotPersisted, \
+			"The message was accepted but the server failed to write it to disk.") \
+		X(NewLogBatchBadFrame, \
+			"Malformed frame for request type \"new_log_batch\". Usage: " \
+			"new_log_batch <number of records> followed by that many records of " \
+			"<username> <priority> <body length in bytes> <body>. Nothing was logged.") \
+		X(DumpAllTooFewArgs, \
+			"Too few arguments for request type \"dump_all\". Usage: " \
+			"dump_all <priority (debug/info/warning/critical/error)>") \
+		X(DumpAllWrongPriority, \
+			"Invalid priority string for request type \"dump_all\". Choose one of the following: " \
+			"debug/info/warning/critical/error") \
+		X(UnknownReqType, \
+			"Unknown request type. Available request types are: new_log, new_log_batch, dump_all, dump_user, dump_range, search, delete_all, stats") \
+		X(UnknownError, \
+			"Unknown error. Sorry, poor user.") \
+		X(DumpUserTooFewArgs, \
+			"Too few arguments for request type \"dump_user\". Usage: " \
+			"dump_user <username> <priority (debug/info/warning/critical/error)>") \
+		X(DumpUserWrongPriority, \
+			"Invalid priority string for request type \"dump_user\". Choose one of the following: " \
+			"debug/info/warning/critical/error") \
+		X(DumpRangeTooFewArgs, \
+			"Too few arguments for request type \"dump_range\". Usage: " \
+			"dump_range <from (ms since the Unix epoch)> <to (ms since the Unix epoch, excluded)> " \
+			"<priority (debug/info/warning/critical/error)>") \
+		X(DumpRangeBadTime, \
+			"Invalid time for request type \"dump_range\". Both ends are whole milliseconds since " \
+			"the Unix epoch, and to can't be before from") \
+		X(DumpRangeWrongPriority, \
+			"Invalid priority string for request type \"dump_range\". Choose one of the following: " \
+			"debug/info/warning/critical/error") \
+		X(SearchTooFewArgs, \
+			"Too few arguments for request type \"search\". Usage: " \
+			"search <term (words joined by anything but whitespace)> [priority (debug/info/warning/critical/error)]") \
+		X(SearchBadTerm, \
+			"Invalid term for request type \"search\". It needs at least one word: letters, digits or _") \
+		X(SearchWrongPriority, \
+			"Invalid priority string for request type \"search\". Choose one of the following: " \
+			"debug/info/warning/critical/error") \
+		X(NewLogBadBytes, \
+			"Invalid bytes for request type \"new_log\". Usernames and bodies are printable ASCII, " \
+			"and usernames hold no whitespace. Nothing was logged.") \
+		X(NewLogTooManyUsers, \
+			"The server has no room left for new usernames and the message was rejected. " \
+			"Usernames it already knows are still taken.")
+
 	enum class ResultCode : unsigned
 	{
-		Ok,
-		TooFewArgs,
-		NewLogTooFewArgs,
-		NewLogWrongPriority,
-		DumpAllTooFewArgs,
-		DumpAllWrongPriority,
-		UnknownReqType,
-		UnknownError
+		#define LOGGER_RESULT_CODE_ENUM(name, description) name,
+		LOGGER_RESULT_CODES(LOGGER_RESULT_CODE_ENUM)
+		#undef LOGGER_RESULT_CODE_ENUM
 	};
 
+	// What binary clients already know them as
+	static_assert(
+		unsigned(ResultCode::Ok) == 0 &&
+		unsigned(ResultCode::TooFewArgs) == 1 &&
+		unsigned(ResultCode::NewLogTooFewArgs) == 2 &&
+		unsigned(ResultCode::NewLogWrongPriority) == 3 &&
+		unsigned(ResultCode::NewLogQueueFull) == 4 &&
+		unsigned(ResultCode::NewLogNotPersisted) == 5 &&
+		unsigned(ResultCode::NewLogBatchBadFrame) == 6 &&
+		unsigned(ResultCode::DumpAllTooFewArgs) == 7 &&
+		unsigned(ResultCode::DumpAllWrongPriority) == 8 &&
+		unsigned(ResultCode::UnknownReqType) == 9 &&
+		unsigned(ResultCode::UnknownError) == 10 &&
+		unsigned(ResultCode::DumpUserTooFewArgs) == 11 &&
+		unsigned(ResultCode::DumpUserWrongPriority) == 12 &&
+		unsigned(ResultCode::DumpRangeTooFewArgs) == 13 &&
+		unsigned(ResultCode::DumpRangeBadTime) == 14 &&
+		unsigned(ResultCode::DumpRangeWrongPriority) == 15 &&
+		unsigned(ResultCode::SearchTooFewArgs) == 16 &&
+		unsigned(ResultCode::SearchBadTerm) == 17 &&
+		unsigned(ResultCode::SearchWrongPriority) == 18 &&
+		unsigned(ResultCode::NewLogBadBytes) == 19 &&
+		unsigned(ResultCode::NewLogTooManyUsers) == 20,
+		"Result codes are on the wire by position: add new ones at the end");
+
 	inline const char * get_short_result_str(ResultCode result_code)
 	{
-		static const std::vector<const char *> available_strings = {
-			"Ok",
-			"TooFewArgs",
-			"NewLogTooFewArgs",
-			"NewLogWrongPriority",
-			"DumpAllTooFewArgs",
-			"DumpAllWrongPriority",
-			"UnknownReqType",
-			"UnknownError"
+		static const char * const available_strings[] = {
+			#define LOGGER_RESULT_CODE_NAME(name, description) #name,
+			LOGGER_RESULT_CODES(LOGGER_RESULT_CODE_NAME)
+			#undef LOGGER_RESULT_CODE_NAME
 		};
 
 		return available_strings[ static_cast<size_t>(result_code) ];
@@ -46,33 +129,28 @@ namespace ReqUtils
 
 	inline const char * get_result_str(ResultCode result_code)
 	{
-		static const std::vector<const char *> available_strings = {
-			"Big success!",
-
-			"Too few arguments. Please start the request with argument: <request_type>, "
-				"which can be one of the following: new_log, dump_all, delete_all",
-
-			"Too few arguments for request type \"new_log\". Usage: "
-				"new_log <username (no whitespace)> <priority (debug/info/warning/critical/error)> "
-					"<message body, anything but no leading or trailing whitespace>",
-
-			"Invalid priority string for request type \"new_log\". Choose one of the following: "
-				"debug/info/warning/critical/error",
-
-			"Too few arguments for request type \"dump_all\". Usage: "
-				"dump_all <priority (debug/info/warning/critical/error)>",
+		static const char * const available_strings[] = {
+			#define LOGGER_RESULT_CODE_DESCRIPTION(name, description) description,
+			LOGGER_RESULT_CODES(LOGGER_RESULT_CODE_DESCRIPTION)
+			#undef LOGGER_RESULT_CODE_DESCRIPTION
+		};
 
-			"Invalid priority string for request type \"dump_all\". Choose one of the following: "
-				"debug/info/warning/critical/error",
+		return available_strings[ static_cast<size_t>(result_code) ];
+	}
+};
 
 
-			"Unknown request type. Available request types are: new_log, dump_all, delete_all",
+class ReplyStream
+// The rest of a reply that's too big to build in one go. Hands it out a
+// chunk at a time, so the session can send each before asking for more.
+{
+public:
 
-			"Unknown error. Sorry, poor user."
-		};
+	virtual ~ReplyStream() = default;
 
-		return available_strings[ static_cast<size_t>(result_code) ];
-	}
+	// Appends about max_bytes to out, or what's left of the reply if less.
+	// False once there's nothing left after this chunk.
+	virtual bool next_chunk(std::string & out, size_t max_bytes) = 0;
 };
 
 
@@ -87,7 +165,27 @@ public:
 
 	virtual ~ReqBase() = default;
 
-	virtual MsgQueueWrapper::Lock serve(MsgQueueWrapper &, std::ostream &) = 0;
+	// The returned lock, if it owns one, still guards the shard that was written to.
+	// result_code tells whether serving succeeded, e.g. it may fail when the queue is full.
+	virtual MsgQueueWrapper::Lock serve(MsgQueueWrapper &, std::ostream &, ReqUtils::ResultCode & result_code) = 0;
+
+	// Like serve(), but a request with a big reply may write only the start
+	// of it to os and return the rest as a stream. Null once it's all in os,
+	// which is the default.
+	virtual std::unique_ptr<ReplyStream> serve_streamed(
+		MsgQueueWrapper & q_wrapper,
+		std::ostream & os,
+		ReqUtils::ResultCode & result_code)
+	{
+		serve(q_wrapper, os, result_code);
+		return nullptr;
+	}
+
+	MsgQueueWrapper::Lock serve(MsgQueueWrapper & q_wrapper, std::ostream & os)
+	{
+		ReqUtils::ResultCode result_code;
+		return serve(q_wrapper, os, result_code);
+	}
 
 	friend std::ostream & operator<<(std::ostream & os, const ReqBase & req)
 	{
@@ -110,8 +208,39 @@ private:
 namespace Reqs
 {
 	typedef std::unique_ptr<ReqBase> ReqBaseUnqPtr;
-
-	ReqBaseUnqPtr parse_req_str(const std::string & req_str, ReqUtils::ResultCode & result_code);
+	typedef boost::string_ref StrRef;
+
+	// Single pass, doesn't allocate until the request object is built
+	ReqBaseUnqPtr parse_req_str(StrRef req_str, ReqUtils::ResultCode & result_code);
+
+	// Same, except that like parse_req_frame() a valid new_log isn't turned
+	// into a request but appended to new_logs as a view into req_str, for
+	// serve_new_logs(). Doesn't allocate at all for a new_log.
+	ReqBaseUnqPtr parse_req_str(
+		StrRef req_str,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
+
+	// Whether line is a new_log_batch, whose records count their bytes:
+	// it's parsed as it came in, not sanitized first, and may run longer
+	// than other request lines
+	bool is_length_prefixed(StrRef line);
+
+	// Serves a run of new_logs the way serving each would, with one shard
+	// lock for the lot and at most one wait for the disk. result_codes gets
+	// one entry per message. No Msg is built unless the ingest ring needs one.
+	void serve_new_logs(
+		MsgQueueWrapper & q_wrapper,
+		const std::vector<MsgView> & msgs,
+		std::vector<ReqUtils::ResultCode> & result_codes);
+
+	// The binary protocol's parse_req_str(). A valid new_log frame isn't
+	// turned into a request but appended to new_logs as a view into the
+	// frame, for serve_new_logs(); null is returned then too.
+	ReqBaseUnqPtr parse_req_frame(
+		const WireFormat::Frame & frame,
+		std::vector<MsgView> & new_logs,
+		ReqUtils::ResultCode & result_code);
 
 };
 
@@ -123,9 +252,23 @@ namespace ReqsUnitTestsUtils
 		const std::string & username,
 		const Msg::Priority priority);
 
+	Reqs::ReqBaseUnqPtr make_new_log_batch_req(const std::vector<Msg> & msgs);
+
+	// What a client sends to log msgs with one new_log_batch, without the
+	// trailing delimiter
+	std::string make_new_log_batch_str(const std::vector<Msg> & msgs);
+
 	Reqs::ReqBaseUnqPtr make_dump_all_req(const Msg::Priority pri);
 
+	Reqs::ReqBaseUnqPtr make_dump_user_req(const std::string & username, const Msg::Priority pri);
+
+	Reqs::ReqBaseUnqPtr make_dump_range_req(const TimeRange & range, const Msg::Priority pri);
+
+	Reqs::ReqBaseUnqPtr make_search_req(const std::string & term, const Msg::Priority pri);
+
 	Reqs::ReqBaseUnqPtr make_delete_all_req();
+
+	Reqs::ReqBaseUnqPtr make_stats_req();
 };
 
 
@@ -0,0 +1,391 @@
+#include "msgs.hh"
+#include "metrics.hh"
+#include "diag.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+
+// MsgQueueWrapper's retention policy: parsing it, and the thread that
+// enforces it off the ingest path
+
+namespace
+{
+
+// <number>[<suffix>], where the suffixes are a string of letters each
+// worth the matching multiplier. False if it doesn't parse, is 0 or
+// comes to more than max_value.
+bool parse_scaled(
+	const std::string & str,
+	const char * suffixes,
+	const size_t * multipliers,
+	size_t & value,
+	size_t max_value = std::numeric_limits<size_t>::max())
+{
+	// strtoull() would take a sign or leading spaces too
+	if (str.empty() || !std::isdigit(static_cast<unsigned char>(str[0])))
+	{
+		return false;
+	}
+
+	errno = 0;
+	char * end = nullptr;
+	const unsigned long long number = std::strtoull(str.c_str(), &end, 10);
+	if (number == 0 || errno == ERANGE)
+	{
+		return false;
+	}
+
+	size_t multiplier = 1;
+	if (*end != '\0')
+	{
+		const char * suffix = std::strchr(suffixes, *end);
+		if (!suffix || end[1] != '\0')
+		{
+			return false;
+		}
+		multiplier = multipliers[suffix - suffixes];
+	}
+
+	if (number > max_value / multiplier)
+	{
+		return false;
+	}
+
+	value = size_t(number) * multiplier;
+	return true;
+}
+
+const char byte_suffixes[] = "kmg";
+const size_t byte_multipliers[] = {size_t(1) << 10, size_t(1) << 20, size_t(1) << 30};
+
+const char age_suffixes[] = "smhd";
+const size_t age_multipliers[] = {1, 60, 60 * 60, 24 * 60 * 60};
+
+}
+
+
+// MsgQueueWrapper::RetentionPolicy
+
+bool MsgQueueWrapper::RetentionPolicy::any() const
+{
+	return std::any_of(std::begin(limits), std::end(limits), [](const Limits & l) { return l.any(); });
+}
+
+bool MsgQueueWrapper::RetentionPolicy::from_str(const std::string & str, RetentionPolicy & policy)
+{
+	RetentionPolicy parsed;
+
+	std::istringstream items(str);
+	std::string item;
+	while (std::getline(items, item, ','))
+	{
+		Msg::Priority priority = Msg::Priority::Error;
+		const size_t colon = item.find(':');
+		if (colon != std::string::npos)
+		{
+			priority = Msg::get_priority_from_str(boost::string_ref(item).substr(0, colon));
+			if (priority == Msg::Priority::Illegal)
+			{
+				return false;
+			}
+			item.erase(0, colon + 1);
+		}
+
+		const size_t eq = item.find('=');
+		if (eq == std::string::npos)
+		{
+			return false;
+		}
+		const std::string limit = item.substr(0, eq);
+		const std::string value_str = item.substr(eq + 1);
+
+		Limits & limits = parsed.limits[size_t(priority)];
+		size_t value = 0;
+		if (limit == "msgs" && parse_scaled(value_str, "", nullptr, value))
+		{
+			limits.max_msgs = value;
+		}
+		else if (limit == "bytes" && parse_scaled(value_str, byte_suffixes, byte_multipliers, value))
+		{
+			limits.max_bytes = value;
+		}
+		else if (limit == "age" &&
+			parse_scaled(value_str, age_suffixes, age_multipliers, value, std::numeric_limits<unsigned>::max()))
+		{
+			limits.max_age_secs = unsigned(value);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if (!parsed.any())
+	{
+		return false;
+	}
+
+	policy = parsed;
+	return true;
+}
+
+std::string MsgQueueWrapper::RetentionPolicy::to_str() const
+{
+	std::string str;
+	for (size_t p = size_t(Msg::Priority::Max); p-- > 0; )
+	{
+		const std::string prefix = (p == size_t(Msg::Priority::Error)) ?
+			std::string() :
+			std::string(Msg::get_priority_str(Msg::Priority(p))) + ":";
+
+		const Limits & l = limits[p];
+		for (const auto & limit : {std::make_pair("msgs=", l.max_msgs), std::make_pair("bytes=", l.max_bytes),
+			std::make_pair("age=", size_t(l.max_age_secs))})
+		{
+			if (limit.second != 0)
+			{
+				str += (str.empty() ? "" : ",") + prefix + limit.first + std::to_string(limit.second);
+			}
+		}
+	}
+	return str;
+}
+
+
+// MsgQueueWrapper
+
+void MsgQueueWrapper::set_retention(const RetentionPolicy & policy, bool run_thread)
+{
+	stop_retention();
+
+	if (_wal)
+	{
+		DIAG(Queue, Warn, "Retention policy ignored, the write-ahead log bounds memory already");
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_retention_mutex);
+		_retention = policy;
+		_now_secs.store(0, std::memory_order_relaxed);
+	}
+
+	DIAG(Queue, Info, "Retention policy: " << policy.to_str());
+
+	if (run_thread && policy.any())
+	{
+		_retention_stop = false;
+		_retention_thread = std::thread([this]() { retention_loop(); });
+	}
+}
+
+void MsgQueueWrapper::stop_retention()
+{
+	if (!_retention_thread.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_retention_stop_mutex);
+		_retention_stop = true;
+	}
+	_retention_stop_cv.notify_one();
+	_retention_thread.join();
+}
+
+void MsgQueueWrapper::retention_loop()
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> lock(_retention_stop_mutex);
+	while (!_retention_stop_cv.wait_for(lock, std::chrono::milliseconds(Cfg::retention_interval_ms),
+		[this]() { return _retention_stop; }))
+	{
+		const auto secs = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start);
+
+		lock.unlock();
+		enforce_retention(uint32_t(secs.count()));
+		lock.lock();
+	}
+}
+
+size_t MsgQueueWrapper::enforce_retention(uint32_t now_secs)
+{
+	std::lock_guard<std::mutex> lock(_retention_mutex);
+	_now_secs.store(now_secs, std::memory_order_relaxed);
+
+	if (_wal)
+	{
+		return 0;
+	}
+
+	// Widest first: whole blocks go before any gets stripped
+	size_t num_dropped = 0;
+	for (size_t p = size_t(Msg::Priority::Max); p-- > 0; )
+	{
+		if (_retention.limits[p].any())
+		{
+			num_dropped += enforce_limits(Msg::Priority(p), _retention.limits[p], now_secs);
+		}
+	}
+
+	if (num_dropped != 0)
+	{
+		Metrics::add(Metrics::Counter::RetentionDropped, num_dropped);
+		DIAG(Queue, Debug, "Retention dropped " << num_dropped << " messages");
+	}
+	return num_dropped;
+}
+
+size_t MsgQueueWrapper::enforce_limits(Msg::Priority priority, const RetentionPolicy::Limits & limits, uint32_t now_secs)
+{
+	const size_t above = size_t(priority) + 1;
+
+	// Messages of the block the limits apply to, and their bytes
+	auto count = [above](const MsgBlock & block)
+		{
+			return block.records.size() - ((above < size_t(Msg::Priority::Max)) ? block.at_least[above].size() : 0);
+		};
+	auto bytes = [above, &count](const MsgBlock & block)
+		{
+			size_t total = count(block) * sizeof(MsgRecord);
+			for (size_t p = 0; p < above; ++p)
+			{
+				total += block.body_bytes[p];
+			}
+			return total;
+		};
+
+	struct Candidate
+	{
+		Shard * shard;
+		std::shared_ptr<MsgBlock> block;
+		Msg::Seq first_seq;
+		uint32_t first_secs;
+		uint32_t last_secs;
+		size_t num_msgs;
+		size_t num_bytes;
+	};
+
+	// Each shard's blocks, under its lock only while they're listed. The
+	// block at the back may still fill up meanwhile, the others are done.
+	std::vector<Candidate> candidates;
+	size_t total_msgs = 0;
+	size_t total_bytes = 0;
+	for (Shard & shard : _shards)
+	{
+		Lock lock(shard.mutex);
+		for (const auto & block : shard.blocks)
+		{
+			const Candidate candidate {
+				&shard, block, block->records.front().seq, block->first_secs, block->last_secs, count(*block), bytes(*block)};
+			if (candidate.num_msgs != 0)
+			{
+				candidates.push_back(candidate);
+				total_msgs += candidate.num_msgs;
+				total_bytes += candidate.num_bytes;
+			}
+		}
+	}
+
+	std::sort(candidates.begin(), candidates.end(),
+		[](const Candidate & a, const Candidate & b) { return a.first_seq < b.first_seq; });
+
+	auto is_older = [&limits, now_secs](uint32_t secs)
+		{
+			return limits.max_age_secs != 0 && uint64_t(secs) + limits.max_age_secs < now_secs;
+		};
+
+	size_t num_dropped = 0;
+	for (Candidate & candidate : candidates)
+	{
+		MsgBlock & block = *candidate.block;
+		Shard & shard = *candidate.shard;
+
+		const bool too_many = limits.max_msgs != 0 && total_msgs > limits.max_msgs;
+		const bool too_big = limits.max_bytes != 0 && total_bytes > limits.max_bytes;
+		if (!too_many && !too_big && !is_older(candidate.first_secs))
+		{
+			continue;
+		}
+
+		{
+			// Writers move on to a new block, this one stays as it is now
+			Lock lock(shard.mutex);
+			if (!block.closed)
+			{
+				block.closed = true;
+				total_msgs += count(block) - candidate.num_msgs;
+				total_bytes += bytes(block) - candidate.num_bytes;
+				candidate.num_msgs = count(block);
+				candidate.num_bytes = bytes(block);
+				candidate.last_secs = block.last_secs;
+			}
+		}
+
+		// One whose first messages are too old but not its last ones ages
+		// out on a later pass; closing it keeps it from getting any younger
+		if (!too_many && !too_big && !is_older(candidate.last_secs))
+		{
+			continue;
+		}
+
+		// What's above priority, copied outside the lock; null if nothing is
+		std::shared_ptr<MsgBlock> stripped;
+		if (candidate.num_msgs != block.records.size())
+		{
+			const std::vector<uint16_t> & kept = block.at_least[above];
+
+			size_t kept_bytes = 0;
+			for (size_t p = above; p < size_t(Msg::Priority::Max); ++p)
+			{
+				kept_bytes += block.body_bytes[p];
+			}
+
+			stripped = std::make_shared<MsgBlock>(kept.size());
+			stripped->arena.reserve(kept_bytes);
+			for (uint16_t pos : kept)
+			{
+				const MsgRecord & record = block.records[pos];
+				stripped->append(boost::string_ref(record.body, record.body_len), record.username, record.priority, record.seq,
+					block.get_time_ms(record));
+			}
+			stripped->first_secs = block.first_secs;
+			stripped->last_secs = block.last_secs;
+			stripped->closed = true;
+		}
+
+		{
+			Lock lock(shard.mutex);
+
+			// Gone already if delete_all came by
+			auto it = std::find(shard.blocks.begin(), shard.blocks.end(), candidate.block);
+			if (it != shard.blocks.end())
+			{
+				if (stripped)
+				{
+					*it = stripped;
+				}
+				else
+				{
+					shard.blocks.erase(it);
+				}
+				shard.num_msgs -= candidate.num_msgs;
+				num_dropped += candidate.num_msgs;
+			}
+		}
+
+		total_msgs -= candidate.num_msgs;
+		total_bytes -= candidate.num_bytes;
+	}
+
+	return num_dropped;
+}
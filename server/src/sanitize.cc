@@ -0,0 +1,358 @@
+#include "sanitize.hh"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANITIZE_X86 1
+#endif
+
+
+// The kernels, one set per Isa, then what's built on them
+
+
+namespace
+{
+
+struct Kernels
+{
+	Sanitize::Isa isa;
+	size_t (*find_non_printable)(const char * data, size_t size);
+	size_t (*find_crlf)(const char * data, size_t size);
+	size_t (*copy_printable)(char * out, const char * data, size_t size);
+};
+
+
+// Scalar, also the tails of the others
+
+size_t find_non_printable_scalar(const char * data, size_t size)
+{
+	size_t i = 0;
+	while (i < size && Sanitize::is_printable(data[i]))
+	{
+		++i;
+	}
+	return i;
+}
+
+size_t find_crlf_scalar(const char * data, size_t size)
+{
+	for (size_t i = 0; i + 1 < size; ++i)
+	{
+		if (data[i] == '\r' && data[i + 1] == '\n')
+		{
+			return i;
+		}
+	}
+	return size;
+}
+
+size_t copy_printable_scalar(char * out, const char * data, size_t size)
+{
+	char * const out_begin = out;
+	for (size_t i = 0; i < size; ++i)
+	{
+		if (Sanitize::is_printable(data[i]))
+		{
+			*out++ = data[i];
+		}
+	}
+	return size_t(out - out_begin);
+}
+
+const Kernels scalar_kernels = {
+	Sanitize::Isa::Scalar, find_non_printable_scalar, find_crlf_scalar, copy_printable_scalar
+};
+
+
+#ifdef SANITIZE_X86
+
+// SSE2, which every x86-64 has. A bit per byte of 16, set for the
+// non-printables: as signed bytes those are below 0x20, 0x7f, or negative.
+
+inline unsigned non_printable_mask_sse2(__m128i bytes)
+{
+	const __m128i printable = _mm_and_si128(
+		_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)),
+		_mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+	return ~unsigned(_mm_movemask_epi8(printable)) & 0xffffu;
+}
+
+size_t find_non_printable_sse2(const char * data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		const unsigned mask = non_printable_mask_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+		if (mask != 0)
+		{
+			return i + unsigned(__builtin_ctz(mask));
+		}
+	}
+	return i + find_non_printable_scalar(data + i, size - i);
+}
+
+size_t find_crlf_sse2(const char * data, size_t size)
+{
+	// The '\n's are looked for one byte further on, so a pair split
+	// between two blocks still lines up
+	size_t i = 0;
+	for (; i + 17 <= size; i += 16)
+	{
+		const __m128i cr = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), _mm_set1_epi8('\r'));
+		const __m128i lf = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1)), _mm_set1_epi8('\n'));
+		const unsigned mask = unsigned(_mm_movemask_epi8(_mm_and_si128(cr, lf)));
+		if (mask != 0)
+		{
+			return i + unsigned(__builtin_ctz(mask));
+		}
+	}
+	return i + find_crlf_scalar(data + i, size - i);
+}
+
+size_t copy_printable_sse2(char * out, const char * data, size_t size)
+{
+	char * const out_begin = out;
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		unsigned mask = non_printable_mask_sse2(bytes);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), bytes);
+		if (mask == 0)
+		{
+			out += 16;
+			continue;
+		}
+		if (i + 32 > size)
+		{
+			out += copy_printable_scalar(out, data + i, 16);
+			continue;
+		}
+
+		// Each run of printables after a non-printable is stored over it,
+		// 16 bytes at a time whatever its length: the next run, or the next
+		// block, lands on what's past it. Never past out_begin + size, as
+		// out doesn't get ahead of data.
+		out += __builtin_ctz(mask);
+		while (mask != 0)
+		{
+			const unsigned pos = unsigned(__builtin_ctz(mask));
+			mask &= mask - 1;
+			const unsigned next = (mask != 0) ? unsigned(__builtin_ctz(mask)) : 16u;
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + pos + 1)));
+			out += next - pos - 1;
+		}
+	}
+	out += copy_printable_scalar(out, data + i, size - i);
+	return size_t(out - out_begin);
+}
+
+const Kernels sse2_kernels = {
+	Sanitize::Isa::Sse2, find_non_printable_sse2, find_crlf_sse2, copy_printable_sse2
+};
+
+
+// AVX2, the same 32 bytes at a time. Built for it whatever the compiler's
+// flags, and only run once the CPU says it can.
+
+#define SANITIZE_AVX2 __attribute__((target("avx2")))
+
+SANITIZE_AVX2 inline uint32_t non_printable_mask_avx2(__m256i bytes)
+{
+	const __m256i printable = _mm256_and_si256(
+		_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(0x1f)),
+		_mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), bytes));
+	return ~uint32_t(_mm256_movemask_epi8(printable));
+}
+
+SANITIZE_AVX2 size_t find_non_printable_avx2(const char * data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		const uint32_t mask = non_printable_mask_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)));
+		if (mask != 0)
+		{
+			return i + unsigned(__builtin_ctz(mask));
+		}
+	}
+	return i + find_non_printable_scalar(data + i, size - i);
+}
+
+SANITIZE_AVX2 size_t find_crlf_avx2(const char * data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 33 <= size; i += 32)
+	{
+		const __m256i cr = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), _mm256_set1_epi8('\r'));
+		const __m256i lf = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1)), _mm256_set1_epi8('\n'));
+		const uint32_t mask = uint32_t(_mm256_movemask_epi8(_mm256_and_si256(cr, lf)));
+		if (mask != 0)
+		{
+			return i + unsigned(__builtin_ctz(mask));
+		}
+	}
+	return i + find_crlf_scalar(data + i, size - i);
+}
+
+SANITIZE_AVX2 size_t copy_printable_avx2(char * out, const char * data, size_t size)
+{
+	char * const out_begin = out;
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		uint32_t mask = non_printable_mask_avx2(bytes);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out), bytes);
+		if (mask == 0)
+		{
+			out += 32;
+			continue;
+		}
+		if (i + 64 > size)
+		{
+			out += copy_printable_scalar(out, data + i, 32);
+			continue;
+		}
+
+		// As in copy_printable_sse2(), but runs are short next to 32 bytes:
+		// the 16 byte stores cover most, and the rest get a second one
+		out += __builtin_ctz(mask);
+		while (mask != 0)
+		{
+			const unsigned pos = unsigned(__builtin_ctz(mask));
+			mask &= mask - 1;
+			const unsigned next = (mask != 0) ? unsigned(__builtin_ctz(mask)) : 32u;
+			const char * const run = data + i + pos + 1;
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_loadu_si128(reinterpret_cast<const __m128i *>(run)));
+			if (next - pos - 1 > 16)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_loadu_si128(reinterpret_cast<const __m128i *>(run + 16)));
+			}
+			out += next - pos - 1;
+		}
+	}
+	out += copy_printable_scalar(out, data + i, size - i);
+	return size_t(out - out_begin);
+}
+
+#undef SANITIZE_AVX2
+
+const Kernels avx2_kernels = {
+	Sanitize::Isa::Avx2, find_non_printable_avx2, find_crlf_avx2, copy_printable_avx2
+};
+
+#endif
+
+const Kernels & get_kernels(Sanitize::Isa isa)
+{
+	switch (isa)
+	{
+#ifdef SANITIZE_X86
+	case Sanitize::Isa::Avx2:
+		return avx2_kernels;
+	case Sanitize::Isa::Sse2:
+		return sse2_kernels;
+#endif
+	default:
+		return scalar_kernels;
+	}
+}
+
+const Kernels * & get_cur_kernels()
+{
+	static const Kernels * cur_kernels = &get_kernels(Sanitize::get_best_isa());
+	return cur_kernels;
+}
+
+}
+
+
+// Sanitize
+
+const char * Sanitize::to_str(Isa isa)
+{
+	static const char * const strs[] = {"scalar", "sse2", "avx2"};
+	return strs[static_cast<size_t>(isa)];
+}
+
+Sanitize::Isa Sanitize::get_best_isa()
+{
+#ifdef SANITIZE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return Isa::Avx2;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		return Isa::Sse2;
+	}
+#endif
+	return Isa::Scalar;
+}
+
+Sanitize::Isa Sanitize::get_isa()
+{
+	return get_cur_kernels()->isa;
+}
+
+bool Sanitize::set_isa(Isa isa)
+{
+	if (isa > get_best_isa())
+	{
+		return false;
+	}
+
+	get_cur_kernels() = &get_kernels(isa);
+	return true;
+}
+
+size_t Sanitize::find_non_printable(const char * data, size_t size)
+{
+	return get_cur_kernels()->find_non_printable(data, size);
+}
+
+size_t Sanitize::find_crlf(const char * data, size_t size)
+{
+	return get_cur_kernels()->find_crlf(data, size);
+}
+
+size_t Sanitize::copy_printable(char * out, const char * data, size_t size)
+{
+	return get_cur_kernels()->copy_printable(out, data, size);
+}
+
+boost::string_ref Sanitize::sanitize(boost::string_ref line, std::forward_list<std::string> & filtered_lines)
+{
+	// Trim trailing whitespace, all but ' ' of it non-printable. Rarely
+	// more than the odd byte, so not worth a kernel.
+
+	if (Cfg::req_trim_trailing_whitespaces)
+	{
+		while (!line.empty() && (!is_printable(line.back()) || line.back() == ' '))
+		{
+			line.remove_suffix(1);
+		}
+	}
+
+	// Delete all non-printables: what comes before the first is kept as is
+
+	if (!Cfg::req_filter_out_non_printable_chars)
+	{
+		return line;
+	}
+
+	const size_t first = find_non_printable(line.data(), line.size());
+	if (first == line.size())
+	{
+		return line;
+	}
+
+	filtered_lines.emplace_front(line.size(), '\0');
+	std::string & filtered = filtered_lines.front();
+	std::memcpy(&filtered[0], line.data(), first);
+	filtered.resize(first + copy_printable(&filtered[first], line.data() + first, line.size() - first));
+	return filtered;
+}
@@ -0,0 +1,69 @@
+#ifndef SANITIZE_HH
+#define SANITIZE_HH
+
+#include <forward_list>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/utility/string_ref.hpp>
+
+
+namespace Cfg
+{
+	static const bool req_trim_trailing_whitespaces = true;
+	static const bool req_filter_out_non_printable_chars = true;
+};
+
+
+namespace Sanitize
+// What a text request line goes through before it's parsed: where it
+// ends, and the bytes that don't belong in it. Printable is what
+// isprint() says in the classic locale, 0x20 to 0x7e, without asking the
+// locale for every byte. The scans run 16 or 32 bytes at a time on CPUs
+// that can, picked once at runtime.
+{
+	// Kernels to scan with, each running on fewer CPUs than the last
+	enum class Isa : uint8_t
+	{
+		Scalar,
+		Sse2,
+		Avx2
+	};
+
+	const char * to_str(Isa isa);
+
+	// The best this CPU runs, which is what's used unless set_isa() says otherwise
+	Isa get_best_isa();
+
+	Isa get_isa();
+
+	// For tests and benchmarks comparing kernels, before anything scans.
+	// False, and a no-op, if the CPU can't run isa.
+	bool set_isa(Isa isa);
+
+	inline bool is_printable(char c)
+	{
+		return static_cast<unsigned char>(c) - 0x20u < 0x5fu;
+	}
+
+	// Where the first non-printable in data is, size if there's none
+	size_t find_non_printable(const char * data, size_t size);
+
+	// Where the first "\r\n" in data starts, size if there's none
+	size_t find_crlf(const char * data, size_t size);
+
+	// Copies the printables of data to out, in order, and returns how
+	// many there were. out has room for size bytes, which may all be
+	// written to, and doesn't overlap data.
+	size_t copy_printable(char * out, const char * data, size_t size);
+
+	// The line minus trailing whitespace and non-printables. Mostly that's
+	// just a shorter view into line; only a line with non-printables inside
+	// is copied, into a new string at the front of filtered_lines, without
+	// them.
+	boost::string_ref sanitize(boost::string_ref line, std::forward_list<std::string> & filtered_lines);
+};
+
+
+#endif
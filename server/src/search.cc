@@ -0,0 +1,267 @@
+#include "search.hh"
+#include "msgs.hh"
+#include "diag.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+
+// Search: words, terms and the token index, then MsgQueueWrapper's side of
+// it: the thread that builds the indexes off the ingest path, and lookups
+
+
+// Search::Term
+
+Search::Term::Term(boost::string_ref text)
+:	_text(text.to_string())
+{
+	for_each_token(text, [this](boost::string_ref token)
+		{
+			std::string folded(token.size(), '\0');
+			std::transform(token.begin(), token.end(), folded.begin(), fold);
+			_hashes.push_back(hash_token(folded));
+			_tokens.push_back(std::move(folded));
+		});
+}
+
+bool Search::Term::matches(boost::string_ref text) const
+{
+	if (_tokens.empty())
+	{
+		return false;
+	}
+
+	const char * pos = text.begin();
+	for (boost::string_ref token = next_token(pos, text.end()); !token.empty(); token = next_token(pos, text.end()))
+	{
+		if (!token_equals(token, _tokens[0]))
+		{
+			continue;
+		}
+
+		// The rest have to follow right after, without moving pos past them
+		const char * rest = pos;
+		size_t i = 1;
+		while (i < _tokens.size() && token_equals(next_token(rest, text.end()), _tokens[i]))
+		{
+			++i;
+		}
+		if (i == _tokens.size())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// Search::TokenIndex
+
+Search::TokenIndex::TokenIndex(const std::vector<boost::string_ref> & bodies)
+{
+	// hash:32 | position:16, so one sort orders both
+	std::vector<uint64_t> postings;
+	for (size_t pos = 0; pos < bodies.size(); ++pos)
+	{
+		for_each_token(bodies[pos], [&postings, pos](boost::string_ref token)
+			{
+				postings.push_back((uint64_t(hash_token(token)) << 16) | pos);
+			});
+	}
+	std::sort(postings.begin(), postings.end());
+
+	// A word that comes up twice in a body is listed once
+	postings.erase(std::unique(postings.begin(), postings.end()), postings.end());
+
+	_positions.reserve(postings.size());
+	for (uint64_t posting : postings)
+	{
+		const TokenHash hash = TokenHash(posting >> 16);
+		if (_hashes.empty() || _hashes.back() != hash)
+		{
+			_hashes.push_back(hash);
+			_starts.push_back(uint32_t(_positions.size()));
+		}
+		_positions.push_back(uint16_t(posting));
+	}
+	_starts.push_back(uint32_t(_positions.size()));
+
+	_hashes.shrink_to_fit();
+	_starts.shrink_to_fit();
+}
+
+std::pair<const uint16_t *, const uint16_t *> Search::TokenIndex::find(TokenHash hash) const
+{
+	const auto it = std::lower_bound(_hashes.begin(), _hashes.end(), hash);
+	if (it == _hashes.end() || *it != hash)
+	{
+		return std::make_pair(nullptr, nullptr);
+	}
+
+	const size_t i = size_t(it - _hashes.begin());
+	return std::make_pair(_positions.data() + _starts[i], _positions.data() + _starts[i + 1]);
+}
+
+std::vector<uint16_t> Search::TokenIndex::find(const Term & term) const
+{
+	std::vector<uint16_t> found;
+	std::vector<uint16_t> narrowed;
+	for (size_t i = 0; i < term.get_hashes().size(); ++i)
+	{
+		const auto range = find(term.get_hashes()[i]);
+		if (i == 0)
+		{
+			found.assign(range.first, range.second);
+		}
+		else
+		{
+			narrowed.clear();
+			std::set_intersection(found.begin(), found.end(), range.first, range.second, std::back_inserter(narrowed));
+			found.swap(narrowed);
+		}
+
+		if (found.empty())
+		{
+			break;
+		}
+	}
+	return found;
+}
+
+
+// MsgQueueWrapper
+
+void MsgQueueWrapper::start_indexer()
+{
+	stop_indexer();
+
+	_indexer_stop = false;
+	_indexer_thread = std::thread([this]() { indexer_loop(); });
+}
+
+void MsgQueueWrapper::stop_indexer()
+{
+	if (!_indexer_thread.joinable())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_indexer_stop_mutex);
+		_indexer_stop = true;
+	}
+	_indexer_stop_cv.notify_one();
+	_indexer_thread.join();
+}
+
+void MsgQueueWrapper::indexer_loop()
+{
+	std::unique_lock<std::mutex> lock(_indexer_stop_mutex);
+	while (!_indexer_stop_cv.wait_for(lock, std::chrono::milliseconds(Cfg::search_index_interval_ms),
+		[this]() { return _indexer_stop; }))
+	{
+		lock.unlock();
+		index_blocks();
+		lock.lock();
+	}
+}
+
+size_t MsgQueueWrapper::index_blocks()
+{
+	std::lock_guard<std::mutex> lock(_indexer_mutex);
+
+	// Writers only ever append to a shard's back block, and not even to
+	// that one once it's closed: the others can be read without the lock
+	std::vector<std::shared_ptr<MsgBlock>> done;
+	for (Shard & shard : _shards)
+	{
+		Lock shard_lock(shard.mutex);
+		for (const auto & block : shard.blocks)
+		{
+			if ((block != shard.blocks.back() || block->closed) && !std::atomic_load(&block->token_index))
+			{
+				done.push_back(block);
+			}
+		}
+	}
+
+	std::vector<boost::string_ref> bodies;
+	for (const auto & block : done)
+	{
+		bodies.clear();
+		for (const MsgRecord & record : block->records)
+		{
+			bodies.emplace_back(record.body, record.body_len);
+		}
+
+		std::shared_ptr<const Search::TokenIndex> token_index = std::make_shared<const Search::TokenIndex>(bodies);
+		std::atomic_store(&block->token_index, std::move(token_index));
+	}
+
+	if (!done.empty())
+	{
+		DIAG(Queue, Trace, "Indexed " << done.size() << " blocks for search");
+	}
+	return done.size();
+}
+
+MsgQueueWrapper::MatchSnapshot MsgQueueWrapper::get_search_snapshot(
+	const Search::Term & term,
+	Msg::Priority priority_cap) const
+{
+	MatchSnapshot search_snapshot;
+	search_snapshot._snapshot = get_snapshot();
+	search_snapshot._term = term;
+	search_snapshot._priority_cap = priority_cap;
+
+	if (term.empty())
+	{
+		return search_snapshot;
+	}
+
+	const Snapshot & snapshot = search_snapshot._snapshot;
+	std::vector<MatchSnapshot::RecordRef> & records = search_snapshot._records;
+	for (const Snapshot::ShardView & shard : snapshot._shards)
+	{
+		for (const Snapshot::BlockRef & block_ref : shard.blocks)
+		{
+			const MsgBlock & block = *block_ref.block;
+
+			// Those before _sealed_end are served from the segments
+			auto add_if_match = [&](const MsgRecord & record)
+			{
+				if (record.priority >= priority_cap && record.seq >= snapshot._sealed_end && record.seq < snapshot._end_seq &&
+					term.matches(boost::string_ref(record.body, record.body_len)))
+				{
+					records.push_back(MatchSnapshot::RecordRef { &record, block.base_ms });
+				}
+			};
+
+			const auto token_index = std::atomic_load(&block.token_index);
+			if (token_index)
+			{
+				const size_t count = block_ref.count(Msg::Priority::Debug);
+				for (uint16_t pos : token_index->find(term))
+				{
+					if (pos < count)
+					{
+						add_if_match(block.records[pos]);
+					}
+				}
+			}
+			else
+			{
+				// Not indexed yet, most likely the shard's back block
+				for (size_t i = 0; i < block_ref.count(priority_cap); ++i)
+				{
+					add_if_match(block_ref.get(priority_cap, i));
+				}
+			}
+		}
+	}
+
+	search_snapshot.sort_records();
+
+	return search_snapshot;
+}
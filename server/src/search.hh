@@ -0,0 +1,164 @@
+#ifndef SEARCH_HH
+#define SEARCH_HH
+
+#include <utility>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/utility/string_ref.hpp>
+
+
+namespace Cfg
+{
+	static const unsigned search_index_interval_ms = 50;
+};
+
+
+namespace Search
+// Word search over message bodies. A word is a run of ASCII letters,
+// digits and '_', and words compare case-insensitively: "Disk_full" is a
+// word of "ERROR: disk_full on /var", "disk" isn't.
+{
+	typedef uint32_t TokenHash;
+
+	inline bool is_token_char(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+	}
+
+	inline char fold(char c)
+	{
+		return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+	}
+
+	// The word at or after pos, which is moved past it. Empty once there
+	// are no more.
+	inline boost::string_ref next_token(const char * & pos, const char * end)
+	{
+		while (pos != end && !is_token_char(*pos))
+		{
+			++pos;
+		}
+		const char * const start = pos;
+		while (pos != end && is_token_char(*pos))
+		{
+			++pos;
+		}
+		return boost::string_ref(start, size_t(pos - start));
+	}
+
+	template <typename Func>
+	void for_each_token(boost::string_ref text, Func && func)
+	{
+		const char * pos = text.begin();
+		for (boost::string_ref token = next_token(pos, text.end()); !token.empty(); token = next_token(pos, text.end()))
+		{
+			func(token);
+		}
+	}
+
+	// FNV-1a of the case-folded word
+	inline TokenHash hash_token(boost::string_ref token)
+	{
+		TokenHash hash = 2166136261u;
+		for (char c : token)
+		{
+			hash = (hash ^ static_cast<unsigned char>(fold(c))) * 16777619u;
+		}
+		return hash;
+	}
+
+	inline bool token_equals(boost::string_ref a, boost::string_ref b)
+	{
+		if (a.size() != b.size())
+		{
+			return false;
+		}
+		for (size_t i = 0; i < a.size(); ++i)
+		{
+			if (fold(a[i]) != fold(b[i]))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+
+	class Term
+	// What a search looks for: a word, or several in a row, whatever
+	// separates them. "conn-reset" matches "conn reset" and "Conn_Reset"
+	// doesn't.
+	{
+	public:
+
+		Term() = default;
+
+		explicit Term(boost::string_ref text);
+
+		// Holds no word at all, so nothing matches
+		bool empty() const
+		{
+			return _tokens.empty();
+		}
+
+		const std::string & get_text() const
+		{
+			return _text;
+		}
+
+		const std::vector<TokenHash> & get_hashes() const
+		{
+			return _hashes;
+		}
+
+		// Whether text holds the term's words, in a row
+		bool matches(boost::string_ref text) const;
+
+	private:
+
+		std::string _text;
+		std::vector<std::string> _tokens;
+		std::vector<TokenHash> _hashes;
+	};
+
+
+	class TokenIndex
+	// Where the words are in a block's bodies: the positions of the bodies
+	// holding each, by the word's hash. Built in one go once the block is
+	// done with, and read-only from then on. Two flat arrays rather than a
+	// map of vectors: a few bytes per distinct word and two per word of a
+	// body, found with a binary search.
+	{
+	public:
+
+		explicit TokenIndex(const std::vector<boost::string_ref> & bodies);
+
+		// Ascending positions of the bodies holding a word of that hash
+		std::pair<const uint16_t *, const uint16_t *> find(TokenHash hash) const;
+
+		// Ascending positions of the bodies holding every word of term.
+		// Hashes collide and words may be out of order, so check them with
+		// Term::matches().
+		std::vector<uint16_t> find(const Term & term) const;
+
+		size_t get_bytes() const
+		{
+			return sizeof(*this) +
+				_hashes.capacity() * sizeof(_hashes[0]) +
+				_starts.capacity() * sizeof(_starts[0]) +
+				_positions.capacity() * sizeof(_positions[0]);
+		}
+
+	private:
+
+		std::vector<TokenHash> _hashes; // Sorted
+		std::vector<uint32_t> _starts; // Where each hash's positions start, and one past the last
+		std::vector<uint16_t> _positions;
+	};
+};
+
+
+#endif
@@ -0,0 +1,748 @@
+#include "wal.hh"
+#include "diag.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+
+
+namespace
+{
+	using WalFormat::RecordHeader;
+
+	const char segment_suffix[] = ".wal";
+	const size_t segment_seq_digits = 20;
+
+	uint32_t record_crc(const char * record, size_t size)
+	// Everything after the crc field itself
+	{
+		boost::crc_32_type crc;
+		crc.process_bytes(record + sizeof(uint32_t), size - sizeof(uint32_t));
+		return crc.checksum();
+	}
+
+	std::string get_segment_path(const std::string & dir, Msg::Seq first_seq)
+	{
+		char name[segment_seq_digits + sizeof(segment_suffix)];
+		std::snprintf(name, sizeof(name), "%020llu%s", static_cast<unsigned long long>(first_seq), segment_suffix);
+		return dir + "/" + name;
+	}
+
+	typedef std::vector<std::pair<Msg::Seq, std::string>> SegmentFiles; // (first seq, path)
+
+	SegmentFiles list_segments(const std::string & dir)
+	// Oldest first. Files that don't look like segments are left alone.
+	{
+		SegmentFiles segments;
+
+		DIR * dir_stream = opendir(dir.c_str());
+		if (!dir_stream)
+		{
+			return segments;
+		}
+
+		while (dirent * entry = readdir(dir_stream))
+		{
+			const std::string name(entry->d_name);
+			if (name.size() != segment_seq_digits + std::strlen(segment_suffix) ||
+				name.compare(segment_seq_digits, std::string::npos, segment_suffix) != 0 ||
+				!std::all_of(name.begin(), name.begin() + segment_seq_digits, ::isdigit))
+			{
+				continue;
+			}
+
+			segments.emplace_back(std::strtoull(name.c_str(), nullptr, 10), dir + "/" + name);
+		}
+		closedir(dir_stream);
+
+		std::sort(segments.begin(), segments.end());
+		return segments;
+	}
+
+	bool is_other_version(const std::string & path)
+	// A segment of ours, but not in the format this build reads
+	{
+		char head[sizeof(WalFormat::magic)];
+		std::ifstream file(path, std::ios::binary);
+		return file.read(head, sizeof(head)) &&
+			std::memcmp(head, WalFormat::magic, sizeof(head) - 1) == 0 &&
+			head[sizeof(head) - 1] != WalFormat::magic[sizeof(head) - 1];
+	}
+
+	void sync_dir(const std::string & dir)
+	// Makes a created or removed segment stick, not just its contents
+	{
+		const int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd >= 0)
+		{
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+	}
+
+	size_t scan_segment(const std::string & path, bool is_last, const std::function<void(const MsgView &)> & func)
+	// Feeds the intact records of one segment to func and returns their
+	// number. Cuts off a torn tail if it's the last segment.
+	{
+		std::ifstream file(path, std::ios::binary);
+		const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		size_t num_records = 0;
+		size_t offset = 0;
+		if (data.size() >= sizeof(WalFormat::magic) &&
+			std::memcmp(data.data(), WalFormat::magic, sizeof(WalFormat::magic)) == 0)
+		{
+			offset = sizeof(WalFormat::magic);
+
+			while (data.size() - offset >= sizeof(RecordHeader))
+			{
+				RecordHeader header;
+				std::memcpy(&header, data.data() + offset, sizeof(header));
+
+				const size_t size = sizeof(header) + size_t(header.username_len) + header.body_len;
+				if (size > data.size() - offset ||
+					header.priority >= static_cast<uint32_t>(Msg::Priority::Illegal) ||
+					header.crc != record_crc(data.data() + offset, size))
+				{
+					break;
+				}
+
+				const char * username = data.data() + offset + sizeof(header);
+				func(MsgView(
+					boost::string_ref(username + header.username_len, header.body_len),
+					boost::string_ref(username, header.username_len),
+					static_cast<Msg::Priority>(header.priority),
+					header.seq,
+					header.time_ms));
+
+				++num_records;
+				offset += size;
+			}
+		}
+
+		if (offset == data.size())
+		{
+			return num_records;
+		}
+
+		if (is_last)
+		{
+			// Most likely a write the crash cut short. Cut it off so
+			// the next segment starts from a clean tail.
+			DIAG(Wal, Warn, "dropping " << data.size() - offset << " torn bytes at the end of " << path);
+			if (offset < sizeof(WalFormat::magic))
+			{
+				unlink(path.c_str());
+			}
+			else if (truncate(path.c_str(), off_t(offset)) != 0)
+			{
+				DIAG(Wal, Error, "truncate() failed: " << std::strerror(errno));
+			}
+		}
+		else
+		{
+			DIAG(Wal, Warn, path << " is damaged at byte " << offset << ", skipping the rest of it");
+		}
+
+		return num_records;
+	}
+};
+
+
+// Segment
+
+std::shared_ptr<const Segment> Segment::map(const std::string & path, Msg::Seq first_seq, Msg::Seq end_seq)
+{
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+
+	struct stat st;
+	void * data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(WalFormat::magic))
+	{
+		data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	}
+
+	// The mapping keeps the file alive, even once it's unlinked
+	close(fd);
+
+	if (data == MAP_FAILED)
+	{
+		return nullptr;
+	}
+
+	// Dumps read it front to back
+	madvise(data, size_t(st.st_size), MADV_SEQUENTIAL);
+
+	return std::shared_ptr<const Segment>(
+		new Segment(static_cast<const char *>(data), size_t(st.st_size), first_seq, end_seq));
+}
+
+Segment::Segment(const char * data, size_t size, Msg::Seq first_seq, Msg::Seq end_seq)
+:	_data(data),
+	_size(size),
+	_first_seq(first_seq),
+	_end_seq(end_seq),
+	_valid_size(sizeof(WalFormat::magic)),
+	_num_records(0),
+	_min_ms(std::numeric_limits<Msg::Time>::max()),
+	_max_ms(0)
+{
+	// Startup only scanned the last segment, so every one is checked here
+	while (_size - _valid_size >= sizeof(RecordHeader))
+	{
+		RecordHeader header;
+		std::memcpy(&header, _data + _valid_size, sizeof(header));
+
+		const size_t record_size = sizeof(header) + size_t(header.username_len) + header.body_len;
+		if (record_size > _size - _valid_size || header.priority >= static_cast<uint32_t>(Msg::Priority::Illegal) ||
+			header.crc != record_crc(_data + _valid_size, record_size))
+		{
+			DIAG(Wal, Warn, "segment " << _first_seq << " is damaged at byte " << _valid_size << ", skipping the rest of it");
+			break;
+		}
+
+		if (_num_records % Cfg::segment_index_stride == 0)
+		{
+			_strides.push_back(Stride {_valid_size, header.seq, 0, 0, header.time_ms, header.time_ms});
+		}
+		Stride & stride = _strides.back();
+		stride.priorities |= 1u << header.priority;
+		stride.users |= get_user_bit(boost::string_ref(_data + _valid_size + sizeof(header), header.username_len));
+		stride.min_ms = std::min(stride.min_ms, Msg::Time(header.time_ms));
+		stride.max_ms = std::max(stride.max_ms, Msg::Time(header.time_ms));
+		_min_ms = std::min(_min_ms, stride.min_ms);
+		_max_ms = std::max(_max_ms, stride.max_ms);
+
+		++_num_records;
+		_valid_size += record_size;
+	}
+	_strides.shrink_to_fit();
+}
+
+size_t Segment::count_before(Msg::Seq seq) const
+{
+	if (seq >= _end_seq)
+	{
+		return _num_records;
+	}
+	if (_strides.empty() || seq <= _first_seq)
+	{
+		return 0;
+	}
+
+	// Whole strides up to the one seq falls in, then that one record by record
+	const size_t i = find_stride(seq);
+	size_t count = i * Cfg::segment_index_stride;
+	const size_t end = (i + 1 < _strides.size()) ? _strides[i + 1].offset : _valid_size;
+	for (size_t offset = _strides[i].offset; offset < end; ++count)
+	{
+		RecordHeader header;
+		std::memcpy(&header, _data + offset, sizeof(header));
+		if (header.seq >= seq)
+		{
+			break;
+		}
+		offset += sizeof(header) + size_t(header.username_len) + header.body_len;
+	}
+	return count;
+}
+
+Segment::~Segment()
+{
+	munmap(const_cast<char *>(_data), _size);
+}
+
+
+// WriteAheadLog::SyncPolicy
+
+bool WriteAheadLog::SyncPolicy::from_str(const std::string & str, SyncPolicy & policy)
+{
+	if (str == "always")
+	{
+		policy.every_records = 1;
+		policy.every_ms = 0;
+		return true;
+	}
+
+	if (str == "none")
+	{
+		policy.every_records = 0;
+		policy.every_ms = 0;
+		return true;
+	}
+
+	const bool is_ms = (str.size() > 2 && str.compare(str.size() - 2, 2, "ms") == 0);
+	const std::string digits = is_ms ? str.substr(0, str.size() - 2) : str;
+
+	if (digits.empty() || !std::all_of(digits.begin(), digits.end(), ::isdigit))
+	{
+		return false;
+	}
+
+	const unsigned long long n = std::strtoull(digits.c_str(), nullptr, 10);
+	if (n == 0)
+	{
+		return false;
+	}
+
+	policy.every_records = is_ms ? 0 : size_t(n);
+	policy.every_ms = is_ms ? unsigned(n) : 0;
+	return true;
+}
+
+std::string WriteAheadLog::SyncPolicy::to_str() const
+{
+	if (every_records == 1)
+	{
+		return "always";
+	}
+	if (every_records != 0)
+	{
+		return std::to_string(every_records);
+	}
+	if (every_ms != 0)
+	{
+		return std::to_string(every_ms) + "ms";
+	}
+	return "none";
+}
+
+
+// WriteAheadLog
+
+WriteAheadLog::WriteAheadLog(const std::string & dir, SyncPolicy policy, size_t segment_bytes)
+:	_dir(dir),
+	_policy(policy),
+	_max_segment_bytes(segment_bytes),
+	_next_seq(0),
+	_pending_records(0),
+	_pending_first_seq(0),
+	_appended(0),
+	_written(0),
+	_durable(0),
+	_sync_wanted(0),
+	_last_sync(Clock::now()),
+	_reset_wanted(false),
+	_failed(false),
+	_stop(false),
+	_stats(),
+	_sealed_end(0),
+	_fd(-1),
+	_segment_first_seq(0),
+	_segment_bytes(0),
+	_seal_failed(false)
+{
+	if (mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST)
+	{
+		throw std::runtime_error("Can't create write-ahead log directory " + _dir + ": " + std::strerror(errno));
+	}
+
+	SegmentFiles files = list_segments(_dir);
+
+	// Reading them as this version's would cut them off as torn
+	for (const auto & file : files)
+	{
+		if (is_other_version(file.second))
+		{
+			throw std::runtime_error("Write-ahead log segment " + file.second + " is of another format version");
+		}
+	}
+
+	if (!files.empty())
+	{
+		// Only the last segment can have been cut short, the others were
+		// synced before the next one was opened. Checking it also tells
+		// where the seqs left off.
+		_next_seq = files.back().first;
+		const size_t num_last = scan_segment(files.back().second, true,
+			[this](const MsgView & msg) { _next_seq = msg.get_seq() + 1; });
+
+		// An empty one would clash with the next segment's name
+		if (num_last == 0)
+		{
+			unlink(files.back().second.c_str());
+			files.pop_back();
+		}
+	}
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		const Msg::Seq end_seq = (i + 1 < files.size()) ? files[i + 1].first : _next_seq;
+		auto segment = Segment::map(files[i].second, files[i].first, end_seq);
+		if (!segment)
+		{
+			throw std::runtime_error("Can't map write-ahead log segment " + files[i].second + ": " + std::strerror(errno));
+		}
+		_sealed.push_back(std::move(segment));
+	}
+	_sealed_end.store(_next_seq, std::memory_order_release);
+
+	_flush_thread = std::thread([this]() { flush_loop(); });
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+	{
+		Lock lock(_mutex);
+		_stop = true;
+		_flush_cv.notify_one();
+	}
+	_flush_thread.join();
+
+	close_segment();
+}
+
+void WriteAheadLog::append(
+	const Lock & lock,
+	boost::string_ref body,
+	boost::string_ref username,
+	Msg::Priority priority,
+	Msg::Seq seq,
+	Msg::Time time_ms)
+{
+	(void) lock;
+
+	const bool was_idle = _pending.empty();
+	if (was_idle)
+	{
+		_pending_first_seq = seq;
+	}
+
+	RecordHeader header;
+	header.crc = 0;
+	header.body_len = static_cast<uint32_t>(body.size());
+	header.username_len = static_cast<uint32_t>(username.size());
+	header.priority = static_cast<uint32_t>(priority);
+	header.seq = seq;
+	header.time_ms = time_ms;
+
+	const size_t start = _pending.size();
+	const size_t size = sizeof(header) + username.size() + body.size();
+	_pending.resize(start + size);
+
+	char * record = &_pending[start];
+	std::memcpy(record, &header, sizeof(header));
+	std::memcpy(record + sizeof(header), username.data(), username.size());
+	std::memcpy(record + sizeof(header) + username.size(), body.data(), body.size());
+
+	header.crc = record_crc(record, size);
+	std::memcpy(record, &header.crc, sizeof(header.crc));
+
+	++_pending_records;
+	++_appended;
+
+	if (was_idle)
+	{
+		_flush_cv.notify_one();
+	}
+}
+
+bool WriteAheadLog::sync()
+{
+	Lock lock(_mutex);
+
+	const uint64_t target = _appended;
+	if (_durable < target)
+	{
+		_sync_wanted = std::max(_sync_wanted, target);
+		_flush_cv.notify_one();
+		_durable_cv.wait(lock, [this, target]() { return _durable >= target; });
+	}
+
+	return !_failed;
+}
+
+void WriteAheadLog::reset()
+{
+	Lock lock(_mutex);
+
+	// Whatever was pending is gone too, nobody needs to wait for it
+	_pending.clear();
+	_pending_records = 0;
+	_written = _durable = _appended;
+
+	_reset_wanted = true;
+	_flush_cv.notify_one();
+	_durable_cv.wait(lock, [this]() { return !_reset_wanted; });
+}
+
+WriteAheadLog::Stats WriteAheadLog::get_stats() const
+{
+	Lock lock(_mutex);
+	return _stats;
+}
+
+void WriteAheadLog::set_seal_hook(std::function<void(Msg::Seq)> hook)
+{
+	Lock lock(_mutex);
+	_seal_hook = std::move(hook);
+}
+
+WriteAheadLog::Segments WriteAheadLog::get_sealed_segments() const
+{
+	Lock lock(_mutex);
+	return _sealed;
+}
+
+void WriteAheadLog::flush_loop()
+{
+	Lock lock(_mutex);
+	std::string buf;
+
+	for (;;)
+	{
+		if (_reset_wanted)
+		{
+			lock.unlock();
+			close_segment();
+			remove_segments();
+			lock.lock();
+
+			// Readers holding on to the old segments keep them mapped
+			_sealed.clear();
+			_sealed_end.store(0, std::memory_order_release);
+			_seal_failed = false;
+			_reset_wanted = false;
+			_durable_cv.notify_all();
+			continue;
+		}
+
+		if (!_pending.empty())
+		{
+			buf.swap(_pending);
+			const Msg::Seq first_seq = _pending_first_seq;
+			const uint64_t batch_end = _appended;
+			const uint64_t num_records = _pending_records;
+			const bool failed = _failed;
+			_pending_records = 0;
+
+			// Appenders keep filling _pending meanwhile
+			lock.unlock();
+			const bool ok = failed || write_batch(buf, first_seq);
+			lock.lock();
+
+			if (!failed)
+			{
+				_failed = !ok;
+				_stats.records += num_records;
+				_stats.bytes += buf.size();
+				++_stats.writes;
+			}
+			_written = std::max(_written, batch_end);
+			buf.clear();
+		}
+
+		const uint64_t unsynced = _written - _durable;
+		const bool sync_due = unsynced > 0 && (
+			_stop ||
+			_sync_wanted > _durable ||
+			(_policy.every_records != 0 && unsynced >= _policy.every_records) ||
+			(_policy.every_ms != 0 && Clock::now() >= _last_sync + std::chrono::milliseconds(_policy.every_ms)));
+
+		if (sync_due)
+		{
+			const uint64_t target = _written;
+			const bool failed = _failed;
+
+			lock.unlock();
+			const bool ok = failed || sync_segment();
+			lock.lock();
+
+			if (!failed)
+			{
+				_failed = !ok;
+				++_stats.syncs;
+			}
+			_durable = std::max(_durable, target);
+			_last_sync = Clock::now();
+			_durable_cv.notify_all();
+			continue;
+		}
+
+		if (!_pending.empty() || _reset_wanted)
+		{
+			continue;
+		}
+
+		if (_stop)
+		{
+			break;
+		}
+
+		if (_policy.every_ms != 0 && unsynced > 0)
+		{
+			_flush_cv.wait_until(lock, _last_sync + std::chrono::milliseconds(_policy.every_ms));
+		}
+		else
+		{
+			_flush_cv.wait(lock);
+		}
+	}
+}
+
+bool WriteAheadLog::write_batch(const std::string & buf, Msg::Seq first_seq)
+{
+	// Seal a full segment between batches, so one never splits a batch
+	if (_fd >= 0 && _segment_bytes >= _max_segment_bytes)
+	{
+		if (!sync_segment())
+		{
+			return false;
+		}
+		close_segment();
+		seal_segment(first_seq);
+	}
+
+	if (_fd < 0 && !open_segment(first_seq))
+	{
+		return false;
+	}
+
+	const char * data = buf.data();
+	size_t left = buf.size();
+	while (left > 0)
+	{
+		const ssize_t n = write(_fd, data, left);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			report_error("write()");
+			return false;
+		}
+		data += n;
+		left -= size_t(n);
+	}
+
+	_segment_bytes += buf.size();
+	return true;
+}
+
+bool WriteAheadLog::sync_segment()
+{
+	if (_fd >= 0 && fdatasync(_fd) != 0)
+	{
+		report_error("fdatasync()");
+		return false;
+	}
+	return true;
+}
+
+bool WriteAheadLog::open_segment(Msg::Seq first_seq)
+{
+	const std::string path = get_segment_path(_dir, first_seq);
+	_segment_path = path;
+	_segment_first_seq = first_seq;
+
+	_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	if (_fd < 0)
+	{
+		report_error(("open() of " + path).c_str());
+		return false;
+	}
+
+	if (write(_fd, WalFormat::magic, sizeof(WalFormat::magic)) != ssize_t(sizeof(WalFormat::magic)))
+	{
+		report_error("write()");
+		return false;
+	}
+	_segment_bytes = sizeof(WalFormat::magic);
+
+	sync_dir(_dir);
+
+	DIAG(Wal, Debug, "opened " << path);
+
+	Lock lock(_mutex);
+	++_stats.segments;
+	return true;
+}
+
+void WriteAheadLog::close_segment()
+{
+	if (_fd >= 0)
+	{
+		fdatasync(_fd);
+		close(_fd);
+		_fd = -1;
+		_segment_bytes = 0;
+	}
+}
+
+void WriteAheadLog::seal_segment(Msg::Seq end_seq)
+{
+	// The sealed segments must not have gaps, so after a failure nothing
+	// is sealed any more. It's all still on disk for the next replay, and
+	// the store just keeps the messages in memory.
+	if (_seal_failed)
+	{
+		return;
+	}
+
+	auto segment = Segment::map(_segment_path, _segment_first_seq, end_seq);
+	if (!segment)
+	{
+		report_error(("mmap() of " + _segment_path).c_str());
+		_seal_failed = true;
+		return;
+	}
+
+	Lock lock(_mutex);
+	_sealed.push_back(std::move(segment));
+	_sealed_end.store(end_seq, std::memory_order_release);
+	const auto hook = _seal_hook;
+	lock.unlock();
+
+	if (hook)
+	{
+		hook(end_seq);
+	}
+}
+
+void WriteAheadLog::remove_segments()
+{
+	for (const auto & segment : list_segments(_dir))
+	{
+		unlink(segment.second.c_str());
+	}
+	sync_dir(_dir);
+}
+
+void WriteAheadLog::report_error(const char * what)
+{
+	DIAG(Wal, Error, what << " failed in " << _dir << ": " << std::strerror(errno));
+}
+
+size_t WriteAheadLog::replay(const std::string & dir, const std::function<void(const MsgView &)> & func)
+{
+	const SegmentFiles segments = list_segments(dir);
+	size_t num_records = 0;
+
+	for (size_t i = 0; i < segments.size(); ++i)
+	{
+		num_records += scan_segment(segments[i].second, i + 1 == segments.size(), func);
+	}
+
+	return num_records;
+}
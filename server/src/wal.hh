@@ -0,0 +1,377 @@
+#ifndef WAL_HH
+#define WAL_HH
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
+
+#include "msgs.hh"
+
+
+namespace Cfg
+{
+	static const size_t wal_segment_bytes = 64 * 1024 * 1024;
+	static const size_t segment_index_stride = 64;
+};
+
+
+namespace WalFormat
+// Segment layout: an 8 byte magic, then records of
+//   RecordHeader | username | body
+// in host byte order. The crc covers everything after the crc field, so
+// a torn write at the tail is caught on replay. The magic's last byte is
+// the format version.
+{
+	static const char magic[8] = {'L', 'O', 'G', 'G', 'W', 'A', 'L', '2'};
+
+	struct RecordHeader
+	{
+		uint32_t crc;
+		uint32_t body_len;
+		uint32_t username_len;
+		uint32_t priority;
+		uint64_t seq;
+		uint64_t time_ms;
+	};
+
+	static_assert(sizeof(RecordHeader) == 32, "RecordHeader must not have padding");
+};
+
+
+class Segment
+// A sealed segment file, mapped read-only. Reading it back walks the
+// records in place: the page cache holds them, not the heap, and no Msg
+// is ever built. A small priority, username and time summary per stride
+// of records lets filtered reads skip most of a segment.
+{
+public:
+
+	// Null if the file can't be mapped
+	static std::shared_ptr<const Segment> map(const std::string & path, Msg::Seq first_seq, Msg::Seq end_seq);
+
+	~Segment();
+
+	Segment(const Segment &) = delete;
+	Segment & operator=(const Segment &) = delete;
+
+	Msg::Seq get_first_seq() const
+	{
+		return _first_seq;
+	}
+
+	// One past the last seq in it
+	Msg::Seq get_end_seq() const
+	{
+		return _end_seq;
+	}
+
+	// The intact ones, which a damaged segment has fewer of than its seqs span
+	size_t get_num_records() const
+	{
+		return _num_records;
+	}
+
+	// How many of them have a seq below seq
+	size_t count_before(Msg::Seq seq) const;
+
+	size_t get_size_bytes() const
+	{
+		return _size;
+	}
+
+	size_t get_index_bytes() const
+	{
+		return _strides.capacity() * sizeof(Stride);
+	}
+
+	// Whether any record in it may fall in range
+	bool overlaps(const TimeRange & range) const
+	{
+		return !_strides.empty() && range.overlaps(_min_ms, _max_ms);
+	}
+
+	template <typename Func>
+	bool for_each(
+		Func && func,
+		Msg::Priority priority_cap = Msg::Priority::Debug,
+		Msg::Seq from_seq = 0,
+		Msg::Seq end_seq = std::numeric_limits<Msg::Seq>::max(),
+		boost::string_ref username = boost::string_ref(),
+		const TimeRange & range = TimeRange()) const
+	// Feeds the records with from_seq <= seq < end_seq that pass
+	// priority_cap, are username's unless that's empty and were stamped
+	// within range, to func as MsgViews, oldest first, for as long as func
+	// returns true. False if func stopped. Strides without a single match
+	// aren't even read, and neither are the ones wholly before from_seq.
+	{
+		const unsigned wanted = ~((1u << static_cast<unsigned>(priority_cap)) - 1);
+		const uint64_t wanted_users = username.empty() ? ~uint64_t(0) : get_user_bit(username);
+		const size_t first_stride = find_stride(from_seq);
+
+		for (size_t i = first_stride; i < _strides.size(); ++i)
+		{
+			if ((_strides[i].priorities & wanted) == 0 || (_strides[i].users & wanted_users) == 0 ||
+				!range.overlaps(_strides[i].min_ms, _strides[i].max_ms))
+			{
+				continue;
+			}
+
+			const size_t end = (i + 1 < _strides.size()) ? _strides[i + 1].offset : _valid_size;
+			for (size_t offset = _strides[i].offset; offset < end; )
+			{
+				WalFormat::RecordHeader header;
+				std::memcpy(&header, _data + offset, sizeof(header));
+
+				if (header.seq >= end_seq)
+				{
+					return true;
+				}
+
+				const boost::string_ref record_username(_data + offset + sizeof(header), header.username_len);
+				if (header.seq >= from_seq && header.priority >= static_cast<uint32_t>(priority_cap) &&
+					(username.empty() || record_username == username) && range.contains(header.time_ms))
+				{
+					const MsgView msg(
+						boost::string_ref(record_username.end(), header.body_len),
+						record_username,
+						static_cast<Msg::Priority>(header.priority),
+						header.seq,
+						header.time_ms);
+					if (!func(msg))
+					{
+						return false;
+					}
+				}
+
+				offset += sizeof(header) + size_t(header.username_len) + header.body_len;
+			}
+		}
+
+		return true;
+	}
+
+private:
+
+	Segment(const char * data, size_t size, Msg::Seq first_seq, Msg::Seq end_seq);
+
+	// Summary of a run of segment_index_stride records
+	struct Stride
+	{
+		size_t offset;
+		Msg::Seq first_seq; // Seqs may skip some, so seeks search these
+		unsigned priorities; // Bit p set if a record of priority p is in it
+		uint64_t users; // get_user_bit() of every username in it, or'ed
+		Msg::Time min_ms; // Records from different shards interleave, so
+		Msg::Time max_ms; // times are only roughly in order
+	};
+
+	// The last stride starting at or before seq, 0 if none does
+	size_t find_stride(Msg::Seq seq) const
+	{
+		const auto after = std::upper_bound(_strides.begin(), _strides.end(), seq,
+			[](Msg::Seq seq, const Stride & stride) { return seq < stride.first_seq; });
+		return (after == _strides.begin()) ? 0 : size_t(after - _strides.begin() - 1);
+	}
+
+	// One bit out of 64, so a stride may be read for nothing, but never skipped wrongly
+	static uint64_t get_user_bit(boost::string_ref username)
+	{
+		return uint64_t(1) << (boost::hash_range(username.begin(), username.end()) % 64);
+	}
+
+	const char * const _data;
+	const size_t _size;
+	const Msg::Seq _first_seq;
+	const Msg::Seq _end_seq;
+
+	// Built when mapped, which is also where the records' bounds and
+	// crcs get checked: reading stops at _valid_size
+	std::vector<Stride> _strides;
+	size_t _valid_size;
+	size_t _num_records;
+	Msg::Time _min_ms;
+	Msg::Time _max_ms;
+};
+
+
+class WriteAheadLog
+// Append-only log of every message the store takes in, kept as a
+// directory of segment files named after the seq of their first record.
+// Appending only copies the record into a pending buffer; a flusher
+// thread writes whatever has piled up with one write() and, as the sync
+// policy says, one fdatasync(). Writers that arrive while a sync is in
+// flight all ride on the next one: that's the group commit.
+//
+// Once a segment is full it's synced, closed and mapped as a Segment.
+// Segments found in dir at startup are taken over the same way.
+{
+public:
+
+	typedef std::unique_lock<std::mutex> Lock;
+	typedef std::vector<std::shared_ptr<const Segment>> Segments;
+
+	struct SyncPolicy
+	{
+		// fdatasync once this many records are written, 0 for no limit
+		size_t every_records = 1;
+
+		// fdatasync at least this often while records are unsynced, 0 for no limit
+		unsigned every_ms = 0;
+
+		// "always", "none", "<n>" records or "<n>ms"
+		static bool from_str(const std::string & str, SyncPolicy & policy);
+
+		std::string to_str() const;
+
+		// Only with a sync per record does a new_log wait for the disk
+		// before it's acknowledged
+		bool acks_after_sync() const
+		{
+			return every_records == 1;
+		}
+	};
+
+	struct Stats
+	{
+		uint64_t records;
+		uint64_t bytes;
+		uint64_t writes;
+		uint64_t syncs;
+		uint64_t segments;
+	};
+
+	// Creates dir if needed, or takes over the segments already in it.
+	// Throws std::runtime_error when it can't, or when they're of another
+	// format version. A segment is sealed once it grows past segment_bytes.
+	WriteAheadLog(const std::string & dir, SyncPolicy policy, size_t segment_bytes = Cfg::wal_segment_bytes);
+
+	// Writes and syncs everything still pending
+	~WriteAheadLog();
+
+	WriteAheadLog(const WriteAheadLog &) = delete;
+	WriteAheadLog & operator=(const WriteAheadLog &) = delete;
+
+	// Hold it across handing out seqs and append() to keep the log in seq order
+	Lock get_lock()
+	{
+		return Lock(_mutex);
+	}
+
+	// Queues a record for the flusher. lock must come from get_lock().
+	void append(
+		const Lock & lock,
+		boost::string_ref body,
+		boost::string_ref username,
+		Msg::Priority priority,
+		Msg::Seq seq,
+		Msg::Time time_ms);
+
+	// Blocks until everything appended so far is on disk. False if the
+	// log has failed to write, in which case nothing is durable any more.
+	bool sync();
+
+	// Drops every record, pending or on disk. For delete_all.
+	void reset();
+
+	const SyncPolicy & get_policy() const
+	{
+		return _policy;
+	}
+
+	Stats get_stats() const;
+
+	// Oldest first. Together they hold every seq before the last one's
+	// end seq; nothing after it.
+	Segments get_sealed_segments() const;
+
+	// Called on the flusher thread after each segment is sealed, with the
+	// new sealed end. It must not wait on anything that waits on the log.
+	void set_seal_hook(std::function<void(Msg::Seq)> hook);
+
+	// End seq of the newest sealed segment, 0 if none
+	Msg::Seq get_sealed_end() const
+	{
+		return _sealed_end.load(std::memory_order_acquire);
+	}
+
+	// The first seq the segments found at startup didn't use
+	Msg::Seq get_next_seq() const
+	{
+		return _next_seq;
+	}
+
+	// Feeds every intact record in dir to func, oldest first, and returns
+	// their number. A torn record at the end of the last segment is cut
+	// off; damage anywhere else skips the rest of that segment.
+	static size_t replay(const std::string & dir, const std::function<void(const MsgView &)> & func);
+
+private:
+
+	typedef std::chrono::steady_clock Clock;
+
+	void flush_loop();
+
+	// Flusher thread only
+	bool write_batch(const std::string & buf, Msg::Seq first_seq);
+	bool sync_segment();
+	bool open_segment(Msg::Seq first_seq);
+	void close_segment();
+	void seal_segment(Msg::Seq end_seq);
+	void remove_segments();
+	void report_error(const char * what);
+
+	const std::string _dir;
+	const SyncPolicy _policy;
+	const size_t _max_segment_bytes;
+	Msg::Seq _next_seq;
+
+	// Everything below is guarded by _mutex, except the current segment,
+	// which only the flusher thread touches
+	mutable std::mutex _mutex;
+	std::condition_variable _flush_cv;
+	std::condition_variable _durable_cv;
+	std::thread _flush_thread;
+
+	std::string _pending;
+	uint64_t _pending_records;
+	Msg::Seq _pending_first_seq;
+
+	// Record counts
+	uint64_t _appended;
+	uint64_t _written;
+	uint64_t _durable;
+	uint64_t _sync_wanted;
+
+	Clock::time_point _last_sync;
+	bool _reset_wanted;
+	bool _failed;
+	bool _stop;
+
+	Stats _stats;
+	Segments _sealed;
+	std::atomic<Msg::Seq> _sealed_end;
+	std::function<void(Msg::Seq)> _seal_hook;
+
+	int _fd;
+	std::string _segment_path;
+	Msg::Seq _segment_first_seq;
+	size_t _segment_bytes;
+	bool _seal_failed;
+};
+
+
+#endif
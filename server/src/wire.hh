@@ -0,0 +1,197 @@
+#ifndef WIRE_HH
+#define WIRE_HH
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <boost/utility/string_ref.hpp>
+
+#include "msgs.hh"
+
+
+namespace WireFormat
+// The binary protocol, an alternative to the text one on the same port.
+// A client opts in by sending hello right after connecting; the server
+// sends it back and from then on both sides speak in frames:
+//
+//   request:  type:u8 | priority:u8 | username_len:u16 | body_len:u32 | username | body
+//   reply:    result:u8 | flags:u8 | reserved:u16 | body_len:u32 | body
+//
+// Integers are little-endian, whatever the host. priority is a
+// Msg::Priority, result a ReqUtils::ResultCode. A reply with More in its
+// flags is followed by another one for the same request, which is how
+// dump_all, dump_user, dump_range and search stream: the messages come as
+// text lines, as in the text protocol, spread over as many replies as it
+// takes. A dump_range's body is from:u64 | to:u64, in milliseconds since
+// the Unix epoch, to excluded; a search's is the term.
+{
+	// Can't start a text request: those are printable
+	static const char hello[4] = {'\0', 'L', 'G', '1'};
+
+	static const size_t header_size = 8;
+
+	enum class FrameType : uint8_t
+	{
+		NewLog = 1,
+		DumpAll = 2,
+		DeleteAll = 3,
+		Stats = 4,
+		DumpUser = 5,
+		DumpRange = 6,
+		Search = 7
+	};
+
+	enum ReplyFlags : uint8_t
+	{
+		More = 1
+	};
+
+	// Views into the bytes it was parsed from
+	struct Frame
+	{
+		uint8_t type;
+		uint8_t priority;
+		boost::string_ref username;
+		boost::string_ref body;
+	};
+
+	struct Reply
+	{
+		uint8_t result;
+		uint8_t flags;
+		boost::string_ref body;
+	};
+
+	enum class ParseStatus
+	{
+		Done,
+		Incomplete, // Wait for more bytes
+		TooLarge    // Give up on the connection
+	};
+
+	inline uint32_t load_le(const char * data, size_t num_bytes)
+	{
+		uint32_t value = 0;
+		for (size_t i = 0; i < num_bytes; ++i)
+		{
+			value |= uint32_t(static_cast<unsigned char>(data[i])) << (8 * i);
+		}
+		return value;
+	}
+
+	inline void append_le(std::string & out, uint32_t value, size_t num_bytes)
+	{
+		for (size_t i = 0; i < num_bytes; ++i)
+		{
+			out += static_cast<char>((value >> (8 * i)) & 0xff);
+		}
+	}
+
+	inline uint64_t load_le64(const char * data)
+	{
+		return uint64_t(load_le(data, 4)) | (uint64_t(load_le(data + 4, 4)) << 32);
+	}
+
+	inline void append_le64(std::string & out, uint64_t value)
+	{
+		append_le(out, uint32_t(value), 4);
+		append_le(out, uint32_t(value >> 32), 4);
+	}
+
+	// The frame at the start of data, of frame_size bytes in all
+	inline ParseStatus parse_frame(
+		const char * data,
+		size_t size,
+		size_t max_frame_size,
+		Frame & frame,
+		size_t & frame_size)
+	{
+		if (size < header_size)
+		{
+			return ParseStatus::Incomplete;
+		}
+
+		const size_t username_len = load_le(data + 2, 2);
+		const size_t body_len = load_le(data + 4, 4);
+		frame_size = header_size + username_len + body_len;
+
+		if (frame_size > max_frame_size)
+		{
+			return ParseStatus::TooLarge;
+		}
+		if (size < frame_size)
+		{
+			return ParseStatus::Incomplete;
+		}
+
+		frame.type = static_cast<uint8_t>(data[0]);
+		frame.priority = static_cast<uint8_t>(data[1]);
+		frame.username = boost::string_ref(data + header_size, username_len);
+		frame.body = boost::string_ref(data + header_size + username_len, body_len);
+		return ParseStatus::Done;
+	}
+
+	inline void append_frame(
+		std::string & out,
+		FrameType type,
+		Msg::Priority priority,
+		boost::string_ref username = boost::string_ref(),
+		boost::string_ref body = boost::string_ref())
+	{
+		out += static_cast<char>(type);
+		out += static_cast<char>(priority);
+		append_le(out, uint32_t(username.size()), 2);
+		append_le(out, uint32_t(body.size()), 4);
+		out.append(username.data(), username.size());
+		out.append(body.data(), body.size());
+	}
+
+	// Same as parse_frame(), for the client side
+	inline ParseStatus parse_reply(const char * data, size_t size, Reply & reply, size_t & reply_size)
+	{
+		if (size < header_size)
+		{
+			return ParseStatus::Incomplete;
+		}
+
+		const size_t body_len = load_le(data + 4, 4);
+		reply_size = header_size + body_len;
+		if (size < reply_size)
+		{
+			return ParseStatus::Incomplete;
+		}
+
+		reply.result = static_cast<uint8_t>(data[0]);
+		reply.flags = static_cast<uint8_t>(data[1]);
+		reply.body = boost::string_ref(data + header_size, body_len);
+		return ParseStatus::Done;
+	}
+
+	// The header of a reply whose body_len bytes of body follow it, over
+	// the header_size bytes at out: for a body built in place behind them
+	inline void write_reply_header(char * out, uint8_t result, uint8_t flags, uint32_t body_len)
+	{
+		out[0] = static_cast<char>(result);
+		out[1] = static_cast<char>(flags);
+		out[2] = 0;
+		out[3] = 0;
+		for (size_t i = 0; i < 4; ++i)
+		{
+			out[4 + i] = static_cast<char>((body_len >> (8 * i)) & 0xff);
+		}
+	}
+
+	inline void append_reply(std::string & out, uint8_t result, uint8_t flags, boost::string_ref body)
+	{
+		out += static_cast<char>(result);
+		out += static_cast<char>(flags);
+		append_le(out, 0, 2);
+		append_le(out, uint32_t(body.size()), 4);
+		out.append(body.data(), body.size());
+	}
+};
+
+
+#endif
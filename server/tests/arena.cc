@@ -0,0 +1,112 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/arena.hh"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE( arena )
+
+BOOST_AUTO_TEST_CASE( arena_append )
+{
+	Arena arena(64);
+
+	std::vector<std::string> strs;
+	std::vector<const char *> ptrs;
+	for (unsigned i = 0; i < 100; ++i)
+	{
+		// Mostly small ones, plus a few bigger than a quarter chunk
+		strs.push_back(std::string((i % 10 == 0) ? 40 : i % 7, char('a' + i % 26)));
+		ptrs.push_back(arena.append(strs.back()));
+	}
+
+	// Nothing moved or got overwritten as chunks were added
+	size_t total = 0;
+	for (size_t i = 0; i < strs.size(); ++i)
+	{
+		BOOST_CHECK(boost::string_ref(ptrs[i], strs[i].size()) == strs[i]);
+		total += strs[i].size();
+	}
+	BOOST_CHECK(arena.get_bytes_used() == total);
+	BOOST_CHECK(arena.get_bytes_reserved() >= total);
+}
+
+BOOST_AUTO_TEST_CASE( arena_reserve )
+{
+	Arena arena(64);
+	arena.reserve(100);
+
+	// Big and small alike land in the one chunk reserved for them
+	const char * first = arena.append(std::string(60, 'a'));
+	const char * second = arena.append(std::string(40, 'b'));
+	BOOST_CHECK(second == first + 60);
+	BOOST_CHECK(arena.get_bytes_reserved() == 100);
+}
+
+BOOST_AUTO_TEST_CASE( symbol_table )
+{
+	SymbolTable symbols;
+
+	SymbolTable::Id alice, bob, empty, again;
+	BOOST_REQUIRE(symbols.intern("alice", alice) && symbols.intern("bob", bob));
+	BOOST_CHECK(alice != bob);
+	BOOST_CHECK(symbols.intern(std::string("alice"), again) && again == alice);
+	BOOST_CHECK(symbols.intern("", empty) && empty == 2);
+	BOOST_CHECK(symbols.size() == 3);
+	BOOST_CHECK(symbols.get_str(alice) == "alice");
+	BOOST_CHECK(symbols.get_str(bob) == "bob");
+	BOOST_CHECK(symbols.get_str(2).empty());
+
+	// Once full, known strings still intern and new ones are refused
+	symbols.set_max_size(4);
+	SymbolTable::Id carol, dave;
+	BOOST_CHECK(symbols.intern("carol", carol) && carol == 3);
+	dave = 1000;
+	BOOST_CHECK(!symbols.intern("dave", dave));
+	BOOST_CHECK(dave == 1000);
+	BOOST_CHECK(symbols.intern("bob", again) && again == bob);
+	BOOST_CHECK(symbols.size() == 4);
+}
+
+BOOST_AUTO_TEST_CASE( symbol_table_concurrency )
+{
+	SymbolTable symbols;
+
+	// Every thread interns the same names, which straddle several id
+	// blocks. They must all agree on the ids.
+	const size_t num_threads = 8;
+	const size_t num_names = 10000;
+
+	std::vector<std::vector<SymbolTable::Id>> ids(num_threads);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < num_threads; ++t)
+	{
+		threads.emplace_back([&symbols, &ids, t]()
+			{
+				for (size_t i = 0; i < num_names; ++i)
+				{
+					// Different threads walk the names in different orders
+					const size_t name = (i * (2 * t + 1)) % num_names;
+					SymbolTable::Id id = 0;
+					BOOST_CHECK(symbols.intern("user" + std::to_string(name), id));
+					BOOST_CHECK(symbols.get_str(id) == "user" + std::to_string(name));
+					ids[t].push_back(id);
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	BOOST_CHECK(symbols.size() == num_names);
+	for (size_t i = 0; i < num_names; ++i)
+	{
+		SymbolTable::Id id = 0;
+		BOOST_CHECK(symbols.intern("user" + std::to_string(i), id));
+		BOOST_CHECK(symbols.get_str(id) == "user" + std::to_string(i));
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,133 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/diag.hh"
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE( diag )
+
+namespace
+{
+
+std::string read_all(FILE * file)
+{
+	std::string contents;
+	std::rewind(file);
+	char buf[4096];
+	size_t n;
+	while ((n = std::fread(buf, 1, sizeof(buf), file)) > 0)
+	{
+		contents.append(buf, n);
+	}
+	return contents;
+}
+
+size_t count_lines(const std::string & str, const std::string & needle)
+{
+	size_t count = 0;
+	for (size_t pos = str.find(needle); pos != std::string::npos; pos = str.find(needle, pos + 1))
+	{
+		++count;
+	}
+	return count;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( levels )
+{
+	Diag::Level level;
+	BOOST_CHECK(Diag::get_level_from_str("trace", level) && level == Diag::Level::Trace);
+	BOOST_CHECK(Diag::get_level_from_str("off", level) && level == Diag::Level::Off);
+	BOOST_CHECK(!Diag::get_level_from_str("verbose", level));
+
+	BOOST_CHECK(Diag::set_levels_from_str("warn"));
+	BOOST_CHECK(Diag::enabled(Diag::Channel::Comm, Diag::Level::Error));
+	BOOST_CHECK(Diag::enabled(Diag::Channel::Comm, Diag::Level::Warn));
+	BOOST_CHECK(!Diag::enabled(Diag::Channel::Comm, Diag::Level::Info));
+
+	BOOST_CHECK(Diag::set_levels_from_str("comm=trace,req=off"));
+	BOOST_CHECK(Diag::get_level(Diag::Channel::Comm) == Diag::Level::Trace);
+	BOOST_CHECK(Diag::get_level(Diag::Channel::Req) == Diag::Level::Off);
+	BOOST_CHECK(Diag::get_level(Diag::Channel::Wal) == Diag::Level::Warn);
+	BOOST_CHECK(!Diag::enabled(Diag::Channel::Req, Diag::Level::Error));
+
+	// All or nothing
+	BOOST_CHECK(!Diag::set_levels_from_str("wal=debug,bogus=info"));
+	BOOST_CHECK(!Diag::set_levels_from_str("wal=loud"));
+	BOOST_CHECK(!Diag::set_levels_from_str("wal"));
+	BOOST_CHECK(Diag::get_level(Diag::Channel::Wal) == Diag::Level::Warn);
+
+	Diag::set_level(Diag::default_level);
+}
+
+BOOST_AUTO_TEST_CASE( disabled_lines_cost_nothing )
+{
+	Diag::set_level(Diag::Level::Info);
+
+	unsigned num_evaluated = 0;
+	auto expensive = [&num_evaluated]()
+		{
+			++num_evaluated;
+			return "expensive";
+		};
+
+	DIAG(Comm, Debug, expensive());
+	DIAG(Comm, Trace, expensive());
+	BOOST_CHECK(num_evaluated == 0);
+
+	Diag::set_level(Diag::Level::Off);
+	DIAG(Server, Error, expensive());
+	BOOST_CHECK(num_evaluated == 0);
+
+	Diag::set_level(Diag::default_level);
+}
+
+BOOST_AUTO_TEST_CASE( async_output )
+{
+	FILE * out = std::tmpfile();
+	BOOST_REQUIRE(out);
+	Diag::set_output(out);
+	Diag::set_level(Diag::Level::Off);
+	Diag::set_level(Diag::Channel::Comm, Diag::Level::Debug);
+
+	// From a few threads at once, fewer than the ring holds
+	const unsigned num_threads = 4;
+	const unsigned num_lines = 200;
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < num_threads; ++t)
+	{
+		threads.emplace_back([t]()
+			{
+				for (unsigned i = 0; i < num_lines; ++i)
+				{
+					DIAG(Comm, Debug, "thread " << t << " line " << i);
+					DIAG(Comm, Trace, "too verbose");
+					DIAG(Req, Error, "wrong channel");
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	Diag::flush();
+	const std::string contents = read_all(out);
+	Diag::set_output(stderr);
+	std::fclose(out);
+
+	BOOST_CHECK(count_lines(contents, " debug comm: thread ") == num_threads * num_lines);
+	BOOST_CHECK(count_lines(contents, "\n") == num_threads * num_lines);
+	BOOST_CHECK(contents.find("too verbose") == std::string::npos);
+	BOOST_CHECK(contents.find("wrong channel") == std::string::npos);
+	BOOST_CHECK(contents.find(" debug comm: thread 3 line 199\n") != std::string::npos);
+	BOOST_CHECK(Diag::get_num_dropped() == 0);
+
+	Diag::set_level(Diag::default_level);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,203 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/ingest.hh"
+#include "../src/msgs.hh"
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+BOOST_AUTO_TEST_SUITE( ingest )
+
+BOOST_AUTO_TEST_CASE( ring_bounds )
+{
+	BoundedRing<std::string> ring(3);
+	BOOST_CHECK(ring.capacity() == 4);
+	BOOST_CHECK(!ring.front_ready());
+
+	for (unsigned i = 0; i < ring.capacity(); ++i)
+	{
+		BOOST_CHECK(ring.try_push(std::to_string(i)));
+	}
+
+	std::string rejected("rejected");
+	BOOST_CHECK(!ring.try_push(std::move(rejected)));
+	BOOST_CHECK(rejected == "rejected");
+	BOOST_CHECK(ring.size_approx() == 4);
+	BOOST_CHECK(ring.front_ready());
+
+	// FIFO, and popping makes room again
+	std::string popped;
+	BOOST_CHECK(ring.try_pop([&popped](std::string && s) { popped = std::move(s); }));
+	BOOST_CHECK(popped == "0");
+	BOOST_CHECK(ring.try_push(std::string("4")));
+
+	std::vector<std::string> rest;
+	while (ring.try_pop([&rest](std::string && s) { rest.push_back(std::move(s)); }))
+	{
+
+	}
+	BOOST_CHECK((rest == std::vector<std::string>{"1", "2", "3", "4"}));
+	BOOST_CHECK(!ring.front_ready());
+}
+
+BOOST_AUTO_TEST_CASE( ring_concurrency )
+{
+	const size_t num_producers = 8;
+	const size_t items_per_producer = 20000;
+
+	BOOST_TEST_MESSAGE("Pushing from " << num_producers << " producers through a 64 slot ring");
+
+	BoundedRing<size_t> ring(64);
+
+	std::vector<std::thread> producers(num_producers);
+	for (size_t p = 0; p < num_producers; ++p)
+	{
+		producers[p] = std::thread([&ring, p]()
+			{
+				for (size_t i = 0; i < items_per_producer; ++i)
+				{
+					size_t item = p * items_per_producer + i;
+					while (!ring.try_push(std::move(item)))
+					{
+						std::this_thread::yield();
+					}
+				}
+			});
+	}
+
+	// Every item arrives exactly once, each producer's items in order
+	std::vector<size_t> next(num_producers, 0);
+	size_t received = 0;
+	bool in_order = true;
+	while (received < num_producers * items_per_producer)
+	{
+		if (!ring.try_pop([&](size_t && item)
+			{
+				const size_t p = item / items_per_producer;
+				in_order = in_order && (item % items_per_producer == next[p]);
+				++next[p];
+				++received;
+			}))
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	for (std::thread & thd : producers)
+	{
+		thd.join();
+	}
+
+	BOOST_CHECK(in_order);
+	BOOST_CHECK(ring.size_approx() == 0);
+}
+
+namespace
+{
+
+IngestRing::Stats run_ingest(MsgQueueWrapper & q_wrapper, IngestRing::OverflowPolicy policy,
+	size_t num_thds, size_t msgs_per_thd, size_t & num_accepted)
+{
+	std::unique_ptr<IngestRing> ingest_ring(new IngestRing(q_wrapper, 16, policy));
+	IngestRing & ring = *ingest_ring;
+	q_wrapper.set_ingest_ring(std::move(ingest_ring));
+
+	std::vector<size_t> accepted(num_thds, 0);
+	std::vector<std::thread> threads(num_thds);
+	for (size_t t = 0; t < num_thds; ++t)
+	{
+		threads[t] = std::thread([&, t]()
+			{
+				for (size_t i = 0; i < msgs_per_thd; ++i)
+				{
+					if (ring.push(Msg(std::to_string(i), std::to_string(t), Msg::Priority::Info)))
+					{
+						++accepted[t];
+					}
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	q_wrapper.sync_ingest();
+
+	num_accepted = 0;
+	for (size_t n : accepted)
+	{
+		num_accepted += n;
+	}
+	return ring.get_stats();
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( overflow_policies )
+{
+	const size_t num_thds = 8;
+	const size_t msgs_per_thd = 5000;
+	const size_t total = num_thds * msgs_per_thd;
+	size_t num_accepted = 0;
+
+	BOOST_TEST_MESSAGE("Overflow policy: block");
+	{
+		MsgQueueWrapper q_wrapper;
+		auto stats = run_ingest(q_wrapper, IngestRing::OverflowPolicy::Block, num_thds, msgs_per_thd, num_accepted);
+		BOOST_CHECK(num_accepted == total);
+		BOOST_CHECK(stats.pushed == total);
+		BOOST_CHECK(stats.drained == total);
+		BOOST_CHECK(stats.dropped == 0 && stats.rejected == 0);
+		BOOST_CHECK(stats.high_watermark <= stats.capacity);
+		BOOST_CHECK(q_wrapper.size() == total);
+
+		// Lossless, so each writer's messages arrive complete and in order
+		std::vector<size_t> next(num_thds, 0);
+		q_wrapper.for_each([&next](const MsgView & msg)
+			{
+				size_t t = size_t(std::stoul(msg.get_username().to_string()));
+				BOOST_CHECK(size_t(std::stoul(msg.get_msg().to_string())) == next[t]);
+				++next[t];
+			});
+	}
+
+	BOOST_TEST_MESSAGE("Overflow policy: drop_oldest");
+	{
+		MsgQueueWrapper q_wrapper;
+		auto stats = run_ingest(q_wrapper, IngestRing::OverflowPolicy::DropOldest, num_thds, msgs_per_thd, num_accepted);
+		BOOST_CHECK(num_accepted == total);
+		BOOST_CHECK(stats.pushed == total);
+		BOOST_CHECK(stats.rejected == 0);
+		BOOST_CHECK(stats.drained + stats.dropped == total);
+		BOOST_CHECK(q_wrapper.size() == total - stats.dropped);
+	}
+
+	BOOST_TEST_MESSAGE("Overflow policy: reject");
+	{
+		MsgQueueWrapper q_wrapper;
+		auto stats = run_ingest(q_wrapper, IngestRing::OverflowPolicy::Reject, num_thds, msgs_per_thd, num_accepted);
+		BOOST_CHECK(stats.pushed == num_accepted);
+		BOOST_CHECK(stats.pushed + stats.rejected == total);
+		BOOST_CHECK(stats.dropped == 0);
+		BOOST_CHECK(q_wrapper.size() == num_accepted);
+	}
+}
+
+BOOST_AUTO_TEST_CASE( refused_usernames )
+{
+	// Eight writers, each under its own username, and room for four
+	MsgQueueWrapper q_wrapper;
+	q_wrapper.set_max_usernames(4);
+
+	size_t num_accepted = 0;
+	auto stats = run_ingest(q_wrapper, IngestRing::OverflowPolicy::Block, 8, 100, num_accepted);
+	BOOST_CHECK(num_accepted == 800);
+	BOOST_CHECK(stats.drained == 800);
+	BOOST_CHECK(stats.refused == 400);
+	BOOST_CHECK(q_wrapper.size() == 400);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,151 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/metrics.hh"
+#include "../src/networking.hh"
+#include "../src/msgs.hh"
+#include "../src/reqs.hh"
+
+#include <boost/asio.hpp>
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+BOOST_AUTO_TEST_SUITE( metrics )
+
+namespace
+{
+
+// The value on the line that starts with name, followed by a space
+uint64_t get_value(const std::string & text, const std::string & name)
+{
+	const size_t pos = text.find("\n" + name + " ");
+	BOOST_REQUIRE(pos != std::string::npos);
+	return std::stoull(text.substr(pos + name.size() + 2));
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( counters_from_many_threads )
+{
+	const unsigned num_threads = 8;
+	const unsigned num_adds = 10000;
+	const uint64_t before = Metrics::get(Metrics::Counter::BytesOut);
+
+	// Twice, so the second round takes over the slots the first let go
+	for (unsigned round = 0; round < 2; ++round)
+	{
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < num_threads; ++t)
+		{
+			threads.emplace_back([]()
+				{
+					for (unsigned i = 0; i < num_adds; ++i)
+					{
+						Metrics::add(Metrics::Counter::BytesOut, 3);
+					}
+				});
+		}
+		for (std::thread & thd : threads)
+		{
+			thd.join();
+		}
+
+		BOOST_CHECK_EQUAL(Metrics::get(Metrics::Counter::BytesOut) - before, uint64_t(3) * num_adds * num_threads * (round + 1));
+	}
+}
+
+BOOST_AUTO_TEST_CASE( histogram_buckets )
+{
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(0), 0u);
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(1), 0u);
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(2), 1u);
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(3), 2u);
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(4), 2u);
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(5), 3u);
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(1024), 10u);
+	BOOST_CHECK_EQUAL(Metrics::get_bucket(uint64_t(1) << 40), Metrics::num_buckets - 1);
+
+	const Metrics::HistogramTotals before = Metrics::get(Metrics::Histogram::ParseNs);
+	Metrics::record(Metrics::Histogram::ParseNs, 100);
+	Metrics::record(Metrics::Histogram::ParseNs, 1000);
+	const Metrics::HistogramTotals after = Metrics::get(Metrics::Histogram::ParseNs);
+
+	BOOST_CHECK_EQUAL(after.count - before.count, 2u);
+	BOOST_CHECK_EQUAL(after.sum - before.sum, 1100u);
+	BOOST_CHECK_EQUAL(after.buckets[7] - before.buckets[7], 1u);
+	BOOST_CHECK_EQUAL(after.buckets[10] - before.buckets[10], 1u);
+}
+
+BOOST_AUTO_TEST_CASE( stats_req )
+{
+	GlobalMsgQueue::init();
+	auto & q_wrapper = GlobalMsgQueue::get_inst();
+	q_wrapper.push(Msg("one", "user", Msg::Priority::Info));
+	q_wrapper.push(Msg("two", "user", Msg::Priority::Info));
+
+	ReqUtils::ResultCode result_code;
+	auto req = Reqs::parse_req_str("stats", result_code);
+	BOOST_REQUIRE(req);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+	BOOST_CHECK(*req == *ReqsUnitTestsUtils::make_stats_req());
+
+	std::ostringstream os;
+	req->serve(q_wrapper, os, result_code);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+
+	const std::string text = os.str();
+	BOOST_CHECK_EQUAL(get_value(text, "logger_queue_msgs"), 2u);
+	BOOST_CHECK(text.find("# TYPE logger_serve_ns histogram") != std::string::npos);
+	BOOST_CHECK(text.find("logger_requests_total{result=\"NewLogQueueFull\"} ") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE( metrics_port )
+{
+	GlobalMsgQueue::init();
+
+	Server server(0, 2);
+	server.serve_metrics(0);
+	server.start();
+
+	boost::asio::io_service io_service;
+	tcp::socket client(io_service);
+	client.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+
+	const std::string reqs = "new_log user info hello\r\nnew_log user bogus hello\r\n";
+	boost::asio::write(client, boost::asio::buffer(reqs));
+	std::string replies;
+	std::vector<char> buf(1024);
+	while (replies.size() < std::string("Ok\nNewLogWrongPriority\n").size())
+	{
+		replies.append(buf.data(), client.read_some(boost::asio::buffer(buf)));
+	}
+	BOOST_CHECK_EQUAL(replies, "Ok\nNewLogWrongPriority\n");
+
+	tcp::socket scraper(io_service);
+	scraper.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_metrics_port()));
+	boost::asio::write(scraper, boost::asio::buffer(std::string("GET /metrics HTTP/1.0\r\n\r\n")));
+
+	std::string text;
+	boost::system::error_code ec;
+	while (!ec)
+	{
+		text.append(buf.data(), scraper.read_some(boost::asio::buffer(buf), ec));
+	}
+
+	server.stop();
+	server.join();
+
+	BOOST_CHECK_EQUAL(text.substr(0, text.find("\r\n")), "HTTP/1.0 200 OK");
+	BOOST_CHECK_GE(get_value(text, "logger_sessions_open"), 1u);
+	BOOST_CHECK_EQUAL(get_value(text, "logger_queue_msgs"), 1u);
+	BOOST_CHECK_GE(get_value(text, "logger_requests_total{result=\"Ok\"}"), 1u);
+	BOOST_CHECK_GE(get_value(text, "logger_requests_total{result=\"NewLogWrongPriority\"}"), 1u);
+	BOOST_CHECK_GE(get_value(text, "logger_bytes_in_total"), reqs.size());
+	BOOST_CHECK_GE(get_value(text, "logger_new_logs_serve_ns_count"), 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,10 @@
 
 #include "../src/msgs.hh"
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <sstream>
 #include <thread>
 #include <vector>
 #include <algorithm>
@@ -13,6 +17,24 @@ BOOST_AUTO_TEST_CASE( trivial )
 	BOOST_CHECK(1);
 }
 
+BOOST_AUTO_TEST_CASE( priority_lookup )
+{
+	for (unsigned i = unsigned(Msg::Priority::Min); i < unsigned(Msg::Priority::Max); ++i)
+	{
+		const auto p = Msg::Priority(i);
+		BOOST_CHECK(Msg::get_priority_from_str(Msg::get_priority_str(p)) == p);
+	}
+
+	// Near misses, including ones hashing to the same slot as a real name
+	static const std::vector<std::string> bad_strs = {
+		"", "d", "debu", "debugg", "Debug", "DEBUG", "dxxxg", "exxxr", "illegal", "info ", " info"
+	};
+	for (const std::string & str : bad_strs)
+	{
+		BOOST_CHECK(Msg::get_priority_from_str(str) == Msg::Priority::Illegal);
+	}
+}
+
 
 // We'll write to this queue concurrently
 // Then check if the results are nice
@@ -26,17 +48,13 @@ struct ThreadFunc
 		{
 			// Write Test
 			{
-				auto q_lock = GlobalMsgQueue::get_lock();
-				auto & q = GlobalMsgQueue::get_queue();
 				//BOOST_TEST_MESSAGE("Thd " << identity.c_str() << " CountDown " << num_msgs << " writing msg");
-				q.emplace_back(msg, identity, pri);
+				GlobalMsgQueue::get_inst().push(Msg(msg, identity, pri));
 			}
 			// Read Test. All msg bodies in the queue shall be identical
 			{
 				auto q_lock = GlobalMsgQueue::get_lock();
-				auto & q = GlobalMsgQueue::get_queue();
-				auto & msg_obj = q.back();
-				BOOST_CHECK(msg_obj.get_msg() == msg);
+				BOOST_CHECK(GlobalMsgQueue::get_inst().back().get_msg() == msg);
 			}
 			num_msgs--;
 		}
@@ -73,12 +91,10 @@ BOOST_AUTO_TEST_CASE( concurrency )
 	BOOST_TEST_MESSAGE("Doing accounting...");
 
 	// Count messages per thread and make sure constants (msg and pri) weren't corrupted
-	MsgQueueWrapper::Queue & q = GlobalMsgQueue::get_queue();
-
 	std::vector<size_t> num_msgs_per_thd(num_threads, 0);
-	for (const Msg & msg : q)
+	GlobalMsgQueue::get_inst().for_each([&](const MsgView & msg)
 	{
-		size_t thd_id = atoi(msg.get_username().c_str());
+		size_t thd_id = std::stoul(msg.get_username().to_string());
 		BOOST_CHECK(msg.get_msg() == default_msg);
 		BOOST_CHECK(msg.get_pri() == default_priority);
 		BOOST_CHECK(thd_id < num_threads);
@@ -86,7 +102,7 @@ BOOST_AUTO_TEST_CASE( concurrency )
 		{
 			++num_msgs_per_thd[thd_id];
 		}
-	}
+	});
 
 	BOOST_CHECK( std::all_of(
 		num_msgs_per_thd.cbegin(),
@@ -98,6 +114,440 @@ BOOST_AUTO_TEST_CASE( concurrency )
 
 }
 
+BOOST_AUTO_TEST_CASE( shard_merge_order )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	const size_t num_threads = 8;
+	const size_t msg_per_thd = 5000;
+
+	BOOST_TEST_MESSAGE("Checking that " << num_threads << " writers over "
+		<< q_wrapper.get_num_shards() << " shards read back in arrival order");
+
+	std::vector<std::thread> threads(num_threads);
+	for (size_t thd_id = 0; thd_id < num_threads; ++thd_id)
+	{
+		threads[thd_id] = std::thread([&q_wrapper, thd_id]()
+			{
+				for (size_t i = 0; i < msg_per_thd; ++i)
+				{
+					q_wrapper.push(Msg(std::to_string(i), std::to_string(thd_id), Msg::Priority::Info));
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	BOOST_CHECK(q_wrapper.size() == num_threads * msg_per_thd);
+
+	// Sequence numbers are dense and strictly increasing, and each
+	// writer's own messages come back in the order it sent them.
+	Msg::Seq expected_seq = 0;
+	std::vector<size_t> next_body(num_threads, 0);
+	q_wrapper.for_each([&](const MsgView & msg)
+	{
+		BOOST_CHECK(msg.get_seq() == expected_seq);
+		++expected_seq;
+
+		size_t thd_id = std::stoul(msg.get_username().to_string());
+		BOOST_CHECK(size_t(std::stoul(msg.get_msg().to_string())) == next_body[thd_id]);
+		++next_body[thd_id];
+	});
+
+	q_wrapper.clear();
+	BOOST_CHECK(q_wrapper.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE( block_storage )
+{
+	MsgQueueWrapper q_wrapper(1);
+
+	// Spill over a few blocks, with a handful of recurring usernames
+	const size_t num_msgs = Cfg::msg_block_records * 3 + 17;
+	const size_t num_users = 5;
+
+	for (size_t i = 0; i < num_msgs; ++i)
+	{
+		const auto pri = Msg::Priority(i % unsigned(Msg::Priority::Max));
+		auto lock = q_wrapper.push(std::string(i % 50, 'x') + std::to_string(i), "user" + std::to_string(i % num_users), pri);
+		BOOST_CHECK(q_wrapper.back() == Msg(std::string(i % 50, 'x') + std::to_string(i), "user" + std::to_string(i % num_users), pri));
+	}
+
+	size_t i = 0;
+	q_wrapper.for_each([&](const MsgView & msg)
+	{
+		const Msg expected(std::string(i % 50, 'x') + std::to_string(i), "user" + std::to_string(i % num_users),
+			Msg::Priority(i % unsigned(Msg::Priority::Max)));
+		BOOST_CHECK(msg == expected);
+		BOOST_CHECK(msg.to_msg() == expected);
+		BOOST_CHECK(msg.get_seq() == i);
+		++i;
+	});
+	BOOST_CHECK(i == num_msgs);
+
+	const auto stats = q_wrapper.get_mem_stats();
+	BOOST_CHECK(stats.num_msgs == num_msgs);
+	BOOST_CHECK(stats.record_bytes >= num_msgs * sizeof(MsgRecord));
+	BOOST_CHECK(stats.body_bytes > 0);
+	BOOST_CHECK(stats.symbol_bytes > 0);
+
+	q_wrapper.clear();
+	BOOST_CHECK(q_wrapper.size() == 0);
+	BOOST_CHECK(q_wrapper.get_mem_stats().body_bytes == 0);
+}
+
+BOOST_AUTO_TEST_CASE( priority_index )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	// Mostly debug, a sprinkle of the rest, from a few threads so the
+	// index gets merged across shards and blocks
+	const size_t num_threads = 4;
+	const size_t msg_per_thd = Cfg::msg_block_records * 2 + 123;
+
+	std::vector<std::thread> threads;
+	for (size_t thd_id = 0; thd_id < num_threads; ++thd_id)
+	{
+		threads.emplace_back([&q_wrapper, thd_id]()
+			{
+				unsigned state = unsigned(thd_id) + 1;
+				for (size_t i = 0; i < msg_per_thd; ++i)
+				{
+					state = state * 1103515245 + 12345;
+					const unsigned roll = (state >> 16) % 1000;
+					const auto pri = (roll < 990) ? Msg::Priority::Debug : Msg::Priority(1 + roll % 4);
+					q_wrapper.push(std::to_string(i), std::to_string(thd_id), pri);
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	std::vector<std::pair<Msg::Seq, Msg::Priority>> all;
+	q_wrapper.for_each([&all](const MsgView & msg) { all.emplace_back(msg.get_seq(), msg.get_priority()); });
+	BOOST_CHECK(all.size() == num_threads * msg_per_thd);
+
+	for (unsigned cap = unsigned(Msg::Priority::Min); cap < unsigned(Msg::Priority::Max); ++cap)
+	{
+		std::vector<std::pair<Msg::Seq, Msg::Priority>> expected;
+		for (const auto & msg : all)
+		{
+			if (unsigned(msg.second) >= cap)
+			{
+				expected.push_back(msg);
+			}
+		}
+
+		std::vector<std::pair<Msg::Seq, Msg::Priority>> filtered;
+		q_wrapper.for_each([&filtered](const MsgView & msg)
+			{
+				filtered.emplace_back(msg.get_seq(), msg.get_priority());
+			},
+			Msg::Priority(cap));
+
+		BOOST_CHECK(filtered == expected);
+	}
+
+	BOOST_CHECK(q_wrapper.get_mem_stats().index_bytes > 0);
+
+	// Nothing to find, nothing visited
+	q_wrapper.clear();
+	q_wrapper.push("quiet", "user", Msg::Priority::Debug);
+	size_t num_visited = 0;
+	q_wrapper.for_each([&num_visited](const MsgView &) { ++num_visited; }, Msg::Priority::Info);
+	BOOST_CHECK(num_visited == 0);
+}
+
+BOOST_AUTO_TEST_CASE( user_index )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	// A few busy users and a rare one, from a few threads so the index
+	// gets merged across shards and blocks
+	const size_t num_threads = 4;
+	const size_t msg_per_thd = Cfg::msg_block_records * 2 + 321;
+
+	std::vector<std::thread> threads;
+	for (size_t thd_id = 0; thd_id < num_threads; ++thd_id)
+	{
+		threads.emplace_back([&q_wrapper, thd_id]()
+			{
+				for (size_t i = 0; i < msg_per_thd; ++i)
+				{
+					const std::string username = (i % 1000 == 7) ? "rare" : "user" + std::to_string(i % 5);
+					q_wrapper.push(std::to_string(thd_id) + ":" + std::to_string(i), username,
+						Msg::Priority((i + thd_id) % unsigned(Msg::Priority::Max)));
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	std::vector<Msg> all;
+	q_wrapper.for_each([&all](const MsgView & msg) { all.push_back(msg.to_msg()); });
+
+	for (const char * username : {"rare", "user3", "nobody"})
+	{
+		for (unsigned cap = unsigned(Msg::Priority::Min); cap < unsigned(Msg::Priority::Max); ++cap)
+		{
+			std::vector<Msg> expected;
+			for (const Msg & msg : all)
+			{
+				if (msg.get_username() == username && unsigned(msg.get_priority()) >= cap)
+				{
+					expected.push_back(msg);
+				}
+			}
+
+			std::vector<Msg> found;
+			q_wrapper.get_user_snapshot(username, Msg::Priority(cap)).visit(
+				[&found](const MsgView & msg)
+				{
+					found.push_back(msg.to_msg());
+					return true;
+				});
+
+			BOOST_CHECK(found == expected);
+			BOOST_CHECK(std::equal(found.begin(), found.end(), expected.begin(), expected.end(),
+				[](const Msg & a, const Msg & b) { return a.get_seq() == b.get_seq(); }));
+		}
+	}
+
+	// Later messages aren't part of it, and visiting resumes where it stopped
+	const auto snapshot = q_wrapper.get_user_snapshot("user3");
+	q_wrapper.push("late", "user3", Msg::Priority::Error);
+
+	std::vector<Msg::Seq> seqs;
+	Msg::Seq from_seq = 0;
+	while (from_seq < snapshot.get_end_seq())
+	{
+		from_seq = snapshot.visit(
+			[&seqs](const MsgView & msg)
+			{
+				seqs.push_back(msg.get_seq());
+				return seqs.size() % 100 != 0;
+			},
+			from_seq);
+	}
+
+	std::vector<Msg::Seq> expected_seqs;
+	for (const Msg & msg : all)
+	{
+		if (msg.get_username() == "user3")
+		{
+			expected_seqs.push_back(msg.get_seq());
+		}
+	}
+	BOOST_CHECK(seqs == expected_seqs);
+}
+
+BOOST_AUTO_TEST_CASE( time_index )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	const auto now_ms = []()
+		{
+			return Msg::Time(std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count());
+		};
+
+	// Pauses now and then, so times spread over a good few milliseconds
+	// and blocks
+	const size_t num_threads = 4;
+	const size_t msg_per_thd = Cfg::msg_block_records * 2 + 321;
+	const Msg::Time start_ms = now_ms();
+
+	std::vector<std::thread> threads;
+	for (size_t thd_id = 0; thd_id < num_threads; ++thd_id)
+	{
+		threads.emplace_back([&q_wrapper, thd_id]()
+			{
+				for (size_t i = 0; i < msg_per_thd; ++i)
+				{
+					q_wrapper.push(std::to_string(thd_id) + ":" + std::to_string(i), "user",
+						Msg::Priority((i + thd_id) % unsigned(Msg::Priority::Max)));
+					if (i % 1000 == 0)
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds(3));
+					}
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	// The clock is coarse, allow for a tick either way
+	const Msg::Time end_ms = now_ms();
+
+	std::vector<Msg> all;
+	q_wrapper.for_each([&all](const MsgView & msg) { all.push_back(msg.to_msg()); });
+	BOOST_REQUIRE(all.size() == num_threads * msg_per_thd);
+
+	std::vector<Msg::Time> times;
+	for (const Msg & msg : all)
+	{
+		BOOST_CHECK(msg.get_time_ms() + 100 >= start_ms && msg.get_time_ms() <= end_ms + 100);
+		times.push_back(msg.get_time_ms());
+	}
+	std::sort(times.begin(), times.end());
+	BOOST_CHECK(times.front() < times.back());
+
+	for (const double from_at : {0.0, 0.1, 0.5, 0.9})
+	{
+		for (const double to_at : {0.2, 0.6, 1.0})
+		{
+			TimeRange range;
+			range.from_ms = times[size_t(from_at * (times.size() - 1))];
+			range.to_ms = times[size_t(to_at * (times.size() - 1))] + (to_at == 1.0);
+
+			for (const Msg::Priority cap : {Msg::Priority::Debug, Msg::Priority::Critical})
+			{
+				std::vector<Msg> expected;
+				for (const Msg & msg : all)
+				{
+					if (range.contains(msg.get_time_ms()) && msg.get_priority() >= cap)
+					{
+						expected.push_back(msg);
+					}
+				}
+
+				std::vector<Msg> found;
+				q_wrapper.for_each([&found](const MsgView & msg) { found.push_back(msg.to_msg()); }, cap, range);
+
+				BOOST_CHECK(found == expected);
+				BOOST_CHECK(std::equal(found.begin(), found.end(), expected.begin(), expected.end(),
+					[](const Msg & a, const Msg & b) { return a.get_seq() == b.get_seq(); }));
+			}
+		}
+	}
+
+	// Nothing before the first message nor after the last
+	TimeRange before;
+	before.to_ms = times.front();
+	TimeRange after;
+	after.from_ms = times.back() + 1;
+	size_t num_found = 0;
+	q_wrapper.for_each([&num_found](const MsgView &) { ++num_found; }, Msg::Priority::Debug, before);
+	q_wrapper.for_each([&num_found](const MsgView &) { ++num_found; }, Msg::Priority::Debug, after);
+	BOOST_CHECK(num_found == 0);
+}
+
+BOOST_AUTO_TEST_CASE( snapshot_reads )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	const size_t num_before = Cfg::msg_block_records + 10;
+	for (size_t i = 0; i < num_before; ++i)
+	{
+		q_wrapper.push(std::to_string(i), "before", Msg::Priority(i % unsigned(Msg::Priority::Max)));
+	}
+
+	// Frozen in time: whatever happens to the store afterwards
+	const auto snapshot = q_wrapper.get_snapshot();
+	BOOST_CHECK(snapshot.get_end_seq() == num_before);
+
+	for (size_t i = 0; i < Cfg::msg_block_records; ++i)
+	{
+		q_wrapper.push(std::to_string(i), "after", Msg::Priority::Error);
+	}
+	BOOST_CHECK(q_wrapper.size() == num_before + Cfg::msg_block_records);
+	q_wrapper.clear();
+	BOOST_CHECK(q_wrapper.size() == 0);
+
+	BOOST_CHECK(snapshot.size() == num_before);
+	size_t num_visited = 0;
+	snapshot.visit([&num_visited](const MsgView & msg)
+		{
+			BOOST_CHECK(msg.get_seq() == num_visited);
+			BOOST_CHECK(msg.get_username() == "before");
+			BOOST_CHECK(msg.get_msg() == std::to_string(num_visited));
+			++num_visited;
+			return true;
+		});
+	BOOST_CHECK(num_visited == num_before);
+
+	// Readers go on while writers append, each seeing a gapless prefix
+	const size_t num_threads = 4;
+	const size_t msg_per_thd = Cfg::msg_block_records * 2;
+	const Msg::Seq first_seq = q_wrapper.get_next_seq();
+
+	std::atomic<bool> done(false);
+	std::thread reader([&q_wrapper, &done, first_seq]()
+		{
+			while (!done)
+			{
+				const auto snapshot = q_wrapper.get_snapshot();
+				Msg::Seq next_seq = first_seq;
+				snapshot.visit([&next_seq](const MsgView & msg)
+					{
+						BOOST_CHECK(msg.get_seq() == next_seq);
+						++next_seq;
+						return true;
+					});
+				BOOST_CHECK(next_seq == snapshot.get_end_seq());
+			}
+		});
+
+	std::vector<std::thread> writers;
+	for (size_t thd_id = 0; thd_id < num_threads; ++thd_id)
+	{
+		writers.emplace_back([&q_wrapper, thd_id]()
+			{
+				for (size_t i = 0; i < msg_per_thd; ++i)
+				{
+					q_wrapper.push(std::to_string(i), std::to_string(thd_id), Msg::Priority::Info);
+				}
+			});
+	}
+	for (std::thread & thd : writers)
+	{
+		thd.join();
+	}
+	done = true;
+	reader.join();
+
+	BOOST_CHECK(q_wrapper.get_snapshot().size() == num_threads * msg_per_thd);
+}
+
+BOOST_AUTO_TEST_CASE( dump_format )
+{
+	MsgQueueWrapper q_wrapper;
+
+	// Empty fields, brackets in them, and every priority
+	q_wrapper.push("", "", Msg::Priority::Debug);
+	q_wrapper.push("m[x] ]", "u]", Msg::Priority::Critical);
+	for (size_t i = 0; i < Cfg::dump_buf_bytes / 16; ++i)
+	{
+		q_wrapper.push("body " + std::to_string(i), "user" + std::to_string(i % 7), Msg::Priority(i % unsigned(Msg::Priority::Max)));
+	}
+
+	// What operator<< and std::endl made of it, before MsgFormat
+	std::ostringstream expected;
+	std::string appended;
+	q_wrapper.for_each([&expected, &appended](const MsgView & msg)
+		{
+			expected << msg << std::endl;
+			BOOST_CHECK(MsgFormat::get_line_size(msg) == msg.get_msg().size() + msg.get_username().size() +
+				std::strlen(Msg::get_priority_str(msg.get_priority())) + 12);
+			MsgFormat::append_line(appended, msg);
+		});
+	BOOST_CHECK(appended == expected.str());
+
+	// Over several of the writer's buffers
+	std::ostringstream dumped;
+	q_wrapper.dump_to_stream(dumped);
+	BOOST_CHECK(dumped.str().size() > Cfg::dump_buf_bytes);
+	BOOST_CHECK(dumped.str() == expected.str());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 
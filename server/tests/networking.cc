@@ -0,0 +1,459 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/networking.hh"
+#include "../src/msgs.hh"
+#include "../src/reqs.hh"
+#include "../src/wire.hh"
+#include "../src/wal.hh"
+#include "../src/ingest.hh"
+#include "utils.hh"
+
+#include <boost/asio.hpp>
+
+#include <string>
+#include <thread>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+using boost::asio::ip::tcp;
+
+BOOST_AUTO_TEST_SUITE( networking )
+
+namespace
+{
+
+std::string round_trip(tcp::socket & socket, const std::string & req_lines, size_t num_reply_lines)
+// Sends (possibly many pipelined) request lines and reads back num_reply_lines lines
+{
+	boost::asio::write(socket, boost::asio::buffer(req_lines));
+
+	std::string reply;
+	std::vector<char> buf(1024);
+	while (size_t(std::count(reply.begin(), reply.end(), '\n')) < num_reply_lines)
+	{
+		size_t n = socket.read_some(boost::asio::buffer(buf));
+		reply.append(buf.data(), n);
+	}
+	return reply;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( concurrent_clients )
+{
+	GlobalMsgQueue::init();
+
+	const unsigned num_io_thds = 4;
+	const unsigned num_clients = 8;
+	const unsigned num_msgs_per_client = 50;
+
+	Server server(0, num_io_thds);
+	server.start();
+
+	BOOST_TEST_MESSAGE("Sending new_logs from " << num_clients << " clients to " << num_io_thds << " IO threads");
+
+	std::vector<std::string> replies(num_clients);
+	std::vector<std::thread> clients(num_clients);
+	for (unsigned i = 0; i < num_clients; ++i)
+	{
+		clients[i] = std::thread([&, i]()
+			{
+				boost::asio::io_service io_service;
+				tcp::socket socket(io_service);
+				socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+
+				std::string lines;
+				for (unsigned j = 0; j < num_msgs_per_client; ++j)
+				{
+					lines += "new_log user" + std::to_string(i) + " warning msg " + std::to_string(j) + "\r\n";
+				}
+				replies[i] = round_trip(socket, lines, num_msgs_per_client);
+			});
+	}
+	for (std::thread & thd : clients)
+	{
+		thd.join();
+	}
+
+	std::string all_ok;
+	for (unsigned j = 0; j < num_msgs_per_client; ++j)
+	{
+		all_ok += "Ok\n";
+	}
+	for (const std::string & reply : replies)
+	{
+		BOOST_CHECK(reply == all_ok);
+	}
+
+	BOOST_TEST_MESSAGE("Reading everything back with dump_all");
+	boost::asio::io_service io_service;
+	tcp::socket socket(io_service);
+	socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+
+	const size_t num_msgs = size_t(num_clients) * num_msgs_per_client;
+	std::string dump = round_trip(socket, "dump_all debug\r\n", num_msgs + 1);
+	BOOST_CHECK(dump.compare(0, 3, "Ok\n") == 0);
+	BOOST_CHECK(size_t(std::count(dump.begin(), dump.end(), '\n')) == num_msgs + 1);
+
+	server.stop();
+	server.join();
+}
+
+BOOST_AUTO_TEST_CASE( streamed_dump_all )
+{
+	GlobalMsgQueue::init();
+	auto & q_wrapper = GlobalMsgQueue::get_inst();
+	q_wrapper.clear();
+
+	// Several chunks' worth
+	const size_t num_msgs = 20000;
+	for (size_t i = 0; i < num_msgs; ++i)
+	{
+		q_wrapper.push(Msg("streamed msg " + std::to_string(i), "user", Msg::Priority::Info));
+	}
+
+	Server server(0, 2);
+	server.start();
+
+	boost::asio::io_service io_service;
+	tcp::socket socket(io_service);
+	socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+
+	// The new_log right behind the dump is answered only once the dump is
+	// all out, and isn't part of it
+	std::string reply = round_trip(socket, "dump_all debug\r\nnew_log user error after\r\n", num_msgs + 2);
+	BOOST_CHECK(size_t(std::count(reply.begin(), reply.end(), '\n')) == num_msgs + 2);
+	BOOST_CHECK(reply.compare(0, 3, "Ok\n") == 0);
+	BOOST_CHECK(reply.find("u[user] p[info] m[streamed msg 0]\n") == 3);
+	BOOST_CHECK(reply.find("after") == std::string::npos);
+	const std::string tail = "u[user] p[info] m[streamed msg 19999]\nOk\n";
+	BOOST_CHECK(reply.compare(reply.size() - tail.size(), tail.size(), tail) == 0);
+
+	q_wrapper.clear();
+	server.stop();
+	server.join();
+}
+
+BOOST_AUTO_TEST_CASE( pipelined_reqs )
+{
+	GlobalMsgQueue::init();
+
+	Server server(0, 2);
+	server.start();
+
+	boost::asio::io_service io_service;
+	tcp::socket socket(io_service);
+	socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+
+	// new_logs batch up around the other requests, but every reply comes
+	// back in request order. Non-printables are dropped, and the last line
+	// arrives in three pieces, the delimiter split between two of them.
+	boost::asio::write(socket, boost::asio::buffer(std::string(
+		"new_log alice info one\r\n"
+		"new_log bob error two\r\n"
+		"new_log carol loud three\r\n"
+		"\r\n"
+		"dump_all error\r\n"
+		"new_log alice error f\tour \x01\r\n"
+		"bogus\r\n"
+		"new_log bob error fi")));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	boost::asio::write(socket, boost::asio::buffer(std::string("ve\r")));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+	const std::string reply = round_trip(socket, "\ndump_all error\r\n", 12);
+	BOOST_CHECK(reply ==
+		"Ok\n"
+		"Ok\n"
+		"NewLogWrongPriority\n"
+		"Ok\n"
+		"u[bob] p[error] m[two]\n"
+		"Ok\n"
+		"UnknownReqType\n"
+		"Ok\n"
+		"Ok\n"
+		"u[bob] p[error] m[two]\n"
+		"u[alice] p[error] m[four]\n"
+		"u[bob] p[error] m[five]\n");
+
+	server.stop();
+	server.join();
+}
+
+BOOST_AUTO_TEST_CASE( new_log_batch )
+{
+	GlobalMsgQueue::init();
+
+	Server server(0, 2);
+	server.start();
+
+	boost::asio::io_service io_service;
+	tcp::socket socket(io_service);
+	socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+
+	// Way past a socket buffer, answered with a single Ok
+	const size_t num_msgs = 10000;
+	std::vector<Msg> msgs;
+	for (size_t i = 0; i < num_msgs; ++i)
+	{
+		msgs.emplace_back("shipped line " + std::to_string(i), "shipper", Msg::Priority::Info);
+	}
+	const std::string frame = ReqsUnitTestsUtils::make_new_log_batch_str(msgs) + "\r\n";
+
+	BOOST_CHECK(round_trip(socket, frame, 1) == "Ok\n");
+	BOOST_CHECK(GlobalMsgQueue::get_inst().size() == num_msgs);
+	BOOST_CHECK(round_trip(socket, "new_log_batch 2 a info 1 x\r\n", 1) == "NewLogBatchBadFrame\n");
+
+	// Lengths count the bytes as sent: nothing is trimmed or filtered out
+	// before the frame is parsed, and what would be is refused
+	BOOST_CHECK(round_trip(socket, "new_log_batch 1 a info 7 spaced \r\n", 1) == "Ok\n");
+	std::vector<Msg> last;
+	GlobalMsgQueue::get_inst().for_each([&last](const MsgView & msg) { last.assign(1, msg.to_msg()); });
+	BOOST_REQUIRE(last.size() == 1);
+	BOOST_CHECK(last[0].get_msg() == "spaced ");
+	BOOST_CHECK(round_trip(socket, "new_log_batch 1 a info 3 x\x01y\r\n", 1) == "NewLogBatchBadFrame\n");
+
+	// Other lines are held to a few KiB
+	const std::string long_line = "new_log a info " + std::string(64 * 1024, 'x') + "\r\n";
+	boost::system::error_code ec;
+	boost::asio::write(socket, boost::asio::buffer(long_line), ec);
+	std::vector<char> buf(1024);
+	size_t num_read = 0;
+	while (!ec)
+	{
+		num_read += socket.read_some(boost::asio::buffer(buf), ec);
+	}
+	BOOST_CHECK(num_read == 0);
+	BOOST_CHECK(GlobalMsgQueue::get_inst().size() == num_msgs + 1);
+
+	server.stop();
+	server.join();
+}
+
+BOOST_AUTO_TEST_CASE( durable_acks )
+{
+	TempDir dir;
+
+	// The ring's on by default, but with a sync per record an Ok has to
+	// wait for the disk, whichever protocol it came by
+	GlobalMsgQueue::init();
+	auto & q_wrapper = GlobalMsgQueue::get_inst();
+	WriteAheadLog::SyncPolicy policy;
+	BOOST_REQUIRE(WriteAheadLog::SyncPolicy::from_str("always", policy));
+	q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir.path, policy)));
+	q_wrapper.set_ingest_ring(std::unique_ptr<IngestRing>(new IngestRing(q_wrapper)));
+
+	Server server(0, 2);
+	server.start();
+
+	auto num_on_disk = [&dir]()
+	{
+		return WriteAheadLog::replay(dir.path, [](const MsgView &) {});
+	};
+
+	boost::asio::io_service io_service;
+	tcp::socket text_socket(io_service);
+	text_socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+	for (size_t i = 0; i < 10; ++i)
+	{
+		BOOST_CHECK(round_trip(text_socket, "new_log alice info durable " + std::to_string(i) + "\r\n", 1) == "Ok\n");
+		BOOST_CHECK(num_on_disk() == i + 1);
+	}
+
+	tcp::socket binary_socket(io_service);
+	binary_socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+	boost::asio::write(binary_socket, boost::asio::buffer(WireFormat::hello, sizeof(WireFormat::hello)));
+	char hello[sizeof(WireFormat::hello)];
+	boost::asio::read(binary_socket, boost::asio::buffer(hello));
+
+	std::string frame;
+	WireFormat::append_frame(frame, WireFormat::FrameType::NewLog, Msg::Priority::Info, "bob", "durable too");
+	boost::asio::write(binary_socket, boost::asio::buffer(frame));
+	char reply[WireFormat::header_size];
+	boost::asio::read(binary_socket, boost::asio::buffer(reply));
+	BOOST_CHECK(uint8_t(reply[0]) == uint8_t(ReqUtils::ResultCode::Ok));
+	BOOST_CHECK(num_on_disk() == 11);
+
+	BOOST_CHECK(q_wrapper.get_ingest_ring()->get_stats().pushed == 0);
+
+	server.stop();
+	server.join();
+
+	// Lets go of the log before dir goes
+	GlobalMsgQueue::init();
+}
+
+BOOST_AUTO_TEST_CASE( binary_protocol )
+{
+	GlobalMsgQueue::init();
+	auto & q_wrapper = GlobalMsgQueue::get_inst();
+	q_wrapper.clear();
+
+	Server server(0, 2);
+	server.start();
+
+	boost::asio::io_service io_service;
+	tcp::socket socket(io_service);
+	socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.get_port()));
+
+	std::string in;
+	std::vector<char> buf(4096);
+	auto read_reply = [&](WireFormat::Reply & reply)
+	{
+		size_t reply_size = 0;
+		while (WireFormat::parse_reply(in.data(), in.size(), reply, reply_size) != WireFormat::ParseStatus::Done)
+		{
+			size_t n = socket.read_some(boost::asio::buffer(buf));
+			in.append(buf.data(), n);
+		}
+		const std::string body = reply.body.to_string();
+		in.erase(0, reply_size);
+		reply.body = boost::string_ref();
+		return body;
+	};
+
+	BOOST_TEST_MESSAGE("Hello is echoed back");
+	boost::asio::write(socket, boost::asio::buffer(WireFormat::hello, sizeof(WireFormat::hello)));
+	char hello[sizeof(WireFormat::hello)];
+	boost::asio::read(socket, boost::asio::buffer(hello));
+	BOOST_CHECK(std::equal(hello, hello + sizeof(hello), WireFormat::hello));
+
+	BOOST_TEST_MESSAGE("new_log frames, one reply each");
+	std::string frames;
+	WireFormat::append_frame(frames, WireFormat::FrameType::NewLog, Msg::Priority::Info, "alice", "one");
+	WireFormat::append_frame(frames, WireFormat::FrameType::NewLog, Msg::Priority::Max, "bob", "bad priority");
+	WireFormat::append_frame(frames, WireFormat::FrameType::NewLog, Msg::Priority::Error, "carol", "two");
+	WireFormat::append_frame(frames, WireFormat::FrameType::NewLog, Msg::Priority::Error, "dave");
+	WireFormat::append_frame(frames, WireFormat::FrameType::NewLog, Msg::Priority::Error, "eve", "x]\nu[root] p[error] m[forged");
+	boost::asio::write(socket, boost::asio::buffer(frames));
+
+	const uint8_t expected[] = {
+		uint8_t(ReqUtils::ResultCode::Ok),
+		uint8_t(ReqUtils::ResultCode::NewLogWrongPriority),
+		uint8_t(ReqUtils::ResultCode::Ok),
+		uint8_t(ReqUtils::ResultCode::NewLogTooFewArgs),
+		uint8_t(ReqUtils::ResultCode::NewLogBadBytes)};
+	for (uint8_t result : expected)
+	{
+		WireFormat::Reply reply;
+		BOOST_CHECK(read_reply(reply).empty());
+		BOOST_CHECK(reply.result == result);
+		BOOST_CHECK(reply.flags == 0);
+	}
+	BOOST_CHECK(q_wrapper.size() == 2);
+
+	BOOST_TEST_MESSAGE("dump_all streams over frames flagged More");
+	for (size_t i = 0; i < 20000; ++i)
+	{
+		q_wrapper.push(Msg("streamed msg " + std::to_string(i), "user", Msg::Priority::Debug));
+	}
+	frames.clear();
+	WireFormat::append_frame(frames, WireFormat::FrameType::DumpAll, Msg::Priority::Debug);
+	boost::asio::write(socket, boost::asio::buffer(frames));
+
+	std::string dump;
+	size_t num_replies = 0;
+	WireFormat::Reply reply;
+	do
+	{
+		dump += read_reply(reply);
+		BOOST_CHECK(reply.result == uint8_t(ReqUtils::ResultCode::Ok));
+		++num_replies;
+	}
+	while (reply.flags & WireFormat::More);
+
+	BOOST_CHECK(num_replies > 2);
+	BOOST_CHECK(size_t(std::count(dump.begin(), dump.end(), '\n')) == 20002);
+	BOOST_CHECK(dump.find("u[alice] p[info] m[one]\nu[carol] p[error] m[two]\n") == 0);
+
+	BOOST_TEST_MESSAGE("dump_range takes its ends in the body");
+	std::string range;
+	WireFormat::append_le64(range, 0);
+	WireFormat::append_le64(range, std::numeric_limits<uint64_t>::max());
+	frames.clear();
+	WireFormat::append_frame(frames, WireFormat::FrameType::DumpRange, Msg::Priority::Error, "", range);
+	WireFormat::append_frame(frames, WireFormat::FrameType::DumpRange, Msg::Priority::Error, "", range.substr(8));
+	boost::asio::write(socket, boost::asio::buffer(frames));
+
+	dump.clear();
+	do
+	{
+		dump += read_reply(reply);
+		BOOST_CHECK(reply.result == uint8_t(ReqUtils::ResultCode::Ok));
+	}
+	while (reply.flags & WireFormat::More);
+	BOOST_CHECK(dump == "u[carol] p[error] m[two]\n");
+	BOOST_CHECK(read_reply(reply).empty());
+	BOOST_CHECK(reply.result == uint8_t(ReqUtils::ResultCode::DumpRangeTooFewArgs));
+
+	BOOST_TEST_MESSAGE("search takes its term in the body");
+	frames.clear();
+	WireFormat::append_frame(frames, WireFormat::FrameType::Search, Msg::Priority::Debug, "", "TWO");
+	boost::asio::write(socket, boost::asio::buffer(frames));
+
+	dump.clear();
+	do
+	{
+		dump += read_reply(reply);
+		BOOST_CHECK(reply.result == uint8_t(ReqUtils::ResultCode::Ok));
+	}
+	while (reply.flags & WireFormat::More);
+	BOOST_CHECK(dump == "u[carol] p[error] m[two]\n");
+
+	BOOST_TEST_MESSAGE("delete_all, then an unknown frame type");
+	frames.clear();
+	WireFormat::append_frame(frames, WireFormat::FrameType::DeleteAll, Msg::Priority::Debug);
+	frames += std::string("\x7f\0\0\0\0\0\0\0", 8);
+	boost::asio::write(socket, boost::asio::buffer(frames));
+
+	BOOST_CHECK(read_reply(reply).empty());
+	BOOST_CHECK(reply.result == uint8_t(ReqUtils::ResultCode::Ok));
+	BOOST_CHECK(q_wrapper.size() == 0);
+	read_reply(reply);
+	BOOST_CHECK(reply.result == uint8_t(ReqUtils::ResultCode::UnknownReqType));
+
+	server.stop();
+	server.join();
+}
+
+BOOST_AUTO_TEST_CASE( metrics_requests )
+{
+	GlobalMsgQueue::init();
+
+	Server server(0, 1);
+	server.serve_metrics(0);
+	server.start();
+
+	boost::asio::io_service io_service;
+	const tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), server.get_metrics_port());
+
+	{
+		tcp::socket socket(io_service);
+		socket.connect(endpoint);
+		const std::string reply = round_trip(socket, "GET /metrics HTTP/1.0\r\n\r\n", 1);
+		BOOST_CHECK(reply.compare(0, 15, "HTTP/1.0 200 OK") == 0);
+	}
+
+	// Headers that never end are cut off, not buffered for good
+	{
+		tcp::socket socket(io_service);
+		socket.connect(endpoint);
+		boost::system::error_code ec;
+		boost::asio::write(socket, boost::asio::buffer("GET /metrics HTTP/1.0\r\n" + std::string(64 * 1024, 'x')), ec);
+
+		std::vector<char> buf(1024);
+		size_t num_read = 0;
+		while (!ec)
+		{
+			num_read += socket.read_some(boost::asio::buffer(buf), ec);
+		}
+		BOOST_CHECK(num_read == 0);
+	}
+
+	server.stop();
+	server.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
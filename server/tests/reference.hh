@@ -0,0 +1,133 @@
+#ifndef TEST_REFERENCE_HH
+#define TEST_REFERENCE_HH
+
+#include "../src/reqs.hh"
+#include "../src/msgs.hh"
+#include "../src/sanitize.hh"
+
+#include <algorithm>
+#include <forward_list>
+#include <regex>
+#include <string>
+#include <cctype>
+
+#include <boost/utility/string_ref.hpp>
+
+
+namespace Reference
+// Former implementations of what the server now does faster, kept to
+// check the new ones against in tests and race them in benchmarks. Not
+// built into the server.
+{
+	inline Reqs::ReqBaseUnqPtr parse_req_str_regex(const std::string & req_str, ReqUtils::ResultCode & result_code)
+	// The original std::regex based Reqs::parse_req_str(), for the requests it knew
+	{
+		result_code = ReqUtils::ResultCode::UnknownError;
+
+		std::smatch matches;
+		std::regex_search(req_str, matches, std::regex("^\\s*(\\S+)\\s*"));
+
+		if (matches.size() < 2)
+		{
+			result_code = ReqUtils::ResultCode::TooFewArgs;
+			return nullptr;
+		}
+
+		const std::string req_type_str = matches[1];
+		const std::string additional_args = matches.suffix();
+
+		if (req_type_str == "new_log")
+		{
+			std::regex_search(additional_args, matches, std::regex("^\\s*(\\S+)\\s+(\\S+)\\s+(.+)"));
+			if (matches.size() < 4)
+			{
+				result_code = ReqUtils::ResultCode::NewLogTooFewArgs;
+				return nullptr;
+			}
+
+			const Msg::Priority pri = Msg::get_priority_from_str(matches[2].str());
+			if (pri == Msg::Priority::Illegal)
+			{
+				result_code = ReqUtils::ResultCode::NewLogWrongPriority;
+				return nullptr;
+			}
+
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqsUnitTestsUtils::make_new_log_req(matches[3], matches[1], pri);
+		}
+
+		if (req_type_str == "dump_all")
+		{
+			std::regex_search(additional_args, matches, std::regex("^\\s*(\\S+)\\s*"));
+			if (matches.size() < 2)
+			{
+				result_code = ReqUtils::ResultCode::DumpAllTooFewArgs;
+				return nullptr;
+			}
+
+			const Msg::Priority pri = Msg::get_priority_from_str(matches[1].str());
+			if (pri == Msg::Priority::Illegal)
+			{
+				result_code = ReqUtils::ResultCode::DumpAllWrongPriority;
+				return nullptr;
+			}
+
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqsUnitTestsUtils::make_dump_all_req(pri);
+		}
+
+		if (req_type_str == "delete_all")
+		{
+			result_code = ReqUtils::ResultCode::Ok;
+			return ReqsUnitTestsUtils::make_delete_all_req();
+		}
+
+		result_code = ReqUtils::ResultCode::UnknownReqType;
+		return nullptr;
+	}
+
+	inline boost::string_ref sanitize(boost::string_ref line, std::forward_list<std::string> & filtered_lines)
+	// The byte at a time Sanitize::sanitize(), on isprint() and isspace()
+	{
+		// Trim trailing whitespace
+
+		if (Cfg::req_trim_trailing_whitespaces)
+		{
+			while (!line.empty())
+			{
+				char trailing_char = line.back();
+				if (!isprint(trailing_char) || isspace(trailing_char))
+				{
+					line.remove_suffix(1);
+				}
+				else
+				{
+					break;
+				}
+			}
+		}
+
+		// Delete all non-printables
+
+		auto is_non_printable = [](char c)
+			{
+				return !isprint(c);
+			};
+
+		if (Cfg::req_filter_out_non_printable_chars &&
+			std::any_of(line.begin(), line.end(), is_non_printable))
+		{
+			filtered_lines.emplace_front(line.begin(), line.end());
+			std::string & filtered = filtered_lines.front();
+			filtered.erase(
+				std::remove_if(filtered.begin(), filtered.end(), is_non_printable),
+				filtered.end());
+			return filtered;
+		}
+
+		return line;
+	}
+};
+
+
+#endif
@@ -6,6 +6,7 @@
 #include "../src/msgs.hh"
 
 #include "utils.hh"
+#include "reference.hh"
 
 #include <iostream>
 #include <sstream>
@@ -14,6 +15,9 @@
 #include <utility>
 
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 
 #include <cstdlib>
 #include <ctime>
@@ -92,6 +96,72 @@ BOOST_AUTO_TEST_CASE( good_dump_all )
 	}
 }
 
+BOOST_AUTO_TEST_CASE( good_dump_user )
+{
+	BOOST_TEST_MESSAGE("Checking correct generation of dump_user requests from strings");
+
+	for (unsigned i = 0; i < unsigned(Msg::Priority::Max); ++i)
+	{
+		const auto p = Msg::Priority(i);
+		const std::string req_str = " dump_user \tJohnDoe  " + std::string(Msg::get_priority_str(p)) + " ";
+
+		ReqUtils::ResultCode ec;
+		auto req_ptr = Reqs::parse_req_str(req_str, ec);
+		BOOST_REQUIRE(req_ptr != nullptr);
+		BOOST_CHECK( *req_ptr == *ReqsUnitTestsUtils::make_dump_user_req("JohnDoe", p) );
+		BOOST_CHECK( *req_ptr != *ReqsUnitTestsUtils::make_dump_user_req("JaneDoe", p) );
+		BOOST_CHECK( *req_ptr != *ReqsUnitTestsUtils::make_dump_all_req(p) );
+		BOOST_CHECK( ec == ReqUtils::ResultCode::Ok );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( good_dump_range )
+{
+	BOOST_TEST_MESSAGE("Checking correct generation of dump_range requests from strings");
+
+	TimeRange range;
+	range.from_ms = 1500000000000;
+	range.to_ms = 1500000060000;
+
+	for (unsigned i = 0; i < unsigned(Msg::Priority::Max); ++i)
+	{
+		const auto p = Msg::Priority(i);
+		const std::string req_str = "dump_range  1500000000000\t1500000060000 " + std::string(Msg::get_priority_str(p));
+
+		ReqUtils::ResultCode ec;
+		auto req_ptr = Reqs::parse_req_str(req_str, ec);
+		BOOST_REQUIRE(req_ptr != nullptr);
+		BOOST_CHECK( *req_ptr == *ReqsUnitTestsUtils::make_dump_range_req(range, p) );
+		BOOST_CHECK( *req_ptr != *ReqsUnitTestsUtils::make_dump_range_req(TimeRange(), p) );
+		BOOST_CHECK( *req_ptr != *ReqsUnitTestsUtils::make_dump_all_req(p) );
+		BOOST_CHECK( ec == ReqUtils::ResultCode::Ok );
+	}
+}
+
+BOOST_AUTO_TEST_CASE( good_search )
+{
+	BOOST_TEST_MESSAGE("Checking correct generation of search requests from strings");
+
+	for (unsigned i = 0; i < unsigned(Msg::Priority::Max); ++i)
+	{
+		const auto p = Msg::Priority(i);
+		const std::string req_str = "search  conn-reset\t" + std::string(Msg::get_priority_str(p)) + " ";
+
+		ReqUtils::ResultCode ec;
+		auto req_ptr = Reqs::parse_req_str(req_str, ec);
+		BOOST_REQUIRE(req_ptr != nullptr);
+		BOOST_CHECK( *req_ptr == *ReqsUnitTestsUtils::make_search_req("conn-reset", p) );
+		BOOST_CHECK( *req_ptr != *ReqsUnitTestsUtils::make_search_req("conn", p) );
+		BOOST_CHECK( ec == ReqUtils::ResultCode::Ok );
+	}
+
+	// The priority is optional
+	ReqUtils::ResultCode ec;
+	auto req_ptr = Reqs::parse_req_str("search timeout", ec);
+	BOOST_REQUIRE(req_ptr != nullptr);
+	BOOST_CHECK( *req_ptr == *ReqsUnitTestsUtils::make_search_req("timeout", Msg::Priority::Debug) );
+}
+
 BOOST_AUTO_TEST_CASE( good_delete_all )
 {
 	BOOST_TEST_MESSAGE("Checking correct generation of delete_all requests from strings");
@@ -118,6 +188,19 @@ BOOST_AUTO_TEST_CASE( bad_reqs )
 			std::make_pair("new_log Joe wrong_priority important_message", ReqUtils::ResultCode::NewLogWrongPriority),
 			std::make_pair("dump_all", ReqUtils::ResultCode::DumpAllTooFewArgs),
 			std::make_pair("dump_all haha_this_priority_doesnt_exist", ReqUtils::ResultCode::DumpAllWrongPriority),
+			std::make_pair("dump_user", ReqUtils::ResultCode::DumpUserTooFewArgs),
+			std::make_pair("dump_user Joe", ReqUtils::ResultCode::DumpUserTooFewArgs),
+			std::make_pair("dump_user Joe loud", ReqUtils::ResultCode::DumpUserWrongPriority),
+			std::make_pair("dump_range", ReqUtils::ResultCode::DumpRangeTooFewArgs),
+			std::make_pair("dump_range 0 10", ReqUtils::ResultCode::DumpRangeTooFewArgs),
+			std::make_pair("dump_range 0 1m info", ReqUtils::ResultCode::DumpRangeBadTime),
+			std::make_pair("dump_range -5 10 info", ReqUtils::ResultCode::DumpRangeBadTime),
+			std::make_pair("dump_range 10 5 info", ReqUtils::ResultCode::DumpRangeBadTime),
+			std::make_pair("dump_range 0 99999999999999999999 info", ReqUtils::ResultCode::DumpRangeBadTime),
+			std::make_pair("dump_range 0 10 loud", ReqUtils::ResultCode::DumpRangeWrongPriority),
+			std::make_pair("search", ReqUtils::ResultCode::SearchTooFewArgs),
+			std::make_pair("search -- info", ReqUtils::ResultCode::SearchBadTerm),
+			std::make_pair("search timeout loud", ReqUtils::ResultCode::SearchWrongPriority),
 			std::make_pair("magic", ReqUtils::ResultCode::UnknownReqType),
 			std::make_pair("areyoukiddingmeicanteventhinkofagoodtestcase", ReqUtils::ResultCode::UnknownReqType)
 		};
@@ -135,14 +218,59 @@ BOOST_AUTO_TEST_CASE( bad_reqs )
 
 }
 
+BOOST_AUTO_TEST_CASE( regex_equivalence )
+{
+	// The hand written parser must agree with the old std::regex one on
+	// everything, including odd whitespace and line terminators.
+	srand(rand_seed);
+	const unsigned num_cases = 5000;
+
+	static const std::vector<std::string> vocabulary = {
+		"new_log", "dump_all", "delete_all", "magic",
+		"debug", "info", "warning", "critical", "error", "illegal", "Error"
+	};
+	static const std::string whitespace_chars(" \t\n\r\v\f");
+
+	BOOST_TEST_MESSAGE("Comparing hand written and regex parsers on " << num_cases << " random strings");
+
+	for (unsigned i = 0; i < num_cases; ++i)
+	{
+		std::string req_str;
+		const unsigned num_parts = unsigned(rand()) % 7;
+		for (unsigned part = 0; part <= num_parts; ++part)
+		{
+			const unsigned num_ws = unsigned(rand()) % 3;
+			for (unsigned w = 0; w < num_ws; ++w)
+			{
+				req_str += whitespace_chars[unsigned(rand()) % whitespace_chars.size()];
+			}
+			if (part < num_parts)
+			{
+				req_str += (rand() % 3) ? vocabulary[unsigned(rand()) % vocabulary.size()] : random_token();
+			}
+		}
+
+		ReqUtils::ResultCode ec;
+		ReqUtils::ResultCode ec_regex;
+		auto req_ptr = Reqs::parse_req_str(req_str, ec);
+		auto req_regex_ptr = Reference::parse_req_str_regex(req_str, ec_regex);
+
+		BOOST_CHECK(ec == ec_regex);
+		BOOST_CHECK((req_ptr == nullptr) == (req_regex_ptr == nullptr));
+		if (req_ptr != nullptr && req_regex_ptr != nullptr)
+		{
+			BOOST_CHECK(*req_ptr == *req_regex_ptr);
+		}
+	}
+}
+
 BOOST_AUTO_TEST_CASE( serve_reqs )
 {
 	GlobalMsgQueue::init();
 	srand(rand_seed);
 
 	auto & q_wrapper = GlobalMsgQueue::get_inst();
-	auto & q = GlobalMsgQueue::get_queue();
-	q.clear();
+	q_wrapper.clear();
 
 	// New Log: Read and Write test
 	const unsigned num_thds = 32;
@@ -165,14 +293,13 @@ BOOST_AUTO_TEST_CASE( serve_reqs )
 				auto req_ptr = ReqsUnitTestsUtils::make_new_log_req(message, username, p);
 
 				auto & q_wrapper = GlobalMsgQueue::get_inst();
-				auto & q = GlobalMsgQueue::get_queue();
 				std::ostringstream oss;
 
 				auto lock = req_ptr->serve(q_wrapper, oss);
 
 				auto msg = Msg(message, username, p);
 
-				BOOST_CHECK(msg == q.back());
+				BOOST_CHECK(q_wrapper.back() == msg);
 			}
 		}
 	};
@@ -217,8 +344,436 @@ BOOST_AUTO_TEST_CASE( serve_reqs )
 	std::ostringstream oss;
 	auto del_all_req_ptr = ReqsUnitTestsUtils::make_delete_all_req();
 	del_all_req_ptr->serve(q_wrapper, oss);
-	BOOST_CHECK(q.empty());
+	BOOST_CHECK(q_wrapper.size() == 0);
+
+}
+
+BOOST_AUTO_TEST_CASE( batched_new_logs )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	// Only new_logs batch
+	std::vector<std::string> lines;
+	std::vector<MsgView> new_logs;
+	ReqUtils::ResultCode result_code;
+	BOOST_CHECK(Reqs::parse_req_str("dump_all error", new_logs, result_code) != nullptr);
+	BOOST_CHECK(Reqs::parse_req_str("delete_all", new_logs, result_code) != nullptr);
+	BOOST_CHECK(new_logs.empty());
+
+	// The views point into the lines, which must outlive them
+	for (unsigned i = 0; i < 100; ++i)
+	{
+		lines.push_back("new_log user" + std::to_string(i % 3) + " warning msg " + std::to_string(i));
+	}
+	for (const std::string & line : lines)
+	{
+		BOOST_CHECK(Reqs::parse_req_str(line, new_logs, result_code) == nullptr);
+		BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+	}
+	BOOST_CHECK(new_logs.size() == 100);
+
+	std::vector<ReqUtils::ResultCode> result_codes;
+	Reqs::serve_new_logs(q_wrapper, new_logs, result_codes);
+	BOOST_CHECK(result_codes == std::vector<ReqUtils::ResultCode>(100, ReqUtils::ResultCode::Ok));
+
+	// In order, as if served one by one
+	unsigned i = 0;
+	q_wrapper.for_each([&i](const MsgView & msg)
+		{
+			BOOST_CHECK(msg == Msg("msg " + std::to_string(i), "user" + std::to_string(i % 3), Msg::Priority::Warning));
+			++i;
+		});
+	BOOST_CHECK(i == 100);
+}
+
+BOOST_AUTO_TEST_CASE( new_log_views )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	// new_logs come back as views into the line, everything else as usual
+	const std::vector<std::string> lines = {
+		"new_log alice info hello world",
+		"dump_all error",
+		"new_log bob loud nope",
+		"new_log carol",
+		"  new_log   dave   error   spaced out",
+		"delete_all"};
+
+	std::vector<MsgView> new_logs;
+	std::vector<ReqUtils::ResultCode> line_codes;
+	std::vector<bool> got_req;
+	for (const std::string & line : lines)
+	{
+		ReqUtils::ResultCode result_code;
+		got_req.push_back(Reqs::parse_req_str(line, new_logs, result_code) != nullptr);
+		line_codes.push_back(result_code);
+
+		// Same verdict as the request parser
+		ReqUtils::ResultCode req_result_code;
+		Reqs::parse_req_str(line, req_result_code);
+		BOOST_CHECK(result_code == req_result_code);
+	}
+
+	BOOST_CHECK(got_req == std::vector<bool>({false, true, false, false, false, true}));
+	BOOST_CHECK(line_codes[2] == ReqUtils::ResultCode::NewLogWrongPriority);
+	BOOST_CHECK(line_codes[3] == ReqUtils::ResultCode::NewLogTooFewArgs);
+
+	BOOST_REQUIRE(new_logs.size() == 2);
+	BOOST_CHECK(new_logs[0].get_msg().data() == lines[0].data() + 19);
+	BOOST_CHECK(new_logs[1] == Msg("spaced out", "dave", Msg::Priority::Error));
+
+	std::vector<ReqUtils::ResultCode> result_codes;
+	Reqs::serve_new_logs(q_wrapper, new_logs, result_codes);
+	BOOST_CHECK(result_codes == std::vector<ReqUtils::ResultCode>(2, ReqUtils::ResultCode::Ok));
+	BOOST_CHECK(q_wrapper.size() == 2);
+}
+
+BOOST_AUTO_TEST_CASE( too_many_users )
+{
+	MsgQueueWrapper q_wrapper(4);
+	q_wrapper.set_max_usernames(2);
+
+	std::ostringstream oss;
+	ReqUtils::ResultCode result_code;
+	for (const char * username : {"alice", "bob", "carol", "alice"})
+	{
+		ReqsUnitTestsUtils::make_new_log_req("hi", username, Msg::Priority::Info)->serve(q_wrapper, oss, result_code);
+		BOOST_CHECK(result_code == ((username == std::string("carol")) ?
+			ReqUtils::ResultCode::NewLogTooManyUsers : ReqUtils::ResultCode::Ok));
+	}
+	BOOST_CHECK(q_wrapper.size() == 3);
+
+	// A batch is all or nothing
+	const std::vector<Msg> batch = {Msg("hi", "bob", Msg::Priority::Info), Msg("hi", "dave", Msg::Priority::Info)};
+	ReqsUnitTestsUtils::make_new_log_batch_req(batch)->serve(q_wrapper, oss, result_code);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::NewLogTooManyUsers);
+	BOOST_CHECK(q_wrapper.size() == 3);
+
+	// A run of new_logs isn't
+	const std::vector<std::string> lines = {"new_log alice info a", "new_log dave info d", "new_log bob info b"};
+	std::vector<MsgView> new_logs;
+	for (const std::string & line : lines)
+	{
+		Reqs::parse_req_str(line, new_logs, result_code);
+	}
+	std::vector<ReqUtils::ResultCode> result_codes;
+	Reqs::serve_new_logs(q_wrapper, new_logs, result_codes);
+	BOOST_CHECK(result_codes == std::vector<ReqUtils::ResultCode>(
+		{ReqUtils::ResultCode::Ok, ReqUtils::ResultCode::NewLogTooManyUsers, ReqUtils::ResultCode::Ok}));
+	BOOST_CHECK(q_wrapper.size() == 5);
+}
 
+BOOST_AUTO_TEST_CASE( new_log_frames )
+{
+	// Binary new_logs hold to what a text one can hold
+	const std::vector<std::pair<std::pair<std::string, std::string>, ReqUtils::ResultCode>> cases = {
+		{{"alice", "fine body, spaces  and all "}, ReqUtils::ResultCode::Ok},
+		{{"alice", std::string("nul\0inside", 10)}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"alice", "forged\nu[root] p[error] m[line]"}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"alice", "crlf\r\n"}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"alice", "tab\there"}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"alice", "caf\xc3\xa9"}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"al ice", "body"}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"al\tice", "body"}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"\x80", "body"}, ReqUtils::ResultCode::NewLogBadBytes},
+		{{"", "body"}, ReqUtils::ResultCode::NewLogTooFewArgs}};
+
+	std::vector<MsgView> new_logs;
+	for (const auto & c : cases)
+	{
+		WireFormat::Frame frame;
+		frame.type = uint8_t(WireFormat::FrameType::NewLog);
+		frame.priority = uint8_t(Msg::Priority::Info);
+		frame.username = c.first.first;
+		frame.body = c.first.second;
+
+		ReqUtils::ResultCode result_code;
+		BOOST_CHECK(Reqs::parse_req_frame(frame, new_logs, result_code) == nullptr);
+		BOOST_CHECK_MESSAGE(result_code == c.second, c.first.first << ": " << c.first.second);
+	}
+
+	// Only the good one is left to log
+	BOOST_REQUIRE(new_logs.size() == 1);
+	BOOST_CHECK(new_logs[0] == Msg("fine body, spaces  and all ", "alice", Msg::Priority::Info));
+}
+
+BOOST_AUTO_TEST_CASE( new_log_batch )
+{
+	// Bodies are taken by length, spaces and all
+	std::vector<Msg> msgs = {
+		Msg("hello world", "alice", Msg::Priority::Info),
+		Msg("x", "bob", Msg::Priority::Error),
+		Msg("  padded  body", "carol", Msg::Priority::Debug),
+		Msg("9 debug not a record", "dave", Msg::Priority::Warning)
+	};
+	const std::string frame = ReqsUnitTestsUtils::make_new_log_batch_str(msgs);
+	BOOST_CHECK(frame.compare(0, 36, "new_log_batch 4 alice info 11 hello ") == 0);
+
+	ReqUtils::ResultCode result_code;
+	auto req_ptr = Reqs::parse_req_str(frame, result_code);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+	BOOST_REQUIRE(req_ptr != nullptr);
+	BOOST_CHECK(*req_ptr == *ReqsUnitTestsUtils::make_new_log_batch_req(msgs));
+	BOOST_CHECK(*req_ptr != *ReqsUnitTestsUtils::make_new_log_batch_req(std::vector<Msg>(msgs.begin(), msgs.end() - 1)));
+
+	MsgQueueWrapper q_wrapper(4);
+	q_wrapper.push(Msg("first", "zed", Msg::Priority::Info));
+	std::ostringstream oss;
+	req_ptr->serve(q_wrapper, oss, result_code);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+	BOOST_CHECK(oss.str().empty());
+
+	std::vector<Msg> read_back;
+	q_wrapper.for_each([&read_back](const MsgView & msg) { read_back.push_back(msg.to_msg()); });
+	BOOST_REQUIRE(read_back.size() == 5);
+	BOOST_CHECK(std::equal(msgs.begin(), msgs.end(), read_back.begin() + 1));
+
+	// One bad record fails the lot
+	for (const char * bad : {
+		"new_log_batch",
+		"new_log_batch 0",
+		"new_log_batch x alice info 1 a",
+		"new_log_batch 2 alice info 1 a",
+		"new_log_batch 1 alice info 1 ab",
+		"new_log_batch 1 alice info 2 a",
+		"new_log_batch 1 alice info 0 ",
+		"new_log_batch 1 alice loud 1 a",
+		"new_log_batch 1 alice info -1 a",
+		"new_log_batch 1 alice info 1  a",
+		"new_log_batch 1 alice info",
+		"new_log_batch 99999999999 alice info 1 a",
+		"new_log_batch 1 alice info 3 a\tb",
+		"new_log_batch 1 al\x01" "ce info 1 a",
+		"new_log_batch 1 alice info 2 \xc3\xa9" })
+	{
+		BOOST_CHECK(Reqs::parse_req_str(bad, result_code) == nullptr);
+		BOOST_CHECK(result_code == ReqUtils::ResultCode::NewLogBatchBadFrame);
+	}
+
+	// Told apart from other lines before they're sanitized
+	BOOST_CHECK(Reqs::is_length_prefixed(frame));
+	BOOST_CHECK(Reqs::is_length_prefixed("  new_log_batch 1 alice info 1 a\r"));
+	BOOST_CHECK(!Reqs::is_length_prefixed("new_log alice info new_log_batch"));
+	BOOST_CHECK(!Reqs::is_length_prefixed("new_log_batches"));
+}
+
+namespace
+{
+
+// Serves req in one go and streamed, checking both against expected, and
+// returns the number of chunks. late is pushed between chunks: chunks
+// stop at the first line that reaches their limit, and messages that
+// arrive mid-dump aren't part of it.
+size_t check_streamed(MsgQueueWrapper & q_wrapper, ReqBase & req, const std::string & expected, const Msg & late)
+{
+	const size_t max_bytes = 1024;
+
+	std::ostringstream served;
+	ReqUtils::ResultCode result_code;
+	req.serve(q_wrapper, served, result_code);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+	BOOST_CHECK(served.str() == expected);
+
+	std::ostringstream head;
+	auto stream = req.serve_streamed(q_wrapper, head, result_code);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+	BOOST_REQUIRE(stream != nullptr);
+
+	std::string dumped = head.str();
+	size_t num_chunks = 0;
+	bool more = true;
+	while (more)
+	{
+		std::string chunk;
+		more = stream->next_chunk(chunk, max_bytes);
+		BOOST_CHECK(chunk.size() < max_bytes + 64);
+		BOOST_CHECK(chunk.empty() || chunk.back() == '\n');
+		dumped += chunk;
+		++num_chunks;
+
+		Msg late_copy = late;
+		q_wrapper.push(std::move(late_copy));
+	}
+	BOOST_CHECK(dumped == expected);
+	return num_chunks;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( streamed_dump_all )
+{
+	MsgQueueWrapper q_wrapper(4);
+	for (unsigned i = 0; i < 20000; ++i)
+	{
+		q_wrapper.push(Msg("msg " + std::to_string(i), "user" + std::to_string(i % 7), Msg::Priority(i % unsigned(Msg::Priority::Max))));
+	}
+
+	for (unsigned i = 0; i < unsigned(Msg::Priority::Max); ++i)
+	{
+		const auto p = Msg::Priority(i);
+
+		std::ostringstream expected;
+		q_wrapper.dump_to_stream(expected, p);
+
+		const size_t num_chunks = check_streamed(
+			q_wrapper, *ReqsUnitTestsUtils::make_dump_all_req(p), expected.str(), Msg("late", "user", Msg::Priority::Error));
+		BOOST_CHECK(num_chunks > expected.str().size() / (1024 + 64));
+	}
+
+	// Requests that reply in one go don't stream
+	std::ostringstream oss;
+	ReqUtils::ResultCode result_code;
+	BOOST_CHECK(ReqsUnitTestsUtils::make_delete_all_req()->serve_streamed(q_wrapper, oss, result_code) == nullptr);
+	BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+	BOOST_CHECK(q_wrapper.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE( streamed_dump_user )
+{
+	MsgQueueWrapper q_wrapper(4);
+	for (unsigned i = 0; i < 20000; ++i)
+	{
+		q_wrapper.push(Msg("msg " + std::to_string(i), "user" + std::to_string(i % 7), Msg::Priority(i % unsigned(Msg::Priority::Max))));
+	}
+
+	for (const std::string username : {"user3", "nobody"})
+	{
+		const auto p = Msg::Priority::Info;
+
+		std::ostringstream expected;
+		q_wrapper.for_each([&expected, &username](const MsgView & msg)
+			{
+				if (msg.get_username() == username)
+				{
+					expected << msg << std::endl;
+				}
+			},
+			p);
+
+		check_streamed(
+			q_wrapper, *ReqsUnitTestsUtils::make_dump_user_req(username, p), expected.str(), Msg("late", username, Msg::Priority::Error));
+	}
+}
+
+BOOST_AUTO_TEST_CASE( streamed_dump_range )
+{
+	MsgQueueWrapper q_wrapper(4);
+	for (unsigned i = 0; i < 20000; ++i)
+	{
+		q_wrapper.push(Msg("msg " + std::to_string(i), "user", Msg::Priority(i % unsigned(Msg::Priority::Max))));
+		if (i % 5000 == 0)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+	}
+
+	std::vector<Msg::Time> times;
+	q_wrapper.for_each([&times](const MsgView & msg) { times.push_back(msg.get_time_ms()); });
+	std::sort(times.begin(), times.end());
+
+	TimeRange range;
+	range.from_ms = times[times.size() / 4];
+	range.to_ms = times[times.size() * 3 / 4];
+	const auto p = Msg::Priority::Info;
+
+	std::ostringstream expected;
+	q_wrapper.for_each([&expected, &range](const MsgView & msg)
+		{
+			if (range.contains(msg.get_time_ms()))
+			{
+				expected << msg << std::endl;
+			}
+		},
+		p);
+
+	check_streamed(
+		q_wrapper, *ReqsUnitTestsUtils::make_dump_range_req(range, p), expected.str(), Msg("late", "user", Msg::Priority::Error));
+}
+
+BOOST_AUTO_TEST_CASE( streamed_search )
+{
+	MsgQueueWrapper q_wrapper(4);
+	for (unsigned i = 0; i < 20000; ++i)
+	{
+		const std::string body = (i % 13 == 0) ? "upstream Timeout after " + std::to_string(i) + "ms" : "msg " + std::to_string(i);
+		q_wrapper.push(Msg(body, "user", Msg::Priority(i % unsigned(Msg::Priority::Max))));
+	}
+	q_wrapper.index_blocks();
+
+	const auto p = Msg::Priority::Info;
+
+	std::ostringstream expected;
+	q_wrapper.for_each([&expected](const MsgView & msg)
+		{
+			if (msg.get_msg().find("Timeout") != boost::string_ref::npos)
+			{
+				expected << msg << std::endl;
+			}
+		},
+		p);
+
+	check_streamed(
+		q_wrapper, *ReqsUnitTestsUtils::make_search_req("timeout", p), expected.str(), Msg("late timeout", "user", Msg::Priority::Error));
+}
+
+BOOST_AUTO_TEST_CASE( new_log_latency_during_dump )
+{
+	typedef std::chrono::steady_clock Clock;
+
+	MsgQueueWrapper q_wrapper(4);
+	for (unsigned i = 0; i < 300000; ++i)
+	{
+		q_wrapper.push(Msg(random_msg(), random_token(), random_pri()));
+	}
+
+	// Big dumps back to back, while new_logs keep coming in
+	const unsigned num_dumps = 3;
+	std::atomic<bool> dumping(true);
+	std::atomic<bool> in_dump(false);
+	double dump_ms = 0;
+
+	std::thread dumper([&]()
+		{
+			for (unsigned i = 0; i < num_dumps; ++i)
+			{
+				std::ostringstream oss;
+				const auto start = Clock::now();
+				in_dump = true;
+				ReqsUnitTestsUtils::make_dump_all_req(Msg::Priority::Debug)->serve(q_wrapper, oss);
+				in_dump = false;
+				dump_ms += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+			}
+			dumping = false;
+		});
+
+	std::vector<double> latencies_us;
+	size_t num_during_dump = 0;
+	while (dumping)
+	{
+		auto req_ptr = ReqsUnitTestsUtils::make_new_log_req("during dump", "writer", Msg::Priority::Info);
+		std::ostringstream oss;
+
+		const bool during_dump = in_dump;
+		const auto start = Clock::now();
+		req_ptr->serve(q_wrapper, oss);
+		latencies_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+
+		num_during_dump += (during_dump && in_dump);
+	}
+	dumper.join();
+	dump_ms /= num_dumps;
+
+	BOOST_REQUIRE(!latencies_us.empty());
+	std::sort(latencies_us.begin(), latencies_us.end());
+	const double p50_us = latencies_us[latencies_us.size() / 2];
+	const double p99_us = latencies_us[latencies_us.size() * 99 / 100];
+	BOOST_TEST_MESSAGE("dump_all of 300000 msgs: " << dump_ms << " ms, new_log p50 " << p50_us <<
+		" us, p99 " << p99_us << " us over " << latencies_us.size() << " new_logs");
+
+	// Had the dump held the store, nothing would have got in meanwhile,
+	// and whatever tried would have waited for the whole dump
+	BOOST_CHECK(num_during_dump > 100);
+	BOOST_CHECK(p99_us < dump_ms * 1000 / 10);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,166 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/msgs.hh"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+BOOST_AUTO_TEST_SUITE( retention )
+
+namespace
+{
+
+MsgQueueWrapper::RetentionPolicy make_policy(const std::string & str)
+{
+	MsgQueueWrapper::RetentionPolicy policy;
+	BOOST_REQUIRE(MsgQueueWrapper::RetentionPolicy::from_str(str, policy));
+	return policy;
+}
+
+// Sequence numbers strictly increasing, returns how many there are
+size_t check_order(const MsgQueueWrapper & q_wrapper)
+{
+	size_t num_msgs = 0;
+	Msg::Seq last_seq = 0;
+	q_wrapper.for_each([&](const MsgView & msg)
+	{
+		BOOST_CHECK(num_msgs == 0 || msg.get_seq() > last_seq);
+		last_seq = msg.get_seq();
+		++num_msgs;
+	});
+	return num_msgs;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( policy_str )
+{
+	const auto policy = make_policy("msgs=1000,debug:age=10m,bytes=1m,warning:msgs=5");
+	BOOST_CHECK_EQUAL(policy.limits[size_t(Msg::Priority::Error)].max_msgs, 1000u);
+	BOOST_CHECK_EQUAL(policy.limits[size_t(Msg::Priority::Error)].max_bytes, size_t(1) << 20);
+	BOOST_CHECK_EQUAL(policy.limits[size_t(Msg::Priority::Debug)].max_age_secs, 600u);
+	BOOST_CHECK_EQUAL(policy.limits[size_t(Msg::Priority::Warning)].max_msgs, 5u);
+	BOOST_CHECK(!policy.limits[size_t(Msg::Priority::Info)].any());
+
+	BOOST_CHECK_EQUAL(policy.to_str(), "msgs=1000,bytes=1048576,warning:msgs=5,debug:age=600");
+	BOOST_CHECK_EQUAL(make_policy(policy.to_str()).to_str(), policy.to_str());
+
+	// Ages up to what the limit holds
+	BOOST_CHECK_EQUAL(make_policy("age=49710d").limits[size_t(Msg::Priority::Error)].max_age_secs, 49710u * 24 * 60 * 60);
+
+	MsgQueueWrapper::RetentionPolicy rejected;
+	for (const char * str : {"", "msgs=0", "msgs=1k", "msgs=", "bogus:msgs=1", "age=5x", "age=5ss", "size=3", "msgs",
+		"msgs=-3", "msgs= 3", "msgs=99999999999999999999", "bytes=17179869184g", "age=100000000d", "age=4294967296"})
+	{
+		BOOST_CHECK_MESSAGE(!MsgQueueWrapper::RetentionPolicy::from_str(str, rejected), str);
+	}
+	BOOST_CHECK(!rejected.any());
+}
+
+BOOST_AUTO_TEST_CASE( max_msgs_drops_oldest_blocks )
+{
+	MsgQueueWrapper q_wrapper(1);
+	q_wrapper.set_retention(make_policy("msgs=5000"), false);
+
+	const size_t num_msgs = Cfg::msg_block_records * 4;
+	for (size_t i = 0; i < num_msgs; ++i)
+	{
+		q_wrapper.push(Msg(std::to_string(i), "user", Msg::Priority::Info));
+	}
+
+	BOOST_CHECK_EQUAL(q_wrapper.enforce_retention(0), Cfg::msg_block_records * 3);
+	BOOST_CHECK_EQUAL(q_wrapper.size(), Cfg::msg_block_records);
+	BOOST_CHECK_EQUAL(check_order(q_wrapper), Cfg::msg_block_records);
+
+	// Whole blocks go, so what's left is the newest one in full
+	Msg::Seq expected_seq = Cfg::msg_block_records * 3;
+	q_wrapper.for_each([&](const MsgView & msg)
+	{
+		BOOST_CHECK(msg.get_seq() == expected_seq);
+		BOOST_CHECK_EQUAL(msg.get_msg(), std::to_string(expected_seq));
+		++expected_seq;
+	});
+
+	// Already within bounds
+	BOOST_CHECK_EQUAL(q_wrapper.enforce_retention(0), 0u);
+}
+
+BOOST_AUTO_TEST_CASE( priority_age_strips_blocks )
+{
+	MsgQueueWrapper q_wrapper(2);
+	q_wrapper.set_retention(make_policy("debug:age=10s"), false);
+
+	for (size_t i = 0; i < 100; ++i)
+	{
+		q_wrapper.push(Msg(std::to_string(i), "user", (i % 2) ? Msg::Priority::Error : Msg::Priority::Debug));
+	}
+
+	BOOST_CHECK_EQUAL(q_wrapper.enforce_retention(5), 0u);
+	BOOST_CHECK_EQUAL(q_wrapper.size(), 100u);
+
+	// The debug messages expire, the errors stay where they were
+	BOOST_CHECK_EQUAL(q_wrapper.enforce_retention(11), 50u);
+	BOOST_CHECK_EQUAL(q_wrapper.size(), 50u);
+
+	// New messages go to a fresh block, stamped with the new time
+	for (size_t i = 100; i < 110; ++i)
+	{
+		q_wrapper.push(Msg(std::to_string(i), "user", Msg::Priority::Debug));
+	}
+	BOOST_CHECK_EQUAL(q_wrapper.enforce_retention(12), 0u);
+	BOOST_CHECK_EQUAL(check_order(q_wrapper), 60u);
+
+	size_t i = 0;
+	q_wrapper.for_each([&](const MsgView & msg)
+	{
+		const size_t expected = (i < 50) ? i * 2 + 1 : i + 50;
+		BOOST_CHECK(msg.get_seq() == expected);
+		BOOST_CHECK_EQUAL(msg.get_msg(), std::to_string(expected));
+		BOOST_CHECK(msg.get_priority() == ((i < 50) ? Msg::Priority::Error : Msg::Priority::Debug));
+		++i;
+	});
+
+	BOOST_CHECK_EQUAL(q_wrapper.enforce_retention(22), 10u);
+	BOOST_CHECK_EQUAL(check_order(q_wrapper), 50u);
+}
+
+BOOST_AUTO_TEST_CASE( max_bytes )
+{
+	MsgQueueWrapper q_wrapper(1);
+
+	const size_t body_len = 100;
+	const size_t block_bytes = Cfg::msg_block_records * (body_len + sizeof(MsgRecord));
+	q_wrapper.set_retention(make_policy("bytes=" + std::to_string(block_bytes * 3 / 2)), false);
+
+	for (size_t i = 0; i < Cfg::msg_block_records * 3; ++i)
+	{
+		q_wrapper.push(Msg(std::string(body_len, 'x'), "user", Msg::Priority::Warning));
+	}
+	const size_t body_bytes = q_wrapper.get_mem_stats().body_bytes;
+
+	BOOST_CHECK_EQUAL(q_wrapper.enforce_retention(0), Cfg::msg_block_records * 2);
+	BOOST_CHECK_EQUAL(check_order(q_wrapper), Cfg::msg_block_records);
+	BOOST_CHECK_LT(q_wrapper.get_mem_stats().body_bytes, body_bytes);
+}
+
+BOOST_AUTO_TEST_CASE( retention_thread )
+{
+	MsgQueueWrapper q_wrapper(4);
+	q_wrapper.set_retention(make_policy("msgs=1000"));
+
+	for (size_t i = 0; i < Cfg::msg_block_records * 2; ++i)
+	{
+		q_wrapper.push(Msg(std::to_string(i), "user", Msg::Priority::Info));
+	}
+
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (q_wrapper.size() > Cfg::msg_block_records && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	BOOST_CHECK_LE(q_wrapper.size(), Cfg::msg_block_records);
+	check_order(q_wrapper);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,146 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/sanitize.hh"
+#include "reference.hh"
+
+#include <cctype>
+#include <forward_list>
+#include <random>
+#include <string>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE( sanitize )
+
+namespace
+{
+
+// Every kernel this CPU runs
+std::vector<Sanitize::Isa> get_isas()
+{
+	std::vector<Sanitize::Isa> isas;
+	for (unsigned i = 0; i <= unsigned(Sanitize::get_best_isa()); ++i)
+	{
+		isas.push_back(Sanitize::Isa(i));
+	}
+	return isas;
+}
+
+// Mostly printable, with runs of the rest at random, of every length a
+// kernel's blocks and tails come in
+std::vector<std::string> make_lines(unsigned seed)
+{
+	static const char others[] = {'\0', '\t', '\r', '\n', ' ', '\x1f', '\x7f', '\x80', '\xff'};
+
+	std::mt19937 rng(seed);
+	std::vector<std::string> lines;
+	for (size_t len = 0; len < 200; ++len)
+	{
+		for (unsigned density : {0u, 1u, 10u, 50u, 100u})
+		{
+			std::string line;
+			for (size_t i = 0; i < len; ++i)
+			{
+				line += (rng() % 100 < density) ? others[rng() % sizeof(others)] : char(0x20 + rng() % 0x5f);
+			}
+			lines.push_back(line);
+		}
+	}
+	return lines;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( printable )
+{
+	for (int c = 0; c < 256; ++c)
+	{
+		BOOST_CHECK(Sanitize::is_printable(char(c)) == bool(isprint(c)));
+	}
+}
+
+BOOST_AUTO_TEST_CASE( kernels_agree )
+{
+	const Sanitize::Isa best = Sanitize::get_best_isa();
+	BOOST_TEST_MESSAGE("Best kernels on this CPU: " << Sanitize::to_str(best));
+	BOOST_CHECK(Sanitize::get_isa() == best);
+
+	const std::vector<std::string> lines = make_lines(7);
+	for (Sanitize::Isa isa : get_isas())
+	{
+		BOOST_REQUIRE(Sanitize::set_isa(isa));
+		for (const std::string & line : lines)
+		{
+			size_t first = 0;
+			while (first < line.size() && isprint(static_cast<unsigned char>(line[first])))
+			{
+				++first;
+			}
+			BOOST_CHECK(Sanitize::find_non_printable(line.data(), line.size()) == first);
+
+			const size_t crlf = line.find("\r\n");
+			BOOST_CHECK(Sanitize::find_crlf(line.data(), line.size()) == ((crlf == std::string::npos) ? line.size() : crlf));
+
+			std::forward_list<std::string> filtered_lines;
+			BOOST_CHECK_MESSAGE(
+				Sanitize::sanitize(line, filtered_lines) == Reference::sanitize(line, filtered_lines),
+				Sanitize::to_str(isa));
+
+			std::string copy(line.size(), '\0');
+			copy.resize(Sanitize::copy_printable(&copy[0], line.data(), line.size()));
+			std::string expected;
+			for (char c : line)
+			{
+				if (isprint(static_cast<unsigned char>(c)))
+				{
+					expected += c;
+				}
+			}
+			BOOST_CHECK(copy == expected);
+		}
+	}
+	Sanitize::set_isa(best);
+}
+
+BOOST_AUTO_TEST_CASE( crlf_anywhere )
+{
+	// At each offset of a few blocks, split across two of them included
+	for (Sanitize::Isa isa : get_isas())
+	{
+		Sanitize::set_isa(isa);
+		for (size_t pos = 0; pos + 1 < 100; ++pos)
+		{
+			std::string line(100, 'x');
+			line[pos] = '\r';
+			line[pos + 1] = '\n';
+			BOOST_CHECK(Sanitize::find_crlf(line.data(), line.size()) == pos);
+
+			// A lone '\r' or '\n' isn't one
+			line[pos + 1] = 'x';
+			BOOST_CHECK(Sanitize::find_crlf(line.data(), line.size()) == line.size());
+			line[pos] = '\n';
+			line[pos + 1] = '\r';
+			BOOST_CHECK(Sanitize::find_crlf(line.data(), line.size()) == line.size());
+		}
+	}
+	Sanitize::set_isa(Sanitize::get_best_isa());
+}
+
+BOOST_AUTO_TEST_CASE( sanitized_lines )
+{
+	std::forward_list<std::string> filtered_lines;
+
+	// Clean ones aren't copied
+	const std::string clean = "new_log alice info all good";
+	BOOST_CHECK(Sanitize::sanitize(clean, filtered_lines).data() == clean.data());
+	const std::string padded = clean + " \t\r";
+	BOOST_CHECK(Sanitize::sanitize(padded, filtered_lines) == clean);
+	BOOST_CHECK(Sanitize::sanitize(padded, filtered_lines).data() == padded.data());
+	BOOST_CHECK(filtered_lines.empty());
+
+	BOOST_CHECK(Sanitize::sanitize("new_log alice\x01 info b\x7f" "ad\x80 \r", filtered_lines) == "new_log alice info bad");
+	BOOST_CHECK(!filtered_lines.empty());
+
+	BOOST_CHECK(Sanitize::sanitize(" \t\x01\r", filtered_lines).empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,186 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/search.hh"
+#include "../src/msgs.hh"
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE( search )
+
+namespace
+{
+
+std::vector<Msg::Seq> search_seqs(const MsgQueueWrapper & q_wrapper, const std::string & term, Msg::Priority cap = Msg::Priority::Debug)
+{
+	std::vector<Msg::Seq> seqs;
+	q_wrapper.get_search_snapshot(Search::Term(term), cap).visit(
+		[&seqs](const MsgView & msg)
+		{
+			seqs.push_back(msg.get_seq());
+			return true;
+		});
+	return seqs;
+}
+
+// What a search has to find, the slow way
+std::vector<Msg::Seq> scan_seqs(const MsgQueueWrapper & q_wrapper, const std::string & term, Msg::Priority cap = Msg::Priority::Debug)
+{
+	const Search::Term search_term(term);
+	std::vector<Msg::Seq> seqs;
+	q_wrapper.for_each([&seqs, &search_term](const MsgView & msg)
+		{
+			if (search_term.matches(msg.get_msg()))
+			{
+				seqs.push_back(msg.get_seq());
+			}
+		},
+		cap);
+	return seqs;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( words )
+{
+	std::vector<std::string> tokens;
+	Search::for_each_token("  ERROR: disk_full on /var/log, retry #3.", [&tokens](boost::string_ref token)
+		{
+			tokens.push_back(token.to_string());
+		});
+	BOOST_CHECK((tokens == std::vector<std::string> {"ERROR", "disk_full", "on", "var", "log", "retry", "3"}));
+
+	BOOST_CHECK(Search::hash_token("Disk_Full") == Search::hash_token("disk_full"));
+	BOOST_CHECK(Search::hash_token("disk") != Search::hash_token("disk_full"));
+
+	const Search::Term term("Conn-Reset");
+	BOOST_CHECK(term.get_hashes().size() == 2);
+	BOOST_CHECK(term.matches("upstream conn reset by peer"));
+	BOOST_CHECK(term.matches("CONN/RESET"));
+	BOOST_CHECK(term.matches("conn conn reset"));
+	BOOST_CHECK(!term.matches("conn_reset"));
+	BOOST_CHECK(!term.matches("reset conn"));
+	BOOST_CHECK(!term.matches("conn was reset"));
+	BOOST_CHECK(!term.matches("connection reset"));
+	BOOST_CHECK(!term.matches(""));
+
+	BOOST_CHECK(Search::Term("--- !!").empty());
+	BOOST_CHECK(!Search::Term("").matches("anything"));
+}
+
+BOOST_AUTO_TEST_CASE( token_index )
+{
+	const std::vector<boost::string_ref> bodies = {
+		"disk full on sda", "Disk ok", "network down", "disk disk disk", "full disk", ""
+	};
+	const Search::TokenIndex index(bodies);
+
+	const auto disk = index.find(Search::hash_token("DISK"));
+	BOOST_CHECK((std::vector<uint16_t>(disk.first, disk.second) == std::vector<uint16_t> {0, 1, 3, 4}));
+
+	const auto none = index.find(Search::hash_token("cpu"));
+	BOOST_CHECK(none.first == none.second);
+
+	// Every word, in any order: the caller checks the order
+	BOOST_CHECK((index.find(Search::Term("full disk")) == std::vector<uint16_t> {0, 4}));
+	BOOST_CHECK(index.find(Search::Term("disk cpu")).empty());
+	BOOST_CHECK(index.get_bytes() > sizeof(index));
+}
+
+BOOST_AUTO_TEST_CASE( indexed_and_scanned_agree )
+{
+	MsgQueueWrapper q_wrapper(4);
+
+	// From a few threads, so there are several shards, several blocks
+	// per shard, and a partly filled back block in each
+	const size_t num_threads = 4;
+	const size_t msg_per_thd = Cfg::msg_block_records * 2 + 321;
+	static const char * const words[] = {"timeout", "disk", "full", "ok", "retry", "Conn", "reset", "42"};
+
+	std::vector<std::thread> threads;
+	for (size_t thd_id = 0; thd_id < num_threads; ++thd_id)
+	{
+		threads.emplace_back([&q_wrapper, thd_id]()
+			{
+				for (size_t i = 0; i < msg_per_thd; ++i)
+				{
+					const std::string body = std::string(words[i % 8]) + " " + words[(i / 8 + thd_id) % 8] +
+						((i % 997 == 0) ? " needle" : "");
+					q_wrapper.push(body, "user", Msg::Priority((i + thd_id) % unsigned(Msg::Priority::Max)));
+				}
+			});
+	}
+	for (std::thread & thd : threads)
+	{
+		thd.join();
+	}
+
+	const std::vector<std::string> terms = {"needle", "DISK", "disk full", "conn-reset", "full disk", "nothing"};
+
+	// Nothing indexed yet: every block gets scanned
+	BOOST_CHECK(q_wrapper.get_mem_stats().search_bytes == 0);
+	for (const std::string & term : terms)
+	{
+		BOOST_CHECK_MESSAGE(search_seqs(q_wrapper, term) == scan_seqs(q_wrapper, term), term);
+	}
+
+	// All but the back blocks, which writers still append to
+	BOOST_CHECK(q_wrapper.index_blocks() == num_threads * 2);
+	BOOST_CHECK(q_wrapper.index_blocks() == 0);
+	BOOST_CHECK(q_wrapper.get_mem_stats().search_bytes > 0);
+
+	for (const std::string & term : terms)
+	{
+		for (const Msg::Priority cap : {Msg::Priority::Debug, Msg::Priority::Critical})
+		{
+			const auto found = search_seqs(q_wrapper, term, cap);
+			BOOST_CHECK_MESSAGE(found == scan_seqs(q_wrapper, term, cap), term);
+			BOOST_CHECK((term == "nothing") == found.empty());
+		}
+	}
+
+	// Later messages aren't part of it, and visiting resumes where it stopped
+	const auto snapshot = q_wrapper.get_search_snapshot(Search::Term("disk"));
+	q_wrapper.push("late disk", "user", Msg::Priority::Error);
+
+	std::vector<Msg::Seq> seqs;
+	Msg::Seq from_seq = 0;
+	while (from_seq < snapshot.get_end_seq())
+	{
+		from_seq = snapshot.visit(
+			[&seqs](const MsgView & msg)
+			{
+				seqs.push_back(msg.get_seq());
+				return seqs.size() % 100 != 0;
+			},
+			from_seq);
+	}
+	std::vector<Msg::Seq> expected = scan_seqs(q_wrapper, "disk");
+	expected.pop_back();
+	BOOST_CHECK(seqs == expected);
+}
+
+BOOST_AUTO_TEST_CASE( indexer_thread )
+{
+	MsgQueueWrapper q_wrapper(1);
+	q_wrapper.start_indexer();
+
+	for (size_t i = 0; i < Cfg::msg_block_records * 3; ++i)
+	{
+		q_wrapper.push("msg " + std::to_string(i % 100), "user", Msg::Priority::Info);
+	}
+
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (q_wrapper.get_mem_stats().search_bytes == 0 && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	BOOST_CHECK(q_wrapper.get_mem_stats().search_bytes > 0);
+
+	// The back block's still scanned
+	BOOST_CHECK(search_seqs(q_wrapper, "7").size() == Cfg::msg_block_records * 3 / 100 + 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
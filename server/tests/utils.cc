@@ -2,6 +2,12 @@
 #include "utils.hh"
 #include "../src/msgs.hh"
 
+#include <boost/test/unit_test.hpp>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cstdlib>
 #include <cassert>
 
@@ -64,3 +70,35 @@ std::string random_msg(unsigned max_tokens )
 
 
 
+
+TempDir::TempDir()
+{
+	char tmpl[] = "/tmp/logger_test_XXXXXX";
+	BOOST_REQUIRE(mkdtemp(tmpl) != nullptr);
+	path = tmpl;
+}
+
+TempDir::~TempDir()
+{
+	for (const std::string & file : list())
+	{
+		unlink(file.c_str());
+	}
+	rmdir(path.c_str());
+}
+
+std::vector<std::string> TempDir::list() const
+{
+	std::vector<std::string> files;
+	DIR * dir = opendir(path.c_str());
+	while (dirent * entry = readdir(dir))
+	{
+		if (entry->d_name[0] != '.')
+		{
+			files.push_back(path + "/" + entry->d_name);
+		}
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end());
+	return files;
+}
@@ -5,6 +5,7 @@
 #include "../src/msgs.hh"
 
 #include <string>
+#include <vector>
 
 std::string random_whitespace(unsigned max_len = 5);
 
@@ -14,4 +15,17 @@ Msg::Priority random_pri();
 
 std::string random_msg(unsigned max_tokens = 10);
 
+struct TempDir
+// A fresh directory, removed with whatever is in it on the way out
+{
+	TempDir();
+
+	~TempDir();
+
+	// The files in it, sorted
+	std::vector<std::string> list() const;
+
+	std::string path;
+};
+
 #endif
@@ -0,0 +1,494 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../src/wal.hh"
+#include "../src/msgs.hh"
+#include "../src/reqs.hh"
+#include "utils.hh"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE( wal )
+
+namespace
+{
+
+std::vector<Msg> read_back(const MsgQueueWrapper & q_wrapper)
+{
+	std::vector<Msg> msgs;
+	q_wrapper.for_each([&msgs](const MsgView & msg) { msgs.push_back(msg.to_msg()); });
+	return msgs;
+}
+
+WriteAheadLog::SyncPolicy make_policy(const std::string & str)
+{
+	WriteAheadLog::SyncPolicy policy;
+	BOOST_REQUIRE(WriteAheadLog::SyncPolicy::from_str(str, policy));
+	return policy;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE( sync_policy )
+{
+	WriteAheadLog::SyncPolicy policy;
+
+	for (const char * str : {"always", "none", "128", "10ms"})
+	{
+		BOOST_CHECK(WriteAheadLog::SyncPolicy::from_str(str, policy));
+		BOOST_CHECK(policy.to_str() == str);
+	}
+
+	BOOST_CHECK(WriteAheadLog::SyncPolicy::from_str("1", policy) && policy.acks_after_sync());
+	BOOST_CHECK(WriteAheadLog::SyncPolicy::from_str("5ms", policy) && !policy.acks_after_sync());
+
+	for (const char * str : {"", "0", "0ms", "ms", "-3", "12s", "Always", "10 ms"})
+	{
+		BOOST_CHECK(!WriteAheadLog::SyncPolicy::from_str(str, policy));
+	}
+}
+
+BOOST_AUTO_TEST_CASE( replay_store )
+{
+	TempDir dir;
+
+	const size_t num_threads = 4;
+	const size_t msgs_per_thd = 3000;
+	std::vector<Msg> written;
+
+	{
+		MsgQueueWrapper q_wrapper(2);
+
+		// Small segments, so the log rolls over a few times
+		q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(
+			new WriteAheadLog(dir.path, make_policy("100"), 16 * 1024)));
+
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < num_threads; ++t)
+		{
+			threads.emplace_back([&q_wrapper, t]()
+				{
+					std::vector<Msg> batch;
+					for (size_t i = 0; i < msgs_per_thd; ++i)
+					{
+						Msg msg(std::to_string(i), "user" + std::to_string(t), Msg::Priority(i % unsigned(Msg::Priority::Max)));
+						if (i % 3 == 0)
+						{
+							q_wrapper.push(std::move(msg));
+						}
+						else
+						{
+							batch.push_back(std::move(msg));
+							if (batch.size() == 7)
+							{
+								q_wrapper.push_batch(batch);
+								batch.clear();
+							}
+						}
+					}
+					q_wrapper.push_batch(batch);
+				});
+		}
+		for (std::thread & thd : threads)
+		{
+			thd.join();
+		}
+
+		BOOST_CHECK(q_wrapper.get_wal()->sync());
+		const auto stats = q_wrapper.get_wal()->get_stats();
+		BOOST_CHECK(stats.records == num_threads * msgs_per_thd);
+		BOOST_CHECK(stats.segments > 1);
+		BOOST_CHECK(stats.segments == dir.list().size());
+
+		written = read_back(q_wrapper);
+		BOOST_CHECK(written.size() == num_threads * msgs_per_thd);
+	}
+
+	// Same messages, same order, same seqs
+	size_t num_replayed = 0;
+	WriteAheadLog::replay(dir.path,
+		[&written, &num_replayed](const MsgView & msg)
+		{
+			BOOST_CHECK(msg == written.at(num_replayed));
+			BOOST_CHECK(msg.get_seq() == written.at(num_replayed).get_seq());
+			++num_replayed;
+		});
+	BOOST_CHECK(num_replayed == written.size());
+
+	// And the same again once a restarted store takes the log over
+	MsgQueueWrapper q_wrapper;
+	q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir.path, make_policy("none"))));
+	BOOST_CHECK(q_wrapper.size() == written.size());
+	const std::vector<Msg> replayed = read_back(q_wrapper);
+
+	BOOST_REQUIRE(replayed.size() == written.size());
+	for (size_t i = 0; i < written.size(); ++i)
+	{
+		BOOST_CHECK(replayed[i] == written[i]);
+		BOOST_CHECK(replayed[i].get_seq() == written[i].get_seq());
+	}
+
+	// New messages carry on after the replayed ones
+	q_wrapper.push(Msg("after", "restart", Msg::Priority::Info));
+	BOOST_CHECK(read_back(q_wrapper).back().get_seq() == written.back().get_seq() + 1);
+}
+
+BOOST_AUTO_TEST_CASE( torn_tail )
+{
+	TempDir dir;
+
+	{
+		WriteAheadLog wal(dir.path, make_policy("none"));
+		auto lock = wal.get_lock();
+		for (unsigned i = 0; i < 10; ++i)
+		{
+			wal.append(lock, "body" + std::to_string(i), "user", Msg::Priority::Warning, i, 1000 + i);
+		}
+	}
+
+	const auto files = dir.list();
+	BOOST_REQUIRE(files.size() == 1);
+
+	struct stat st;
+	BOOST_REQUIRE(stat(files[0].c_str(), &st) == 0);
+	const off_t intact_size = st.st_size;
+
+	// Half a record, as if the crash hit mid write
+	{
+		std::ofstream file(files[0], std::ios::binary | std::ios::app);
+		file << std::string(30, 'x');
+	}
+
+	std::vector<std::string> bodies;
+	const size_t num_replayed = WriteAheadLog::replay(dir.path,
+		[&bodies](const MsgView & msg)
+		{
+			BOOST_CHECK(msg.get_username() == "user");
+			BOOST_CHECK(msg.get_priority() == Msg::Priority::Warning);
+			BOOST_CHECK(msg.get_seq() == bodies.size());
+			BOOST_CHECK(msg.get_time_ms() == 1000 + bodies.size());
+			bodies.push_back(msg.get_msg().to_string());
+		});
+
+	BOOST_CHECK(num_replayed == 10);
+	BOOST_CHECK(bodies.size() == 10 && bodies.back() == "body9");
+
+	BOOST_REQUIRE(stat(files[0].c_str(), &st) == 0);
+	BOOST_CHECK(st.st_size == intact_size);
+}
+
+BOOST_AUTO_TEST_CASE( damaged_segment )
+{
+	TempDir dir;
+
+	// Seqs with gaps, over a few segments
+	const size_t num_records = 500;
+	{
+		WriteAheadLog wal(dir.path, make_policy("none"), 4096);
+		for (size_t i = 0; i < num_records; ++i)
+		{
+			{
+				auto lock = wal.get_lock();
+				wal.append(lock, "body" + std::to_string(i), "user", Msg::Priority::Info, 3 * i, 1000 + i);
+			}
+			if (i % 50 == 49)
+			{
+				wal.sync();
+			}
+		}
+	}
+
+	const auto files = dir.list();
+	BOOST_REQUIRE(files.size() > 2);
+
+	// A flipped byte halfway into a segment that isn't the last
+	struct stat st;
+	BOOST_REQUIRE(stat(files[0].c_str(), &st) == 0);
+	{
+		std::fstream file(files[0], std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(st.st_size / 2);
+		file.put('\xff');
+	}
+
+	MsgQueueWrapper q_wrapper;
+	q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir.path, make_policy("none"), 4096)));
+
+	std::vector<Msg::Seq> seqs;
+	q_wrapper.for_each([&seqs](const MsgView & msg) { seqs.push_back(msg.get_seq()); });
+	BOOST_CHECK(seqs.size() < num_records);
+	BOOST_CHECK(q_wrapper.size() == seqs.size());
+	BOOST_CHECK(std::is_sorted(seqs.begin(), seqs.end()));
+
+	// Seeks land on the first record at or after from_seq, wherever that is
+	for (Msg::Seq from_seq = 0; from_seq < 3 * num_records; from_seq += 7)
+	{
+		const auto expected = std::lower_bound(seqs.begin(), seqs.end(), from_seq);
+		Msg::Seq first = 3 * num_records;
+		q_wrapper.get_snapshot().visit(
+			[&first](const MsgView & msg)
+			{
+				first = msg.get_seq();
+				return false;
+			},
+			Msg::Priority::Debug, from_seq);
+		BOOST_CHECK(first == ((expected == seqs.end()) ? 3 * num_records : *expected));
+
+		// And counts of what's before it too, which a snapshot whose
+		// segments reach past its end seq takes its size from
+		size_t num_before = 0;
+		for (const auto & segment : q_wrapper.get_wal()->get_sealed_segments())
+		{
+			num_before += segment->count_before(from_seq);
+		}
+		BOOST_CHECK(num_before == size_t(expected - seqs.begin()));
+	}
+}
+
+BOOST_AUTO_TEST_CASE( other_version_refused )
+{
+	TempDir dir;
+
+	{
+		WriteAheadLog wal(dir.path, make_policy("always"));
+		auto lock = wal.get_lock();
+		wal.append(lock, "body", "user", Msg::Priority::Info, 0, 1000);
+	}
+
+	const auto files = dir.list();
+	BOOST_REQUIRE(files.size() == 1);
+
+	// As an older build would have left it
+	{
+		std::fstream file(files[0], std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(sizeof(WalFormat::magic) - 1);
+		file.put('1');
+	}
+
+	struct stat before;
+	BOOST_REQUIRE(stat(files[0].c_str(), &before) == 0);
+
+	BOOST_CHECK_THROW(WriteAheadLog(dir.path, make_policy("none")), std::runtime_error);
+
+	// Not taken for torn and cut off
+	struct stat after;
+	BOOST_REQUIRE(stat(files[0].c_str(), &after) == 0);
+	BOOST_CHECK(after.st_size == before.st_size);
+}
+
+BOOST_AUTO_TEST_CASE( delete_all_resets )
+{
+	TempDir dir;
+
+	{
+		MsgQueueWrapper q_wrapper;
+		q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir.path, make_policy("always"))));
+
+		for (unsigned i = 0; i < 100; ++i)
+		{
+			q_wrapper.push(Msg("gone", "user", Msg::Priority::Info));
+		}
+		q_wrapper.get_wal()->sync();
+
+		std::ostringstream oss;
+		ReqsUnitTestsUtils::make_delete_all_req()->serve(q_wrapper, oss);
+		BOOST_CHECK(dir.list().empty());
+
+		// Served the way a client would get it: acked after the sync
+		ReqUtils::ResultCode result_code;
+		ReqsUnitTestsUtils::make_new_log_req("kept", "user", Msg::Priority::Error)->serve(q_wrapper, oss, result_code);
+		BOOST_CHECK(result_code == ReqUtils::ResultCode::Ok);
+		BOOST_CHECK(q_wrapper.get_wal()->get_stats().syncs > 0);
+	}
+
+	MsgQueueWrapper q_wrapper;
+	q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir.path, make_policy("none"))));
+	BOOST_CHECK(q_wrapper.size() == 1);
+	BOOST_CHECK(read_back(q_wrapper).at(0) == Msg("kept", "user", Msg::Priority::Error));
+}
+
+BOOST_AUTO_TEST_CASE( sealed_segments )
+{
+	TempDir dir;
+
+	MsgQueueWrapper q_wrapper(1);
+	q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir.path, make_policy("none"), 64 * 1024)));
+
+	// Enough to seal a good number of segments and blocks
+	const size_t num_msgs = Cfg::msg_block_records * 8;
+	std::vector<Msg> expected;
+	for (size_t i = 0; i < num_msgs; ++i)
+	{
+		expected.emplace_back(std::to_string(i), "user" + std::to_string(i % 3), Msg::Priority(i % unsigned(Msg::Priority::Max)));
+		Msg msg = expected.back();
+		q_wrapper.push(std::move(msg));
+
+		// Let the flusher keep up, so segments get sealed as we go
+		if (i % 1000 == 0)
+		{
+			q_wrapper.get_wal()->sync();
+		}
+	}
+	q_wrapper.get_wal()->sync();
+
+	BOOST_CHECK(q_wrapper.get_wal()->get_sealed_segments().size() > 1);
+	BOOST_CHECK(q_wrapper.size() == num_msgs);
+
+	// Sealed history went out of memory, and comes back from the segments
+	const auto stats = q_wrapper.get_mem_stats();
+	BOOST_CHECK(stats.num_msgs < num_msgs / 2);
+	BOOST_CHECK(stats.mapped_bytes > 0);
+
+	const std::vector<Msg> read = read_back(q_wrapper);
+	BOOST_REQUIRE(read.size() == num_msgs);
+	for (size_t i = 0; i < num_msgs; ++i)
+	{
+		BOOST_CHECK(read[i] == expected[i]);
+		BOOST_CHECK(read[i].get_seq() == i);
+	}
+
+	// Priority filtering holds across both
+	size_t num_errors = 0;
+	q_wrapper.for_each([&num_errors](const MsgView & msg)
+		{
+			BOOST_CHECK(msg.get_priority() == Msg::Priority::Error);
+			++num_errors;
+		},
+		Msg::Priority::Error);
+	BOOST_CHECK(num_errors == num_msgs / unsigned(Msg::Priority::Max));
+
+	std::ostringstream dumped;
+	q_wrapper.dump_to_stream(dumped, Msg::Priority::Error);
+	BOOST_CHECK(dumped.str().find("u[user1] p[error] m[4]\n") == 0);
+
+	// Resuming mid-way, whether in a segment or in the shards, picks up
+	// right where it stopped
+	std::ostringstream head;
+	ReqUtils::ResultCode result_code;
+	auto stream = ReqsUnitTestsUtils::make_dump_all_req(Msg::Priority::Error)->serve_streamed(q_wrapper, head, result_code);
+	std::string streamed = head.str();
+	while (stream->next_chunk(streamed, 1000))
+	{
+	}
+	BOOST_CHECK(streamed == dumped.str());
+
+	const Msg::Seq from_seq = num_msgs / 3 + 5;
+	Msg::Seq next_seq = from_seq;
+	const Msg::Seq resume_seq = q_wrapper.get_snapshot().visit(
+		[&next_seq](const MsgView & msg)
+		{
+			BOOST_CHECK(msg.get_seq() == next_seq++);
+			return next_seq < num_msgs - 10;
+		},
+		Msg::Priority::Debug, from_seq, num_msgs);
+	BOOST_CHECK(resume_seq == num_msgs - 10);
+
+	// One user's messages, from the segments' strides and the username
+	// index both
+	std::vector<Msg::Seq> user_seqs;
+	q_wrapper.get_user_snapshot("user1", Msg::Priority::Warning).visit(
+		[&user_seqs, &expected](const MsgView & msg)
+		{
+			BOOST_CHECK(msg == expected[msg.get_seq()]);
+			user_seqs.push_back(msg.get_seq());
+			return true;
+		});
+	std::vector<Msg::Seq> expected_seqs;
+	for (size_t i = 0; i < num_msgs; ++i)
+	{
+		if (expected[i].get_username() == "user1" && expected[i].get_priority() >= Msg::Priority::Warning)
+		{
+			expected_seqs.push_back(i);
+		}
+	}
+	BOOST_CHECK(user_seqs == expected_seqs);
+
+	// A search, through the segments and the token indexes both
+	q_wrapper.index_blocks();
+	for (const Msg::Seq seq : {Msg::Seq(777), Msg::Seq(num_msgs - 1)})
+	{
+		std::vector<Msg::Seq> search_seqs;
+		q_wrapper.get_search_snapshot(Search::Term(std::to_string(seq)), Msg::Priority::Info).visit(
+			[&search_seqs](const MsgView & msg)
+			{
+				search_seqs.push_back(msg.get_seq());
+				return true;
+			});
+		BOOST_CHECK(search_seqs.size() == 1 && search_seqs[0] == seq);
+	}
+
+	// A time range, whether its ends fall in a segment or in the shards
+	const std::vector<Msg::Time> times = [&q_wrapper]()
+		{
+			std::vector<Msg::Time> times;
+			q_wrapper.for_each([&times](const MsgView & msg) { times.push_back(msg.get_time_ms()); });
+			return times;
+		}();
+	BOOST_REQUIRE(times.size() == num_msgs);
+	BOOST_CHECK(std::is_sorted(times.begin(), times.end()));
+	for (const size_t first : {size_t(0), num_msgs / 4, num_msgs - 1})
+	{
+		TimeRange range;
+		range.from_ms = times[first];
+		range.to_ms = times[first] + 1;
+
+		std::vector<Msg::Seq> range_seqs;
+		q_wrapper.for_each([&range_seqs](const MsgView & msg) { range_seqs.push_back(msg.get_seq()); },
+			Msg::Priority::Debug, range);
+
+		std::vector<Msg::Seq> expected_range_seqs;
+		for (size_t i = 0; i < num_msgs; ++i)
+		{
+			if (range.contains(times[i]))
+			{
+				expected_range_seqs.push_back(i);
+			}
+		}
+		BOOST_CHECK(!range_seqs.empty() && range_seqs == expected_range_seqs);
+	}
+
+	q_wrapper.clear();
+	BOOST_CHECK(q_wrapper.size() == 0);
+	BOOST_CHECK(q_wrapper.get_wal()->get_sealed_segments().empty());
+}
+
+BOOST_AUTO_TEST_CASE( idle_shards_evicted )
+{
+	TempDir dir;
+
+	MsgQueueWrapper q_wrapper(2);
+	q_wrapper.set_wal(std::unique_ptr<WriteAheadLog>(new WriteAheadLog(dir.path, make_policy("none"), 64 * 1024)));
+
+	// Two fresh threads take consecutive slots, so two different shards.
+	// The first goes quiet; only the second pushes while segments seal.
+	auto push_some = [&q_wrapper](size_t num_msgs)
+		{
+			for (size_t i = 0; i < num_msgs; ++i)
+			{
+				q_wrapper.push(Msg(std::to_string(i), "user", Msg::Priority::Info));
+				if (i % 1000 == 0)
+				{
+					q_wrapper.get_wal()->sync();
+				}
+			}
+			q_wrapper.get_wal()->sync();
+		};
+	std::thread(push_some, Cfg::msg_block_records).join();
+	std::thread(push_some, Cfg::msg_block_records * 4).join();
+
+	// Whatever is left in memory starts at most a block before the
+	// sealed end, and the idle shard's messages are all below it
+	const size_t num_msgs = Cfg::msg_block_records * 5;
+	const Msg::Seq sealed_end = q_wrapper.get_wal()->get_sealed_end();
+	BOOST_REQUIRE(sealed_end > Cfg::msg_block_records);
+	BOOST_CHECK(q_wrapper.get_mem_stats().num_msgs < num_msgs - sealed_end + Cfg::msg_block_records);
+	BOOST_CHECK(q_wrapper.size() == num_msgs);
+}
+
+BOOST_AUTO_TEST_SUITE_END()